@@ -132,6 +132,7 @@ typedef std::vector<const sw::POS*> mapList;
 mapList Maps;
 sw::MediaType DataMediaType;
 std::map<std::string, std::string> HTTPHeaders;
+sw::QueryOptions Options;
 
 #ifndef TEST_CLI
 std::ostream* DebugStream = NULL;
@@ -273,6 +274,7 @@ struct MyServer : WEBSERVER {
 			} else {
 			    sw::Operation* op = server.sparqlParser.root;
 			    sw::ResultSet rs(&server.posFactory);
+			    rs.options = &Options;
 			    std::string language;
 			    std::string newQuery(query);
 
@@ -1079,6 +1081,7 @@ int main(int ac, char* av[])
             ("no-exec,n", "don't execute (or load data)")
             ("pipe,p", "pipe query to output (print final query)")
             ("quiet,q", "quiet")
+            ("no-reorder", "match triple patterns in query order instead of by estimated cost")
             ("version,v", "print version string")
 	    ;
 
@@ -1123,6 +1126,12 @@ int main(int ac, char* av[])
 	     "read application description graph into graph arg.")
             ("service", po::value<std::string>(), 
 	     "relay all queries to service URL.")
+            ("snapshot", po::value<std::string>(), 
+	     "load all graphs from a binary snapshot file.")
+            ("write-snapshot", po::value<std::string>(), 
+	     "write all loaded graphs to a binary snapshot file.")
+            ("stats", 
+	     "print per-graph statistics after loading.")
             ;
     
         po::options_description httpOpts("HTTP options");
@@ -1215,6 +1224,10 @@ int main(int ac, char* av[])
             Quiet = true;
         }
 
+        if (vm.count("no-reorder"))
+	    Options.patternOrdering = false;
+	rs.options = &Options;
+
 	static const char* queryHelp = "Queries and maps:\n"
 	    "  <queryURI>            read and execute a query from <queryURI>.\n"
 	    "  -e <query>            execute <query>.\n"
@@ -1348,10 +1361,24 @@ int main(int ac, char* av[])
 		    }
 		}
 
+		if (vm.count("snapshot"))
+		    TheServer.db.loadSnapshot(vm["snapshot"].as<std::string>(), &F);
+
 		for (loadList::iterator it = LoadList.begin();
 		     it != LoadList.end(); ++it)
 		    it->loadGraph();
 
+		if (vm.count("write-snapshot")) {
+		    std::string path = vm["write-snapshot"].as<std::string>();
+		    std::ofstream os(path.c_str(), std::ios::out | std::ios::binary);
+		    if (!os)
+			throw std::string("unable to write snapshot ").append(path);
+		    TheServer.db.writeSnapshot(os);
+		}
+
+		if (vm.count("stats"))
+		    std::cout << TheServer.db.statisticsString();
+
 		if (Debug > 0)
 		    std::cout << "<loadedData>\n" << TheServer.db << "</loadedData>\n";
 	    }
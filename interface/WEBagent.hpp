@@ -10,6 +10,7 @@
 #define WEB_AGENT_H
 
 #include <string>
+#include <vector>
 #include "SWObjects.hpp"
 
 namespace w3c_sw {
@@ -20,7 +21,7 @@ namespace w3c_sw {
     public:
 	SWWEBagent () {  }
 	virtual ~SWWEBagent () {  }
-	std::string getMediaType () { return mediaType; }
+	virtual std::string getMediaType () { return mediaType; }
 	virtual std::string get(
 #if REGEX_LIB == SWOb_DISABLED
 				std::string host, std::string port, std::string path
@@ -29,6 +30,86 @@ namespace w3c_sw {
 #endif /* !REGEX_LIB == SWOb_DISABLED */
 				) = 0;
 
+	/* The body of a GET of <url> as a stream for the caller to delete.
+	 * Agents which can read the body as it arrives override this; here
+	 * it is all read first.
+	 */
+	virtual std::istream* getStream (const char* url) {
+#if REGEX_LIB == SWOb_DISABLED
+	    throw std::string("GET ") + url + " needs a URL parser";
+#else /* !REGEX_LIB == SWOb_DISABLED */
+	    return new std::istringstream(get(url));
+#endif /* !REGEX_LIB == SWOb_DISABLED */
+	}
+
+	/* One GET of a batch; either body (and its mediaType) or error is
+	 * filled in.
+	 */
+	struct Request {
+	    std::string url;
+	    std::string body;
+	    std::string mediaType;
+	    std::string error;
+	    Request (std::string url) : url(url) {  }
+	};
+	/* GET all <requests>. Agents which can have several GETs outstanding
+	 * override this; here they are done one after another.
+	 */
+	virtual void getAll (std::vector<Request>& requests) {
+	    for (std::vector<Request>::iterator it = requests.begin(); it != requests.end(); ++it)
+		try {
+#if REGEX_LIB == SWOb_DISABLED
+		    throw std::string("GET ") + it->url + " needs a URL parser";
+#else /* !REGEX_LIB == SWOb_DISABLED */
+		    it->body = get(it->url.c_str());
+		    it->mediaType = getMediaType();
+#endif /* !REGEX_LIB == SWOb_DISABLED */
+		} catch (std::string& e) {
+		    it->error = e;
+		} catch (std::exception& e) {
+		    it->error = e.what();
+		}
+	}
+
+	/* Takes the answers of streamAll. */
+	struct AnswerHandler {
+	    virtual ~AnswerHandler () {  }
+	    /* Read the i'th request's answer from <body>; reads throw if the
+	     * GET fails part way.
+	     */
+	    virtual void answer(size_t i, std::istream& body) = 0;
+	    /* The i'th GET failed before any of its answer was read. */
+	    virtual void failed(size_t i, std::string error) = 0;
+	};
+	/* GET all <requests>, handing each answer to <handler> in the
+	 * requests' order as it is read. Agents which can have several GETs
+	 * outstanding override this; here each is a getStream in turn.
+	 */
+	virtual void streamAll (std::vector<Request>& requests, AnswerHandler* handler) {
+	    for (size_t i = 0; i < requests.size(); ++i) {
+		std::istream* body = NULL;
+		try {
+		    body = getStream(requests[i].url.c_str());
+		    requests[i].mediaType = getMediaType();
+		} catch (std::string& e) {
+		    requests[i].error = e;
+		} catch (std::exception& e) {
+		    requests[i].error = e.what();
+		}
+		if (body == NULL) {
+		    handler->failed(i, requests[i].error);
+		    continue;
+		}
+		try {
+		    handler->answer(i, *body);
+		} catch (...) {
+		    delete body;
+		    throw;
+		}
+		delete body;
+	    }
+	}
+
 	struct Parameter {
 	    std::string attr;
 	    std::string value;
@@ -7,8 +7,14 @@
 #pragma once
 #include <stack>
 #include <map>
+#include <deque>
 #include <boost/regex.hpp>
 #include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/algorithm/string.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/iostreams/stream.hpp>
 #include "../interface/WEBagent.hpp"
 
 using boost::asio::ip::tcp;
@@ -21,24 +27,26 @@ namespace w3c_sw {
 	typedef std::string AuthPreempt(std::string url);
 	AuthHandler* authHandler;
 	AuthPreempt* authPreempt;
+	size_t maxPerEndpoint;	// GETs getAll has outstanding, and idle connections kept, per host:port; 0: no limit
+	long deadline;		// milliseconds getAll waits for its GETs; 0: no limit
 	WEBagent_boostASIO (AuthHandler authHandler = NULL,
-			    AuthPreempt authPreempt = NULL)
-	    : SWWEBagent(), authHandler(authHandler), authPreempt(authPreempt)
+			    AuthPreempt authPreempt = NULL, 
+			    size_t maxPerEndpoint = 4, long deadline = 0)
+	    : SWWEBagent(), authHandler(authHandler), authPreempt(authPreempt), 
+	      maxPerEndpoint(maxPerEndpoint), deadline(deadline)
 	{  }
-	~WEBagent_boostASIO () {  }
-	virtual std::string get (
-#if REGEX_LIB == SWOb_DISABLED
-				 std::string host, std::string port, std::string path
-#else /* !REGEX_LIB == SWOb_BOOST */
-				 const char* url
-#endif /* !REGEX_LIB == SWOb_BOOST */
-				 ) {
+	~WEBagent_boostASIO () {
+	    for (std::map<std::string, std::vector<Connection*> >::iterator it = idle.begin(); it != idle.end(); ++it)
+		for (std::vector<Connection*>::iterator c = it->second.begin(); c != it->second.end(); ++c)
+		    delete *c;
+	}
+
 #if REGEX_LIB == SWOb_BOOST
+	static void crackURL (const char* url, std::string& host, std::string& port, std::string& path) {
 	    // !!! duplicate of SPARQL_server.cpp
-	    boost::regex re;
+	    static const boost::regex re("(ftp|http|https):\\/\\/((?:\\w+\\.)*\\w*)(?::([0-9]+))?(.*)");
 	    boost::cmatch matches;
 
-	    re = "(ftp|http|https):\\/\\/((?:\\w+\\.)*\\w*)(?::([0-9]+))?(.*)";
 	    if (!boost::regex_match(url, matches, re))
 		throw std::string("Address ") + url + " is not a valid URL\n";
 
@@ -46,126 +54,735 @@ namespace w3c_sw {
 #define HOST 2
 #define PORT 3
 #define PATH 4
-	    std::string host(matches[HOST].first, matches[HOST].second);
-	    std::string port(matches[PORT].first, matches[PORT].second);
-	    std::string path(matches[PATH].first, matches[PATH].second);
-#endif /* !REGEX_LIB == SWOb_BOOST */
+	    host.assign(matches[HOST].first, matches[HOST].second);
+	    port.assign(matches[PORT].first, matches[PORT].second);
+	    path.assign(matches[PATH].first, matches[PATH].second);
+	    if (port.empty())
+		port = "80";
+	}
+#endif /* REGEX_LIB == SWOb_BOOST */
 
+	virtual std::string get (
+#if REGEX_LIB == SWOb_DISABLED
+				 std::string host, std::string port, std::string path
+#else /* !REGEX_LIB == SWOb_BOOST */
+				 const char* url
+#endif /* !REGEX_LIB == SWOb_BOOST */
+				 ) {
+#if REGEX_LIB == SWOb_BOOST
+	    std::string host, port, path;
+	    crackURL(url, host, port, path);
+#else /* !REGEX_LIB == SWOb_BOOST */
 	    if (port.empty())
 		port = "80";
+	    std::string url("http://" + host + ":" + port + path);
+#endif /* !REGEX_LIB == SWOb_BOOST */
+
+	    std::string type;
+	    std::string ret = fetch(host, port, path, url, type);
+	    setMediaType(type);
+	    return ret;
+	}
 
-	    bool redo = false;
-	    boost::system::error_code error;
+	virtual std::string getMediaType () {
+	    boost::mutex::scoped_lock lock(mediaTypeMutex);
+	    return mediaType;
+	}
+
+#if REGEX_LIB == SWOb_BOOST
+	/* The body of a GET of <url>, read off the socket as the caller reads
+	 * the stream. Delete the stream before the agent.
+	 */
+	virtual std::istream* getStream (const char* url) {
+	    if (deadline != 0) {
+		// Only getAll can give up on a GET at the deadline.
+		std::vector<Request> requests(1, Request(url));
+		getAll(requests);
+		if (!requests[0].error.empty())
+		    throw requests[0].error;
+		return new std::istringstream(requests[0].body);
+	    }
+	    std::string host, port, path;
+	    crackURL(url, host, port, path);
+	    std::string type;
+	    boost::iostreams::stream<BodySource>* ret = 
+		new boost::iostreams::stream<BodySource>(BodySource(open(host, port, path, url, type)));
+	    setMediaType(type);
+	    ret->exceptions(std::ios::badbit); // pass on network errors
+	    return ret;
+	}
+#endif /* REGEX_LIB == SWOb_BOOST */
+
+    protected:
+	/* A kept-alive connection and the buffers reused by each GET on it. */
+	struct Connection {
+	    tcp::socket socket;
+	    boost::asio::streambuf request;
 	    boost::asio::streambuf response;
-	    boost::asio::io_service io_service;
-	    tcp::socket socket(io_service);
-	    std::ostringstream body;
-	    std::string authString;
+	    Connection (boost::asio::io_service& io_service) : socket(io_service) {  }
+	};
 
-	    if (authPreempt != NULL)
-		authString = (*authPreempt)(url);
-	    do {
-		// Form the request. We specify the "Connection: close" header so that the
-		// server will close the socket after transmitting the response. This will
-		// allow us to treat all data up until the EOF as the content.
-		boost::asio::streambuf request;
-		std::ostream request_stream(&request);
-		request_stream << "GET " << path << " HTTP/1.0\r\n";
-		request_stream << "Host: " << host << "\r\n";
-		request_stream << "Accept: */*\r\n";
-		request_stream << authString;
-		request_stream << "User-Agent: WEBagent_boostASIO 0.1\r\n";
-		request_stream << "Connection: close\r\n\r\n";
+	struct Head {
+	    unsigned int status;
+	    std::string realm;
+	    std::string mediaType;
+	};
+
+	/* Read into <c>'s response buffer until it holds <count> bytes. */
+	static void fill (Connection* c, size_t count) {
+	    if (c->response.size() < count)
+		boost::asio::read(c->socket, c->response, boost::asio::transfer_at_least(count - c->response.size()));
+	}
+
+	/* Reads a response body off its Connection as it arrives, undoing
+	 * any chunked transfer-coding. The Connection goes back to the pool
+	 * if the body was read to its end.
+	 */
+	class BodyReader {
+	public:
+	    enum Framing { SIZED, CHUNKED, TO_EOF };
+	protected:
+	    WEBagent_boostASIO* agent;
+	    std::string host, port;
+	    Connection* c;
+	    Framing framing;
+	    size_t left;	// bytes left in the body or the current chunk
+	    bool keepAlive;
+	    bool started;
+	    bool done;
+
+	    void nextChunk () {
+		std::istream response_stream(&c->response);
+		std::string line;
+		if (started) {
+		    fill(c, 2);
+		    c->response.consume(2); // the previous chunk's CRLF
+		}
+		started = true;
+		boost::asio::read_until(c->socket, c->response, "\r\n");
+		std::getline(response_stream, line);
+		left = strtoul(line.c_str(), NULL, 16);
+		if (left == 0) {
+		    // Skip trailers up to the blank line.
+		    do {
+			boost::asio::read_until(c->socket, c->response, "\r\n");
+		    } while (std::getline(response_stream, line) && line != "\r");
+		    done = true;
+		}
+	    }
+
+	public:
+	    BodyReader (WEBagent_boostASIO* agent, std::string host, std::string port, 
+			Connection* c, Framing framing, size_t length, bool keepAlive)
+		: agent(agent), host(host), port(port), c(c), framing(framing), 
+		  left(length), keepAlive(keepAlive && framing != TO_EOF), started(false), 
+		  done(framing == SIZED && length == 0) {  }
+	    ~BodyReader () {
+		if (done && keepAlive)
+		    agent->checkin(host, port, c);
+		else
+		    delete c;
+	    }
+
+	    /* Up to <n> bytes of the body; -1 at its end. */
+	    std::streamsize read (char* s, std::streamsize n) {
+		if (!done && framing == CHUNKED && left == 0)
+		    nextChunk();
+		if (done)
+		    return -1;
+		if (c->response.size() == 0) {
+		    boost::system::error_code error;
+		    boost::asio::read(c->socket, c->response, boost::asio::transfer_at_least(1), error);
+		    if (error == boost::asio::error::eof && framing == TO_EOF) {
+			done = true;
+			return -1;
+		    }
+		    if (error)
+			throw boost::system::system_error(error);
+		}
+		size_t count = std::min((size_t)n, c->response.size());
+		if (framing != TO_EOF) {
+		    count = std::min(count, left);
+		    left -= count;
+		}
+		c->response.sgetn(s, count);
+		if (framing == SIZED && left == 0)
+		    done = true;
+		return count;
+	    }
+
+	    /* Read and drop the rest of the body. */
+	    void skip () {
+		char buf[8192];
+		while (read(buf, sizeof(buf)) > 0)
+		    ;
+	    }
+	};
 
+	/* Boost.Iostreams source sharing a BodyReader between its copies. */
+	class BodySource {
+	    boost::shared_ptr<BodyReader> reader;
+	public:
+	    typedef char char_type;
+	    typedef boost::iostreams::source_tag category;
+	    BodySource (BodyReader* reader) : reader(reader) {  }
+	    std::streamsize read (char* s, std::streamsize n) { return reader->read(s, n); }
+	};
+
+	boost::asio::io_service io_service;	// for get() and getStream(); getAll runs its own
+	boost::mutex poolMutex;			// guards idle and resolved
+	boost::mutex mediaTypeMutex;		// guards mediaType
+	std::map<std::string, std::vector<Connection*> > idle;		// by host:port
+	std::map<std::string, std::vector<tcp::endpoint> > resolved;	// by host:port
+
+	/* An idle connection to host:port, or a new one if there is none. */
+	Connection* checkout (std::string host, std::string port, bool* reused) {
+	    std::string key(host + ":" + port);
+	    std::vector<tcp::endpoint> endpoints;
+	    {
+		boost::mutex::scoped_lock lock(poolMutex);
+		std::vector<Connection*>& conns = idle[key];
+		if (!conns.empty()) {
+		    Connection* ret = conns.back();
+		    conns.pop_back();
+		    *reused = true;
+		    return ret;
+		}
+		endpoints = resolved[key];
+	    }
+	    *reused = false;
+
+	    if (endpoints.empty()) {
 		// Get a list of endpoints corresponding to the server name.
 		tcp::resolver resolver(io_service);
 		tcp::resolver::query query(host.c_str(), port.c_str());
-		tcp::resolver::iterator endpoint_iterator = resolver.resolve(query);
 		tcp::resolver::iterator end;
+		for (tcp::resolver::iterator it = resolver.resolve(query); it != end; ++it)
+		    endpoints.push_back(*it);
+		boost::mutex::scoped_lock lock(poolMutex);
+		resolved[key] = endpoints;
+	    }
+
+	    // Try each endpoint until we successfully establish a connection.
+	    Connection* ret = new Connection(io_service);
+	    boost::system::error_code error = boost::asio::error::host_not_found;
+	    for (std::vector<tcp::endpoint>::const_iterator it = endpoints.begin();
+		 error && it != endpoints.end(); ++it) {
+		ret->socket.close();
+		ret->socket.connect(*it, error);
+	    }
+	    if (error) {
+		delete ret;
+		boost::mutex::scoped_lock lock(poolMutex);
+		resolved.erase(key); // maybe the address changed
+		throw boost::system::system_error(error);
+	    }
+	    return ret;
+	}
+
+	/* Keep <c> for the next GET to host:port. */
+	void checkin (std::string host, std::string port, Connection* c) {
+	    boost::mutex::scoped_lock lock(poolMutex);
+	    std::vector<Connection*>& conns = idle[host + ":" + port];
+	    if (maxPerEndpoint != 0 && conns.size() >= maxPerEndpoint)
+		delete c;
+	    else
+		conns.push_back(c);
+	}
+
+	/* Send a GET of <path> to host:port on a pooled connection and read
+	 * the response's status and headers into <head>, returning a reader
+	 * for its body. A failure on a reused connection before any response
+	 * arrives means the server closed it while idle, so that one is
+	 * retried on a new connection.
+	 */
+	BodyReader* request (std::string host, std::string port, std::string path, std::string authString, Head& head) {
+	    for (;;) {
+		bool reused;
+		Connection* c = checkout(host, port, &reused);
+		try {
+		    std::ostream request_stream(&c->request);
+		    request_stream << "GET " << path << " HTTP/1.1\r\n";
+		    request_stream << "Host: " << host << "\r\n";
+		    request_stream << "Accept: */*\r\n";
+		    request_stream << authString;
+		    request_stream << "User-Agent: WEBagent_boostASIO 0.1\r\n\r\n";
+		    boost::system::error_code error;
+		    boost::asio::write(c->socket, c->request, boost::asio::transfer_all(), error);
+
+		    // Read the response status line and headers.
+		    if (!error)
+			boost::asio::read_until(c->socket, c->response, "\r\n\r\n", error);
+		    if (error && reused && c->response.size() == 0) {
+			delete c;
+			continue;
+		    }
+		    if (error)
+			throw boost::system::system_error(error);
+		    return readHead(host, port, c, head);
+		} catch (...) {
+		    delete c;
+		    throw;
+		}
+	    }
+	}
+
+	/* Parse the status and headers in <c>'s response buffer. */
+	BodyReader* readHead (std::string host, std::string port, Connection* c, Head& head) {
+	    // Check that response is OK.
+	    std::istream response_stream(&c->response);
+	    std::string http_version;
+	    response_stream >> http_version;
+	    response_stream >> head.status;
+	    std::string status_message;
+	    std::getline(response_stream, status_message);
+	    if (!response_stream || http_version.substr(0, 5) != "HTTP/")
+		throw std::string("Invalid response code: ") + http_version.substr(0, 5);
+
+	    // Process the response headers, which are terminated by a blank line.
+	    bool keepAlive = http_version == "HTTP/1.1";
+	    BodyReader::Framing framing = BodyReader::TO_EOF;
+	    size_t length = 0;
+	    std::string header;
+	    head.realm = "unspecified";
+	    while (std::getline(response_stream, header) && header != "\r") {
+		size_t colon = header.find_first_of(":");
+		if (colon == std::string::npos)
+		    continue;
+		std::string name(header, 0, colon);
+		std::string value(header, colon + 1);
+		boost::trim(value);
+		if (boost::iequals(name, "WWW-Authenticate")) {
+		    size_t space = value.find_first_of(" ");
+		    head.realm = value.substr(value.find_first_of("=", space + 1) + 1);
+		} else if (boost::iequals(name, "Content-Type"))
+		    head.mediaType = value;
+		else if (boost::iequals(name, "Content-Length")) {
+		    if (framing == BodyReader::TO_EOF)
+			framing = BodyReader::SIZED;
+		    length = strtoul(value.c_str(), NULL, 10);
+		} else if (boost::iequals(name, "Transfer-Encoding")) {
+		    if (!boost::iequals(value, "identity"))
+			framing = BodyReader::CHUNKED;
+		} else if (boost::iequals(name, "Connection"))
+		    keepAlive = boost::iequals(value, "keep-alive");
+	    }
+	    // 1xx, 204 and 304 responses have no body, whatever their headers say.
+	    if (head.status / 100 == 1 || head.status == 204 || head.status == 304) {
+		framing = BodyReader::SIZED;
+		length = 0;
+	    }
+	    return new BodyReader(this, host, port, c, framing, framing == BodyReader::SIZED ? length : 0, keepAlive);
+	}
+
+	void setMediaType (std::string type) {
+	    boost::mutex::scoped_lock lock(mediaTypeMutex);
+	    mediaType = type;
+	}
+
+	/* GET <path> from host:port, answering a 401 with the authHandler,
+	 * and return a reader for a 200's body, setting <mediaType> to its
+	 * Content-Type.
+	 */
+	BodyReader* open (std::string host, std::string port, std::string path, std::string url, std::string& mediaType) {
+	    std::string authString;
+	    if (authPreempt != NULL)
+		authString = (*authPreempt)(url);
+	    bool asked = false;
+	    for (;;) {
+		Head head;
+		BodyReader* body = request(host, port, path, authString, head);
+		if (head.status == 200) {
+		    mediaType = head.mediaType;
+		    return body;
+		}
+
+		// Drop the body so the connection can be reused.
+		try {
+		    body->skip();
+		} catch (...) {
+		    delete body;
+		    throw;
+		}
+		delete body;
+		switch (head.status) {
+		case 401:
+		    if (authHandler != NULL && !asked) {
+			asked = true;
+			authString = (*authHandler)(url, head.realm);
+			continue;
+		    }
+		    throw std::string("GET ") + url + " requires auth in " + head.realm + " realm";
+		default: {
+		    std::stringstream s;
+		    s << head.status;
+		    throw std::string("GET ") + url + " returned with status code " + s.str();
+		}
+		}
+	    }
+	}
+
+	/* The body of a GET of <path> from host:port and its <mediaType>.
+	 * Unlike get(), this leaves the agent's mediaType alone.
+	 */
+	std::string fetch (std::string host, std::string port, std::string path, std::string url, std::string& mediaType) {
+	    BodyReader* body = open(host, port, path, url, mediaType);
+	    std::string ret;
+	    try {
+		char buf[8192];
+		std::streamsize count;
+		while ((count = body->read(buf, sizeof(buf))) > 0)
+		    ret.append(buf, count);
+	    } catch (...) {
+		delete body;
+		throw;
+	    }
+	    delete body;
+	    return ret;
+	}
+
+    public:
+
+#if REGEX_LIB == SWOb_BOOST
+	/* Run all of <requests>' GETs at once, at most maxPerEndpoint to
+	 * each host:port, giving up on any still running after deadline.
+	 * Each call runs its own io_service, so threads sharing the agent
+	 * may call it at the same time.
+	 */
+	virtual void getAll (std::vector<Request>& requests) {
+	    Batch batch(*this, requests);
+	    batch.run();
+	    batch.reauthorize();
+	}
+
+	/* As getAll, but each answer is handed on as it arrives: reading
+	 * one runs the GETs until it has more, so the others keep going. A
+	 * lone GET takes getStream's kept-alive connection instead.
+	 */
+	virtual void streamAll (std::vector<Request>& requests, AnswerHandler* handler) {
+	    if (requests.size() == 1 && deadline == 0) {
+		SWWEBagent::streamAll(requests, handler);
+		return;
+	    }
+	    Batch batch(*this, requests, true);
+	    for (size_t i = 0; i < requests.size(); ++i) {
+		boost::iostreams::stream<BatchSource> body(BatchSource(&batch, i));
+		body.exceptions(std::ios::badbit); // pass on network errors
+		handler->answer(i, body);
+	    }
+	}
+
+    protected:
+
+	/* The GETs of one getAll, each a chain of handlers: resolve, connect,
+	 * write the request, read the headers and read the body to EOF.
+	 * Handlers called after their Fetch is done (e.g. by the deadline)
+	 * just return. They only touch the Batch and its Requests, not the
+	 * agent's state.
+	 */
+	class Batch {
+	    struct Fetch {
+		Request* request;
+		std::string host, port, path, endpoint;
+		tcp::resolver resolver;
+		tcp::socket socket;
+		boost::asio::streambuf out;
+		boost::asio::streambuf response;
+		std::ostringstream body;
+		std::string unread;	// streamed: arrived but not yet read
+		size_t readTo;
+		bool done;
+		bool reauthorize;	// got a 401 for the authHandler
+		Fetch (boost::asio::io_service& io_service, Request* request)
+		    : request(request), resolver(io_service), socket(io_service), 
+		      readTo(0), done(false), reauthorize(false) {  }
+	    };
+	    WEBagent_boostASIO& agent;
+	    boost::asio::io_service io_service;
+	    std::vector<Fetch*> fetches;
+	    std::map<std::string, std::deque<Fetch*> > waiting; // beyond maxPerEndpoint
+	    std::map<std::string, size_t> running;
+	    size_t outstanding;
+	    boost::asio::deadline_timer timer;
+	    bool streamed;	// bodies are read with read() rather than set in the Requests
+
+	public:
+	    Batch (WEBagent_boostASIO& agent, std::vector<Request>& requests, bool streamed = false)
+		: agent(agent), io_service(), outstanding(0), timer(io_service), streamed(streamed) {
+		for (std::vector<Request>::iterator it = requests.begin(); it != requests.end(); ++it) {
+		    Fetch* f = new Fetch(io_service, &*it);
+		    fetches.push_back(f);
+		    try {
+			crackURL(it->url.c_str(), f->host, f->port, f->path);
+		    } catch (std::string& e) {
+			f->request->error = e;
+			f->done = true;
+			continue;
+		    }
+		    f->endpoint = f->host + ":" + f->port;
+		    ++outstanding;
+		    if (agent.maxPerEndpoint == 0 || running[f->endpoint] < agent.maxPerEndpoint) {
+			++running[f->endpoint];
+			start(f);
+		    } else
+			waiting[f->endpoint].push_back(f);
+		}
+		if (agent.deadline != 0 && outstanding > 0) {
+		    timer.expires_from_now(boost::posix_time::milliseconds(agent.deadline));
+		    timer.async_wait(boost::bind(&Batch::expired, this, boost::asio::placeholders::error));
+		}
+	    }
+	    ~Batch () {
+		for (std::vector<Fetch*>::iterator it = fetches.begin(); it != fetches.end(); ++it)
+		    delete *it;
+	    }
+
+	    void run () {
+		io_service.run();
+	    }
+
+	    /* Repeat the GETs refused with a 401, letting fetch() ask the authHandler. */
+	    void reauthorize () {
+		for (std::vector<Fetch*>::iterator it = fetches.begin(); it != fetches.end(); ++it)
+		    if ((*it)->reauthorize)
+			_reauthorize(*it);
+	    }
+
+	    /* Up to <n> bytes of the i'th streamed body, running the GETs
+	     * until some arrive; -1 at its end.
+	     */
+	    std::streamsize read (size_t i, char* s, std::streamsize n) {
+		Fetch* f = fetches[i];
+		while (f->readTo == f->unread.size() && !f->done && io_service.run_one() > 0)
+		    ;
+		if (f->readTo == f->unread.size() && f->reauthorize) {
+		    f->reauthorize = false;
+		    _reauthorize(f);
+		    f->unread = f->request->body;
+		    f->request->body.clear();
+		    f->readTo = 0;
+		}
+		if (f->readTo < f->unread.size()) {
+		    size_t count = std::min((size_t)n, f->unread.size() - f->readTo);
+		    f->unread.copy(s, count, f->readTo);
+		    f->readTo += count;
+		    if (f->readTo == f->unread.size()) {
+			f->unread.clear();
+			f->readTo = 0;
+		    }
+		    return count;
+		}
+		if (!f->request->error.empty())
+		    throw f->request->error;
+		return -1;
+	    }
+
+	protected:
+	    void _reauthorize (Fetch* f) {
+		try {
+		    f->request->body = agent.fetch(f->host, f->port, f->path, f->request->url, f->request->mediaType);
+		} catch (std::string& e) {
+		    f->request->error = e;
+		} catch (std::exception& e) {
+		    f->request->error = e.what();
+		}
+	    }
 
-		// Try each endpoint until we successfully establish a connection.
-		error = boost::asio::error::host_not_found;
-		while (error && endpoint_iterator != end) {
-		    socket.close();
-		    socket.connect(*endpoint_iterator++, error);
+	    /* Move what has arrived of f's body out of its response buffer. */
+	    void take (Fetch* f) {
+		if (f->response.size() == 0)
+		    return;
+		if (!streamed) {
+		    f->body << &f->response;
+		    return;
 		}
+		boost::asio::streambuf::const_buffers_type data = f->response.data();
+		f->unread.append(boost::asio::buffers_begin(data), boost::asio::buffers_end(data));
+		f->response.consume(f->response.size());
+	    }
+
+	    void start (Fetch* f) {
+		// As in get(), "Connection: close" lets us read the content to EOF.
+		std::ostream request_stream(&f->out);
+		request_stream << "GET " << f->path << " HTTP/1.0\r\n";
+		request_stream << "Host: " << f->host << "\r\n";
+		request_stream << "Accept: */*\r\n";
+		if (agent.authPreempt != NULL)
+		    request_stream << (*agent.authPreempt)(f->request->url);
+		request_stream << "User-Agent: WEBagent_boostASIO 0.1\r\n";
+		request_stream << "Connection: close\r\n\r\n";
+
+		tcp::resolver::query query(f->host.c_str(), f->port.c_str());
+		f->resolver.async_resolve(query, boost::bind(&Batch::resolved, this, f, 
+							     boost::asio::placeholders::error, 
+							     boost::asio::placeholders::iterator));
+	    }
+
+	    void resolved (Fetch* f, const boost::system::error_code& error, tcp::resolver::iterator endpoint) {
+		if (f->done)
+		    return;
 		if (error)
-		    throw boost::system::system_error(error);
+		    fail(f, boost::system::system_error(error).what());
+		else
+		    connect(f, endpoint);
+	    }
 
-		// Send the request.
-		boost::asio::write(socket, request);
+	    // Try each endpoint until we successfully establish a connection.
+	    void connect (Fetch* f, tcp::resolver::iterator endpoint) {
+		tcp::endpoint e = *endpoint;
+		f->socket.async_connect(e, boost::bind(&Batch::connected, this, f, 
+						       boost::asio::placeholders::error, ++endpoint));
+	    }
 
-		// Read the response status line.
-		boost::asio::read_until(socket, response, "\r\n");
+	    void connected (Fetch* f, const boost::system::error_code& error, tcp::resolver::iterator next) {
+		if (f->done)
+		    return;
+		if (error && next != tcp::resolver::iterator()) {
+		    f->socket.close();
+		    connect(f, next);
+		} else if (error)
+		    fail(f, boost::system::system_error(error).what());
+		else
+		    boost::asio::async_write(f->socket, f->out, 
+					     boost::bind(&Batch::written, this, f, boost::asio::placeholders::error));
+	    }
+
+	    void written (Fetch* f, const boost::system::error_code& error) {
+		if (f->done)
+		    return;
+		if (error)
+		    fail(f, boost::system::system_error(error).what());
+		else
+		    boost::asio::async_read_until(f->socket, f->response, "\r\n\r\n", 
+						  boost::bind(&Batch::headed, this, f, boost::asio::placeholders::error));
+	    }
+
+	    void headed (Fetch* f, const boost::system::error_code& error) {
+		if (f->done)
+		    return;
+		if (error) {
+		    fail(f, boost::system::system_error(error).what());
+		    return;
+		}
 
 		// Check that response is OK.
-		std::istream response_stream(&response);
+		std::istream response_stream(&f->response);
 		std::string http_version;
 		response_stream >> http_version;
 		unsigned int status_code;
 		response_stream >> status_code;
 		std::string status_message;
 		std::getline(response_stream, status_message);
-		if (!response_stream || http_version.substr(0, 5) != "HTTP/")
-		    throw std::string("Invalid response code: ") + http_version.substr(0, 5);
-
-		// Read the response headers, which are terminated by a blank line.
-		boost::asio::read_until(socket, response, "\r\n\r\n");
+		if (!response_stream || http_version.substr(0, 5) != "HTTP/") {
+		    fail(f, std::string("Invalid response code: ") + http_version.substr(0, 5));
+		    return;
+		}
 
 		// Process the response headers.
 		std::string header;
-		std::string authType("unspecified");
 		std::string realm("unspecified");
 		while (std::getline(response_stream, header) && header != "\r") {
 		    size_t colon = header.find_first_of(":");
 		    if (colon != std::string::npos) {
 			if (!header.compare(0, colon, "WWW-Authenticate")) {
 			    size_t space = header.find_first_of(" ", colon + 2);
-			    realm = header.substr(colon+2, space);
 			    size_t equal = header.find_first_of("=", space + 2);
 			    realm = header.substr(equal+1);
 			}
 			if (!header.compare(0, colon, "Content-Type"))
-			    mediaType = header.substr(colon+2);
+			    f->request->mediaType = header.substr(colon+2);
 		    }
-		    //std::cout << header << "\n";
 		}
 		switch (status_code) {
-		case 401: {
-		    while (boost::asio::read(socket, response,
-					     boost::asio::transfer_at_least(1), error))
-			;
-		    if (authHandler != NULL) {
-			authString = (*authHandler)(url, realm);
-			redo = true;
+		case 401:
+		    if (agent.authHandler != NULL) {
+			f->reauthorize = true;
+			finish(f);
 		    } else
-			throw std::string("GET ") + url + " requires auth in " + realm + " realm";
-		}
-		case 200: {
+			fail(f, std::string("GET ") + f->request->url + " requires auth in " + realm + " realm");
+		    return;
+		case 200:
 		    // Write whatever content we already have to output.
-		    if (response.size() > 0)
-			body << &response;
-
-		    // Read until EOF, writing data to output as we go.
-		    while (boost::asio::read(socket, response,
-					     boost::asio::transfer_at_least(1), error))
-			body << &response;
-		    if (error != boost::asio::error::eof)
-			throw boost::system::system_error(error);
-		    break;
-		}
+		    take(f);
+		    read(f);
+		    return;
 		default: {
-		    //std::cout << "\n";
 		    std::stringstream s;
 		    s << status_code;
-		    throw std::string("GET ") + url + " returned with status code " + s.str();
+		    fail(f, std::string("GET ") + f->request->url + " returned with status code " + s.str());
 		}
-
 		}
-	    } while (redo);
+	    }
 
-	    return body.str();
-	}
+	    void read (Fetch* f) {
+		boost::asio::async_read(f->socket, f->response, boost::asio::transfer_at_least(1), 
+					boost::bind(&Batch::got, this, f, boost::asio::placeholders::error));
+	    }
+
+	    void got (Fetch* f, const boost::system::error_code& error) {
+		if (f->done)
+		    return;
+		take(f);
+		if (error == boost::asio::error::eof) {
+		    if (!streamed)
+			f->request->body = f->body.str();
+		    finish(f);
+		} else if (error)
+		    fail(f, boost::system::system_error(error).what());
+		else
+		    read(f);
+	    }
+
+	    void fail (Fetch* f, std::string error) {
+		f->request->error = error;
+		finish(f);
+	    }
+
+	    /* Let the next GET waiting for f's endpoint have its place. */
+	    void finish (Fetch* f) {
+		f->done = true;
+		boost::system::error_code ignored;
+		f->socket.close(ignored);
+		std::deque<Fetch*>& queue = waiting[f->endpoint];
+		if (!queue.empty()) {
+		    Fetch* next = queue.front();
+		    queue.pop_front();
+		    start(next);
+		} else
+		    --running[f->endpoint];
+		if (--outstanding == 0)
+		    timer.cancel();
+	    }
+
+	    void expired (const boost::system::error_code& error) {
+		if (error == boost::asio::error::operation_aborted)
+		    return;
+		std::stringstream s;
+		s << agent.deadline;
+		for (std::vector<Fetch*>::iterator it = fetches.begin(); it != fetches.end(); ++it)
+		    if (!(*it)->done) {
+			(*it)->request->error = std::string("GET ") + (*it)->request->url + " exceeded the deadline of " + s.str() + "ms";
+			(*it)->done = true;
+			(*it)->resolver.cancel();
+			boost::system::error_code ignored;
+			(*it)->socket.close(ignored);
+		    }
+		waiting.clear();
+		outstanding = 0;
+	    }
+	};
+
+	/* Boost.Iostreams source reading one of a streamed Batch's bodies. */
+	class BatchSource {
+	    Batch* batch;
+	    size_t i;
+	public:
+	    typedef char char_type;
+	    typedef boost::iostreams::source_tag category;
+	    BatchSource (Batch* batch, size_t i) : batch(batch), i(i) {  }
+	    std::streamsize read (char* s, std::streamsize n) { return batch->read(i, s, n); }
+	};
+#endif /* REGEX_LIB == SWOb_BOOST */
     };
 
 } /* namespace w3c_sw */
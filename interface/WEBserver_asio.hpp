@@ -408,6 +408,10 @@ namespace w3c_sw {
 	    /// Handle completion of a write operation.
 	    void handle_write(const boost::system::error_code& e);
 
+	    /// Whether the client wants the connection kept open and the reply
+	    /// can be delimited without closing it.
+	    bool keepAlive() const;
+
 	    /// Strand to ensure the connection's handlers are not called concurrently.
 	    boost::asio::io_service::strand strand_;
 
@@ -428,6 +432,9 @@ namespace w3c_sw {
 
 	    /// The reply to be sent back to the client.
 	    reply reply_;
+
+	    /// Read another request after sending reply_.
+	    bool keepAlive_;
 	};
 
 	typedef boost::shared_ptr<connection> connection_ptr;
@@ -437,7 +444,7 @@ namespace w3c_sw {
 	    : strand_(io_service),
 	      socket_(io_service),
 	      request_handler_(handler),
-	      request_(new asioRequest()), reply_() {  }
+	      request_(new asioRequest()), reply_(), keepAlive_(false) {  }
 
 	inline connection::~connection() {
 	    delete request_;
@@ -469,6 +476,9 @@ namespace w3c_sw {
 			reply_ = rep;
 		    }
 		    std::cerr << reply_.content << std::endl;
+		    keepAlive_ = keepAlive();
+		    if (keepAlive_)
+			reply_.addHeader("Connection", "keep-alive");
 		    boost::asio::async_write(socket_, reply_.to_buffers(),
 		     strand_.wrap(
 			  boost::bind(&connection::handle_write, shared_from_this(),
@@ -494,8 +504,34 @@ namespace w3c_sw {
 	    // handler returns. The connection class's destructor closes the socket.
 	}
 
+	inline bool connection::keepAlive() const {
+	    bool ret = request_->http_version_major == 1 && request_->http_version_minor >= 1;
+	    for (request::headerset::const_iterator it = request_->headers.begin();
+		 it != request_->headers.end(); ++it)
+		if (boost::iequals(it->name, "Connection"))
+		    ret = boost::iequals(it->value, "keep-alive");
+	    if (ret)
+		for (std::vector<header>::const_iterator it = reply_.headers.begin();
+		     it != reply_.headers.end(); ++it)
+		    if (boost::iequals(it->name, "Content-Length") || 
+			boost::iequals(it->name, "Transfer-Encoding"))
+			return true;
+	    return false;
+	}
+
 	inline void connection::handle_write(const boost::system::error_code& e)
 	{
+	    if (!e && keepAlive_) {
+		// Wait for the client's next request on this socket.
+		delete request_;
+		request_ = new asioRequest();
+		request_parser_.reset();
+		reply_ = reply();
+		keepAlive_ = false;
+		start();
+		return;
+	    }
+
 	    if (!e) {
 		// Initiate graceful connection closure.
 		boost::system::error_code ignored_ec;
@@ -528,6 +564,9 @@ namespace w3c_sw {
 	    /// Stop the server.
 	    void stop();
 
+	    /// The port listened on, e.g. the one picked for port "0".
+	    unsigned short port() const { return acceptor_.local_endpoint().port(); }
+
 	private:
 	    /// Handle completion of an asynchronous accept operation.
 	    void handle_accept(const boost::system::error_code& e);
@@ -7,6 +7,17 @@
 #include "TurtleSParser/TurtleSParser.hpp"
 #include "TrigSParser/TrigSParser.hpp"
 #include <boost/iostreams/stream.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/static_assert.hpp>
+#include <algorithm>
+#include <string.h>
+#ifndef _WIN32
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <fcntl.h>
+  #include <unistd.h>
+#endif /* !_WIN32 */
 
 namespace io = boost::iostreams;
 
@@ -15,32 +26,155 @@ namespace w3c_sw {
     RdfDB::HandlerSet RdfDB::defaultHandler;
 
     RdfDB::~RdfDB () {
-	for (graphmap_type::const_iterator it = graphs.begin();
-	     it != graphs.end(); it++)
-	    delete it->second;
+	/* graphs are released with the last version which shares them. */
+    }
+
+    BasicGraphPattern* RdfDB::_newGraph (const POS* name) const {
+	BasicGraphPattern* ret;
+	if (name == DefaultGraph)
+	    ret = new DefaultGraphPattern();
+	else
+	    ret = new NamedGraphPattern(name);
+	if (termTable != NULL)
+	    ret->encode(termTable, termOwner);
+	return ret;
+    }
+
+    void RdfDB::setTermTable (TermTable* terms, boost::shared_ptr<const void> owner) {
+	boost::mutex::scoped_lock writer(writeLock);
+	boost::mutex::scoped_lock lock(versionLock);
+	termTable = terms;
+	termOwner = owner;
+	graphmap_type& g = _writableGraphs();
+	for (graphmap_type::iterator it = g.begin(); it != g.end(); ++it)
+	    if (it->second->getTermTable() != terms)
+		_writableGraph(it)->encode(terms, owner);
+    }
+
+    /* Callers hold versionLock. */
+    RdfDB::graphmap_type& RdfDB::_writableGraphs () {
+	if (!graphs.unique())
+	    graphs.reset(new graphmap_type(*graphs));
+	return *graphs;
+    }
+
+    BasicGraphPattern* RdfDB::_writableGraph (graphmap_type::iterator it) {
+	if (!it->second.unique())
+	    it->second.reset(dynamic_cast<BasicGraphPattern*>(it->second->getDNF()));
+	return it->second.get();
     }
 
     void RdfDB::clearTriples () {
-	for (graphmap_type::const_iterator it = graphs.begin();
-	     it != graphs.end(); it++)
-	    it->second->clearTriples();
+	boost::mutex::scoped_lock writer(writeLock);
+	boost::mutex::scoped_lock lock(versionLock);
+	graphmap_type& g = _writableGraphs();
+	for (graphmap_type::iterator it = g.begin(); it != g.end(); it++)
+	    if (it->second.unique())
+		it->second->clearTriples();
+	    else
+		it->second.reset(_newGraph(it->first));
     }
 
     BasicGraphPattern* RdfDB::assureGraph (const POS* name) {
 	if (name == NULL)
 	    name = DefaultGraph;
-	graphmap_type::const_iterator vi = graphs.find(name);
-	if (vi == graphs.end()) {
-	    BasicGraphPattern* ret;
-	    if (name == DefaultGraph)
-		ret = new DefaultGraphPattern();
-	    else
-		ret = new NamedGraphPattern(name);
-	    graphs[name] = ret;
+	boost::mutex::scoped_lock writer(writeLock);
+	boost::mutex::scoped_lock lock(versionLock);
+	graphmap_type& g = _writableGraphs();
+	graphmap_type::iterator vi = g.find(name);
+	if (vi == g.end()) {
+	    BasicGraphPattern* ret = _newGraph(name);
+	    g[name].reset(ret);
 	    return ret;
 	} else {
-	    return vi->second;
+	    return _writableGraph(vi);
+	}
+    }
+
+    void RdfDB::assureGraphs (std::set<const POS*> names) {
+	boost::mutex::scoped_lock writer(writeLock);
+	boost::mutex::scoped_lock lock(versionLock);
+	for (std::set<const POS*>::const_iterator it = names.begin(); it != names.end(); ++it)
+	    if (graphs->find(*it) == graphs->end())
+		_writableGraphs()[*it].reset(_newGraph(*it));
+    }
+
+    const BasicGraphPattern* RdfDB::findGraph (const POS* name) const {
+	if (name == NULL)
+	    name = DefaultGraph;
+	graphmap_type::const_iterator vi = graphs->find(name);
+	return vi == graphs->end() ? NULL : vi->second.get();
+    }
+
+    const BasicGraphPattern* RdfDB::findGraph (const POS* name, const ResultSet* rs) const {
+	if (rs->reading == NULL || rs->reading->db != this)
+	    return findGraph(name);
+	if (name == NULL)
+	    name = DefaultGraph;
+	graphmap_type::const_iterator vi = rs->reading->version->find(name);
+	return vi == rs->reading->version->end() ? NULL : vi->second.get();
+    }
+
+    RdfDB::Reading::Reading (const RdfDB* db, ResultSet* rs) : rs(rs), outer(rs->reading), db(db) {
+	if (outer != NULL && outer->db == db)
+	    version = outer->version;
+	else
+	    version = db->pin();
+	rs->reading = this;
+    }
+
+    RdfDB::Reading::~Reading () {
+	rs->reading = outer;
+    }
+
+    const RdfDB::graphmap_type& RdfDB::_readable (const ResultSet* rs, Version* pinned) const {
+	if (rs->reading != NULL && rs->reading->db == this)
+	    return *rs->reading->version;
+	*pinned = pin();
+	return **pinned;
+    }
+
+    void RdfDB::_apply (graphmap_type& target, const RdfDB* inserts, const RdfDB* deletes) {
+	if (deletes != NULL)
+	    for (graphmap_type::const_iterator it = deletes->graphs->begin();
+		 it != deletes->graphs->end(); ++it) {
+		graphmap_type::iterator vi = target.find(it->first);
+		if (vi != target.end() && it->second->size() > 0)
+		    _writableGraph(vi)->eraseTriples(*it->second);
+	    }
+	if (inserts != NULL)
+	    for (graphmap_type::const_iterator it = inserts->graphs->begin();
+		 it != inserts->graphs->end(); ++it) {
+		graphmap_type::iterator vi = target.find(it->first);
+		BasicGraphPattern* to;
+		if (vi == target.end()) {
+		    to = _newGraph(it->first);
+		    target[it->first].reset(to);
+		} else if (it->second->size() > 0) {
+		    to = _writableGraph(vi);
+		} else
+		    continue;
+		to->addTriples(*it->second);
+	    }
+    }
+
+    void RdfDB::commit (const RdfDB* inserts, const RdfDB* deletes) {
+	boost::mutex::scoped_lock writer(writeLock);
+	boost::mutex::scoped_lock lock(versionLock);
+	if (graphs.unique()) {
+	    /* Nobody has this version pinned so update it in place; new pins
+	     * wait for the (delta-sized) update.
+	     */
+	    _apply(*graphs, inserts, deletes);
+	    return;
 	}
+
+	/* Build the next version beside the pinned one and publish it. */
+	boost::shared_ptr<graphmap_type> next(new graphmap_type(*graphs));
+	lock.unlock();
+	_apply(*next, inserts, deletes);
+	lock.lock();
+	graphs = next;
     }
 
     bool RdfDB::loadData (BasicGraphPattern* target, IStreamContext& istrP, std::string nameStr, std::string baseURI, POSFactory* posFactory, NamespaceMap* nsMap) {
@@ -104,24 +238,79 @@ namespace w3c_sw {
     DefaultGraphClass defaultGraphInst;
     POS* DefaultGraph = &defaultGraphInst;
 
+    boost::shared_ptr<const QuadIndex> RdfDB::_quadIndex (const graphmap_type& current) const {
+	boost::mutex::scoped_lock lock(quadLock);
+	/* quadSources and graphs are both ordered by name. */
+	std::vector<const POS*> stale;
+	std::vector<graphmap_type::const_iterator> added;
+	std::vector<QuadSource>::const_iterator source = quadSources.begin();
+	graphmap_type::const_iterator it = current.begin();
+	while (source != quadSources.end() || it != current.end()) {
+	    if (it != current.end() && it->first == DefaultGraph) {
+		++it;
+	    } else if (it == current.end() || (source != quadSources.end() && source->name < it->first)) {
+		stale.push_back((source++)->name);
+	    } else if (source == quadSources.end() || it->first < source->name) {
+		added.push_back(it++);
+	    } else {
+		if (source->graph.owner_before(it->second) || it->second.owner_before(source->graph)
+		    || source->generation != it->second->getGeneration()) {
+		    stale.push_back(source->name);
+		    added.push_back(it);
+		}
+		++source;
+		++it;
+	    }
+	}
+	if (quads == NULL)
+	    quads.reset(new QuadIndex());
+	else if (stale.empty() && added.empty())
+	    return quads;
+	else if (!quads.unique())
+	    quads.reset(new QuadIndex(*quads));
+
+	for (std::vector<const POS*>::const_iterator name = stale.begin(); name != stale.end(); ++name)
+	    quads->removeGraph(*name);
+	for (std::vector<graphmap_type::const_iterator>::const_iterator graph = added.begin(); graph != added.end(); ++graph)
+	    quads->addGraph((*graph)->first, (*graph)->second.get());
+	quadSources.clear();
+	for (it = current.begin(); it != current.end(); ++it)
+	    if (it->first != DefaultGraph) {
+		QuadSource s = { it->first, it->second, it->second->getGeneration() };
+		quadSources.push_back(s);
+	    }
+	return quads;
+    }
+
     void RdfDB::bindVariables (ResultSet* rs, const POS* graph, const BasicGraphPattern* toMatch) {
 	if (graph == NULL) graph = DefaultGraph;
+	Version pinned;
+	const graphmap_type& current = _readable(rs, &pinned);
 	graphmap_type::const_iterator vi;
 	size_t matched = 0;
 
 	/* Look in each candidate graph. */
 	if (graph->isConstant()) {
-	    if ((vi = graphs.find(graph)) != graphs.end()) {
+	    if ((vi = current.find(graph)) != current.end()) {
 		vi->second->bindVariables(rs, graph, toMatch, vi->first);
 		++matched;
 	    }
+	} else if (rs->options->quadIndex && QuadIndex::Handles(toMatch) && termTable == NULL) {
+	    boost::shared_ptr<const QuadIndex> index = _quadIndex(current);
+	    ResultSet island(rs->getPOSFactory(), rs->debugStream);
+	    island.partOf(*rs);
+	    index->bindVariables(&island, graph, toMatch);
+	    rs->joinIn(&island, NULL);
+	    matched = index->graphCount();
 	} else {
 	    ResultSet island(rs->getPOSFactory());
+	    island.partOf(*rs);
 	    delete *(island.begin());
 	    island.erase(island.begin());
-	    for (vi = graphs.begin(); vi != graphs.end(); vi++)
+	    for (vi = current.begin(); vi != current.end(); vi++)
 		if (vi->first != DefaultGraph) {
 		    ResultSet disjoint(rs->getPOSFactory());
+		    disjoint.partOf(*rs);
 		    vi->second->bindVariables(&disjoint, graph, toMatch, vi->first);
 		    for (ResultSetIterator row = disjoint.begin() ; row != disjoint.end(); ) {
 			island.insert(island.end(), (*row)->duplicate(&island, island.end()));
@@ -130,7 +319,7 @@ namespace w3c_sw {
 		    }
 		    ++matched;
 		}
-	    rs->joinIn(&island, false);
+	    rs->joinIn(&island, NULL);
 	}
 	if (matched == 0)
 	    for (ResultSetIterator it = rs->begin(); it != rs->end(); ) {
@@ -139,9 +328,500 @@ namespace w3c_sw {
 	    }
     }
 
+    bool RdfDB::pipeline (ResultSet* rs, const POS* graph, const BasicGraphPattern* toMatch, Result* row, RowSink* sink) {
+	if (graph == NULL) graph = DefaultGraph;
+	if (!graph->isConstant()) {
+	    /* GRAPH ?g spans graphs; match this row the materializing way. */
+	    ResultSet island(rs->getPOSFactory(), rs->debugStream);
+	    island.partOf(*rs);
+	    island.reseed(row);
+	    bindVariables(&island, graph, toMatch);
+	    return island.pushRows(sink);
+	}
+	Version pinned;
+	const graphmap_type& current = _readable(rs, &pinned);
+	graphmap_type::const_iterator vi = current.find(graph);
+	if (vi == current.end())
+	    return true;
+	return vi->second->pipelineMatches(rs, graph, toMatch, vi->first, row, sink);
+    }
+
+    /* Snapshot layout (host byte order, checked by byteOrder):
+     *   SnapshotHeader
+     *   SnapshotTerm[termCount]		sorted by TermKey; term IDs are 1-based indexes
+     *   char strings[stringBytes]		lexical forms, padded to 8
+     *   per graph: SnapshotGraph, then EncodedTriples::Entry[tripleCount]
+     *					in SPO, POS and OSP order, each padded to 8
+     * Graph name 0 is the default graph. A loaded snapshot is read in
+     * place: graphs match against the mapped permutations, terms are
+     * decoded as they're read and query constants are found by a binary
+     * search of the term table.
+     */
+    namespace snapshot {
+	const char Magic[8] = {'S', 'W', 'O', 'b', 'S', 'n', 'a', 'p'};
+	const boost::uint32_t Version = 2;
+	const boost::uint32_t ByteOrder = 0x01020304;
+	BOOST_STATIC_ASSERT(sizeof(EncodedTriples::Entry) == 3 * sizeof(TermID));
+
+	struct SnapshotHeader {
+	    char magic[8];
+	    boost::uint32_t version;
+	    boost::uint32_t byteOrder;
+	    boost::uint32_t termCount;
+	    boost::uint32_t graphCount;
+	    boost::uint64_t stringBytes;
+	};
+	enum e_Kind { KIND_URI = 1, KIND_BNode = 2, KIND_Literal = 3 };
+	struct SnapshotTerm {
+	    boost::uint8_t kind;
+	    boost::uint8_t pad[3];
+	    boost::uint32_t datatype;	// term ID or 0
+	    boost::uint64_t lexOffset;	// lexical form, then language tag
+	    boost::uint32_t lexLength;
+	    boost::uint32_t langLength;
+	};
+	struct SnapshotGraph {
+	    boost::uint32_t name;
+	    boost::uint32_t pad;
+	    boost::uint64_t tripleCount;
+	};
+
+	inline size_t padding (size_t length) { return (8 - length % 8) % 8; }
+
+	/* What the term table is sorted on: kind, lexical form, language
+	 * tag, then datatype IRI. The strings aren't terminated.
+	 */
+	struct TermKey {
+	    boost::uint8_t kind; // 0: no term a snapshot can hold.
+	    const char* lex; size_t lexLength;
+	    const char* lang; size_t langLength;
+	    const char* datatype; size_t datatypeLength;
+	};
+
+	inline int compareBytes (const char* l, size_t lLength, const char* r, size_t rLength) {
+	    int ret = memcmp(l, r, std::min(lLength, rLength));
+	    if (ret != 0)
+		return ret;
+	    return lLength < rLength ? -1 : lLength > rLength ? 1 : 0;
+	}
+
+	int compare (const TermKey& l, const TermKey& r) {
+	    if (l.kind != r.kind)
+		return l.kind < r.kind ? -1 : 1;
+	    int ret = compareBytes(l.lex, l.lexLength, r.lex, r.lexLength);
+	    if (ret == 0)
+		ret = compareBytes(l.lang, l.langLength, r.lang, r.langLength);
+	    if (ret == 0)
+		ret = compareBytes(l.datatype, l.datatypeLength, r.datatype, r.datatypeLength);
+	    return ret;
+	}
+
+	/* The key of <pos>, whose strings are kept in <lex>, <lang> and <datatype>. */
+	TermKey key (const POS* pos, std::string& lex, std::string& lang, std::string& datatype) {
+	    TermKey ret = { 0, "", 0, "", 0, "", 0 };
+	    const RDFLiteral* literal;
+	    if (dynamic_cast<const URI*>(pos) != NULL)
+		ret.kind = KIND_URI;
+	    else if (dynamic_cast<const BNode*>(pos) != NULL)
+		ret.kind = KIND_BNode;
+	    else if ((literal = dynamic_cast<const RDFLiteral*>(pos)) != NULL) {
+		ret.kind = KIND_Literal;
+		if (literal->getLangtag() != NULL)
+		    lang = literal->getLangtag()->getLexicalValue();
+		if (literal->getDatatype() != NULL)
+		    datatype = literal->getDatatype()->getLexicalValue();
+	    } else
+		return ret;
+	    lex = pos->getLexicalValue();
+	    ret.lex = lex.data(); ret.lexLength = lex.size();
+	    ret.lang = lang.data(); ret.langLength = lang.size();
+	    ret.datatype = datatype.data(); ret.datatypeLength = datatype.size();
+	    return ret;
+	}
+
+	/* A term table and its strings, being written or mapped. */
+	struct Table {
+	    const SnapshotTerm* terms;
+	    boost::uint32_t termCount;
+	    const char* strings;
+	    boost::uint64_t stringBytes;
+
+	    const SnapshotTerm& at (TermID id) const {
+		if (id == 0 || id > termCount)
+		    throw std::string("snapshot term ID out of range");
+		const SnapshotTerm& t = terms[id - 1];
+		if (t.lexOffset + t.lexLength + t.langLength > stringBytes)
+		    throw std::string("snapshot term string out of range");
+		return t;
+	    }
+	    TermKey key (TermID id) const {
+		const SnapshotTerm& t = at(id);
+		TermKey ret = { t.kind, strings + t.lexOffset, t.lexLength,
+				strings + t.lexOffset + t.lexLength, t.langLength, "", 0 };
+		if (t.datatype != 0) {
+		    const SnapshotTerm& d = at(t.datatype);
+		    ret.datatype = strings + d.lexOffset;
+		    ret.datatypeLength = d.lexLength;
+		}
+		return ret;
+	    }
+	};
+
+	struct KeyLess {
+	    const Table* table;
+	    KeyLess (const Table* table) : table(table) {  }
+	    bool operator() (TermID l, TermID r) const { return compare(table->key(l), table->key(r)) < 0; }
+	};
+
+	/* Assigns snapshot-local term IDs in order of first use, then sort
+	 * renumbers them in key order.
+	 */
+	struct Writer {
+	    boost::unordered_map<const POS*, TermID> ids;
+	    std::vector<SnapshotTerm> terms;
+	    std::string strings;
+
+	    TermID id (const POS* pos) {
+		if (pos == NULL)
+		    return 0;
+		boost::unordered_map<const POS*, TermID>::const_iterator known = ids.find(pos);
+		if (known != ids.end())
+		    return known->second;
+
+		SnapshotTerm t;
+		memset(&t, 0, sizeof(t));
+		std::string lex, lang, datatype;
+		TermKey k = key(pos, lex, lang, datatype);
+		if (k.kind == 0)
+		    throw std::string("can't write ") + pos->toString() + " to a snapshot";
+		t.kind = k.kind;
+		if (k.kind == KIND_Literal)
+		    t.datatype = id(dynamic_cast<const RDFLiteral*>(pos)->getDatatype());
+		t.lexOffset = strings.size();
+		t.lexLength = lex.size();
+		t.langLength = lang.size();
+		strings += lex;
+		strings += lang;
+		terms.push_back(t);
+		return ids[pos] = terms.size();
+	    }
+
+	    /* Sort the terms, merging any with equal keys; returns the new ID
+	     * of each old one.
+	     */
+	    std::vector<TermID> sort () {
+		std::vector<TermID> renumbered(terms.size() + 1, 0);
+		if (terms.empty())
+		    return renumbered;
+		Table table = { &terms[0], (boost::uint32_t)terms.size(), strings.data(), strings.size() };
+		std::vector<TermID> order;
+		for (TermID id = 1; id <= terms.size(); ++id)
+		    order.push_back(id);
+		std::sort(order.begin(), order.end(), KeyLess(&table));
+		std::vector<SnapshotTerm> sorted;
+		for (size_t i = 0; i < order.size(); ++i) {
+		    if (i == 0 || compare(table.key(order[i - 1]), table.key(order[i])) != 0)
+			sorted.push_back(terms[order[i] - 1]);
+		    renumbered[order[i]] = sorted.size();
+		}
+		for (std::vector<SnapshotTerm>::iterator it = sorted.begin(); it != sorted.end(); ++it)
+		    it->datatype = renumbered[it->datatype];
+		terms.swap(sorted);
+		return renumbered;
+	    }
+	};
+
+	/* The TermTable of a mapped snapshot, which it keeps mapped. Terms
+	 * are made in <posFactory> on first use; ones interned later are
+	 * numbered after the snapshot's.
+	 */
+	class Terms : public TermTable {
+	    typedef boost::atomic<const POS*> Slot;
+	    enum { Chunk = 1 << 12 };
+
+	    const char* base;
+	    size_t length;
+#ifdef _WIN32
+	    std::vector<char> buffer;
+#endif /* _WIN32 */
+	    const SnapshotHeader* header;
+	    Table table;
+	    POSFactory* posFactory;
+	    boost::scoped_array< boost::atomic<Slot*> > decoded; // chunks of Slots, made as they're needed.
+	    size_t chunks;
+	    mutable boost::mutex lock; // guards decoding, <bnodes> and <added>.
+	    mutable POS::String2BNode bnodes;
+	    std::vector<const POS*> added;
+	    boost::unordered_map<const POS*, TermID> addedIDs;
+
+	    void _map (std::string path) {
+#ifndef _WIN32
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+		    throw std::string("unable to open snapshot ") + path;
+		struct stat st;
+		if (::fstat(fd, &st) != 0 || st.st_size == 0) {
+		    ::close(fd);
+		    throw std::string("unable to stat snapshot ") + path;
+		}
+		length = st.st_size;
+		void* mapped = ::mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd);
+		if (mapped == MAP_FAILED)
+		    throw std::string("unable to mmap snapshot ") + path;
+		base = (const char*)mapped;
+#else /* _WIN32 */
+		std::ifstream is(path.c_str(), std::ios::in | std::ios::binary);
+		if (!is)
+		    throw std::string("unable to open snapshot ") + path;
+		buffer.assign(std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>());
+		length = buffer.size();
+		base = buffer.empty() ? "" : &buffer[0];
+#endif /* _WIN32 */
+	    }
+	    void _unmap () {
+#ifndef _WIN32
+		::munmap((void*)base, length);
+#endif /* !_WIN32 */
+	    }
+
+	    const POS* _decode (TermID id) const {
+		const SnapshotTerm& t = table.at(id);
+		const URI* datatype = NULL;
+		if (t.kind == KIND_Literal && t.datatype != 0) {
+		    if (table.at(t.datatype).kind != KIND_URI)
+			throw std::string("snapshot datatype isn't a URI");
+		    datatype = dynamic_cast<const URI*>(term(t.datatype));
+		}
+		boost::mutex::scoped_lock guard(lock);
+		Slot* chunk = decoded[id / Chunk].load(boost::memory_order_relaxed);
+		if (chunk == NULL) {
+		    chunk = new Slot[Chunk];
+		    for (size_t i = 0; i < Chunk; ++i)
+			chunk[i].store(NULL, boost::memory_order_relaxed);
+		    decoded[id / Chunk].store(chunk, boost::memory_order_release);
+		}
+		const POS* ret = chunk[id % Chunk].load(boost::memory_order_relaxed);
+		if (ret != NULL)
+		    return ret;
+		std::string lex(table.strings + t.lexOffset, t.lexLength);
+		switch (t.kind) {
+		case KIND_URI:
+		    ret = posFactory->getURI(lex);
+		    break;
+		case KIND_BNode:
+		    ret = posFactory->getBNode(lex, bnodes);
+		    break;
+		case KIND_Literal: {
+		    LANGTAG* lang = t.langLength == 0 ? NULL :
+			new LANGTAG(std::string(table.strings + t.lexOffset + t.lexLength, t.langLength));
+		    ret = posFactory->getRDFLiteral(lex, datatype, lang);
+		    break;
+		}
+		default:
+		    throw std::string("unknown snapshot term kind");
+		}
+		chunk[id % Chunk].store(ret, boost::memory_order_release);
+		return ret;
+	    }
+
+	public:
+	    Terms (std::string path, POSFactory* posFactory) : posFactory(posFactory) {
+		_map(path);
+		try {
+		    header = (const SnapshotHeader*)base;
+		    if (length < sizeof(SnapshotHeader) || memcmp(header->magic, Magic, sizeof(Magic)))
+			throw path + " is not an RdfDB snapshot";
+		    if (header->byteOrder != ByteOrder)
+			throw path + " was written with a different byte order";
+		    if (header->version != Version)
+			throw path + " is an unsupported snapshot version";
+		    table.terms = (const SnapshotTerm*)(base + sizeof(SnapshotHeader));
+		    table.termCount = header->termCount;
+		    table.strings = (const char*)(table.terms + header->termCount);
+		    table.stringBytes = header->stringBytes;
+		    if (header->termCount > length / sizeof(SnapshotTerm)
+			|| (size_t)(table.strings - base) + header->stringBytes > length)
+			throw path + " is truncated";
+		} catch (...) {
+		    _unmap();
+		    throw;
+		}
+		chunks = header->termCount / Chunk + 1;
+		decoded.reset(new boost::atomic<Slot*>[chunks]);
+		for (size_t i = 0; i < chunks; ++i)
+		    decoded[i].store(NULL, boost::memory_order_relaxed);
+	    }
+	    ~Terms () {
+		for (size_t i = 0; i < chunks; ++i)
+		    delete [] decoded[i].load(boost::memory_order_relaxed);
+		_unmap();
+	    }
+
+	    const char* getBase () const { return base; }
+	    size_t getLength () const { return length; }
+	    boost::uint32_t graphCount () const { return header->graphCount; }
+	    const char* graphs () const {
+		return table.strings + header->stringBytes + padding(header->stringBytes);
+	    }
+
+	    virtual TermID termID (const POS* pos) const {
+		std::string lex, lang, datatype;
+		TermKey k = key(pos, lex, lang, datatype);
+		if (k.kind != 0) {
+		    TermID low = 1, high = table.termCount + 1;
+		    while (low < high) {
+			TermID mid = low + (high - low) / 2;
+			int c = compare(table.key(mid), k);
+			if (c == 0)
+			    return mid;
+			if (c < 0)
+			    low = mid + 1;
+			else
+			    high = mid;
+		    }
+		}
+		boost::mutex::scoped_lock guard(lock);
+		boost::unordered_map<const POS*, TermID>::const_iterator it = addedIDs.find(pos);
+		return it == addedIDs.end() ? 0 : it->second;
+	    }
+	    virtual TermID intern (const POS* pos) {
+		TermID ret = termID(pos);
+		if (ret != 0)
+		    return ret;
+		if (posFactory->termID(pos) == 0)
+		    throw std::runtime_error(std::string("can't intern ") + pos->toString() + " from another POSFactory");
+		boost::mutex::scoped_lock guard(lock);
+		boost::unordered_map<const POS*, TermID>::const_iterator it = addedIDs.find(pos);
+		if (it != addedIDs.end())
+		    return it->second;
+		if (table.termCount + added.size() == (TermID)-1)
+		    throw std::runtime_error("out of TermIDs");
+		added.push_back(pos);
+		return addedIDs[pos] = table.termCount + added.size();
+	    }
+	    virtual const POS* term (TermID id) const {
+		if (id == 0)
+		    return NULL;
+		if (id > table.termCount) {
+		    boost::mutex::scoped_lock guard(lock);
+		    if (id - table.termCount > added.size())
+			throw std::string("snapshot term ID out of range");
+		    return added[id - table.termCount - 1];
+		}
+		Slot* chunk = decoded[id / Chunk].load(boost::memory_order_acquire);
+		const POS* ret = chunk == NULL ? NULL : chunk[id % Chunk].load(boost::memory_order_acquire);
+		return ret != NULL ? ret : _decode(id);
+	    }
+	    virtual POSFactory* getPOSFactory () const { return posFactory; }
+	};
+    } // namespace snapshot
+
+    void RdfDB::writeSnapshot (std::ostream& os) const {
+	Version current = pin();
+	snapshot::Writer w;
+	std::vector< std::pair<TermID, EncodedTriples::Permutation> > encoded;
+	for (graphmap_type::const_iterator it = current->begin(); it != current->end(); ++it) {
+	    encoded.push_back(std::make_pair(it->first == DefaultGraph ? 0 : w.id(it->first),
+					     EncodedTriples::Permutation()));
+	    EncodedTriples::Permutation& triples = encoded.back().second;
+	    triples.reserve(it->second->size());
+	    for (std::vector<const TriplePattern*>::const_iterator t = it->second->begin();
+		 t != it->second->end(); ++t) {
+		EncodedTriples::Entry entry = { { w.id((*t)->getS()), w.id((*t)->getP()), w.id((*t)->getO()) } };
+		triples.push_back(entry);
+	    }
+	}
+	std::vector<TermID> renumbered = w.sort();
+
+	snapshot::SnapshotHeader header;
+	memcpy(header.magic, snapshot::Magic, sizeof(header.magic));
+	header.version = snapshot::Version;
+	header.byteOrder = snapshot::ByteOrder;
+	header.termCount = w.terms.size();
+	header.graphCount = encoded.size();
+	header.stringBytes = w.strings.size();
+	const char zeros[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+
+	os.write((const char*)&header, sizeof(header));
+	if (!w.terms.empty())
+	    os.write((const char*)&w.terms[0], w.terms.size() * sizeof(snapshot::SnapshotTerm));
+	os.write(w.strings.data(), w.strings.size());
+	os.write(zeros, snapshot::padding(w.strings.size()));
+	for (size_t i = 0; i < encoded.size(); ++i) {
+	    EncodedTriples::Permutation& spo = encoded[i].second;
+	    for (EncodedTriples::Permutation::iterator it = spo.begin(); it != spo.end(); ++it)
+		for (size_t j = 0; j < 3; ++j)
+		    it->at[j] = renumbered[it->at[j]];
+	    std::sort(spo.begin(), spo.end());
+	    spo.erase(std::unique(spo.begin(), spo.end()), spo.end());
+
+	    snapshot::SnapshotGraph g;
+	    g.name = renumbered[encoded[i].first];
+	    g.pad = 0;
+	    g.tripleCount = spo.size();
+	    os.write((const char*)&g, sizeof(g));
+	    size_t bytes = spo.size() * sizeof(EncodedTriples::Entry);
+	    for (size_t order = 0; order < EncodedTriples::Orders; ++order) {
+		EncodedTriples::Permutation rotated;
+		rotated.reserve(spo.size());
+		for (EncodedTriples::Permutation::const_iterator it = spo.begin(); it != spo.end(); ++it)
+		    rotated.push_back(it->rotated(order));
+		std::sort(rotated.begin(), rotated.end());
+		if (bytes != 0)
+		    os.write((const char*)&rotated[0], bytes);
+		os.write(zeros, snapshot::padding(bytes));
+	    }
+	}
+	if (!os)
+	    throw std::string("error writing snapshot");
+    }
+
+    void RdfDB::loadSnapshot (std::string path, POSFactory* posFactory) {
+	boost::shared_ptr<snapshot::Terms> terms(new snapshot::Terms(path, posFactory));
+	RdfDB loaded;
+	loaded.setTermTable(terms.get(), terms);
+	const char* base = terms->getBase();
+	size_t length = terms->getLength();
+	const char* ptr = terms->graphs();
+	for (boost::uint32_t i = 0; i < terms->graphCount(); ++i) {
+	    if ((size_t)(ptr - base) + sizeof(snapshot::SnapshotGraph) > length)
+		throw path + " is truncated";
+	    const snapshot::SnapshotGraph* g = (const snapshot::SnapshotGraph*)ptr;
+	    if (g->tripleCount > length / sizeof(EncodedTriples::Entry))
+		throw path + " is truncated";
+	    size_t bytes = g->tripleCount * sizeof(EncodedTriples::Entry);
+	    size_t stride = bytes + snapshot::padding(bytes);
+	    const char* spo = (const char*)(g + 1);
+	    if ((size_t)(spo - base) + 3 * stride > length)
+		throw path + " is truncated";
+	    loaded.assureGraph(g->name == 0 ? DefaultGraph : terms->term(g->name))
+		->mapTriples((const EncodedTriples::Entry*)spo, (const EncodedTriples::Entry*)(spo + stride),
+			     (const EncodedTriples::Entry*)(spo + 2 * stride), g->tripleCount);
+	    ptr = spo + 3 * stride;
+	}
+	/* Graphs in the same table take the mapped permutations as they are. */
+	setTermTable(terms.get(), terms);
+	commit(&loaded, NULL);
+    }
+
+    std::string RdfDB::statisticsString () const {
+	std::list<const POS*> graphList;
+	for (graphmap_type::const_iterator it = graphs->begin(); it != graphs->end(); ++it)
+	    graphList.push_back(it->first);
+	POSsorter sorter;
+	graphList.sort(sorter);
+	std::stringstream s;
+	for (std::list<const POS*>::const_iterator it = graphList.begin(); it != graphList.end(); ++it) {
+	    s << (*it == DefaultGraph ? std::string("default graph") : (*it)->toString()) << ": ";
+	    s << graphs->find(*it)->second->getStatistics().toString();
+	}
+	return s.str();
+    }
+
     void RdfDB::express (Expressor* expressor) const {
-	for (graphmap_type::const_iterator it = graphs.begin();
-	     it != graphs.end(); it++)
+	for (graphmap_type::const_iterator it = graphs->begin();
+	     it != graphs->end(); it++)
 	    it->second->express(expressor);
     }
 
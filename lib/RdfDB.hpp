@@ -6,6 +6,9 @@
 #define RDF_DB_H
 
 #include <fstream>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/thread/mutex.hpp>
 #include "SWObjects.hpp"
 #include "SPARQLSerializer.hpp"
 #include "../interface/WEBagent.hpp"
@@ -43,10 +46,50 @@ namespace w3c_sw {
     };
     extern POS* DefaultGraph;
 
+    /* RdfDB graphs are versioned. A version is a map of shared graphs;
+     * readers pin() one and are unaffected by later commits. Writers copy
+     * the map and any graph still shared with a pinned version before
+     * changing it, so a version is reclaimed when its last pin goes away.
+     * Queries pin the version they start with in an RdfDB::Reading.
+     *
+     * Writes through assureGraph()'s BasicGraphPattern* are not isolated
+     * from readers already sharing that graph, so SPARUL updates and FROM
+     * loads fill a private RdfDB and commit() it. Readers use findGraph().
+     */
     class RdfDB {
-	typedef std::map<const POS*, BasicGraphPattern*> graphmap_type;
+    public:
+	typedef std::map<const POS*, boost::shared_ptr<BasicGraphPattern> > graphmap_type;
+	typedef boost::shared_ptr<const graphmap_type> Version;
     protected:
-	graphmap_type graphs;
+	boost::shared_ptr<graphmap_type> graphs;
+	mutable boost::mutex versionLock; // guards the graphs pointer.
+	boost::mutex writeLock; // serializes writers.
+	TermTable* termTable; // graphs store TermIDs from it; NULL: pointers.
+	boost::shared_ptr<const void> termOwner; // keeps termTable alive, if it's ours.
+
+	/* The version <rs>'s query is reading, or else the latest, which is
+	 * pinned in <pinned> for the caller.
+	 */
+	const graphmap_type& _readable(const ResultSet* rs, Version* pinned) const;
+
+	BasicGraphPattern* _newGraph(const POS* name) const;
+	graphmap_type& _writableGraphs();
+	static BasicGraphPattern* _writableGraph(graphmap_type::iterator it);
+	void _apply(graphmap_type& target, const RdfDB* inserts, const RdfDB* deletes);
+
+	/* The QuadIndex over the named graphs is built on demand. Graphs which
+	 * have been added, replaced, changed or dropped since are re-indexed
+	 * individually, in place unless a reader still holds the index.
+	 */
+	struct QuadSource {
+	    const POS* name;
+	    boost::weak_ptr<BasicGraphPattern> graph;
+	    size_t generation;
+	};
+	mutable boost::mutex quadLock;
+	mutable boost::shared_ptr<QuadIndex> quads;
+	mutable std::vector<QuadSource> quadSources;
+	boost::shared_ptr<const QuadIndex> _quadIndex(const graphmap_type& current) const;
 
     public:
 	struct HandlerSet {
@@ -66,18 +109,22 @@ namespace w3c_sw {
 	static HandlerSet defaultHandler;
 
 	RdfDB (SWSAXparser* xmlParser = NULL)
-	    : graphs(), webAgent(NULL), xmlParser(xmlParser), debugStream(NULL), handler(&defaultHandler)
+	    : graphs(new graphmap_type()), termTable(NULL), webAgent(NULL), xmlParser(xmlParser), debugStream(NULL), handler(&defaultHandler)
 	{ assureGraph(DefaultGraph); }
 	RdfDB (SWWEBagent* webAgent, SWSAXparser* xmlParser = NULL, std::ostream** debugStream = NULL)
-	    : graphs() , webAgent(webAgent), xmlParser(xmlParser), debugStream(debugStream), handler(&defaultHandler)
+	    : graphs(new graphmap_type()), termTable(NULL), webAgent(webAgent), xmlParser(xmlParser), debugStream(debugStream), handler(&defaultHandler)
 	{ assureGraph(DefaultGraph); }
 	RdfDB (SWWEBagent* webAgent, SWSAXparser* xmlParser, std::ostream** debugStream, HandlerSet* handler)
-	    : graphs() , webAgent(webAgent), xmlParser(xmlParser), debugStream(debugStream), handler(handler)
+	    : graphs(new graphmap_type()), termTable(NULL), webAgent(webAgent), xmlParser(xmlParser), debugStream(debugStream), handler(handler)
 	{ assureGraph(DefaultGraph); }
 	RdfDB (RdfDB const &)
-	    : graphs()
+	    : graphs(new graphmap_type()), termTable(NULL)
 	{ throw(std::runtime_error(FUNCTION_STRING)); assureGraph(DefaultGraph); }
-	RdfDB (const DefaultGraphPattern* graph) : graphs(), debugStream(NULL), handler(&defaultHandler) {
+	/* A private view of <pinned>; writes to it copy what they touch. */
+	RdfDB (Version pinned)
+	    : graphs(boost::const_pointer_cast<graphmap_type>(pinned)), termTable(NULL), webAgent(NULL), xmlParser(NULL), debugStream(NULL), handler(&defaultHandler)
+	{  }
+	RdfDB (const DefaultGraphPattern* graph) : graphs(new graphmap_type()), termTable(NULL), debugStream(NULL), handler(&defaultHandler) {
 	    BasicGraphPattern* bgp = assureGraph(DefaultGraph);
 	    for (std::vector<const TriplePattern*>::const_iterator it = graph->begin();
 		 it != graph->end(); it++)
@@ -86,29 +133,64 @@ namespace w3c_sw {
 	virtual ~RdfDB();
 	std::set<const POS*> getGraphNames () {
 	    std::set<const POS*> names;
-	    for (graphmap_type::const_iterator it = graphs.begin(); it != graphs.end(); ++it)
+	    for (graphmap_type::const_iterator it = graphs->begin(); it != graphs->end(); ++it)
 		names.insert(it->first);
 	    return names;
 		    
 	}
 	BasicGraphPattern* assureGraph(const POS* name);
-	void assureGraphs(std::set<const POS*> names) {
-	    for (std::set<const POS*>::const_iterator it = names.begin(); it != names.end(); ++it)
-		assureGraph(*it);
+	/* Store every graph, and those made later, as TermIDs from <terms>
+	 * (see BasicGraphPattern::encode); NULL: as TriplePattern pointers.
+	 * Named graphs are then matched in place, not through a QuadIndex.
+	 * <owner>, if any, keeps <terms> alive as long as a graph uses it.
+	 */
+	void setTermTable(TermTable* terms, boost::shared_ptr<const void> owner = boost::shared_ptr<const void>());
+	const BasicGraphPattern* findGraph(const POS* name) const;
+	/* Graph <name> in the version a Reading of this RdfDB pinned for
+	 * <rs>, else in the current version.
+	 */
+	const BasicGraphPattern* findGraph(const POS* name, const ResultSet* rs) const;
+	/* Statistics for graph <name>, or NULL if there's no such graph. */
+	const GraphStatistics* getStatistics (const POS* name) const {
+	    const BasicGraphPattern* graph = findGraph(name);
+	    return graph == NULL ? NULL : &graph->getStatistics();
 	}
+	std::string statisticsString() const;
+	/* Create any of <names> which don't exist, leaving the rest shared. */
+	void assureGraphs(std::set<const POS*> names);
+	/* Pin the current version; cheap, and safe against concurrent commits. */
+	Version pin () const {
+	    boost::mutex::scoped_lock lock(versionLock);
+	    return graphs;
+	}
+	/* Reading - pins <db>'s current version for the query filling <rs>
+	 * while in scope. The query's matches, including those in islands
+	 * which are partOf() it, see that version; commits meanwhile leave it
+	 * alone. A nested Reading of the same RdfDB keeps the outer version.
+	 */
+	class Reading {
+	    ResultSet* rs;
+	    const Reading* outer;
+	public:
+	    const RdfDB* db;
+	    Version version;
+	    Reading(const RdfDB* db, ResultSet* rs);
+	    ~Reading();
+	};
+	/* Atomically apply <deletes> then <inserts> (either may be NULL),
+	 * creating any graphs named in <inserts>.
+	 */
+	void commit(const RdfDB* inserts, const RdfDB* deletes);
 	RdfDB& operator= (const RdfDB &ref) {
-	    for (graphmap_type::const_iterator it = graphs.begin(); // @@@ same as ~RdfDB()
-		 it != graphs.end(); it++)
-		delete it->second;
-	    graphs.clear();
-
-	    for (graphmap_type::const_iterator it = ref.graphs.begin(); it != ref.graphs.end(); ++it) {
-		BasicGraphPattern* to = assureGraph(it->first);
-		const BasicGraphPattern* from = it->second;
-		for (std::vector<const TriplePattern*>::const_iterator it = from->begin(); 
-		     it != from->end(); ++it)
-		    to->addTriplePattern(*it);
-	    }	
+	    /* Share ref's current version; copy-on-write keeps them apart. */
+	    Version v = ref.pin();
+	    {
+		boost::mutex::scoped_lock writer(writeLock);
+		boost::mutex::scoped_lock lock(versionLock);
+		graphs = boost::const_pointer_cast<graphmap_type>(v);
+		termTable = ref.termTable;
+		termOwner = ref.termOwner;
+	    }
 
 	    webAgent = ref.webAgent;
 	    xmlParser = ref.xmlParser;
@@ -118,26 +200,26 @@ namespace w3c_sw {
 	}
 	bool operator== (const RdfDB& ref) const {
 	    std::set<const POS*> thisGraphs;
-	    for (graphmap_type::const_iterator it = graphs.begin(); it != graphs.end(); ++it)
+	    for (graphmap_type::const_iterator it = graphs->begin(); it != graphs->end(); ++it)
 		// if (it->second->size() > 0)
 		    thisGraphs.insert(it->first);
 
 	    std::set<const POS*> refGraphs;
-	    for (graphmap_type::const_iterator it = ref.graphs.begin(); it != ref.graphs.end(); ++it)
+	    for (graphmap_type::const_iterator it = ref.graphs->begin(); it != ref.graphs->end(); ++it)
 		// if (it->second->size() > 0)
 		    refGraphs.insert(it->first);
 
 	    if (thisGraphs != refGraphs)
 		return false;
 
-	    for (graphmap_type::const_iterator it = graphs.begin(); it != graphs.end(); ++it) {
-		// compare BasicGraphPatterns *it->second and *ref.graphs.find(it->first)->second;
+	    for (graphmap_type::const_iterator it = graphs->begin(); it != graphs->end(); ++it) {
+		// compare BasicGraphPatterns *it->second and *ref.graphs->find(it->first)->second;
 		const POS* label = it->first;
-		BasicGraphPattern* l = it->second;
-		graphmap_type::const_iterator rit = ref.graphs.find(label);
-		if (rit == ref.graphs.end())
+		const BasicGraphPattern* l = it->second.get();
+		graphmap_type::const_iterator rit = ref.graphs->find(label);
+		if (rit == ref.graphs->end())
 		    return false;
-		BasicGraphPattern* r = rit->second;
+		const BasicGraphPattern* r = rit->second.get();
 		if (! (*l == *r) )
 		    return false;
 	    }
@@ -145,8 +227,21 @@ namespace w3c_sw {
 	    return true;
 	}
 	void clearTriples();
+
+	/* Binary snapshots of every graph; see RdfDB.cpp for the layout.
+	 * writeSnapshot writes the current version, unaffected by commits.
+	 * loadSnapshot mmaps <path>, makes its terms this RdfDB's TermTable
+	 * and commits its graphs. Graphs which were empty match against the
+	 * mapped permutations; terms are made in <posFactory> as they're read.
+	 */
+	void writeSnapshot(std::ostream& os) const;
+	void loadSnapshot(std::string path, POSFactory* posFactory);
 	virtual bool loadData(BasicGraphPattern* target, IStreamContext& istr, std::string nameStr, std::string baseURI, POSFactory* posFactory, NamespaceMap* nsMap = NULL);
 	virtual void bindVariables(ResultSet* rs, const POS* graph, const BasicGraphPattern* toMatch);
+	/* Stream the matches of <toMatch> extending <row> to <sink>; see
+	 * TableOperation::pipeline.
+	 */
+	virtual bool pipeline(ResultSet* rs, const POS* graph, const BasicGraphPattern* toMatch, Result* row, RowSink* sink);
 	void express(Expressor* expressor) const;
 	std::string toString (MediaType mediaType = MediaType("text/trig"), NamespaceMap* namespaces = NULL) const {
 	    /* simple unordered serializer -
@@ -163,14 +258,14 @@ namespace w3c_sw {
 		mediaType.match("application/rdf+xml"))
 		graphList.push_back(DefaultGraph);
 	    else
-		for (graphmap_type::const_iterator it = graphs.begin(); it != graphs.end(); ++it)
+		for (graphmap_type::const_iterator it = graphs->begin(); it != graphs->end(); ++it)
 		    // if (it->second->size() > 0)
 		    graphList.push_back(it->first);
 	    POSsorter sorter;
 	    graphList.sort(sorter);
 	    std::stringstream s;
 	    for (std::list<const POS*>::const_iterator it = graphList.begin(); it != graphList.end(); ++it) 
-		s << graphs.find(*it)->second->toString(mediaType, namespaces);
+		s << graphs->find(*it)->second->toString(mediaType, namespaces);
 	    return s.str();
 	}
     };
@@ -6,6 +6,7 @@
 #define RDF_REMOTE_DB_H
 
 #include "RdfDB.hpp"
+#include "ServiceCache.hpp"
 #include "../interface/WEBagent.hpp"
 
 namespace w3c_sw {
@@ -15,7 +16,7 @@ namespace w3c_sw {
 	    ResultSet* rs;
 	    bool expectOuterGraph;
 	    bool lexicalCompare;
-	    std::set<const Variable*> vars;
+	    std::set<const POS*> vars;
 	    std::string selectString;
 	    std::string federationString;
 
@@ -39,18 +40,24 @@ namespace w3c_sw {
 
 		    /* Serialize nested stuff. */
 		    depth++;
-		    ExprSet* filters = injectFilter; injectFilter = NULL;
+		    const ExprSet* filters = injectFilter; injectFilter = NULL;
 		    p_TriplePatterns->express(this);
 		    serializeFilter(filters);
 		    depth--;
 		    // _BasicGraphPattern(self, p_TriplePatterns, p_Filters, p_allOpts);
 
 		    /* Build SELECT and FILTER strings from enountered Variables. */
-		    selectString = "SELECT ";
-		    for (std::set<const Variable*>::const_iterator it = vars.begin();
+		    selectString = vars.empty() ? "SELECT * " : "SELECT ";
+		    for (std::set<const POS*>::const_iterator it = vars.begin();
 			 it != vars.end(); ++it)
 			selectString += (*it)->toString() + ' ';
-		    federationString = rs->buildFederationString(vars, lexicalCompare);
+		    const Expression* federation = rs->getFederationExpression(vars, lexicalCompare);
+		    if (federation != NULL) {
+			SPARQLSerializer s;
+			federation->express(&s);
+			federationString = " FILTER (" + s.str() + ")";
+			delete federation;
+		    }
 
 		    expectOuterGraph = true;
 		} else
@@ -61,7 +68,6 @@ namespace w3c_sw {
     protected:
 	std::vector<const char*> endpointPatterns;
 	std::set<const POS*> loadedEndpoints;
-	POSFactory* posFactory;
 	bool lexicalCompare;
 
     public:
@@ -70,21 +76,34 @@ namespace w3c_sw {
 		     bool lexicalCompare = false, std::ostream** debugStream = NULL) : 
 	    RdfDB(webAgent, xmlParser, debugStream), endpointPatterns(endpointPatterns), lexicalCompare(lexicalCompare) {  }
 #if REGEX_LIB == SWOb_BOOST
-	virtual void loadData (const POS* name, BasicGraphPattern* target, POSFactory* posFactory) {
+	/* Graphs named by an endpoint pattern are queried, not loaded. */
+	virtual bool loadData (BasicGraphPattern* target, IStreamContext& istr, std::string nameStr, std::string baseURI, POSFactory* posFactory, NamespaceMap* nsMap = NULL) {
 	    for (std::vector<const char*>::const_iterator it = endpointPatterns.begin();
 		 it != endpointPatterns.end(); ++it) {
 		boost::regex re(*it);
 		boost::cmatch matches;
-		if (boost::regex_match(name->getLexicalValue().c_str(), matches, re)) {
-		    loadedEndpoints.insert(name);
-		    this->posFactory = posFactory;
-		    return;
+		if (boost::regex_match(nameStr.c_str(), matches, re)) {
+		    loadedEndpoints.insert(posFactory->getURI(nameStr));
+		    return false;
 		}
 	    }
-	    RdfDB::loadData(name, target, posFactory);
+	    return RdfDB::loadData(target, istr, nameStr, baseURI, posFactory, nsMap);
 	}
 #endif /* REGEX_LIB == SWOb_BOOST */
 
+	/* Remote graphs are fetched per ResultSet, so match this row the
+	 * materializing way.
+	 */
+	virtual bool pipeline (ResultSet* rs, const POS* graph, const BasicGraphPattern* toMatch, Result* row, RowSink* sink) {
+	    ResultSet island(rs->getPOSFactory(), rs->debugStream);
+	    island.partOf(*rs);
+	    island.reseed(row);
+	    island.filtersFor = rs->filtersFor;
+	    island.filters = rs->filters;
+	    bindVariables(&island, graph, toMatch);
+	    return island.pushRows(sink);
+	}
+
 	virtual void bindVariables (ResultSet* rs, const POS* graph, const BasicGraphPattern* toMatch) {
 #if REGEX_LIB == SWOb_BOOST
 	    if (loadedEndpoints.find(graph) == loadedEndpoints.end())
@@ -92,48 +111,26 @@ namespace w3c_sw {
 		RdfDB::bindVariables(rs, graph, toMatch);
 #if REGEX_LIB == SWOb_BOOST
 	    else {
-		/* Build the request URL in buffer u. */
-		std::stringstream u;
-		u.setf(std::ios::hex, std::ios::basefield);
-		u.setf(std::ios::uppercase);
-
-		std::string srvc = graph->getLexicalValue();
-		u << srvc;
-		u << (srvc.find_first_of("?") == std::string::npos ? "?" : 
-		      srvc.at(srvc.size()-1) == '&' ? "" : 
-		      "&");
-		u << "query=";
 		GraphSerializer ser(rs, lexicalCompare);
 		toMatch->express(&ser);
+		std::string srvc = graph->getLexicalValue();
 		std::string q = ser.getSelectString() + '{' + ser.str() + ser.getFederationString() + '}';
 		if (debugStream != NULL && *debugStream != NULL)
 		    **debugStream << "Querying <" << srvc << "> for\n" << q;
-		for (std::string::const_iterator it = q.begin(); it != q.end(); ++it) {
-		    if (*it == ' ')
-			u << '+';
-		    else if ((*it >= 'a' && *it <= 'z') || 
-			     (*it >= 'A' && *it <= 'Z') || 
-			     (*it >= '0' && *it <= '9') || 
-			     *it == '.' || *it == '-' || *it == '_')
-			u << *it;
-		    else if (*it < 0x10)
-			u << "%0" << (unsigned)*it;
-		    else
-			u << '%' << (unsigned)*it;
-		}
 
-		/* Do an HTTP GET. */
-		std::string s(webAgent->get(
-#if REGEX_LIB == SWOb_DISABLED
-#warning "Web agent needs REGEX to parse service URL -- defaulting to http://localhost:8888/sparql"
-					    "localhost", "8888", "/sparql"
-#else /* !REGEX_LIB == SWOb_DISABLED */
-					    u.str().c_str()
-#endif /* !REGEX_LIB == SWOb_DISABLED */
-					    ));
+		/* Do an HTTP GET unless the cache has the answer. */
+		ServiceCache* cache = rs->options->serviceCache;
+		std::string s;
+		if (cache == NULL || !cache->get(srvc, q, &s)) {
+		    SWWEBagent::Parameter p("query", SWWEBagent::urlEncode(q));
+		    s = webAgent->get(SWWEBagent::getURL(srvc, &p, 1).c_str());
+		    if (cache != NULL)
+			cache->put(srvc, q, s);
+		}
 
 		/* Parse results into a ResultSet. */
-		ResultSet red(posFactory, xmlParser, s.begin(), s.end());
+		IStreamContext istr(s, IStreamContext::STRING);
+		ResultSet red(rs->getPOSFactory(), xmlParser, istr);
 		if (debugStream != NULL && *debugStream != NULL)
 		    **debugStream << " yielded\n" << red;
 
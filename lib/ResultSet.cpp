@@ -3,6 +3,10 @@
  */
 
 #include <set>
+#include <iterator>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
 #include "ResultSet.hpp"
 #include "SWObjectDuplicator.hpp"
 #include "XMLQueryExpressor.hpp"
@@ -13,37 +17,160 @@ namespace w3c_sw {
     const char* ResultSet::NS_srx = "http://www.w3.org/2005/sparql-results#";
     const char* ResultSet::NS_xml = "http://www.w3.org/XML/1998/namespace";
 
+    VariableSlots::~VariableSlots () {
+	for (std::vector<Pool>::iterator pool = pools.begin(); pool != pools.end(); ++pool)
+	    for (std::vector<char*>::iterator batch = pool->batches.begin(); batch != pool->batches.end(); ++batch)
+		delete [] *batch;
+    }
+
+    size_t VariableSlots::slot (const POS* variable) {
+	int found = find(variable);
+	if (found >= 0)
+	    return found;
+	size_t ret = variables.size();
+	variables.push_back(variable);
+	if (variables.size() > Scanned) {
+	    if (index.empty())
+		for (size_t i = 0; i < ret; ++i)
+		    index[variables[i]] = i;
+	    index[variable] = ret;
+	}
+	if (variables.size() > width)
+	    width = (variables.size() + 3) & ~(size_t)3;
+	return ret;
+    }
+
+    void* VariableSlots::allocate (size_t bytes) {
+	std::vector<Pool>::iterator pool = pools.begin();
+	while (pool != pools.end() && pool->bytes != bytes)
+	    ++pool;
+	if (pool == pools.end()) {
+	    Pool added;
+	    added.bytes = bytes;
+	    added.carved = Rows;
+	    pool = pools.insert(pools.end(), added);
+	}
+	if (!pool->free.empty()) {
+	    void* ret = pool->free.back();
+	    pool->free.pop_back();
+	    return ret;
+	}
+	if (pool->carved == Rows) {
+	    pool->batches.push_back(new char[bytes * Rows]);
+	    pool->carved = 0;
+	}
+	return pool->batches.back() + bytes * pool->carved++;
+    }
+
+    void VariableSlots::deallocate (void* cell, size_t bytes) {
+	std::vector<Pool>::iterator pool = pools.begin();
+	while (pool->bytes != bytes)
+	    ++pool;
+	pool->free.push_back(cell);
+    }
+
+    Result::Result (ResultSet* rs) : 
+	slots(rs != NULL ? rs->slots : new VariableSlots()), width(0), values(NULL), count(0), cell(false), widened(false) {
+	if (rs != NULL)
+	    slots->retain();
+    }
+
+    Result::~Result () {
+	if (widened)
+	    slots->deallocate(values, _bytes(width));
+	if (!cell)
+	    slots->release();
+    }
+
+    Result* Result::_make (VariableSlots* slots, size_t width, bool clear) {
+	size_t bytes = sizeof(Cell) + sizeof(Result) + _bytes(width);
+	Cell* cell = static_cast<Cell*>(slots->allocate(bytes));
+	cell->slots = slots;
+	cell->bytes = bytes;
+	const POS** values = reinterpret_cast<const POS**>(reinterpret_cast<char*>(cell + 1) + sizeof(Result));
+	if (clear)
+	    std::memset(values, 0, _bytes(width));
+	return new (cell + 1) Result(slots, width, values);
+    }
+
+    Result* Result::make (ResultSet* rs) {
+	if (rs == NULL)
+	    return _make(new VariableSlots(), 0, true); // the cell's reference
+	rs->slots->retain();
+	return _make(rs->slots, rs->slots->getWidth(), true);
+    }
+
+    void Result::operator delete (void* p) {
+	Cell* cell = static_cast<Cell*>(p) - 1;
+	VariableSlots* slots = cell->slots;
+	slots->deallocate(cell, cell->bytes);
+	slots->release();
+    }
+
+    /* Reallocate values at the current width of slots. */
+    void Result::_widen () {
+	size_t to = slots->getWidth();
+	const POS** wider = static_cast<const POS**>(slots->allocate(_bytes(to)));
+	std::memset(wider, 0, _bytes(to));
+	if (width > 0) {
+	    std::copy(values, values + width, wider);
+	    Word* bound = reinterpret_cast<Word*>(wider + to);
+	    std::copy(_bound(), _bound() + _words(width), bound);
+	    std::copy(_weak(), _weak() + _words(width), bound + _words(to));
+	}
+	if (widened)
+	    slots->deallocate(values, _bytes(width));
+	values = wider;
+	width = to;
+	widened = true;
+    }
+
     void Result::set (const POS* variable, const POS* value, bool weaklyBound, bool replace) {
-	if (variable->toString() == "?") {
-	    std::stringstream s;
-	    s << "tried to assign empty variable  to \"" << value->toString() << "\"";
-	    throw(std::runtime_error(s.str()));
+	int found = slots->find(variable);
+	if (found < 0) {
+	    const Variable* asVar = dynamic_cast<const Variable*>(variable);
+	    if (asVar != NULL && asVar->getLexicalValue().empty()) {
+		std::stringstream s;
+		s << "tried to assign empty variable  to \"" << value->toString() << "\"";
+		throw(std::runtime_error(s.str()));
+	    }
+	    found = slots->slot(variable);
 	}
-	BindingSet::const_iterator vi = bindings.find(variable);
-	if (replace || vi == bindings.end()) {
-	    BindingInfo b = {weaklyBound, value};
-	    bindings[variable] = b;
-	} else {
+	size_t slot = found;
+	if (slot >= width)
+	    _widen();
+	Word bit = Word(1) << (slot % 64);
+	Word& bound = _bound()[slot / 64];
+	if ((bound & bit) == 0) {
+	    bound |= bit;
+	    ++count;
+	} else if (!replace) {
 	    std::stringstream s;
 	    s << "variable " << variable->toString() << " reassigned:"
-		" old value:" << bindings[variable].pos->toString() << 
+		" old value:" << values[slot]->toString() << 
 		" new value:" << value->toString();
 	    throw(std::runtime_error(s.str()));
 	}
+	values[slot] = value;
+	if (weaklyBound)
+	    _weak()[slot / 64] |= bit;
+	else
+	    _weak()[slot / 64] &= ~bit;
     }
 
-    const POS* Result::get (const POS* variable) const {
-	BindingSet::const_iterator vi = bindings.find(variable);
-	if (vi == bindings.end())
-	    return NULL;
-	else
-	    return (*vi).second.pos;
+    void Result::erase (BindingSetConstIterator it) {
+	size_t slot = it.getSlot();
+	Word bit = Word(1) << (slot % 64);
+	_bound()[slot / 64] &= ~bit;
+	_weak()[slot / 64] &= ~bit;
+	values[slot] = NULL;
+	--count;
     }
 
     XMLSerializer* Result::toXml (XMLSerializer* xml) {
 	XMLQueryExpressor xmlizer(xml);
 	xml->open("result");
-	for (BindingSetIterator it = bindings.begin(); it != bindings.end(); it++) {
+	for (BindingSetConstIterator it = begin(); it != end(); it++) {
 	    xml->open("binding");
 	    xml->attribute(it->first->getBindingAttributeName(), it->first->getLexicalValue());
 	    if (it->second.weaklyBound) xml->attribute("binding", "weak" );
@@ -54,23 +181,249 @@ namespace w3c_sw {
 	return xml;
     }
 
-    Result* Result::duplicate (ResultSet* rs, ResultSetIterator /* row */) {
-	Result* ret = new Result(rs);
-	for (BindingSetIterator it = bindings.begin(); it != bindings.end(); it++)
-	    ret->set(it->first, it->second.pos, it->second.weaklyBound);
+    /* A copy of this row in rs's slots; rows of the same slots copy their
+     * values and masks wholesale.
+     */
+    Result* Result::duplicate (ResultSet* rs, ResultSetIterator /* row */) const {
+	if (rs->slots != slots) {
+	    Result* ret = make(rs);
+	    for (BindingSetConstIterator it = begin(); it != end(); ++it)
+		ret->set(it->first, it->second.pos, it->second.weaklyBound);
+	    return ret;
+	}
+	slots->retain();
+	size_t to = std::max(width, slots->getWidth());
+	Result* ret = _make(slots, to, to != width);
+	if (width > 0) {
+	    std::copy(values, values + width, ret->values);
+	    std::copy(_bound(), _bound() + _words(width), ret->_bound());
+	    std::copy(_weak(), _weak() + _words(width), ret->_weak());
+	}
+	ret->count = count;
 	return ret;
     }
 
     ResultSet::ResultSet (POSFactory* posFactory, std::ostream** debugStream) : 
-	posFactory(posFactory), knownVars(), results(), ordered(false),  db(NULL), 
-	selectOrder(), orderedSelect(false), resultType(RESULT_Tabular), debugStream(debugStream) {
-	results.insert(results.begin(), new Result(this));
+	posFactory(posFactory), slots(new VariableSlots()), knownVars(), results(), ordered(false),  db(NULL), 
+	selectOrder(), orderedSelect(false), resultType(RESULT_Tabular), debugStream(debugStream), filtersFor(NULL), filters(NULL), reading(NULL), options(&QueryOptions::Defaults) {
+	results.insert(results.begin(), Result::make(this));
     }
 
     ResultSet::~ResultSet () {
 	selectOrder.clear();
 	for (ResultSetIterator it = results.begin(); it != results.end(); it++)
 	    delete *it;
+	slots->release();
+    }
+
+    /* Collects a query's variables (and bnodes) in the order they appear. */
+    class SlotAssigner : public RecursiveExpressor {
+	VariableSlots* slots;
+    public:
+	SlotAssigner (VariableSlots* slots) : slots(slots) {  }
+	virtual void base (const Base* const, std::string) {  }
+	virtual void variable (const Variable* const self, std::string) { slots->slot(self); }
+	virtual void bnode (const BNode* const self, std::string) { slots->slot(self); }
+    };
+
+    void ResultSet::assignSlots (const Base* query) {
+	SlotAssigner assigner(slots);
+	query->express(&assigner);
+    }
+
+
+    /* Bindings in yourRow must agree with myRow's; on success their union
+     * is inserted before myRow.
+     */
+    void ResultSet::_joinRows (ResultSetIterator myRow, const Result* yourRow, const ProductionVector<const Expression*>* expressions, 
+			       bool minus, bool* matchedSomeRow) {
+	std::set<const POS*>copy;
+	for (BindingSetConstIterator yourBinding = yourRow->begin();
+	     yourBinding != yourRow->end(); ++yourBinding) {
+	    const POS* var = yourBinding->first;
+	    const POS* yourVal = yourBinding->second.pos;
+	    const POS* myVal = (*myRow)->get(var);
+	    if (myVal == NULL) {
+		knownVars.insert(var); // means we can bypass ResultSet::set(...).
+		if (yourVal != NULL)
+		    copy.insert(var);
+	    } else if (myVal != yourVal) {
+		return;
+	    }
+	}
+	bool matched = true;
+	Result* newRow = (*myRow)->duplicate(this, myRow);
+	for (std::set<const POS*>::iterator vars = copy.begin();
+	     vars != copy.end(); ++vars)
+	    newRow->set(*vars, yourRow->get(*vars), false);
+	if (expressions != NULL)
+	    for (std::vector<const Expression*>::const_iterator expression = expressions->begin();
+		 matched && expression != expressions->end(); expression++)
+		matched &= posFactory->eval(*expression, newRow);
+	if (matched) {
+	    if (minus)
+		delete newRow;
+	    else
+		insert(myRow, newRow);
+	    *matchedSomeRow = true;
+	} else {
+	    delete newRow;
+	}
+    }
+
+    typedef std::vector<const POS*> JoinKey;
+    typedef std::vector< std::pair<size_t, const Result*> > JoinRows; // (position in ref, row)
+
+    /* The values of <vars> in <row>, or false if any is unbound. */
+    static bool _joinKey (const Result* row, const VariableVector& vars, JoinKey* key) {
+	key->clear();
+	for (VariableVectorConstIterator var = vars.begin(); var != vars.end(); ++var) {
+	    const POS* val = row->get(*var);
+	    if (val == NULL)
+		return false;
+	    key->push_back(val);
+	}
+	return true;
+    }
+
+    void ResultSet::joinIn (ResultSet* ref, const ProductionVector<const Expression*>* expressions, e_OP operation) {
+	bool minus = operation == OP_minus;
+	VariableVector shared;
+	if (options->hashJoin)
+	    std::set_intersection(knownVars.begin(), knownVars.end(), 
+				  ref->knownVars.begin(), ref->knownVars.end(), 
+				  std::back_inserter(shared));
+
+	/* Bucket ref's rows by their shared bindings, remembering their order
+	 * so the output is the same as from the nested loop.
+	 */
+	boost::unordered_map<JoinKey, JoinRows, boost::hash<JoinKey> > buckets;
+	JoinRows unkeyed, all;
+	JoinKey key;
+	std::set<const POS*> refVars; // the nested loop would have added these to knownVars.
+	size_t position = 0;
+	for (ResultSetConstIterator yourRow = ref->results.begin();
+	     yourRow != ref->results.end(); ++yourRow, ++position) {
+	    all.push_back(std::make_pair(position, *yourRow));
+	    if (shared.empty())
+		continue;
+	    for (BindingSetConstIterator binding = (*yourRow)->begin(); binding != (*yourRow)->end(); ++binding)
+		refVars.insert(binding->first);
+	    if (_joinKey(*yourRow, shared, &key))
+		buckets[key].push_back(all.back());
+	    else
+		unkeyed.push_back(all.back());
+	}
+
+	if (!results.empty())
+	    knownVars.insert(refVars.begin(), refVars.end());
+	JoinRows none;
+	for (ResultSetIterator myRow = results.begin();
+	     myRow != results.end(); ) {
+	    bool matchedSomeRow = false;
+	    if (shared.empty() || !_joinKey(*myRow, shared, &key)) {
+		for (JoinRows::const_iterator yourRow = all.begin(); yourRow != all.end(); ++yourRow)
+		    _joinRows(myRow, yourRow->second, expressions, minus, &matchedSomeRow);
+	    } else {
+		boost::unordered_map<JoinKey, JoinRows, boost::hash<JoinKey> >::const_iterator bucket = buckets.find(key);
+		const JoinRows& keyed = bucket == buckets.end() ? none : bucket->second;
+		JoinRows::const_iterator k = keyed.begin(), u = unkeyed.begin();
+		while (k != keyed.end() || u != unkeyed.end())
+		    if (u == unkeyed.end() || (k != keyed.end() && k->first < u->first))
+			_joinRows(myRow, (k++)->second, expressions, minus, &matchedSomeRow);
+		    else
+			_joinRows(myRow, (u++)->second, expressions, minus, &matchedSomeRow);
+	    }
+	    if ((operation == OP_outer || operation == OP_minus) && !matchedSomeRow)
+		myRow++;
+	    else {
+		delete *myRow;
+		myRow = erase(myRow);
+	    }
+	}
+    }
+
+    /* RSsax which joins each parsed row with <left>'s rows and appends the
+     * products to <target> instead of keeping the parsed row.
+     */
+    class JoiningRSsax : public ResultSet::RSsax {
+	const ResultSet* left;
+	ResultSet* target;
+	bool indexed;
+	VariableVector shared;
+	boost::unordered_map<JoinKey, JoinRows, boost::hash<JoinKey> > buckets;
+	JoinRows unkeyed, all;
+
+	/* Bucket left's rows by the variables the results' head declared. */
+	void index () {
+	    const VariableList& leftVars = *left->getKnownVars();
+	    const VariableList& rightVars = *rs->getKnownVars();
+	    if (target->options->hashJoin)
+		std::set_intersection(leftVars.begin(), leftVars.end(), 
+				      rightVars.begin(), rightVars.end(), 
+				      std::back_inserter(shared));
+	    JoinKey key;
+	    size_t position = 0;
+	    for (ResultSetConstIterator row = left->begin(); row != left->end(); ++row, ++position) {
+		all.push_back(std::make_pair(position, *row));
+		if (shared.empty())
+		    continue;
+		if (_joinKey(*row, shared, &key))
+		    buckets[key].push_back(all.back());
+		else
+		    unkeyed.push_back(all.back());
+	    }
+	    indexed = true;
+	}
+
+	void joinRows (const Result* leftRow, const Result* rightRow) {
+	    for (BindingSetConstIterator binding = rightRow->begin(); binding != rightRow->end(); ++binding) {
+		const POS* leftVal = leftRow->get(binding->first);
+		if (leftVal != NULL && leftVal != binding->second.pos)
+		    return;
+	    }
+	    Result* newRow = Result::make(target);
+	    for (BindingSetConstIterator binding = leftRow->begin(); binding != leftRow->end(); ++binding) {
+		target->addKnownVar(binding->first);
+		newRow->set(binding->first, binding->second.pos, false);
+	    }
+	    for (BindingSetConstIterator binding = rightRow->begin(); binding != rightRow->end(); ++binding)
+		if (binding->second.pos != NULL && leftRow->get(binding->first) == NULL) {
+		    target->addKnownVar(binding->first);
+		    newRow->set(binding->first, binding->second.pos, false);
+		}
+	    target->insert(target->end(), newRow);
+	}
+
+	virtual void resultDone (Result* right) {
+	    if (!indexed)
+		index();
+	    JoinKey key;
+	    if (shared.empty() || !_joinKey(right, shared, &key)) {
+		for (JoinRows::const_iterator leftRow = all.begin(); leftRow != all.end(); ++leftRow)
+		    joinRows(leftRow->second, right);
+	    } else {
+		boost::unordered_map<JoinKey, JoinRows, boost::hash<JoinKey> >::const_iterator bucket = buckets.find(key);
+		if (bucket != buckets.end())
+		    for (JoinRows::const_iterator leftRow = bucket->second.begin(); leftRow != bucket->second.end(); ++leftRow)
+			joinRows(leftRow->second, right);
+		for (JoinRows::const_iterator leftRow = unkeyed.begin(); leftRow != unkeyed.end(); ++leftRow)
+		    joinRows(leftRow->second, right);
+	    }
+	    delete right;
+	}
+
+    public:
+	JoiningRSsax (ResultSet* right, POSFactory* posFactory, const ResultSet* left, ResultSet* target)
+	    : ResultSet::RSsax(right, posFactory), left(left), target(target), indexed(false) {  }
+    };
+
+    void ResultSet::joinStream (SWSAXparser* parser, IStreamContext& sptr, ResultSet* target) const {
+	ResultSet right(posFactory); // collects the head's variables
+	delete *right.begin();
+	right.erase(right.begin());
+	JoiningRSsax handler(&right, posFactory, this, target);
+	parser->parse(sptr, &handler);
     }
 
     ResultSet* Result::makeResultSet (POSFactory* posFactory) {
@@ -81,9 +434,8 @@ namespace w3c_sw {
 	return ret;
     }
     void Result::assumeNewBindings (Result* from) {
-	for (BindingSetIterator it = from->bindings.begin(); it != from->bindings.end(); it++)
-	    bindings[it->first] = it->second;
-	//	    set(it->first, it->second);	
+	for (BindingSetConstIterator it = from->begin(); it != from->end(); it++)
+	    set(it->first, it->second.pos, it->second.weaklyBound, true);
     }
 
 
@@ -237,21 +589,726 @@ namespace w3c_sw {
 
     }
 
+
+    ColumnBatch::ColumnBatch (VariableSlots* slots) : slots(slots), width(0), count(0) {
+	slots->retain();
+	_widen(slots->size());
+    }
+
+    ColumnBatch::~ColumnBatch () {
+	slots->release();
+    }
+
+    /* Add columns; rows past count stay NULL in every column. */
+    void ColumnBatch::_widen (size_t to) {
+	if (to <= width)
+	    return;
+	values.resize(to * Rows, NULL);
+	weak.resize(to * Rows, 0);
+	width = to;
+    }
+
+    void ColumnBatch::append (const Result* row) {
+	if (full())
+	    throw std::runtime_error("ColumnBatch::append: batch is full");
+	bool same = row->getSlots() == slots;
+	for (BindingSetConstIterator it = row->begin(); it != row->end(); ++it) {
+	    size_t slot = same ? it.getSlot() : slots->slot(it->first);
+	    if (slot >= width)
+		_widen(slots->size());
+	    values[slot * Rows + count] = it->second.pos;
+	    weak[slot * Rows + count] = it->second.weaklyBound;
+	}
+	++count;
+    }
+
+    Result* ColumnBatch::makeRow (size_t i, ResultSet* rs) const {
+	Result* ret = Result::make(rs);
+	bool same = ret->getSlots() == slots;
+	for (size_t slot = 0; slot < width; ++slot) {
+	    const POS* value = values[slot * Rows + i];
+	    if (value == NULL)
+		continue;
+	    if (same)
+		ret->_setSlot(slot, value, weak[slot * Rows + i] != 0);
+	    else
+		ret->set(slots->variable(slot), value, weak[slot * Rows + i] != 0);
+	}
+	return ret;
+    }
+
+    void ColumnBatch::select (const std::vector<char>& keep) {
+	size_t kept = 0;
+	for (size_t i = 0; i < count; ++i)
+	    if (keep[i]) {
+		if (kept != i)
+		    for (size_t slot = 0; slot < width; ++slot) {
+			values[slot * Rows + kept] = values[slot * Rows + i];
+			weak[slot * Rows + kept] = weak[slot * Rows + i];
+		    }
+		++kept;
+	    }
+	for (size_t slot = 0; slot < width; ++slot) {
+	    std::fill(values.begin() + slot * Rows + kept, values.begin() + slot * Rows + count, (const POS*)NULL);
+	    std::fill(weak.begin() + slot * Rows + kept, weak.begin() + slot * Rows + count, 0);
+	}
+	count = kept;
+    }
+
+    ColumnarResultSet::ColumnarResultSet (ResultSet* rs) : slots(rs->slots) {
+	slots->retain();
+	for (ResultSetIterator it = rs->begin(); it != rs->end(); ++it) {
+	    if (batches.empty() || batches.back()->full())
+		batches.push_back(new ColumnBatch(slots));
+	    batches.back()->append(*it);
+	    delete *it;
+	}
+	rs->results.clear();
+    }
+
+    ColumnarResultSet::~ColumnarResultSet () {
+	for (std::vector<ColumnBatch*>::iterator it = batches.begin(); it != batches.end(); ++it)
+	    delete *it;
+	slots->release();
+    }
+
+    size_t ColumnarResultSet::size () const {
+	size_t ret = 0;
+	for (std::vector<ColumnBatch*>::const_iterator it = batches.begin(); it != batches.end(); ++it)
+	    ret += (*it)->size();
+	return ret;
+    }
+
+    void ColumnarResultSet::toRows (ResultSet* rs) {
+	for (std::vector<ColumnBatch*>::iterator it = batches.begin(); it != batches.end(); ++it) {
+	    for (size_t i = 0; i < (*it)->size(); ++i)
+		rs->results.insert(rs->results.end(), (*it)->makeRow(i, rs));
+	    delete *it;
+	}
+	batches.clear();
+    }
+
+    /* ColumnKernel - a FILTER compiled to loops over the columns of a
+     * ColumnBatch. Variables are decoded once per batch by their
+     * POS::getNumeric tag into int, float and double arrays; integer
+     * arithmetic (+, *, unary -) and comparisons then run as loops over
+     * those arrays with the int/float/double promotion of
+     * POSFactory::cmp, and &&, || and ! combine the comparisons' outcomes
+     * with SPARQL's error semantics. Values the loops can't decide --
+     * unbound or non-numeric terms, and float or double arithmetic, whose
+     * row-at-a-time results are rounded through their lexical forms --
+     * mark their rows KIND_row/STATE_row, which are then evaluated with
+     * POSFactory::eval. Expressions with other operators don't compile.
+     */
+    class ColumnKernel {
+    public:
+	typedef enum { STATE_false = 0, STATE_true = 1, STATE_error = 2, STATE_row = 3 } e_State;
+    protected:
+	typedef enum { KIND_row = 0, KIND_int = 1, KIND_float = 2, KIND_double = 3 } e_Kind;
+	typedef enum { OP_constant, OP_column, OP_sum, OP_product, OP_negate,
+		       OP_LT, OP_GT, OP_LE, OP_GE, OP_EQ, OP_NE,
+		       OP_and, OP_or, OP_not } e_Op;
+	struct Node {
+	    e_Op op;
+	    size_t slot; // OP_column
+	    std::vector<size_t> args; // earlier nodes
+	    /* numeric nodes: a kind and a value per row */
+	    std::vector<char> kinds;
+	    std::vector<int> ints; std::vector<float> floats; std::vector<double> doubles;
+	    /* comparisons: operands promoted to their common kind, and their order */
+	    std::vector<int> lInts, rInts; std::vector<float> lFloats, rFloats; std::vector<double> lDoubles, rDoubles;
+	    std::vector<int> intCmp, floatCmp, doubleCmp;
+	    /* boolean nodes: an e_State per row */
+	    std::vector<char> states;
+	    Node (e_Op op) : op(op), slot(0) {  }
+	};
+	POSFactory* posFactory;
+	VariableSlots* slots;
+	std::vector<Node> nodes; // operands before the nodes which use them
+	bool compiled;
+
+	static bool _boolean (e_Op op) { return op >= OP_LT; }
+	static bool _numeric (e_Op op) { return op <= OP_negate; }
+	static float _float (const Node& n, size_t i) {
+	    return n.kinds[i] == KIND_int ? (float)n.ints[i] : n.floats[i];
+	}
+	static double _double (const Node& n, size_t i) {
+	    return
+		n.kinds[i] == KIND_int ? (double)n.ints[i] :
+		n.kinds[i] == KIND_float ? (double)n.floats[i] :
+		n.doubles[i];
+	}
+	/* Fill row <i> of numeric node <n> from <pos>. */
+	static void _decode (Node& n, size_t i, const POS* pos) {
+	    switch (pos == NULL ? POS::NUMERIC_none : pos->getNumeric()) {
+	    case POS::NUMERIC_integer:
+		n.kinds[i] = KIND_int;
+		n.ints[i] = static_cast<const IntegerRDFLiteral*>(pos)->getValue();
+		break;
+	    case POS::NUMERIC_float: // or decimal
+		n.kinds[i] = KIND_float;
+		n.floats[i] = static_cast<const FloatRDFLiteral*>(pos)->getValue();
+		break;
+	    case POS::NUMERIC_double:
+		n.kinds[i] = KIND_double;
+		n.doubles[i] = static_cast<const DoubleRDFLiteral*>(pos)->getValue();
+		break;
+	    default:
+		n.kinds[i] = KIND_row;
+	    }
+	}
+	static void _size (Node& n) {
+	    n.kinds.resize(ColumnBatch::Rows, KIND_row);
+	    n.ints.resize(ColumnBatch::Rows, 0);
+	    n.floats.resize(ColumnBatch::Rows, 0);
+	    n.doubles.resize(ColumnBatch::Rows, 0);
+	}
+	template<typename T>
+	static void _compare (const std::vector<T>& l, const std::vector<T>& r, size_t count, std::vector<int>* out) {
+	    const T* lv = &l[0];
+	    const T* rv = &r[0];
+	    int* res = &(*out)[0];
+	    for (size_t i = 0; i < count; ++i)
+		res[i] = (lv[i] > rv[i]) - (lv[i] < rv[i]);
+	}
+
+	/* The index of the node computing <e>, or -1 if it doesn't compile. */
+	int _compile (const Expression* e) {
+	    if (e->isConstant()) {
+		const POS* value;
+		try {
+		    Result empty((ResultSet*)NULL);
+		    value = e->eval(&empty, posFactory, NULL);
+		} catch (...) {
+		    return -1; // leave the error to the row-at-a-time path
+		}
+		if (value == NULL || value->getNumeric() == POS::NUMERIC_none)
+		    return -1;
+		Node n(OP_constant);
+		_size(n);
+		for (size_t i = 0; i < ColumnBatch::Rows; ++i)
+		    _decode(n, i, value);
+		nodes.push_back(n);
+		return nodes.size() - 1;
+	    }
+
+	    const POSExpression* pos = dynamic_cast<const POSExpression*>(e);
+	    if (pos != NULL) {
+		if (dynamic_cast<const Variable*>(pos->getPOS()) == NULL)
+		    return -1;
+		int slot = slots->find(pos->getPOS());
+		if (slot < 0)
+		    return -1; // no row binds it
+		Node n(OP_column);
+		n.slot = slot;
+		_size(n);
+		nodes.push_back(n);
+		return nodes.size() - 1;
+	    }
+
+	    const NaryExpression* nary = dynamic_cast<const NaryExpression*>(e);
+	    if (nary != NULL) {
+		e_Op op;
+		if (dynamic_cast<const ArithmeticSum*>(e) != NULL) op = OP_sum;
+		else if (dynamic_cast<const ArithmeticProduct*>(e) != NULL) op = OP_product;
+		else if (dynamic_cast<const BooleanConjunction*>(e) != NULL) op = OP_and;
+		else if (dynamic_cast<const BooleanDisjunction*>(e) != NULL) op = OP_or;
+		else return -1;
+		Node n(op);
+		for (std::vector<const Expression*>::const_iterator it = nary->begin(); it != nary->end(); ++it) {
+		    int arg = _compile(*it);
+		    if (arg < 0 || _boolean(nodes[arg].op) != _boolean(op))
+			return -1;
+		    n.args.push_back(arg);
+		}
+		if (_boolean(op))
+		    n.states.resize(ColumnBatch::Rows, STATE_row);
+		else
+		    _size(n);
+		nodes.push_back(n);
+		return nodes.size() - 1;
+	    }
+
+	    e_Op op;
+	    const Expression* operand = NULL;
+	    if (dynamic_cast<const ArithmeticNegation*>(e) != NULL) {
+		op = OP_negate;
+		operand = static_cast<const ArithmeticNegation*>(e)->getExpression();
+	    } else if (dynamic_cast<const BooleanNegation*>(e) != NULL) {
+		op = OP_not;
+		operand = static_cast<const BooleanNegation*>(e)->getExpression();
+	    }
+	    if (operand != NULL) {
+		int arg = _compile(operand);
+		if (arg < 0 || _boolean(nodes[arg].op) != _boolean(op))
+		    return -1;
+		Node n(op);
+		n.args.push_back(arg);
+		if (_boolean(op))
+		    n.states.resize(ColumnBatch::Rows, STATE_row);
+		else
+		    _size(n);
+		nodes.push_back(n);
+		return nodes.size() - 1;
+	    }
+
+	    const ComparatorExpression* comp = dynamic_cast<const ComparatorExpression*>(e);
+	    if (comp == NULL)
+		return -1;
+	    const BooleanComparator* c = comp->getComparator();
+	    if      (dynamic_cast<const BooleanLT*>(c) != NULL) op = OP_LT;
+	    else if (dynamic_cast<const BooleanGT*>(c) != NULL) op = OP_GT;
+	    else if (dynamic_cast<const BooleanLE*>(c) != NULL) op = OP_LE;
+	    else if (dynamic_cast<const BooleanGE*>(c) != NULL) op = OP_GE;
+	    else if (dynamic_cast<const BooleanEQ*>(c) != NULL) op = OP_EQ;
+	    else if (dynamic_cast<const BooleanNE*>(c) != NULL) op = OP_NE;
+	    else return -1;
+	    int l = c->getLeft() == NULL ? -1 : _compile(c->getLeft());
+	    if (l < 0 || !_numeric(nodes[l].op))
+		return -1;
+	    int r = c->getRight() == NULL ? -1 : _compile(c->getRight());
+	    if (r < 0 || !_numeric(nodes[r].op))
+		return -1;
+	    Node n(op);
+	    n.args.push_back(l);
+	    n.args.push_back(r);
+	    n.states.resize(ColumnBatch::Rows, STATE_row);
+	    n.kinds.resize(ColumnBatch::Rows, KIND_row);
+	    n.lInts.resize(ColumnBatch::Rows, 0); n.rInts.resize(ColumnBatch::Rows, 0);
+	    n.lFloats.resize(ColumnBatch::Rows, 0); n.rFloats.resize(ColumnBatch::Rows, 0);
+	    n.lDoubles.resize(ColumnBatch::Rows, 0); n.rDoubles.resize(ColumnBatch::Rows, 0);
+	    n.intCmp.resize(ColumnBatch::Rows, 0);
+	    n.floatCmp.resize(ColumnBatch::Rows, 0);
+	    n.doubleCmp.resize(ColumnBatch::Rows, 0);
+	    nodes.push_back(n);
+	    return nodes.size() - 1;
+	}
+
+	void _column (Node& n, const ColumnBatch& batch) {
+	    const POS* const* column = batch.column(n.slot);
+	    for (size_t i = 0; i < batch.size(); ++i)
+		_decode(n, i, column == NULL ? NULL : column[i]);
+	}
+
+	/* Integer arithmetic with the wraparound of the row-at-a-time path. */
+	void _arithmetic (Node& n, size_t count) {
+	    char* kinds = &n.kinds[0];
+	    unsigned* res = reinterpret_cast<unsigned*>(&n.ints[0]);
+	    const Node& first = nodes[n.args[0]];
+	    for (size_t i = 0; i < count; ++i)
+		kinds[i] = first.kinds[i] == KIND_int ? KIND_int : KIND_row;
+	    if (n.op == OP_negate) {
+		const unsigned* in = reinterpret_cast<const unsigned*>(&first.ints[0]);
+		for (size_t i = 0; i < count; ++i)
+		    res[i] = 0u - in[i];
+		return;
+	    }
+	    std::copy(first.ints.begin(), first.ints.begin() + count, n.ints.begin());
+	    for (size_t a = 1; a < n.args.size(); ++a) {
+		const Node& arg = nodes[n.args[a]];
+		const unsigned* in = reinterpret_cast<const unsigned*>(&arg.ints[0]);
+		for (size_t i = 0; i < count; ++i)
+		    if (arg.kinds[i] != KIND_int)
+			kinds[i] = KIND_row;
+		if (n.op == OP_sum)
+		    for (size_t i = 0; i < count; ++i)
+			res[i] += in[i];
+		else
+		    for (size_t i = 0; i < count; ++i)
+			res[i] *= in[i];
+	    }
+	}
+
+	void _comparison (Node& n, size_t count) {
+	    const Node& l = nodes[n.args[0]];
+	    const Node& r = nodes[n.args[1]];
+	    for (size_t i = 0; i < count; ++i) {
+		e_Kind kind = l.kinds[i] == KIND_row || r.kinds[i] == KIND_row
+		    ? KIND_row : (e_Kind)std::max(l.kinds[i], r.kinds[i]);
+		n.kinds[i] = kind;
+		switch (kind) {
+		case KIND_int:    n.lInts[i] = l.ints[i]; n.rInts[i] = r.ints[i]; break;
+		case KIND_float:  n.lFloats[i] = _float(l, i); n.rFloats[i] = _float(r, i); break;
+		case KIND_double: n.lDoubles[i] = _double(l, i); n.rDoubles[i] = _double(r, i); break;
+		default: break;
+		}
+	    }
+	    _compare(n.lInts, n.rInts, count, &n.intCmp);
+	    _compare(n.lFloats, n.rFloats, count, &n.floatCmp);
+	    _compare(n.lDoubles, n.rDoubles, count, &n.doubleCmp);
+	    for (size_t i = 0; i < count; ++i) {
+		int c;
+		switch (n.kinds[i]) {
+		case KIND_int:    c = n.intCmp[i]; break;
+		case KIND_float:  c = n.floatCmp[i]; break;
+		case KIND_double: c = n.doubleCmp[i]; break;
+		default:
+		    n.states[i] = STATE_row;
+		    continue;
+		}
+		bool pass;
+		switch (n.op) {
+		case OP_LT: pass = c < 0; break;
+		case OP_GT: pass = c > 0; break;
+		case OP_LE: pass = c <= 0; break;
+		case OP_GE: pass = c >= 0; break;
+		case OP_EQ: pass = c == 0; break;
+		default:    pass = c != 0;
+		}
+		n.states[i] = pass ? STATE_true : STATE_false;
+	    }
+	}
+
+	/* && is false if any operand is; || is true if any operand is. */
+	void _junction (Node& n, size_t count) {
+	    e_State decisive = n.op == OP_and ? STATE_false : STATE_true;
+	    e_State otherwise = n.op == OP_and ? STATE_true : STATE_false;
+	    for (size_t i = 0; i < count; ++i) {
+		bool found = false, row = false, error = false;
+		for (size_t a = 0; a < n.args.size(); ++a) {
+		    char s = nodes[n.args[a]].states[i];
+		    found |= s == decisive;
+		    row |= s == STATE_row;
+		    error |= s == STATE_error;
+		}
+		n.states[i] = found ? decisive : row ? STATE_row : error ? STATE_error : otherwise;
+	    }
+	}
+
+	void _negation (Node& n, size_t count) {
+	    const std::vector<char>& in = nodes[n.args[0]].states;
+	    for (size_t i = 0; i < count; ++i)
+		n.states[i] =
+		    in[i] == STATE_true ? (char)STATE_false :
+		    in[i] == STATE_false ? (char)STATE_true :
+		    in[i];
+	}
+
+    public:
+	ColumnKernel (POSFactory* posFactory, VariableSlots* slots, const Expression* expression)
+	    : posFactory(posFactory), slots(slots), compiled(false) {
+	    int root = _compile(expression);
+	    compiled = root >= 0 && _boolean(nodes[root].op);
+	}
+
+	bool isCompiled () const { return compiled; }
+
+	/* Set decided[i] to STATE_true or STATE_false for each row of
+	 * <batch> the loops decide, or STATE_row where they can't.
+	 */
+	void evaluate (const ColumnBatch& batch, std::vector<char>* decided) {
+	    size_t count = batch.size();
+	    for (std::vector<Node>::iterator n = nodes.begin(); n != nodes.end(); ++n)
+		switch (n->op) {
+		case OP_constant: break;
+		case OP_column: _column(*n, batch); break;
+		case OP_sum: case OP_product: case OP_negate: _arithmetic(*n, count); break;
+		case OP_and: case OP_or: _junction(*n, count); break;
+		case OP_not: _negation(*n, count); break;
+		default: _comparison(*n, count);
+		}
+	    const std::vector<char>& root = nodes.back().states;
+	    decided->resize(count);
+	    for (size_t i = 0; i < count; ++i)
+		(*decided)[i] = root[i] == STATE_error ? (char)STATE_false : root[i];
+	}
+    };
+
     void ResultSet::restrict (const Expression* expression) {
+	ColumnKernel kernel(posFactory, slots, expression);
+	if (!options->columnBatches || !kernel.isCompiled()) {
+	    for (ResultSetIterator it = begin(); it != end(); ) {
+		if (posFactory->eval(expression, *it) == true)
+		    ++it;
+		else {
+		    delete *it;
+		    it = erase(it);
+		}
+	    }
+	    return;
+	}
 
-	for (ResultSetIterator it = begin(); it != end(); ) {
-	    if (posFactory->eval(expression, *it) == true)
-		++it;
-	    else {
-		delete *it;
-		it = erase(it);
+	ColumnarResultSet columns(this);
+	std::vector<char> keep;
+	for (size_t b = 0; b < columns.batchCount(); ++b) {
+	    ColumnBatch& batch = columns.batch(b);
+	    kernel.evaluate(batch, &keep);
+	    for (size_t i = 0; i < batch.size(); ++i)
+		if (keep[i] == ColumnKernel::STATE_row) {
+		    Result* row = batch.makeRow(i, this);
+		    keep[i] = posFactory->eval(expression, row);
+		    delete row;
+		}
+	    batch.select(keep);
+	}
+	columns.toRows(this);
+    }
+
+    void ResultSet::reseed (const Result* row) {
+	for (ResultSetIterator it = results.begin(); it != results.end(); ++it)
+	    delete *it;
+	results.clear();
+	Result* copy = Result::make(this);
+	for (BindingSetConstIterator it = row->begin(); it != row->end(); ++it)
+	    set(copy, it->first, it->second.pos, it->second.weaklyBound);
+	results.insert(results.end(), copy);
+    }
+
+    bool ResultSet::pushRows (RowSink* sink) {
+	for (ResultSetIterator it = results.begin(); it != results.end(); ++it)
+	    if (!sink->push(*it))
+		return false;
+	return true;
+    }
+
+    /* A row, its ORDER BY keys and its input position, which breaks ties
+     * so that sorting is stable.
+     */
+    struct SortEntry {
+	std::vector<const POS*> keys;
+	size_t seq;
+	Result* row;
+	SortEntry () : seq(0), row(NULL) {  }
+    };
+
+    struct SortKeyComp {
+	std::vector<s_OrderConditionPair>* orderConditions;
+	POSFactory* posFactory;
+	SortKeyComp (std::vector<s_OrderConditionPair>* orderConditions, POSFactory* posFactory) : 
+	    orderConditions(orderConditions), posFactory(posFactory) {  }
+	bool operator() (const SortEntry& lhs, const SortEntry& rhs) const {
+	    for (size_t i = 0; i < lhs.keys.size(); ++i) {
+		const POS* l = lhs.keys[i];
+		const POS* r = rhs.keys[i];
+		if (l == r || (dynamic_cast<const Bindable*>(l) && dynamic_cast<const Bindable*>(r)))
+		    continue;
+		bool desc = (*orderConditions)[i].ascOrDesc == ORDER_Desc;
+		if (posFactory->lessThan(l, r))
+		    return !desc;
+		if (posFactory->lessThan(r, l))
+		    return desc;
+		break; // incomparable; keep input order.
 	    }
+	    return lhs.seq < rhs.seq;
 	}
+    };
+
+    /* Sort runs which exceed the orderMemoryBudget option are written to
+     * temp files as raw pointers (terms live as long as their POSFactory):
+     *   seq, keys[orderConditions], bindingCount, (var, value, weak)[bindingCount]
+     * and their Results deleted until the runs are merged back.
+     */
+    static void _writeOrThrow (const void* data, size_t size, std::FILE* f) {
+	if (std::fwrite(data, size, 1, f) != 1)
+	    throw std::runtime_error("unable to write ORDER BY sort run");
     }
 
-    void ResultSet::order (std::vector<s_OrderConditionPair>* orderConditions) {
-	ResultComp resultComp(orderConditions, posFactory);
-	results.sort(resultComp);
+    static void _spillRun (std::vector<SortEntry>::iterator first, std::vector<SortEntry>::iterator last,
+			   const SortKeyComp& comp, std::vector<std::FILE*>* runs) {
+	std::sort(first, last, comp);
+	std::FILE* f = std::tmpfile();
+	if (f == NULL)
+	    throw std::runtime_error("unable to create a temp file for an ORDER BY sort run");
+	runs->push_back(f);
+	for (std::vector<SortEntry>::iterator e = first; e != last; ++e) {
+	    _writeOrThrow(&e->seq, sizeof(e->seq), f);
+	    for (std::vector<const POS*>::const_iterator key = e->keys.begin(); key != e->keys.end(); ++key)
+		_writeOrThrow(&*key, sizeof(*key), f);
+	    size_t count = e->row->size();
+	    _writeOrThrow(&count, sizeof(count), f);
+	    for (BindingSetConstIterator b = e->row->begin(); b != e->row->end(); ++b) {
+		char weak = b->second.weaklyBound;
+		_writeOrThrow(&b->first, sizeof(b->first), f);
+		_writeOrThrow(&b->second.pos, sizeof(b->second.pos), f);
+		_writeOrThrow(&weak, sizeof(weak), f);
+	    }
+	    delete e->row;
+	    e->row = NULL;
+	    std::vector<const POS*>().swap(e->keys);
+	}
+	std::rewind(f);
+    }
+
+    /* Read the next entry of run <f> into <e>, or return false at its end. */
+    static bool _readRun (std::FILE* f, size_t keyCount, ResultSet* rs, SortEntry* e) {
+	if (std::fread(&e->seq, sizeof(e->seq), 1, f) != 1)
+	    return false;
+	e->keys.resize(keyCount);
+	size_t count;
+	bool ok = (keyCount == 0 || std::fread(&e->keys[0], sizeof(const POS*), keyCount, f) == keyCount) &&
+	    std::fread(&count, sizeof(count), 1, f) == 1;
+	e->row = Result::make(rs);
+	for (size_t i = 0; ok && i < count; ++i) {
+	    const POS* var;
+	    const POS* value;
+	    char weak;
+	    ok = std::fread(&var, sizeof(var), 1, f) == 1 &&
+		std::fread(&value, sizeof(value), 1, f) == 1 &&
+		std::fread(&weak, sizeof(weak), 1, f) == 1;
+	    if (ok)
+		e->row->set(var, value, weak != 0);
+	}
+	if (!ok) {
+	    delete e->row;
+	    e->row = NULL;
+	    throw std::runtime_error("truncated ORDER BY sort run");
+	}
+	return true;
+    }
+
+    /* Orders (entry, run) pairs for a min-heap on the entries. */
+    struct RunHeadComp {
+	const SortKeyComp& comp;
+	const std::vector<SortEntry>& heads;
+	RunHeadComp (const SortKeyComp& comp, const std::vector<SortEntry>& heads) : comp(comp), heads(heads) {  }
+	bool operator() (size_t l, size_t r) const { return comp(heads[r], heads[l]); }
+    };
+
+    /* The sort entries of the rows held by an OrderingSink (a heap for
+     * top-K), and the temp files of spilled runs. The rows still held
+     * (row != NULL) and the files are released if ordering is abandoned.
+     */
+    struct SortState {
+	std::vector<s_OrderConditionPair>* orderConditions;
+	SortKeyComp comp;
+	std::vector<SortEntry> entries;
+	std::vector<SortEntry> heads;
+	std::vector<std::FILE*> runs;
+	size_t seq;
+	size_t bytes;
+	SortState (std::vector<s_OrderConditionPair>* orderConditions, POSFactory* posFactory) : 
+	    orderConditions(orderConditions), comp(orderConditions, posFactory), seq(0), bytes(0) {  }
+	~SortState () {
+	    for (std::vector<SortEntry>::iterator e = entries.begin(); e != entries.end(); ++e)
+		delete e->row;
+	    for (std::vector<SortEntry>::iterator e = heads.begin(); e != heads.end(); ++e)
+		delete e->row;
+	    for (std::vector<std::FILE*>::iterator f = runs.begin(); f != runs.end(); ++f)
+		std::fclose(*f);
+	}
+    };
+
+    OrderingSink::OrderingSink (ResultSet* rs, std::vector<s_OrderConditionPair>* orderConditions, int keep) : 
+	rs(rs), keep(keep), state(new SortState(orderConditions, rs->getPOSFactory())) {
+	if (keep > 0)
+	    state->entries.reserve(keep);
+    }
+
+    OrderingSink::~OrderingSink () {
+	delete state;
+    }
+
+    static Result* _keepRow (ResultSet* rs, Result* row, bool owned) {
+	if (owned)
+	    return row;
+	Result* copy = Result::make(rs);
+	for (BindingSetConstIterator it = row->begin(); it != row->end(); ++it)
+	    rs->set(copy, it->first, it->second.pos, it->second.weaklyBound);
+	return copy;
+    }
+
+    void OrderingSink::_add (Result* row, bool owned) {
+	SortEntry e;
+	e.keys.reserve(state->orderConditions->size());
+	for (std::vector<s_OrderConditionPair>::const_iterator cond = state->orderConditions->begin();
+	     cond != state->orderConditions->end(); ++cond)
+	    e.keys.push_back(cond->expression->eval(row, rs->getPOSFactory(), NULL));
+	e.seq = state->seq++;
+	std::vector<SortEntry>& entries = state->entries;
+
+	if (keep >= 0) {
+	    /* Top-K: entries is a heap of at most <keep> rows, worst first. */
+	    if (entries.size() < (size_t)keep) {
+		entries.push_back(SortEntry());
+		entries.back().keys.swap(e.keys);
+		entries.back().seq = e.seq;
+		entries.back().row = _keepRow(rs, row, owned);
+		std::push_heap(entries.begin(), entries.end(), state->comp);
+	    } else if (keep > 0 && state->comp(e, entries.front())) {
+		std::pop_heap(entries.begin(), entries.end(), state->comp);
+		SortEntry& worst = entries.back();
+		delete worst.row;
+		worst.keys.swap(e.keys);
+		worst.seq = e.seq;
+		worst.row = _keepRow(rs, row, owned);
+		std::push_heap(entries.begin(), entries.end(), state->comp);
+	    } else if (owned)
+		delete row;
+	    return;
+	}
+
+	entries.push_back(SortEntry());
+	entries.back().keys.swap(e.keys);
+	entries.back().seq = e.seq;
+	entries.back().row = _keepRow(rs, row, owned);
+	if (rs->options->orderMemoryBudget != 0) {
+	    /* Spill as soon as the rows held exceed the budget. */
+	    state->bytes += sizeof(SortEntry) + entries.back().keys.size() * sizeof(const POS*)
+		+ entries.back().row->bytes();
+	    if (state->bytes > rs->options->orderMemoryBudget) {
+		_spillRun(entries.begin(), entries.end(), state->comp, &state->runs);
+		entries.clear();
+		state->bytes = 0;
+	    }
+	}
+    }
+
+    void OrderingSink::finish () {
+	std::vector<SortEntry>& entries = state->entries;
+	if (state->runs.empty()) {
+	    if (keep >= 0)
+		std::sort_heap(entries.begin(), entries.end(), state->comp);
+	    else
+		std::sort(entries.begin(), entries.end(), state->comp);
+	    for (std::vector<SortEntry>::iterator e = entries.begin(); e != entries.end(); ++e) {
+		rs->insert(rs->end(), e->row);
+		e->row = NULL;
+	    }
+	    entries.clear();
+	    return;
+	}
+
+	/* Merge the runs. */
+	if (!entries.empty()) {
+	    _spillRun(entries.begin(), entries.end(), state->comp, &state->runs);
+	    entries.clear();
+	}
+	size_t keyCount = state->orderConditions->size();
+	state->heads.resize(state->runs.size());
+	std::vector<size_t> heap;
+	for (size_t i = 0; i < state->runs.size(); ++i)
+	    if (_readRun(state->runs[i], keyCount, rs, &state->heads[i]))
+		heap.push_back(i);
+	RunHeadComp headComp(state->comp, state->heads);
+	std::make_heap(heap.begin(), heap.end(), headComp);
+	while (!heap.empty()) {
+	    std::pop_heap(heap.begin(), heap.end(), headComp);
+	    size_t run = heap.back();
+	    rs->insert(rs->end(), state->heads[run].row);
+	    state->heads[run].row = NULL;
+	    if (_readRun(state->runs[run], keyCount, rs, &state->heads[run]))
+		std::push_heap(heap.begin(), heap.end(), headComp);
+	    else
+		heap.pop_back();
+	}
+    }
+
+    void ResultSet::order (std::vector<s_OrderConditionPair>* orderConditions, int keep) {
+	if (!options->sortKeys) {
+	    ResultComp resultComp(orderConditions, posFactory);
+	    results.sort(resultComp);
+	    return;
+	}
+
+	/* Each row leaves results once its keys are evaluated, so an
+	 * expression which throws leaves the rows after it in place.
+	 */
+	OrderingSink sink(this, orderConditions, keep);
+	while (!results.empty()) {
+	    sink.adopt(results.front());
+	    results.pop_front();
+	}
+	sink.finish();
     }
 
 
@@ -261,8 +1318,30 @@ namespace w3c_sw {
     }
 
 
+    bool DistinctFilter::firstSighting (const Result* row) {
+	key.clear();
+	if (vars.empty()) {
+	    for (BindingSetConstIterator it = row->begin(); it != row->end(); ++it)
+		key.push_back(std::make_pair(it->first, it->second.pos));
+	    std::sort(key.begin(), key.end()); // rows of other slots list them in another order
+	} else
+	    for (std::vector<const POS*>::const_iterator var = vars.begin(); var != vars.end(); ++var)
+		key.push_back(std::make_pair(*var, row->get(*var)));
+	return seen.insert(key).second;
+    }
+
     void ResultSet::trim (e_distinctness distinctness, int limit, int offset) {
-	if (distinctness == DIST_distinct)
+	/* REDUCED permits dropping duplicates; it's free once they're hashed. */
+	if (options->hashDistinct && distinctness != DIST_all) {
+	    DistinctFilter distinct;
+	    for (ResultSetIterator row = begin() ; row != end(); )
+		if (distinct.firstSighting(*row))
+		    ++row;
+		else {
+		    delete *row;
+		    row = erase(row);
+		}
+	} else if (distinctness == DIST_distinct)
 	    for (ResultSetIterator lead = begin() ; lead != end(); ) {
 		bool matched = false;
 		for (ResultSetIterator look = begin() ; look != lead; ++look)
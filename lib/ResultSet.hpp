@@ -12,22 +12,79 @@
 #define RESULT_SET_H
 
 #include <set>
+#include <map>
 #include <list>
 #include <vector>
+#include <iterator>
+#include <algorithm>
 #include "SWObjects.hpp"
 #include "RdfDB.hpp"
 #include "XMLSerializer.hpp"
 #include "../interface/SAXparser.hpp"
 #include "SPARQLSerializer.hpp"
 #include "SPARQLfedParser/SPARQLfedParser.hpp"
+#include <boost/unordered_set.hpp>
+#include <boost/cstdint.hpp>
 
 namespace w3c_sw {
 
     typedef struct { bool weaklyBound; const POS* pos; } BindingInfo;
-    typedef std::map<const POS*, BindingInfo> BindingSet;
-    typedef std::map<const POS*, BindingInfo>::iterator BindingSetIterator;
-    typedef std::map<const POS*, BindingInfo>::const_iterator BindingSetConstIterator;
-    //typedef std::pair<std::map<POS*,POS*>::iterator, bool> InsertRet;
+
+    /* VariableSlots - numbers a query's variables densely so that a Result
+     * is a fixed-width array of values indexed by slot, with bitmasks of
+     * the slots it binds and of those bound weakly. ResultSet::assignSlots
+     * numbers the variables of a whole query before it runs; a variable
+     * first bound later takes the next slot and rows made before then are
+     * widened when they bind it. The ResultSets partOf() one query share
+     * its VariableSlots and carve their rows from its batches of Rows
+     * cells. ResultSets and rows hold counted references. A query's rows
+     * are made and freed by one thread at a time so nothing is locked.
+     */
+    class VariableSlots {
+    public:
+	static const size_t Rows = 1024;
+    protected:
+	std::vector<const POS*> variables;
+	boost::unordered_map<const POS*, size_t> index; // past Scanned variables
+	size_t width;
+	size_t refs;
+	struct Pool {
+	    size_t bytes; // per cell
+	    std::vector<char*> batches;
+	    size_t carved; // cells taken from the last batch
+	    std::vector<void*> free;
+	};
+	std::vector<Pool> pools;
+	static const size_t Scanned = 8;
+	VariableSlots(const VariableSlots&);
+	VariableSlots& operator=(const VariableSlots&);
+	~VariableSlots();
+    public:
+	/* The creator holds the first reference. */
+	VariableSlots () : width(0), refs(1) {  }
+	void retain () { ++refs; }
+	void release () { if (--refs == 0) delete this; }
+	/* The slot of <variable>, or -1 if it has none yet. */
+	int find (const POS* variable) const {
+	    if (variables.size() <= Scanned) {
+		for (size_t i = 0; i < variables.size(); ++i)
+		    if (variables[i] == variable)
+			return (int)i;
+		return -1;
+	    }
+	    boost::unordered_map<const POS*, size_t>::const_iterator it = index.find(variable);
+	    return it == index.end() ? -1 : (int)it->second;
+	}
+	/* The slot of <variable>, assigning the next one if it has none. */
+	size_t slot(const POS* variable);
+	const POS* variable (size_t slot) const { return variables[slot]; }
+	size_t size () const { return variables.size(); }
+	/* The number of slots in the rows made now. */
+	size_t getWidth () const { return width; }
+	void* allocate(size_t bytes);
+	void deallocate(void* cell, size_t bytes);
+    };
+
     typedef std::set<const POS*> VariableList;
     typedef std::set<const POS*>::iterator VariableListIterator;
     typedef std::set<const POS*>::const_iterator VariableListConstIterator;
@@ -43,44 +100,102 @@ namespace w3c_sw {
 	return l.pos == r.pos;
     }
 
-    class Result {
+    /* BindingIterator - walks the bound slots of a Result in slot order,
+     * presenting each as a (variable, BindingInfo) pair.
+     */
+    class BindingIterator {
+    public:
+	typedef std::forward_iterator_tag iterator_category;
+	typedef std::pair<const POS*, BindingInfo> value_type;
+	typedef std::ptrdiff_t difference_type;
+	typedef const value_type* pointer;
+	typedef const value_type& reference;
     protected:
-	BindingSet bindings;
+	const Result* row;
+	size_t at;
+	value_type current;
+	void _settle();
     public:
-	Result (ResultSet*) : bindings() {  }
-	Result (const Result& ref) : bindings() {
-	    for (BindingSetConstIterator it = ref.begin(); it != ref.end(); ++it) {
-		const POS* var = it->first;
-		BindingInfo bi(it->second);
-		bindings[var] = bi;
-	    }
+	BindingIterator (const Result* row, size_t at) : row(row), at(at) { _settle(); }
+	reference operator* () const { return current; }
+	pointer operator-> () const { return &current; }
+	BindingIterator& operator++ () { ++at; _settle(); return *this; }
+	BindingIterator operator++ (int) { BindingIterator ret(*this); ++*this; return ret; }
+	bool operator== (const BindingIterator& r) const { return at == r.at && row == r.row; }
+	bool operator!= (const BindingIterator& r) const { return !(*this == r); }
+	size_t getSlot () const { return at; }
+    };
+    typedef BindingIterator BindingSetIterator;
+    typedef BindingIterator BindingSetConstIterator;
+
+    /* Result - one row: the values of its VariableSlots' variables by slot.
+     * Rows live in cells carved from their VariableSlots; make() and
+     * duplicate() create them and delete returns the cell. A Result on the
+     * stack keeps its values apart.
+     */
+    class Result {
+	friend class BindingIterator;
+	friend class ColumnBatch;
+    public:
+	typedef boost::uint64_t Word;
+    protected:
+	struct Cell { VariableSlots* slots; size_t bytes; };
+	VariableSlots* slots;
+	size_t width;
+	const POS** values; // width values, then the bound and weak masks
+	size_t count; // slots bound
+	bool cell; // carved by make() or duplicate()
+	bool widened; // values were reallocated apart from the cell
+
+	static size_t _words (size_t width) { return (width + 63) / 64; }
+	static size_t _bytes (size_t width) { return width * sizeof(const POS*) + 2 * _words(width) * sizeof(Word); }
+	Word* _bound () const { return reinterpret_cast<Word*>(values + width); }
+	Word* _weak () const { return _bound() + _words(width); }
+	bool _isBound (size_t slot) const { return slot < width && (_bound()[slot / 64] >> (slot % 64) & 1) != 0; }
+	bool _isWeak (size_t slot) const { return (_weak()[slot / 64] >> (slot % 64) & 1) != 0; }
+	void _widen();
+	static Result* _make(VariableSlots* slots, size_t width, bool clear);
+	/* Bind <slot>, which must be unbound; see ColumnBatch::row. */
+	void _setSlot (size_t slot, const POS* value, bool weaklyBound) {
+	    if (slot >= width)
+		_widen();
+	    Word bit = Word(1) << (slot % 64);
+	    _bound()[slot / 64] |= bit;
+	    if (weaklyBound)
+		_weak()[slot / 64] |= bit;
+	    values[slot] = value;
+	    ++count;
 	}
-	~Result () {  }
+	Result (VariableSlots* slots, size_t width, const POS** values) : 
+	    slots(slots), width(width), values(values), count(0), cell(true), widened(false) {  }
+	Result(const Result&);
+	Result& operator=(const Result&);
+	/* Rows are made by make() and duplicate(). */
+	static void* operator new(size_t);
+	static void* operator new (size_t, void* at) { return at; }
+    public:
+	static void operator delete(void* p);
+	static void operator delete (void*, void*) {  }
+	/* A row on the stack, using rs's slots (or slots of its own). */
+	Result(ResultSet* rs);
+	~Result();
+	/* A new empty row in rs's slots (or slots of its own). */
+	static Result* make(ResultSet* rs);
 	bool operator== (const Result& ref) const {
-	    std::set<const POS*> boundInFirst;
-	    for (BindingSetConstIterator it = begin(); it != end(); ++it)
-		boundInFirst.insert(it->first);
-
-	    for (BindingSetConstIterator it = ref.begin(); it != ref.end(); ++it)
-		if (boundInFirst.find(it->first) == boundInFirst.end())
-		    return false;
-	    // done with boundInFirst
-
+	    if (ref.size() != size())
+		return false;
 	    for (BindingSetConstIterator l = begin(); l != end(); ++l) {
 		BindingSetConstIterator r = ref.find(l->first);
-		if (r == ref.end())
-		    return false;
-		if (! (l->second == r->second) )
+		if (r == ref.end() || !(l->second == r->second))
 		    return false;
 	    }
-
-	    return true;	    
+	    return true;
 	}
 	std::string toString () const {
 	    std::stringstream s;
 	    s << "{";
-	    for (BindingSetConstIterator it = bindings.begin(); it != bindings.end(); ++it)
-		s << (it == bindings.begin() ? "" : ", ")
+	    for (BindingSetConstIterator it = begin(); it != end(); ++it)
+		s << (it == begin() ? "" : ", ")
 		  << it->first->toString() << "="
 		  << it->second.pos->toString();
 	    s << "}";
@@ -88,29 +203,141 @@ namespace w3c_sw {
 	}
 
 	XMLSerializer* toXml(XMLSerializer* xml = NULL);
-	BindingSetIterator begin () { return bindings.begin(); }
-	BindingSetConstIterator begin () const { return bindings.begin(); }
-	BindingSetIterator end () { return bindings.end(); }
-	BindingSetConstIterator end () const { return bindings.end(); }
-	size_t size () const { return bindings.size(); }
-	BindingSetIterator find (const POS* pos) { return bindings.find(pos); }
-	BindingSetConstIterator find (const POS* pos) const { return bindings.find(pos); }
-	void erase (BindingSetIterator it) { bindings.erase(it); }
-
-	const POS* get(const POS* variable) const;
+	BindingSetConstIterator begin () const { return BindingIterator(this, 0); }
+	BindingSetConstIterator end () const { return BindingIterator(this, width); }
+	size_t size () const { return count; }
+	BindingSetConstIterator find (const POS* variable) const {
+	    int slot = slots->find(variable);
+	    return slot >= 0 && _isBound(slot) ? BindingIterator(this, slot) : end();
+	}
+	void erase(BindingSetConstIterator it);
+	VariableSlots* getSlots () const { return slots; }
+	/* The memory this row occupies. */
+	size_t bytes () const { return sizeof(Cell) + sizeof(Result) + _bytes(width); }
+
+	const POS* get (size_t slot) const { return _isBound(slot) ? values[slot] : NULL; }
+	const POS* get (const POS* variable) const {
+	    int slot = slots->find(variable);
+	    return slot < 0 ? NULL : get((size_t)slot);
+	}
 	/* set should only be used by ResultSet::set if you want to keep the
 	   header consistent.
 	 */
 	void set(const POS* variable, const POS* value, bool weaklyBound, bool replace = false);
-	Result* duplicate(ResultSet* rs, ResultSetIterator row);
+	Result* duplicate(ResultSet* rs, ResultSetIterator row) const;
 
 	ResultSet* makeResultSet(POSFactory* posFactory);
 	void assumeNewBindings(Result* from);
     };
 
+    inline void BindingIterator::_settle () {
+	while (at < row->width && !row->_isBound(at))
+	    ++at;
+	if (at < row->width) {
+	    current.first = row->slots->variable(at);
+	    current.second.pos = row->values[at];
+	    current.second.weaklyBound = row->_isWeak(at);
+	}
+    }
+
+    /* DistinctFilter - remembers the rows it has been shown, as their
+     * bindings for <vars> (all bindings if vars is empty), in a hash set.
+     */
+    class DistinctFilter {
+	typedef std::vector<std::pair<const POS*, const POS*> > RowKey;
+	std::vector<const POS*> vars;
+	boost::unordered_set<RowKey, boost::hash<RowKey> > seen;
+	RowKey key; // reused between calls
+    public:
+	DistinctFilter () {  }
+	DistinctFilter (const std::vector<const POS*>& vars) : vars(vars) {  }
+	/* Whether no earlier row had the same bindings as <row>. */
+	bool firstSighting(const Result* row);
+    };
+
+    /* OrderingSink - evaluates the ORDER BY keys of each row as it is
+     * produced. With a <keep> >= 0, only the best <keep> rows are held, in
+     * a heap whose worst row is replaced by better ones; otherwise rows
+     * are held until they exceed the orderMemoryBudget option and are
+     * then spilled to a sorted run. finish() adds the ordered rows to rs.
+     */
+    struct SortState;
+    class OrderingSink : public RowSink {
+	ResultSet* rs;
+	int keep;
+	SortState* state;
+	/* Take <row> (copying it unless <owned>) if it may be in the answer. */
+	void _add(Result* row, bool owned);
+    public:
+	OrderingSink(ResultSet* rs, std::vector<s_OrderConditionPair>* orderConditions, int keep);
+	~OrderingSink();
+	/* Copies the producer's <row> if it is kept. */
+	virtual bool push (Result* row) { _add(row, false); return true; }
+	/* Takes <row>, deleting it if it isn't kept. */
+	void adopt (Result* row) { _add(row, true); }
+	void finish();
+    };
+
+    /* ColumnBatch - up to Rows rows stored as one array of values per
+     * slot of their VariableSlots, NULL where a row leaves the variable
+     * unbound, and a weak flag per value. append() turns a row into the
+     * next values of each column and makeRow() turns them back into a Result.
+     */
+    class ColumnBatch {
+    public:
+	static const size_t Rows = VariableSlots::Rows;
+    protected:
+	VariableSlots* slots;
+	size_t width; // columns
+	size_t count; // rows
+	std::vector<const POS*> values; // column-major: values[slot * Rows + row]
+	std::vector<char> weak; // likewise
+	void _widen(size_t to);
+	ColumnBatch(const ColumnBatch&);
+	ColumnBatch& operator=(const ColumnBatch&);
+    public:
+	ColumnBatch(VariableSlots* slots);
+	~ColumnBatch();
+	size_t size () const { return count; }
+	size_t getWidth () const { return width; }
+	bool full () const { return count == Rows; }
+	VariableSlots* getSlots () const { return slots; }
+	/* The <slot> column, or NULL if no row binds it. */
+	const POS* const* column (size_t slot) const { return slot < width ? &values[slot * Rows] : NULL; }
+	void append(const Result* row);
+	/* A new row of rs with the values of row <i>. */
+	Result* makeRow(size_t i, ResultSet* rs) const;
+	/* Keep the rows <keep> marks, in their order. */
+	void select(const std::vector<char>& keep);
+    };
+
+    /* ColumnarResultSet - a ResultSet's rows as ColumnBatches. It takes
+     * the rows of the ResultSet it's made from and toRows() gives them
+     * back, so a stretch of a query (e.g. ResultSet::restrict) can work a
+     * column at a time between operations which work a row at a time.
+     */
+    class ColumnarResultSet {
+    protected:
+	VariableSlots* slots;
+	std::vector<ColumnBatch*> batches;
+	ColumnarResultSet(const ColumnarResultSet&);
+	ColumnarResultSet& operator=(const ColumnarResultSet&);
+    public:
+	ColumnarResultSet(ResultSet* rs);
+	~ColumnarResultSet();
+	size_t size() const;
+	size_t batchCount () const { return batches.size(); }
+	ColumnBatch& batch (size_t i) { return *batches[i]; }
+	/* Append the rows to rs, leaving this empty. */
+	void toRows(ResultSet* rs);
+    };
+
     class ResultSet {
+	friend class ColumnarResultSet;
+	friend class Result;
     protected:
 	POSFactory* posFactory;
+	VariableSlots* slots;
 	VariableList knownVars;
 	ResultList results;
 	bool ordered;
@@ -118,20 +345,43 @@ namespace w3c_sw {
 	ProductionVector<const POS*> selectOrder;
 	bool orderedSelect;
 
+	void _joinRows(ResultSetIterator myRow, const Result* yourRow, const ProductionVector<const Expression*>* expressions, 
+		       bool minus, bool* matchedSomeRow);
+
     public:
 	static const char* NS_srx;
 	static const char* NS_xml;
 	typedef enum {RESULT_Tabular, RESULT_Boolean, RESULT_Graphs} ResultType;
 	ResultType resultType;
 	std::ostream** debugStream;
+	/* FILTER conjuncts which BasicGraphPattern::bindVariables and
+	 * pipelineMatches check while matching <filtersFor>. bindVariables
+	 * resets filtersFor to show that it applied them.
+	 */
+	const BasicGraphPattern* filtersFor;
+	const PushedFilters* filters;
+	/* Solutions of independent operations which a pipeline evaluates
+	 * once and joins with each row it extends; see JoinTable.
+	 */
+	std::map<const TableOperation*, boost::shared_ptr<JoinTable> > joinTables;
+	/* The RdfDB version pinned for this query; see RdfDB::Reading. */
+	const RdfDB::Reading* reading;
+	/* How this query is evaluated; never NULL. */
+	const QueryOptions* options;
+	/* The (pattern, plan) pairs this query has written to debugStream,
+	 * shared by partOf() so each is written once per query.
+	 */
+	typedef std::set<std::pair<const BasicGraphPattern*, std::vector<const TriplePattern*> > > PrintedPlans;
+	mutable boost::shared_ptr<PrintedPlans> printedPlans;
 
 	ResultSet(POSFactory* posFactory, std::ostream** debugStream = NULL);
 	ResultSet (const ResultSet& ref) : 
-	    posFactory(ref.posFactory), knownVars(ref.knownVars), 
+	    posFactory(ref.posFactory), slots(ref.slots), knownVars(ref.knownVars), 
 	    results(), ordered(ref.ordered), db(ref.db), selectOrder(ref.selectOrder), 
-	    orderedSelect(ref.orderedSelect), resultType(ref.resultType), debugStream(NULL) {
+	    orderedSelect(ref.orderedSelect), resultType(ref.resultType), debugStream(NULL), filtersFor(NULL), filters(NULL), reading(NULL), options(ref.options) {
+	    slots->retain();
 	    for (ResultSetConstIterator row = ref.results.begin() ; row != ref.results.end(); row++)
-		insert(this->end(), new Result(**row));
+		insert(this->end(), (*row)->duplicate(this, this->end()));
 	}
 	ResultSet& operator= (const ResultSet& ref) {
 	    if (this == &ref)
@@ -143,6 +393,9 @@ namespace w3c_sw {
 	    results.clear();
 
 	    posFactory = ref.posFactory;
+	    ref.slots->retain();
+	    slots->release();
+	    slots = ref.slots;
 	    knownVars = ref.knownVars;
 	    ordered = ref.ordered;
 	    db = ref.db;
@@ -151,7 +404,7 @@ namespace w3c_sw {
 	    resultType = ref.resultType;
 	    debugStream = ref.debugStream;
 	    for (ResultSetConstIterator row = ref.results.begin() ; row != ref.results.end(); row++)
-		insert(this->end(), new Result(**row));
+		insert(this->end(), (*row)->duplicate(this, this->end()));
 
 	    return *this;
 	}
@@ -164,9 +417,9 @@ namespace w3c_sw {
 	 */
 #if REGEX_LIB != SWOb_DISABLED
 	ResultSet (POSFactory* posFactory, std::string str, bool ordered, POS::String2BNode& nodeMap) : 
-	    posFactory(posFactory), knownVars(), 
+	    posFactory(posFactory), slots(new VariableSlots()), knownVars(), 
 	    results(), ordered(ordered), db(NULL), selectOrder(), 
-	    orderedSelect(false), resultType(RESULT_Tabular), debugStream(NULL) {
+	    orderedSelect(false), resultType(RESULT_Tabular), debugStream(NULL), filtersFor(NULL), filters(NULL), reading(NULL), options(&QueryOptions::Defaults) {
 	    const boost::regex expression("[ \\t]*((?:<[^>]*>)|(?:_:[^[:space:]]+)|(?:[?$][^[:space:]]+)|(?:\\\"[^\\\"]+\\\")|\\+|┌|├|└|┏|┠|┗|\\n)");
 	    std::string::const_iterator start, end; 
 	    start = str.begin(); 
@@ -192,7 +445,7 @@ namespace w3c_sw {
 			headers.push_back(pos);
 		    else {
 			if (curRow == NULL) {
-			    curRow = new Result(this);
+			    curRow = Result::make(this);
 			    insert(this->end(), curRow);
 			}
 			set(curRow, headers[col++], pos, false);
@@ -230,11 +483,17 @@ namespace w3c_sw {
 		return stateStrs[stateStack.top()];
 	    }
 
+	    /* Take each <result> once it is parsed. */
+	    virtual void resultDone (Result* result) {
+		rs->insert(rs->end(), result);
+	    }
+
 	public:
 	    RSsax (ResultSet* rs, POSFactory* posFactory) : 
 		rs(rs), posFactory(posFactory), result(NULL), variable(NULL), datatype(NULL), chars("") {
 		stateStack.push(DOCUMENT);
 	    }
+	    virtual ~RSsax () { delete result; }
 
 	    virtual void startElement (std::string uri,
 				       std::string localName,
@@ -274,8 +533,7 @@ namespace w3c_sw {
 		case RESULTS:
 		    if (localName == "result") {
 			newState = RESULT;
-			result = new Result(rs);
-			rs->insert(rs->end(), result);
+			result = Result::make(rs);
 		    } break;
 		case RESULT:
 		    if (localName == "binding") {
@@ -316,10 +574,16 @@ namespace w3c_sw {
 		case BOOLEAN:
 		    /* http://www.w3.org/TR/rdf-sparql-XMLres/#boolean-results */
 		    if (chars == "true")
-			rs->insert(rs->end(), new Result(rs));
+			rs->insert(rs->end(), Result::make(rs));
 		    rs->resultType = RESULT_Boolean;
 		    chars = "";
 		    break;
+		case RESULT: {
+		    Result* done = result;
+		    result = NULL;
+		    resultDone(done);
+		    break;
+		}
 		case BINDING: //@@
 		    break;
 		case _URI:
@@ -356,14 +620,14 @@ namespace w3c_sw {
 	};
 
 	ResultSet (POSFactory* posFactory, RdfDB* db) : 
-	    posFactory(posFactory), knownVars(), 
+	    posFactory(posFactory), slots(new VariableSlots()), knownVars(), 
 	    results(), ordered(false), db(db), selectOrder(), 
-	    orderedSelect(false), resultType(RESULT_Graphs), debugStream(NULL) {  }
+	    orderedSelect(false), resultType(RESULT_Graphs), debugStream(NULL), filtersFor(NULL), filters(NULL), reading(NULL), options(&QueryOptions::Defaults) {  }
 
 	ResultSet (POSFactory* posFactory, RdfDB* db, const char* baseURI) : 
-	    posFactory(posFactory), knownVars(), 
+	    posFactory(posFactory), slots(new VariableSlots()), knownVars(), 
 	    results(), ordered(false), db(NULL), selectOrder(), 
-	    orderedSelect(false), resultType(RESULT_Tabular), debugStream(NULL) {
+	    orderedSelect(false), resultType(RESULT_Tabular), debugStream(NULL), filtersFor(NULL), filters(NULL), reading(NULL), options(&QueryOptions::Defaults) {
 	    SPARQLfedDriver sparqlParser(baseURI, posFactory);
 	    IStreamContext boolq("PREFIX rs: <http://www.w3.org/2001/sw/DataAccess/tests/result-set#>\n"
 				 "SELECT ?bool { ?t rs:boolean ?bool . }\n", IStreamContext::STRING);
@@ -384,7 +648,7 @@ namespace w3c_sw {
 		resultType = RESULT_Boolean;
 		/* So far, size() > 0 is how we test a boolean ResultSet. */
 		if (blit->getValue())
-		    results.insert(results.begin(), new Result(this));
+		    results.insert(results.begin(), Result::make(this));
 	    } else {
 		/* Get list of known variables. */
 		IStreamContext variablesQ("PREFIX rs: <http://www.w3.org/2001/sw/DataAccess/tests/result-set#>\n"
@@ -423,7 +687,7 @@ namespace w3c_sw {
 		    const POS* var  = posFactory->getVariable(varStr->getLexicalValue());
 		    const POS* val  = (*resultRecord)->get(posFactory->getVariable("val" ));
 		    if (lastSoln != soln) {
-			r = new Result(this);
+			r = Result::make(this);
 			insert(end(), r);
 			lastSoln = soln;
 		    }
@@ -433,9 +697,9 @@ namespace w3c_sw {
 	}
 
 	ResultSet (POSFactory* posFactory, SWSAXparser* parser, IStreamContext& sptr) : 
-	    posFactory(posFactory), knownVars(), 
+	    posFactory(posFactory), slots(new VariableSlots()), knownVars(), 
 	    results(), ordered(false), db(NULL), selectOrder(), 
-	    orderedSelect(false), resultType(RESULT_Tabular), debugStream(NULL) {
+	    orderedSelect(false), resultType(RESULT_Tabular), debugStream(NULL), filtersFor(NULL), filters(NULL), reading(NULL), options(&QueryOptions::Defaults) {
 	    RSsax handler(this, posFactory);
 	    parser->parse(sptr, &handler);
 	}
@@ -513,56 +777,16 @@ namespace w3c_sw {
 	    return mismatches;
 	}
 	typedef enum {OP_join, OP_outer, OP_minus} e_OP;
-	void joinIn (ResultSet* ref, const ProductionVector<const Expression*>* expressions = NULL, e_OP operation = OP_join) { // !!! make const ref
-	    for (ResultSetIterator myRow = results.begin();
-		 myRow != results.end(); ) {
-		bool matchedSomeRow = false;
-		for (ResultSetConstIterator yourRow = ref->results.begin();
-		     yourRow != ref->results.end(); ++yourRow) {
-		    bool matched = true;
-		    std::set<const POS*>copy;
-		    for (BindingSetConstIterator yourBinding = (*yourRow)->begin();
-			 yourBinding != (*yourRow)->end(); ++yourBinding) {
-			const POS* var = yourBinding->first;
-			const POS* yourVal = yourBinding->second.pos;
-			const POS* myVal = (*myRow)->get(var);
-			if (myVal == NULL) {
-			    knownVars.insert(var); // means we can bypass ResultSet::set(...).
-			    if (yourVal != NULL)
-				copy.insert(var);
-			} else if (myVal != yourVal) {
-			    matched = false;
-			    break;
-			}
-		    }
-		    if (matched) {
-			Result* newRow = (*myRow)->duplicate(this, myRow);
-			for (std::set<const POS*>::iterator vars = copy.begin();
-			     vars != copy.end(); ++vars)
-			    newRow->set(*vars, (*yourRow)->get(*vars), false);
-			if (expressions != NULL)
-			    for (std::vector<const Expression*>::const_iterator expression = expressions->begin();
-				 matched && expression != expressions->end(); expression++)
-				matched &= posFactory->eval(*expression, newRow);
-			if (matched) {
-			    if (operation == OP_minus)
-				delete newRow;
-			    else
-				insert(myRow, newRow);
-			    matchedSomeRow = true;
-			} else {
-			    delete newRow;
-			}
-		    }
-		}
-		if ((operation == OP_outer || operation == OP_minus) && !matchedSomeRow)
-		    myRow++;
-		else {
-		    delete *myRow;
-		    myRow = erase(myRow);
-		}
-	    }
-	}
+	/* Join the rows of ref into this. Rows are paired up through a hash
+	 * table on the variables both sides know; rows missing one of those
+	 * bindings fall back to comparison with every row.
+	 */
+	void joinIn(ResultSet* ref, const ProductionVector<const Expression*>* expressions = NULL, e_OP operation = OP_join); // !!! make const ref
+	/* Join results parsed from <sptr> with this ResultSet's rows as they
+	 * are parsed, appending the joined rows to <target>. The parsed rows
+	 * are never gathered into a ResultSet.
+	 */
+	void joinStream(SWSAXparser* parser, IStreamContext& sptr, ResultSet* target) const;
 	bool compareOrdered (const ResultSet & ref) const {
 	    if (ref.size() != size())
 		return false;
@@ -613,8 +837,40 @@ namespace w3c_sw {
 	}
 
 	void project(ProductionVector<const POS*> const * varsV);
+	/* Drop the rows for which <expression> isn't true. With the
+	 * columnBatches option, expressions of numeric comparisons and
+	 * integer arithmetic are evaluated a ColumnBatch at a time.
+	 */
 	void restrict(const Expression* expression);
-	void order(std::vector<s_OrderConditionPair>* orderConditions);
+	/* Number the variables of <query> before it fills this ResultSet. */
+	void assignSlots(const Base* query);
+	/* Evaluate as part of the query filling <outer>, sharing its slots. */
+	void partOf (const ResultSet& outer) {
+	    if (outer.slots != slots) {
+		outer.slots->retain();
+		slots->release();
+		slots = outer.slots;
+		for (ResultSetIterator row = results.begin(); row != results.end(); ++row) {
+		    Result* moved = (*row)->duplicate(this, row);
+		    delete *row;
+		    *row = moved;
+		}
+	    }
+	    reading = outer.reading;
+	    options = outer.options;
+	    if (outer.printedPlans == NULL && outer.debugStream != NULL && *outer.debugStream != NULL)
+		outer.printedPlans.reset(new PrintedPlans());
+	    printedPlans = outer.printedPlans;
+	}
+	/* Replace the rows with a copy of <row>. */
+	void reseed(const Result* row);
+	/* Push each row to <sink>; false if it asked to stop. */
+	bool pushRows(RowSink* sink);
+	/* Sort by <orderConditions>, evaluating each row's sort keys once.
+	 * With <keep> >= 0, only the first <keep> rows are kept. If a key
+	 * throws, the rows not yet ordered stay in this ResultSet.
+	 */
+	void order(std::vector<s_OrderConditionPair>* orderConditions, int keep = -1);
 	void order();
 	bool isOrdered () const { return ordered; }
 	void trim(e_distinctness distinctness, int offset, int limit);
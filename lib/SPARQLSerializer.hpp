@@ -264,8 +264,8 @@ public:
 	    ret << std::endl;
 	}
     }
-    virtual void binding (const Binding* const, const ProductionVector<const POS*>* values) {//!!!
-	ret << "  { ";
+    virtual void binding (const Binding* const, const ProductionVector<const POS*>* values) {
+	ret << "  ( ";
 	for (std::vector<const POS*>::const_iterator it = values->begin();
 	     it != values->end(); ++it)
 	    (*it)->express(this);
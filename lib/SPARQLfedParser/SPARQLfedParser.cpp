@@ -1209,7 +1209,7 @@ namespace w3c_sw {
 /* Line 678 of lalr1.cc  */
 #line 989 "lib/SPARQLfedParser/SPARQLfedParser.ypp"
     {
-	  (yyval.p_ParserFilter) = driver.curFilter;
+	  (yyval.p_ParserFilter) = driver.saveFilter();
       }
     break;
 
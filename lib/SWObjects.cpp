@@ -8,8 +8,11 @@
 #include "SWObjects.hpp"
 #include "ResultSet.hpp"
 #include <string.h>
+#include <algorithm>
+#include <boost/iostreams/stream.hpp>
 #include "SPARQLSerializer.hpp"
 #include "SWObjectDuplicator.hpp"
+#include "ServiceCache.hpp"
 #include "../interface/WEBagent.hpp"
 
 #ifdef _MSC_VER
@@ -43,6 +46,15 @@ void Base::express (Expressor* p_expressor) const {
 char const * yit = "yacker:implicit-terminal";
 std::map<StringException*, std::string> StringException::strs;
 
+void* ArenaAllocated::operator new (size_t size, Arena* arena) {
+    return arena == NULL ? ::operator new(size) : arena->allocate(size);
+}
+/* Only called when a constructor throws; arena space is simply abandoned. */
+void ArenaAllocated::operator delete (void* ptr, Arena* arena) {
+    if (arena == NULL)
+	::operator delete(ptr);
+}
+
 } // namespace w3c_sw
 
 /* END yacker-specific test harness */
@@ -349,9 +361,11 @@ void Filter::express (Expressor* p_expressor) const {
     p_expressor->filter(this, m_TableOperation, &m_Expressions);
 }
 void NamedGraphPattern::express (Expressor* p_expressor) const {
+    _decode();
     p_expressor->namedGraphPattern(this, m_name, allOpts, &m_TriplePatterns);
 }
 void DefaultGraphPattern::express (Expressor* p_expressor) const {
+    _decode();
     p_expressor->defaultGraphPattern(this, allOpts, &m_TriplePatterns);
 }
 void TableDisjunction::express (Expressor* p_expressor) const {
@@ -492,50 +506,119 @@ void NumberExpression::express (Expressor* p_expressor) const {
     POSsorter* ThePOSsorter;
 
     /* <POSFactory> */
+    unsigned long POSFactory::_nextSerial () {
+	static boost::mutex lock;
+	static unsigned long last = 0;
+	boost::mutex::scoped_lock guard(lock);
+	return ++last;
+    }
+
     POSFactory::~POSFactory () {
+	for (size_t stripe = 0; stripe < Stripes; ++stripe) {
+	    for (TriplePatternTable::iterator iTriples = triples[stripe].begin(); iTriples != triples[stripe].end(); ++iTriples)
+		if (*iTriples != NULL)
+		    _release(*iTriples);
+	    triples[stripe].clear();
+	    tripleCount[stripe] = 0;
+	}
 
-	std::map<std::string, const TriplePattern*>::iterator iTriples;
-	for (iTriples = triples.begin(); iTriples != triples.end(); iTriples++)
-	    delete iTriples->second;
-	triples.clear();
+	for (size_t stripe = 0; stripe < Stripes; ++stripe) {
+	    std::map<std::string, const Variable*>::iterator iVariables;
+	    for (iVariables = variables[stripe].begin(); iVariables != variables[stripe].end(); iVariables++)
+		_release(iVariables->second);
+	    variables[stripe].clear();
+
+	    std::map<std::string, const URI*>::iterator iURIs;
+	    for (iURIs = uris[stripe].begin(); iURIs != uris[stripe].end(); iURIs++)
+		_release(iURIs->second);
+	    uris[stripe].clear();
+
+	    std::set<const BNode*>::iterator iBNodes;
+	    for (iBNodes = bnodes[stripe].begin(); iBNodes != bnodes[stripe].end(); ++iBNodes)
+		_release(*iBNodes);
+	    bnodes[stripe].clear();
+
+	    std::map<std::string, const RDFLiteral*>::iterator iRDFLiterals;
+	    for (iRDFLiterals = rdfLiterals[stripe].begin(); iRDFLiterals != rdfLiterals[stripe].end(); iRDFLiterals++)
+		_release(iRDFLiterals->second);
+	    rdfLiterals[stripe].clear();
+	}
+
+	TermChunks* chunks = termChunks.load(boost::memory_order_acquire);
+	if (chunks != NULL) {
+	    for (TermChunks::const_iterator it = chunks->begin(); it != chunks->end(); ++it)
+		delete [] *it;
+	    delete chunks;
+	}
+	for (std::vector<TermChunks*>::iterator it = retiredTermChunks.begin(); it != retiredTermChunks.end(); ++it)
+	    delete *it;
 
-	std::map<std::string, const Variable*>::iterator iVariables;
-	for (iVariables = variables.begin(); iVariables != variables.end(); iVariables++)
-	    delete iVariables->second;
-	variables.clear();
+	delete arena;
+    }
+
+    /* Called with the stripe holding <pos> locked, before it's published. */
+    void POSFactory::_number (POS* pos) {
+	StripeLock lock(concurrent, termLock);
+	TermID id = ++termCount;
+	if (id == 0)
+	    throw std::runtime_error("POSFactory: out of TermIDs");
+	size_t chunk = id / TermChunk;
+	TermChunks* chunks = termChunks.load(boost::memory_order_relaxed);
+	if (chunks == NULL || chunk >= chunks->size()) {
+	    TermChunks* grown = new TermChunks(chunks == NULL ? 1 : chunks->size() * 2, NULL);
+	    if (chunks != NULL) {
+		std::copy(chunks->begin(), chunks->end(), grown->begin());
+		retiredTermChunks.push_back(chunks);
+	    }
+	    termChunks.store(grown, boost::memory_order_release);
+	    chunks = grown;
+	}
+	if ((*chunks)[chunk] == NULL)
+	    (*chunks)[chunk] = new const POS*[TermChunk]();
+	(*chunks)[chunk][id % TermChunk] = pos;
+	pos->termID = id;
+    }
 
-	std::map<std::string, const URI*>::iterator iURIs;
-	for (iURIs = uris.begin(); iURIs != uris.end(); iURIs++)
-	    delete iURIs->second;
-	uris.clear();
+    const POS* POSFactory::term (TermID id) const {
+	const TermChunks* chunks = termChunks.load(boost::memory_order_acquire);
+	size_t chunk = id / TermChunk;
+	if (chunks == NULL || chunk >= chunks->size() || (*chunks)[chunk] == NULL)
+	    return NULL;
+	return (*chunks)[chunk][id % TermChunk];
+    }
 
-	std::set<const BNode*>::iterator iBNodes;
-	for (iBNodes = bnodes.begin(); iBNodes != bnodes.end(); ++iBNodes)
-	    delete *iBNodes;
-	bnodes.clear();
+    TermID POSFactory::termID (const POS* pos) const {
+	return pos != NULL && pos->termID != 0 && term(pos->termID) == pos ? pos->termID : 0;
+    }
 
-	std::map<std::string, const RDFLiteral*>::iterator iRDFLiterals;
-	for (iRDFLiterals = rdfLiterals.begin(); iRDFLiterals != rdfLiterals.end(); iRDFLiterals++)
-	    delete iRDFLiterals->second;
-	rdfLiterals.clear();
+    TermID POSFactory::intern (const POS* pos) {
+	TermID id = termID(pos);
+	if (id == 0)
+	    throw std::runtime_error(std::string("POSFactory::intern: ") + (pos == NULL ? std::string("NULL") : pos->toString()) + " wasn't made by this POSFactory");
+	return id;
     }
 
     const Variable* POSFactory::getVariable (std::string name) {
-	std::string key(name);
-	VariableMap::const_iterator vi = variables.find(key);
-	if (vi == variables.end()) {
-	    Variable* ret = new Variable(name);
-	    variables[key] = ret;
+	size_t stripe = _stripe(name);
+	StripeLock lock(concurrent, variableLocks[stripe]);
+	VariableMap::const_iterator vi = variables[stripe].find(name);
+	if (vi == variables[stripe].end()) {
+	    Variable* ret = new (arena) Variable(name);
+	    _number(ret);
+	    variables[stripe][name] = ret;
 	    return ret;
 	} else
 	    return vi->second;
     }
 
+    /* BNode labels are generated from their addresses, so no shared
+     * counter is needed; only the registry is locked. */
     const BNode* POSFactory::createBNode () {
-	BNode* ret = new BNode();
-	std::stringstream name;
-	name << ret; // addr
-	bnodes.insert(ret);
+	BNode* ret = new (arena) BNode();
+	size_t stripe = _stripe(ret);
+	StripeLock lock(concurrent, bnodeLocks[stripe]);
+	_number(ret);
+	bnodes[stripe].insert(ret);
 	return ret;
     }
 
@@ -543,20 +626,25 @@ void NumberExpression::express (Expressor* p_expressor) const {
 	std::string key(name);
 	POS::String2BNode::const_iterator vi = nodeMap.find(key);
 	if (vi == nodeMap.end()) {
-	    BNode* ret = new BNode(name);
+	    BNode* ret = new (arena) BNode(name);
 	    nodeMap[key] = ret;
-	    bnodes.insert(ret);
+	    size_t stripe = _stripe(ret);
+	    StripeLock lock(concurrent, bnodeLocks[stripe]);
+	    _number(ret);
+	    bnodes[stripe].insert(ret);
 	    return ret;
 	} else
 	    return vi->second;
     }
 
     const URI* POSFactory::getURI (std::string name) {
-	std::string key(name);
-	URIMap::const_iterator vi = uris.find(key);
-	if (vi == uris.end()) {
-	    URI* ret = new URI(name);
-	    uris[key] = ret;
+	size_t stripe = _stripe(name);
+	StripeLock lock(concurrent, uriLocks[stripe]);
+	URIMap::const_iterator vi = uris[stripe].find(name);
+	if (vi == uris[stripe].end()) {
+	    URI* ret = new (arena) URI(name);
+	    _number(ret);
+	    uris[stripe][name] = ret;
 	    return ret;
 	} else
 	    return vi->second;
@@ -676,10 +764,13 @@ void NumberExpression::express (Expressor* p_expressor) const {
 	    buf << "@" << lang;
 	}
 	std::string key(buf.str());
-	RDFLiteralMap::const_iterator vi = rdfLiterals.find(key);
-	if (vi == rdfLiterals.end()) {
-	    RDFLiteral* ret = new RDFLiteral(p_String, p_URI, p_LANGTAG);
-	    rdfLiterals[key] = ret;
+	size_t stripe = _stripe(key);
+	StripeLock lock(concurrent, rdfLiteralLocks[stripe]);
+	RDFLiteralMap::const_iterator vi = rdfLiterals[stripe].find(key);
+	if (vi == rdfLiterals[stripe].end()) {
+	    RDFLiteral* ret = new (arena) RDFLiteral(p_String, p_URI, p_LANGTAG);
+	    _number(ret);
+	    rdfLiterals[stripe][key] = ret;
 	    return ret;
 	} else {
 	    delete p_LANGTAG; // will not be used to create an RDFLiteral.
@@ -692,12 +783,12 @@ void NumberExpression::express (Expressor* p_expressor) const {
     const IntegerRDFLiteral* POSFactory::getNumericRDFLiteral (std::string p_String, int p_value) {
 	class MakeIntegerRDFLiteral : public MakeNumericRDFLiteral {
 	private: int m_value;
-	public: MakeIntegerRDFLiteral (int p_value) : m_value(p_value) {  }
-	    virtual const NumericRDFLiteral* makeIt (std::string p_String, const URI* p_URI) {
-		return new IntegerRDFLiteral(p_String, p_URI, m_value);
+	public: MakeIntegerRDFLiteral (int p_value, Arena* arena) : MakeNumericRDFLiteral(arena), m_value(p_value) {  }
+	    virtual NumericRDFLiteral* makeIt (std::string p_String, const URI* p_URI) {
+		return new (arena) IntegerRDFLiteral(p_String, p_URI, m_value);
 	    }
 	};
-	MakeIntegerRDFLiteral maker(p_value);
+	MakeIntegerRDFLiteral maker(p_value, arena);
 	IntegerRDFLiteral* ret = (IntegerRDFLiteral*)getNumericRDFLiteral(p_String, "integer", &maker);
 	return ret;
     }
@@ -705,12 +796,12 @@ void NumberExpression::express (Expressor* p_expressor) const {
     const DecimalRDFLiteral* POSFactory::getNumericRDFLiteral (std::string p_String, float p_value) {
 	class MakeDecimalRDFLiteral : public MakeNumericRDFLiteral {
 	private: float m_value;
-	public: MakeDecimalRDFLiteral (float p_value) : m_value(p_value) {  }
-	    virtual const NumericRDFLiteral* makeIt (std::string p_String, const URI* p_URI) {
-		return new DecimalRDFLiteral(p_String, p_URI, m_value);
+	public: MakeDecimalRDFLiteral (float p_value, Arena* arena) : MakeNumericRDFLiteral(arena), m_value(p_value) {  }
+	    virtual NumericRDFLiteral* makeIt (std::string p_String, const URI* p_URI) {
+		return new (arena) DecimalRDFLiteral(p_String, p_URI, m_value);
 	    }
 	};
-	MakeDecimalRDFLiteral maker(p_value);
+	MakeDecimalRDFLiteral maker(p_value, arena);
 	DecimalRDFLiteral* ret = (DecimalRDFLiteral*)getNumericRDFLiteral(p_String, "decimal", &maker);
 	return ret;
     }
@@ -718,12 +809,12 @@ void NumberExpression::express (Expressor* p_expressor) const {
     const FloatRDFLiteral* POSFactory::getNumericRDFLiteral (std::string p_String, float p_value, bool /* floatness */) {
 	class MakeFloatRDFLiteral : public MakeNumericRDFLiteral {
 	private: float m_value;
-	public: MakeFloatRDFLiteral (float p_value) : m_value(p_value) {  }
-	    virtual const NumericRDFLiteral* makeIt (std::string p_String, const URI* p_URI) {
-		return new FloatRDFLiteral(p_String, p_URI, m_value);
+	public: MakeFloatRDFLiteral (float p_value, Arena* arena) : MakeNumericRDFLiteral(arena), m_value(p_value) {  }
+	    virtual NumericRDFLiteral* makeIt (std::string p_String, const URI* p_URI) {
+		return new (arena) FloatRDFLiteral(p_String, p_URI, m_value);
 	    }
 	};
-	MakeFloatRDFLiteral maker(p_value);
+	MakeFloatRDFLiteral maker(p_value, arena);
 	FloatRDFLiteral* ret = (FloatRDFLiteral*)getNumericRDFLiteral(p_String, "float", &maker);
 	return ret;
     }
@@ -731,12 +822,12 @@ void NumberExpression::express (Expressor* p_expressor) const {
     const DoubleRDFLiteral* POSFactory::getNumericRDFLiteral (std::string p_String, double p_value) {
 	class MakeDoubleRDFLiteral : public MakeNumericRDFLiteral {
 	private: double m_value;
-	public: MakeDoubleRDFLiteral (double p_value) : m_value(p_value) {  }
-	    virtual const NumericRDFLiteral* makeIt (std::string p_String, const URI* p_URI) {
-		return new DoubleRDFLiteral(p_String, p_URI, m_value);
+	public: MakeDoubleRDFLiteral (double p_value, Arena* arena) : MakeNumericRDFLiteral(arena), m_value(p_value) {  }
+	    virtual NumericRDFLiteral* makeIt (std::string p_String, const URI* p_URI) {
+		return new (arena) DoubleRDFLiteral(p_String, p_URI, m_value);
 	    }
 	};
-	MakeDoubleRDFLiteral maker(p_value);
+	MakeDoubleRDFLiteral maker(p_value, arena);
 	DoubleRDFLiteral* ret = (DoubleRDFLiteral*)getNumericRDFLiteral(p_String, "double", &maker);
 	return ret;
     }
@@ -745,10 +836,14 @@ void NumberExpression::express (Expressor* p_expressor) const {
 	std::stringstream buf;
 	buf << "\"" << (p_value ? "true" : "false") << "\"^^<http://www.w3.org/2001/XMLSchema#boolean>"; // p_String
 	std::string key(buf.str());
-	RDFLiteralMap::const_iterator vi = rdfLiterals.find(key);
-	if (vi == rdfLiterals.end()) {
-	    BooleanRDFLiteral* ret = new BooleanRDFLiteral(p_String, getURI("http://www.w3.org/2001/XMLSchema#boolean"), p_value);
-	    rdfLiterals[key] = ret;
+	const URI* datatype = getURI("http://www.w3.org/2001/XMLSchema#boolean");
+	size_t stripe = _stripe(key);
+	StripeLock lock(concurrent, rdfLiteralLocks[stripe]);
+	RDFLiteralMap::const_iterator vi = rdfLiterals[stripe].find(key);
+	if (vi == rdfLiterals[stripe].end()) {
+	    BooleanRDFLiteral* ret = new (arena) BooleanRDFLiteral(p_String, datatype, p_value);
+	    _number(ret);
+	    rdfLiterals[stripe][key] = ret;
 	    return ret;
 	} else
 	    return (BooleanRDFLiteral*)vi->second; // shameful downcast
@@ -766,15 +861,52 @@ void NumberExpression::express (Expressor* p_expressor) const {
 	if (uri)
 	    buf << "^^<" << uri->getLexicalValue() << ">";
 	std::string key(buf.str());
-	RDFLiteralMap::const_iterator vi = rdfLiterals.find(key);
-	if (vi == rdfLiterals.end()) {
-	    const NumericRDFLiteral* ret = maker->makeIt(p_String, uri);
-	    rdfLiterals[key] = ret;
+	size_t stripe = _stripe(key);
+	StripeLock lock(concurrent, rdfLiteralLocks[stripe]);
+	RDFLiteralMap::const_iterator vi = rdfLiterals[stripe].find(key);
+	if (vi == rdfLiterals[stripe].end()) {
+	    NumericRDFLiteral* ret = maker->makeIt(p_String, uri);
+	    _number(ret);
+	    try {
+		_validateNumeric(p_String);
+		ret->numeric =
+		    strcmp(type, "integer") == 0 ? POS::NUMERIC_integer :
+		    strcmp(type, "double") == 0 ? POS::NUMERIC_double :
+		    POS::NUMERIC_float; // decimal or float
+	    } catch (TypeError&) {
+		// leave it NUMERIC_none
+	    }
+	    rdfLiterals[stripe][key] = ret;
 	    return ret;
 	} else
 	    return (const NumericRDFLiteral*)vi->second; // shameful downcast
     }
 
+    size_t POSFactory::_hashTriple (const POS* s, const POS* p, const POS* o, bool weaklyBound) {
+	size_t seed = 0;
+	boost::hash_combine(seed, s);
+	boost::hash_combine(seed, p);
+	boost::hash_combine(seed, o);
+	boost::hash_combine(seed, weaklyBound);
+	return seed;
+    }
+
+    /* The low bits of a triple's hash pick its stripe, the rest its slot. */
+    void POSFactory::_growTriples (size_t stripe) {
+	TriplePatternTable old;
+	TriplePatternTable& table = triples[stripe];
+	old.swap(table);
+	table.resize(old.empty() ? 64 : old.size() * 2, NULL);
+	size_t mask = table.size() - 1;
+	for (TriplePatternTable::const_iterator it = old.begin(); it != old.end(); ++it)
+	    if (*it != NULL) {
+		size_t slot = (_hashTriple((*it)->m_s, (*it)->m_p, (*it)->m_o, (*it)->weaklyBound) / Stripes) & mask;
+		while (table[slot] != NULL)
+		    slot = (slot + 1) & mask;
+		table[slot] = *it;
+	    }
+    }
+
     const TriplePattern* POSFactory::getTriple (const POS* s, const POS* p, const POS* o, bool weaklyBound) {
 	if (s == NULL || p == NULL || o == NULL)
 	    throw
@@ -783,16 +915,26 @@ void NumberExpression::express (Expressor* p_expressor) const {
 		+ (p == NULL ? "NULL" : p->toString()) + ", " 
 		+ (o == NULL ? "NULL" : o->toString()) + ")";
 
-	std::stringstream key;
-	key << s << p << o << weaklyBound;
-	TriplePatternMap::const_iterator vi = triples.find(key.str());
-	if (vi == triples.end()) {
-	    TriplePattern* ret = new TriplePattern(s, p, o);
-	    triples[key.str()] = ret;
-	    return ret;
-	} else {
-	    const TriplePattern* ret = vi->second;
-	    return ret;
+	size_t hash = _hashTriple(s, p, o, weaklyBound);
+	size_t stripe = hash % Stripes;
+	StripeLock lock(concurrent, tripleLocks[stripe]);
+	TriplePatternTable& table = triples[stripe];
+
+	/* Keep the load factor under 1/2 so probe sequences stay short. */
+	if ((tripleCount[stripe] + 1) * 2 > table.size())
+	    _growTriples(stripe);
+	size_t mask = table.size() - 1;
+	for (size_t slot = (hash / Stripes) & mask; ; slot = (slot + 1) & mask) {
+	    TriplePattern* t = table[slot];
+	    if (t == NULL) {
+		t = new (arena) TriplePattern(s, p, o);
+		t->weaklyBound = weaklyBound;
+		table[slot] = t;
+		++tripleCount[stripe];
+		return t;
+	    }
+	    if (t->m_s == s && t->m_p == p && t->m_o == o && t->weaklyBound == weaklyBound)
+		return t;
 	}
     }
 
@@ -956,14 +1098,48 @@ void NumberExpression::express (Expressor* p_expressor) const {
 	    m_TableOperations.push_back(tableOp);
     }
 
+    const QueryOptions QueryOptions::Defaults;
+
     ResultSet* Select::execute (RdfDB* db, ResultSet* rs) const {
-	if (!rs) rs = new ResultSet(rs->getPOSFactory());
+	if (rs == NULL) // no POSFactory to make one with.
+	    throw(std::runtime_error(FUNCTION_STRING));
 	for (std::vector<const DatasetClause*>::const_iterator ds = m_DatasetClauses->begin();
 	     ds != m_DatasetClauses->end(); ds++)
 	    (*ds)->loadData(db);
-	m_WhereClause->bindVariables(db, rs);
-	if (m_SolutionModifier != NULL)
-	    m_SolutionModifier->order(rs);
+	RdfDB::Reading reading(db, rs); // one version for the whole query.
+	rs->assignSlots(m_WhereClause); // number the variables its rows bind
+	/* Without ORDER BY, the first OFFSET+LIMIT (distinct) solutions
+	 * are the ones kept, so stop looking after those.
+	 */
+	bool pipelines = rs->options->pipelining && m_WhereClause->pipelines();
+	bool orders = m_SolutionModifier != NULL && m_SolutionModifier->orders();
+	if (pipelines && orders && rs->options->sortKeys) {
+	    /* Order the solutions as they are found so that top-K and the
+	     * orderMemoryBudget bound what is held at once.
+	     */
+	    OrderingSink ordering(rs, m_SolutionModifier->getOrderConditions(), m_SolutionModifier->keep(m_distinctness));
+	    m_WhereClause->pipeline(db, rs, &ordering);
+	    ordering.finish();
+	} else if (pipelines && !orders
+		   && (m_distinctness == DIST_all || rs->options->hashDistinct)) {
+	    int maxRows = -1;
+	    if (m_SolutionModifier != NULL && m_SolutionModifier->m_limit != LIMIT_None)
+		maxRows = m_SolutionModifier->m_limit +
+		    (m_SolutionModifier->m_offset == OFFSET_None ? 0 : m_SolutionModifier->m_offset);
+	    if (m_distinctness == DIST_all)
+		m_WhereClause->pipeline(db, rs, maxRows);
+	    else {
+		/* Compare the projected bindings, or all of them for SELECT *. */
+		const POSList* projection = dynamic_cast<const POSList*>(m_VarSet);
+		DistinctFilter distinct = projection == NULL ? DistinctFilter() :
+		    DistinctFilter(std::vector<const POS*>(projection->begin(), projection->end()));
+		m_WhereClause->pipeline(db, rs, maxRows, &distinct);
+	    }
+	} else {
+	    m_WhereClause->bindVariables(db, rs);
+	    if (m_SolutionModifier != NULL)
+		m_SolutionModifier->order(rs, m_distinctness);
+	}
 	m_VarSet->project(rs);
 	if (m_SolutionModifier == NULL)
 	    rs->trim(m_distinctness, -1, -1);
@@ -973,10 +1149,13 @@ void NumberExpression::express (Expressor* p_expressor) const {
     }
 
     ResultSet* Construct::execute (RdfDB* db, ResultSet* rs) const {
-	if (!rs) rs = new ResultSet(rs->getPOSFactory());
+	if (rs == NULL) // no POSFactory to make one with.
+	    throw(std::runtime_error(FUNCTION_STRING));
 	for (std::vector<const DatasetClause*>::const_iterator ds = m_DatasetClauses->begin();
 	     ds != m_DatasetClauses->end(); ds++)
 	    (*ds)->loadData(db);
+	RdfDB::Reading reading(db, rs);
+	rs->assignSlots(m_WhereClause);
 	m_WhereClause->bindVariables(db, rs);
 	struct MakeNewBNode : public BNodeEvaluator {
 	    POSFactory* posFactory;
@@ -994,19 +1173,29 @@ void NumberExpression::express (Expressor* p_expressor) const {
     }
 
     ResultSet* Ask::execute (RdfDB* db, ResultSet* rs) const {
-	if (!rs) rs = new ResultSet(rs->getPOSFactory());
+	if (rs == NULL) // no POSFactory to make one with.
+	    throw(std::runtime_error(FUNCTION_STRING));
 	for (std::vector<const DatasetClause*>::const_iterator ds = m_DatasetClauses->begin();
 	     ds != m_DatasetClauses->end(); ds++)
 	    (*ds)->loadData(db);
-	m_WhereClause->bindVariables(db, rs);
+	RdfDB::Reading reading(db, rs);
+	rs->assignSlots(m_WhereClause);
+	if (rs->options->pipelining && m_WhereClause->pipelines())
+	    m_WhereClause->pipeline(db, rs, 1); // one solution answers the question.
+	else
+	    m_WhereClause->bindVariables(db, rs);
 	rs->resultType = ResultSet::RESULT_Boolean;
 	return rs;
     }
 
     ResultSet* Insert::execute (RdfDB* db, ResultSet* rs) const {
-	if (!rs) rs = new ResultSet(rs->getPOSFactory());
-	if (m_WhereClause != NULL)
+	if (rs == NULL) // no POSFactory to make one with.
+	    throw(std::runtime_error(FUNCTION_STRING));
+	if (m_WhereClause != NULL) {
+	    RdfDB::Reading reading(db, rs); // released before the commit.
+	    rs->assignSlots(m_WhereClause);
 	    m_WhereClause->bindVariables(db, rs);
+	}
 	struct MakeNewBNode : public BNodeEvaluator {
 	    POSFactory* posFactory;
 	    virtual const POS* evaluate (const BNode* /* node */, const Result* /* r */) {
@@ -1017,20 +1206,33 @@ void NumberExpression::express (Expressor* p_expressor) const {
 	};
 	MakeNewBNode makeNewBNode(rs->getPOSFactory());
 	rs->resultType = ResultSet::RESULT_Graphs;
-	m_GraphTemplate->construct(rs->getRdfDB(), rs, &makeNewBNode, NULL);
+	RdfDB* target = rs->getRdfDB() != NULL ? rs->getRdfDB() : db;
+	RdfDB inserts;
+	m_GraphTemplate->construct(&inserts, rs, &makeNewBNode, NULL);
+	target->commit(&inserts, NULL);
 	return rs;
     }
 
     ResultSet* Delete::execute (RdfDB* db, ResultSet* rs) const {
-	if (!rs) {
-	    rs = new ResultSet(rs->getPOSFactory());
-	    *rs->getRdfDB() = *db;
-	}
-	if (m_WhereClause != NULL)
+	if (rs == NULL) // no POSFactory to make one with.
+	    throw(std::runtime_error(FUNCTION_STRING));
+	if (m_WhereClause != NULL) {
+	    RdfDB::Reading reading(db, rs); // released before the commit.
+	    rs->assignSlots(m_WhereClause);
 	    m_WhereClause->bindVariables(db, rs);
+	}
 	TreatAsVar treatAsVar;
 	rs->resultType = ResultSet::RESULT_Graphs;
-	m_GraphTemplate->deletePattern(rs->getRdfDB(), rs, &treatAsVar, NULL);
+	/* Match the template against a pinned version of the target and
+	 * commit what matched, rather than editing the target in place.
+	 */
+	RdfDB* target = rs->getRdfDB() != NULL ? rs->getRdfDB() : db;
+	RdfDB deletes;
+	{
+	    RdfDB::Reading reading(target, rs); // released before the commit.
+	    m_GraphTemplate->deletePattern(target, &deletes, rs, &treatAsVar, NULL);
+	}
+	target->commit(NULL, &deletes);
 	return rs;
     }
 
@@ -1040,11 +1242,18 @@ void NumberExpression::express (Expressor* p_expressor) const {
 	if (db->loadData(target, iptr, nameStr, nameStr, m_posFactory))
 	    throw nameStr + ":0: error: unable to parse web document";
     }
+    /* Loads are parsed into a private RdfDB and committed, so queries
+     * already reading <db> don't see a half-loaded graph.
+     */
     void DefaultGraphClause::loadData (RdfDB* db) const {
-	loadGraph(db, m_IRIref, db->assureGraph(DefaultGraph));
+	RdfDB loaded;
+	loadGraph(db, m_IRIref, loaded.assureGraph(DefaultGraph));
+	db->commit(&loaded, NULL);
     }
     void NamedGraphClause::loadData (RdfDB* db) const {
-	loadGraph(db, m_IRIref, db->assureGraph(m_IRIref));
+	RdfDB loaded;
+	loadGraph(db, m_IRIref, loaded.assureGraph(m_IRIref));
+	db->commit(&loaded, NULL);
     }
 
     void WhereClause::bindVariables (RdfDB* db, ResultSet* rs) const {
@@ -1052,6 +1261,49 @@ void NumberExpression::express (Expressor* p_expressor) const {
 	m_GroupGraphPattern->bindVariables(db, rs);
     }
 
+    /* Copies each new solution into the target ResultSet until it has enough. */
+    struct CollectingSink : public RowSink {
+	ResultSet* rs;
+	int remaining;
+	DistinctFilter* distinct;
+	CollectingSink (ResultSet* rs, int remaining, DistinctFilter* distinct) : rs(rs), remaining(remaining), distinct(distinct) {  }
+	virtual bool push (Result* row) {
+	    if (distinct != NULL && !distinct->firstSighting(row))
+		return true;
+	    Result* copy = Result::make(rs);
+	    for (BindingSetConstIterator it = row->begin(); it != row->end(); ++it)
+		rs->set(copy, it->first, it->second.pos, it->second.weaklyBound);
+	    rs->insert(rs->end(), copy);
+	    return remaining < 0 || --remaining > 0;
+	}
+    };
+
+    void WhereClause::pipeline (RdfDB* db, ResultSet* rs, int maxRows, DistinctFilter* distinct) const {
+	if (maxRows == 0) {
+	    for (ResultSetIterator it = rs->begin(); it != rs->end(); ) {
+		delete *it;
+		it = rs->erase(it);
+	    }
+	    return;
+	}
+	CollectingSink sink(rs, maxRows, distinct);
+	pipeline(db, rs, &sink);
+    }
+
+    void WhereClause::pipeline (RdfDB* db, ResultSet* rs, RowSink* sink) const {
+	std::vector<Result*> inputs(rs->begin(), rs->end());
+	for (ResultSetIterator it = rs->begin(); it != rs->end(); )
+	    it = rs->erase(it);
+	bool more = true;
+	rs->joinTables.clear();
+	for (std::vector<Result*>::iterator input = inputs.begin(); input != inputs.end(); ++input) {
+	    if (more)
+		more = m_GroupGraphPattern->pipeline(db, rs, *input, sink);
+	    delete *input;
+	}
+	rs->joinTables.clear();
+    }
+
     void POSList::project (ResultSet* rs) const {
 	rs->project(&m_POSs);
     }
@@ -1059,15 +1311,259 @@ void NumberExpression::express (Expressor* p_expressor) const {
     void StarVarSet::project (ResultSet* /* rs */) const {
     }
 
-    void SolutionModifier::order (ResultSet* rs) {
-	if (m_OrderConditions != NULL)
-	    rs->order(m_OrderConditions);
+    int SolutionModifier::keep (e_distinctness distinctness) const {
+	if (m_limit != LIMIT_None && distinctness == DIST_all)
+	    return m_limit + (m_offset == OFFSET_None ? 0 : m_offset);
+	return -1;
+    }
+
+    void SolutionModifier::order (ResultSet* rs, e_distinctness distinctness) {
+	if (m_OrderConditions == NULL)
+	    return;
+	rs->order(m_OrderConditions, keep(distinctness));
+    }
+
+    FunctionCall::e_Function FunctionCall::_resolve (std::string iri) {
+	if (iri == "http://www.w3.org/2001/XMLSchema#float"    || 
+	    iri == "http://www.w3.org/2001/XMLSchema#double"   || 
+	    iri == "http://www.w3.org/2001/XMLSchema#decimal"  || 
+	    iri == "http://www.w3.org/2001/XMLSchema#integer"  || 
+	    iri == "http://www.w3.org/2001/XMLSchema#boolean"    )
+	    return FUNC_numericCast;
+	if (iri == "http://www.w3.org/2001/XMLSchema#dateTime") return FUNC_dateTimeCast;
+	if (iri == "http://www.w3.org/2001/XMLSchema#string") return FUNC_stringCast;
+	if (iri == "http://www.w3.org/TR/rdf-sparql-query/#func-bound") return FUNC_bound;
+	if (iri == "http://www.w3.org/TR/rdf-sparql-query/#func-isIRI") return FUNC_isIRI;
+	if (iri == "http://www.w3.org/TR/rdf-sparql-query/#func-isBlank") return FUNC_isBlank;
+	if (iri == "http://www.w3.org/TR/rdf-sparql-query/#func-isLiteral") return FUNC_isLiteral;
+	if (iri == "http://www.w3.org/TR/rdf-sparql-query/#func-str") return FUNC_str;
+	if (iri == "http://www.w3.org/TR/rdf-sparql-query/#func-lang") return FUNC_lang;
+	if (iri == "http://www.w3.org/TR/rdf-sparql-query/#func-datatype") return FUNC_datatype;
+	if (iri == "http://www.w3.org/TR/rdf-sparql-query/#func-sameTerm") return FUNC_sameTerm;
+	if (iri == "http://www.w3.org/TR/rdf-sparql-query/#func-langMatches") return FUNC_langMatches;
+	if (iri == "http://www.w3.org/TR/rdf-sparql-query/#func-regex") return FUNC_regex;
+	return FUNC_unknown;
+    }
+
+    /* A plain literal constant, as REGEX requires of its pattern and flags. */
+    static const RDFLiteral* _plainConstant (const Expression* arg) {
+	const POSExpression* pos = dynamic_cast<const POSExpression*>(arg);
+	const RDFLiteral* lit = pos == NULL ? NULL : dynamic_cast<const RDFLiteral*>(pos->getPOS());
+	return lit != NULL && lit->getDatatype() == NULL && lit->getLangtag() == NULL ? lit : NULL;
+    }
+
+    /* Resolve the function once per query rather than once per row, and
+     * compile constant REGEX patterns.
+     */
+    void FunctionCall::_compile () {
+	m_Function = _resolve(m_IRIref->getLexicalValue());
+	bool constant = true;
+	for (ArgList::ArgIterator it = m_ArgList->begin(); it != m_ArgList->end(); ++it)
+	    if (!(*it)->isConstant())
+		constant = false;
+	m_Folded.setConstant(constant);
+#if REGEX_LIB == SWOb_BOOST
+	if (m_Function == FUNC_regex && (m_ArgList->size() == 2 || m_ArgList->size() == 3)) {
+	    const RDFLiteral* pattern = _plainConstant(*(m_ArgList->begin() + 1));
+	    const RDFLiteral* flags = m_ArgList->size() == 3 ? _plainConstant(*(m_ArgList->begin() + 2)) : NULL;
+	    if (pattern != NULL && (m_ArgList->size() == 2 || flags != NULL)) {
+		try {
+		    m_Pattern.reset(new boost::regex(pattern->getLexicalValue(), _regexFlags(flags)));
+		} catch (boost::regex_error&) {
+		    /* leave it to eval to report. */
+		}
+	    }
+	}
+    }
+
+    unsigned FunctionCall::_regexFlags (const RDFLiteral* flags) {
+	unsigned l_flags = boost::regex::basic | boost::regex::no_mod_m | boost::regex::no_mod_s;
+	if (flags != NULL) {
+	    std::string smix = flags->getLexicalValue();
+	    if (smix.find_first_of('s') != std::string::npos)
+		l_flags &= ~boost::regex::no_mod_s;
+	    if (smix.find_first_of('m') != std::string::npos)
+		l_flags &= ~boost::regex::no_mod_m;
+	    if (smix.find_first_of('i') != std::string::npos)
+		l_flags |= boost::regex::icase;
+	    if (smix.find_first_of('x') != std::string::npos)
+		l_flags |= boost::regex::mod_x;
+	}
+	return l_flags;
+    }
+#else /* !REGEX_LIB == SWOb_BOOST */
+    }
+#endif /* !REGEX_LIB == SWOb_BOOST */
+
+    const POS* FunctionCall::_eval (const Result* r, POSFactory* posFactory, BNodeEvaluator* evaluator) const {
+	std::vector<const POS*> subd;
+	for (ArgList::ArgIterator it = m_ArgList->begin(); it != m_ArgList->end(); ++it)
+	    subd.push_back((*it)->eval(r, posFactory, evaluator));
+
+	/* Write down the first 3 for convenience. */
+	std::vector<const POS*>::const_iterator it = subd.begin();
+	const POS* first = it == subd.end() ? NULL : *it++;
+	const POS* second = it == subd.end() ? NULL : *it++;
+	const POS* third = it == subd.end() ? NULL : *it++;
+
+	switch (m_Function) {
+
+	/* casts */
+	case FUNC_numericCast: {
+	    const RDFLiteral* s = dynamic_cast<const RDFLiteral*>(first);
+	    if (s != NULL) {
+		const URI* dt = s->getDatatype();
+		std::string dtl = dt ? dt->getLexicalValue() : ":noDT";
+		if (dt == NULL || 
+		    dtl == "http://www.w3.org/2001/XMLSchema#string"  || 
+		    dtl == "http://www.w3.org/2001/XMLSchema#float"   || 
+		    dtl == "http://www.w3.org/2001/XMLSchema#double"  || 
+		    dtl == "http://www.w3.org/2001/XMLSchema#decimal" || // check
+		    dtl == "http://www.w3.org/2001/XMLSchema#integer" || // check
+		    dtl == "http://www.w3.org/2001/XMLSchema#boolean"   )// adjust
+		    return posFactory->getRDFLiteral(first->getLexicalValue(), m_IRIref, NULL, true);
+	    }
+	    break;
+	}
+
+	case FUNC_dateTimeCast: {
+	    const RDFLiteral* s = dynamic_cast<const RDFLiteral*>(first);
+	    if (s != NULL) {
+		const URI* dt = s->getDatatype();
+		std::string dtl = dt ? dt->getLexicalValue() : ":noDT";
+		if (dt == NULL || 
+		    dtl == "http://www.w3.org/2001/XMLSchema#dateTime"  )// adjust
+		    return posFactory->getRDFLiteral(first->getLexicalValue(), m_IRIref, NULL, true);
+	    }
+	    break;
+	}
+
+	case FUNC_stringCast:
+	    return posFactory->getRDFLiteral(first->getLexicalValue(), m_IRIref, NULL, true);
+
+	/* operators */
+	case FUNC_bound:
+	    if (subd.size() == 1)
+		return first == NULL ? posFactory->getFalse() : posFactory->getTrue();
+	    break;
+
+	case FUNC_isIRI:
+	    if (subd.size() == 1)
+		return dynamic_cast<const URI*>(first) == NULL ? posFactory->getFalse() : posFactory->getTrue();
+	    break;
+
+	case FUNC_isBlank:
+	    if (subd.size() == 1)
+		return dynamic_cast<const BNode*>(first) == NULL ? posFactory->getFalse() : posFactory->getTrue();
+	    break;
+
+	case FUNC_isLiteral:
+	    if (subd.size() == 1)
+		return dynamic_cast<const RDFLiteral*>(first) == NULL ? posFactory->getFalse() : posFactory->getTrue();
+	    break;
+
+	case FUNC_str: // STR(RDFLiteral), STR(URI)
+	    if (subd.size() == 1 && (dynamic_cast<const RDFLiteral*>(first) != NULL ||
+				     dynamic_cast<const URI*>(first) != NULL))
+		return posFactory->getRDFLiteral(first->getLexicalValue());
+	    break;
+
+	case FUNC_lang:
+	    if (subd.size() == 1 && dynamic_cast<const RDFLiteral*>(first) != NULL) {
+		const LANGTAG* t = dynamic_cast<const RDFLiteral*>(first)->getLangtag();
+		return posFactory->getRDFLiteral(t ? t->getLexicalValue() : "");
+	    }
+	    break;
+
+	case FUNC_datatype:
+	    if (subd.size() == 1 && dynamic_cast<const RDFLiteral*>(first) != NULL && 
+		dynamic_cast<const RDFLiteral*>(first)->getLangtag() == NULL) {
+		const URI* dt = dynamic_cast<const RDFLiteral*>(first)->getDatatype();
+		return dt ? dt : posFactory->getURI("http://www.w3.org/2001/XMLSchema#string");
+	    }
+	    break;
+
+	case FUNC_sameTerm:
+	    if (subd.size() == 2)
+		return first == second && first != NULL ? posFactory->getTrue() : posFactory->getFalse();
+	    break;
+
+	case FUNC_langMatches:
+	    if (subd.size() == 2 && 
+		dynamic_cast<const RDFLiteral*>(first) != NULL && 
+		dynamic_cast<const RDFLiteral*>(second) != NULL) {
+
+		/* knock off the easy ones... */
+		if (first == second)
+		    return posFactory->getTrue();
+		std::string tag = dynamic_cast<const RDFLiteral*>(first)->getLexicalValue();
+		std::string range = dynamic_cast<const RDFLiteral*>(second)->getLexicalValue();
+		if (range == "*")
+		    return tag.empty() ? posFactory->getFalse() : posFactory->getTrue();
+
+		std::string::iterator t = tag.begin();
+		std::string::iterator te = tag.end();
+		std::string::iterator r = range.begin();
+		std::string::iterator re = range.end();
+
+		while (t != te && r != re)
+		    if (::tolower(*t++) != ::tolower(*r++))
+			return posFactory->getFalse();
+
+		if (r == re && 
+		    (t == te || *t == '-'))
+		    return posFactory->getTrue();
+
+		return posFactory->getFalse();
+	    }
+	    break;
+
+	case FUNC_regex: {
+	    const RDFLiteral* firstLit = dynamic_cast<const RDFLiteral*>(first);
+	    const RDFLiteral* secondLit = dynamic_cast<const RDFLiteral*>(second);
+	    const RDFLiteral* thirdLit = dynamic_cast<const RDFLiteral*>(third);
+	    if (( subd.size() == 2 || subd.size() == 3 ) && 
+		firstLit != NULL && firstLit->getDatatype() == NULL && firstLit->getLangtag() == NULL && 
+		secondLit != NULL && secondLit->getDatatype() == NULL && secondLit->getLangtag() == NULL && 
+		( subd.size() == 2 || 
+		  (thirdLit != NULL && thirdLit->getDatatype() == NULL && thirdLit->getLangtag() == NULL))) {
+#if REGEX_LIB == SWOb_DISABLED
+		throw std::string("no regular expression library was linked in");
+#else
+		boost::match_results<std::string::const_iterator> what;
+		boost::match_flag_type flags = boost::match_default;
+		const std::string& subject = firstLit->getLexicalValue();
+		if (m_Pattern.get() != NULL)
+		    return regex_search(subject, what, *m_Pattern, flags) ? posFactory->getTrue() : posFactory->getFalse();
+		const boost::regex pattern(secondLit->getLexicalValue(), _regexFlags(thirdLit));
+		return regex_search(subject, what, pattern, flags) ? posFactory->getTrue() : posFactory->getFalse();
+#endif
+	    }
+	    break;
+	}
+
+	case FUNC_unknown:
+	    break;
+	}
+
+	std::stringstream s;
+	s << m_IRIref->toString() << '(';
+	for (std::vector<const POS*>::iterator it = subd.begin(); it != subd.end(); ++it) {
+	    if (it != subd.begin())
+		s << ", ";
+	    if (*it)
+		s << (*it)->toString();
+	    else
+		s << "NULL";
+	}
+	s << ')';
+	throw NotImplemented(s.str());
     }
 
     void BindingClause::bindVariables (RdfDB* db, ResultSet* rs) const {
 	for (ResultSetIterator it = rs->begin() ; it != rs->end(); ) {
 	    for (std::vector<const Binding*>::const_iterator binding = begin() ; binding != end(); ++binding) {
-		Result* r = new Result(rs);
+		Result* r = Result::make(rs);
 		rs->insert(it, r);
 		(*binding)->bindVariables(db, rs, r, m_Vars);
 	    }
@@ -1080,59 +1576,448 @@ void NumberExpression::express (Expressor* p_expressor) const {
 	std::vector<const POS*>::const_iterator variable = p_Vars->begin();
 	std::vector<const POS*>::const_iterator value = begin();
 	while (value != end()) {
-	    rs->set(r, *variable, *value, false);
+	    if (*value != rs->getPOSFactory()->getNULL()) // NULL leaves it unbound
+		rs->set(r, *variable, *value, false);
 	    variable++;
 	    value++;
 	}
     }
 
+    bool TableOperation::pipeline (RdfDB* db, ResultSet* rs, Result* row, RowSink* sink) const {
+	ResultSet island(rs->getPOSFactory(), rs->debugStream);
+	island.partOf(*rs);
+	island.reseed(row);
+	bindVariables(db, &island);
+	return island.pushRows(sink);
+    }
+
+    /* A copy of <incoming> with <row>'s bindings, or NULL if they conflict. */
+    static Result* _joined (ResultSet* rs, Result* incoming, const Result* row) {
+	Result* joined = incoming->duplicate(rs, rs->end());
+	for (BindingSetConstIterator it = row->begin(); it != row->end(); ++it) {
+	    const POS* had = joined->get(it->first);
+	    if (had == NULL)
+		joined->set(it->first, it->second.pos, it->second.weaklyBound);
+	    else if (had != it->second.pos) {
+		delete joined;
+		return NULL;
+	    }
+	}
+	return joined;
+    }
+
+    /* Push <row> joined with <incoming> to <sink>, if they're compatible. */
+    static bool _joinAndPush (ResultSet* rs, Result* incoming, Result* row, RowSink* sink) {
+	if (incoming->size() == 0)
+	    return sink->push(row);
+	Result* joined = _joined(rs, incoming, row);
+	if (joined == NULL)
+	    return true;
+	bool ret = sink->push(joined);
+	delete joined;
+	return ret;
+    }
+
+    /* JoinTable - the solutions of an independent TableOperation, evaluated
+     * once per pipeline and joined with each row the pipeline feeds it.
+     * They're bucketed on the variables which they all bind and the first
+     * row to probe them binds too.
+     */
+    class JoinTable {
+	typedef std::vector<const POS*> Key;
+	typedef std::vector<Result*> Rows;
+	ResultSet solutions;
+	Rows all, none;
+	VariableVector keyVars;
+	bool indexed;
+	boost::unordered_map<Key, Rows, boost::hash<Key> > buckets;
+
+	/* The values of keyVars in <row>, or false if any is unbound. */
+	bool _key (const Result* row, Key* key) const {
+	    key->clear();
+	    for (VariableVectorConstIterator var = keyVars.begin(); var != keyVars.end(); ++var) {
+		const POS* val = row->get(*var);
+		if (val == NULL)
+		    return false;
+		key->push_back(val);
+	    }
+	    return true;
+	}
+
+	void _index (const Result* probe) {
+	    indexed = true;
+	    if (all.empty())
+		return;
+	    std::set<const POS*> certain;
+	    for (BindingSetConstIterator it = all[0]->begin(); it != all[0]->end(); ++it)
+		if (it->second.pos != NULL && probe->get(it->first) != NULL)
+		    certain.insert(it->first);
+	    for (Rows::const_iterator row = all.begin() + 1; row != all.end() && !certain.empty(); ++row)
+		for (std::set<const POS*>::iterator var = certain.begin(); var != certain.end(); )
+		    if ((*row)->get(*var) == NULL)
+			certain.erase(var++);
+		    else
+			++var;
+	    keyVars.assign(certain.begin(), certain.end());
+	    if (keyVars.empty())
+		return;
+	    Key key;
+	    for (Rows::const_iterator row = all.begin(); row != all.end(); ++row) {
+		_key(*row, &key);
+		buckets[key].push_back(*row);
+	    }
+	}
+
+    public:
+	JoinTable (RdfDB* db, ResultSet* rs, const TableOperation* op) :
+	    solutions(rs->getPOSFactory(), rs->debugStream), indexed(false) {
+	    solutions.partOf(*rs);
+	    op->bindVariables(db, &solutions);
+	    all.assign(solutions.begin(), solutions.end());
+	}
+
+	/* Push <row> joined with each compatible solution which passes
+	 * <expressions> to <sink>. For OP_outer, push <row> itself if none
+	 * did; for OP_minus, push only that.
+	 */
+	bool join (ResultSet* rs, Result* row, const ProductionVector<const Expression*>* expressions,
+		   ResultSet::e_OP operation, RowSink* sink) {
+	    if (!indexed)
+		_index(row);
+	    const Rows* candidates = &all;
+	    Key key;
+	    if (!keyVars.empty() && _key(row, &key)) {
+		boost::unordered_map<Key, Rows, boost::hash<Key> >::const_iterator bucket = buckets.find(key);
+		candidates = bucket == buckets.end() ? &none : &bucket->second;
+	    }
+	    bool matched = false;
+	    for (Rows::const_iterator solution = candidates->begin(); solution != candidates->end(); ++solution) {
+		Result* joined = _joined(rs, row, *solution);
+		if (joined == NULL)
+		    continue;
+		bool passes = true;
+		if (expressions != NULL)
+		    for (std::vector<const Expression*>::const_iterator it = expressions->begin();
+			 passes && it != expressions->end(); ++it)
+			passes = rs->getPOSFactory()->eval(*it, joined);
+		if (passes)
+		    matched = true;
+		bool more = !passes || operation == ResultSet::OP_minus || sink->push(joined);
+		delete joined;
+		if (!more)
+		    return false;
+		if (matched && operation == ResultSet::OP_minus)
+		    return true;
+	    }
+	    return matched || operation == ResultSet::OP_join ? true : sink->push(row);
+	}
+    };
+
+    /* <op>'s JoinTable for the pipeline filling <rs>, evaluated on first use. */
+    static JoinTable* _joinTable (RdfDB* db, ResultSet* rs, const TableOperation* op) {
+	boost::shared_ptr<JoinTable>& table = rs->joinTables[op];
+	if (table == NULL)
+	    table.reset(new JoinTable(db, rs, op));
+	return table.get();
+    }
+
+    /* Extend <row> with <op>'s solutions, evaluating an independent <op>
+     * only once however many rows the pipeline feeds it.
+     */
+    static bool _pipelineOperand (RdfDB* db, ResultSet* rs, const TableOperation* op, Result* row, RowSink* sink) {
+	if (op->independent())
+	    return _joinTable(db, rs, op)->join(rs, row, NULL, ResultSet::OP_join, sink);
+	return op->pipeline(db, rs, row, sink);
+    }
+
+    /* Passes on the rows which satisfy every expression, joined with the
+     * row the Filter was asked to extend.
+     */
+    struct FilteringSink : public RowSink {
+	std::vector<const Expression*>::const_iterator begin, end;
+	ResultSet* rs;
+	Result* incoming;
+	RowSink* next;
+	FilteringSink (std::vector<const Expression*>::const_iterator begin, std::vector<const Expression*>::const_iterator end,
+		       ResultSet* rs, Result* incoming, RowSink* next) :
+	    begin(begin), end(end), rs(rs), incoming(incoming), next(next) {  }
+	virtual bool push (Result* row) {
+	    for (std::vector<const Expression*>::const_iterator it = begin; it != end; ++it)
+		if (!rs->getPOSFactory()->eval(*it, row))
+		    return true;
+	    return _joinAndPush(rs, incoming, row, next);
+	}
+    };
+
+    /* Collects the variables (and bnodes) an expression reads. */
+    class BindableCollector : public RecursiveExpressor {
+    public:
+	std::set<const POS*> bindables;
+	virtual void base (const Base* const, std::string productionName) { throw(std::runtime_error(productionName)); };
+	virtual void variable (const Variable* const self, std::string) { bindables.insert(self); }
+	virtual void bnode (const BNode* const self, std::string) { bindables.insert(self); }
+    };
+
+    /* Split <expression> at its top-level &&s; a row passes the whole
+     * expression iff it passes every conjunct.
+     */
+    static void _conjuncts (const Expression* expression, PushedFilters* conjuncts) {
+	const BooleanConjunction* conjunction = dynamic_cast<const BooleanConjunction*>(expression);
+	if (conjunction != NULL) {
+	    for (std::vector<const Expression*>::const_iterator it = conjunction->begin(); it != conjunction->end(); ++it)
+		_conjuncts(*it, conjuncts);
+	    return;
+	}
+	BindableCollector collector;
+	expression->express(&collector);
+	PushedFilter conjunct;
+	conjunct.expression = expression;
+	conjunct.vars = collector.bindables;
+	conjuncts->push_back(conjunct);
+    }
+
+    /* The pattern to hand conjuncts to if <op> checks them in its triple loop. */
+    static const BasicGraphPattern* _pushable (const TableOperation* op) {
+	const DefaultGraphPattern* bgp = dynamic_cast<const DefaultGraphPattern*>(op);
+	return bgp != NULL && !bgp->getAllOpts() ? bgp : NULL;
+    }
+
+    /* Add the variables which every solution of <op> binds. */
+    static void _certainBindables (const TableOperation* op, std::set<const POS*>* bound) {
+	const BasicGraphPattern* bgp = dynamic_cast<const BasicGraphPattern*>(op);
+	if (bgp != NULL && !bgp->getAllOpts()) {
+	    for (std::vector<const TriplePattern*>::const_iterator triple = bgp->begin(); triple != bgp->end(); ++triple) {
+		const POS* positions[] = { (*triple)->getS(), (*triple)->getP(), (*triple)->getO() };
+		for (size_t i = 0; i < 3; ++i)
+		    if (dynamic_cast<const Bindable*>(positions[i]) != NULL)
+			bound->insert(positions[i]);
+	    }
+	}
+	const TableConjunction* conjunction = dynamic_cast<const TableConjunction*>(op);
+	if (conjunction != NULL)
+	    for (std::vector<const TableOperation*>::const_iterator it = conjunction->begin(); it != conjunction->end(); ++it)
+		_certainBindables(*it, bound);
+    }
+
+    /* Places each FILTER conjunct after the first operand of the filtered
+     * pattern (its conjuncts, or just the pattern) by which all of its
+     * variables are certainly bound. Conjuncts which no operand certainly
+     * binds are checked at the end, as they would see different bindings
+     * earlier.
+     */
+    struct FilterPlan {
+	std::vector<const TableOperation*> operands;
+	std::vector<PushedFilters> stages;
+	std::vector<const Expression*> residual;
+	FilterPlan (const TableOperation* op, const ProductionVector<const Expression*>& expressions) {
+	    const TableConjunction* conjunction = dynamic_cast<const TableConjunction*>(op);
+	    if (conjunction != NULL)
+		operands.assign(conjunction->begin(), conjunction->end());
+	    else
+		operands.push_back(op);
+	    stages.resize(operands.size());
+
+	    PushedFilters conjuncts;
+	    for (std::vector<const Expression*>::const_iterator it = expressions.begin(); it != expressions.end(); ++it)
+		_conjuncts(*it, &conjuncts);
+	    std::vector<bool> placed(conjuncts.size(), false);
+	    std::set<const POS*> bound;
+	    for (size_t i = 0; i < operands.size(); ++i) {
+		_certainBindables(operands[i], &bound);
+		for (size_t j = 0; j < conjuncts.size(); ++j)
+		    if (!placed[j] && std::includes(bound.begin(), bound.end(), conjuncts[j].vars.begin(), conjuncts[j].vars.end())) {
+			stages[i].push_back(conjuncts[j]);
+			placed[j] = true;
+		    }
+	    }
+	    for (size_t j = 0; j < conjuncts.size(); ++j)
+		if (!placed[j])
+		    residual.push_back(conjuncts[j].expression);
+	}
+    };
+
+    static bool _passesAll (const PushedFilters& filters, const Result* row, POSFactory* posFactory) {
+	for (PushedFilters::const_iterator filter = filters.begin(); filter != filters.end(); ++filter)
+	    if (!posFactory->eval(filter->expression, row))
+		return false;
+	return true;
+    }
+
+    /* Feeds rows to operand <next> of a FilterPlan, first checking the
+     * conjuncts placed after operand <next-1> unless its triple loop did.
+     */
+    struct StageSink : public RowSink {
+	RdfDB* db;
+	ResultSet* rs;
+	const FilterPlan& plan;
+	size_t next;
+	RowSink* out;
+	StageSink (RdfDB* db, ResultSet* rs, const FilterPlan& plan, size_t next, RowSink* out) :
+	    db(db), rs(rs), plan(plan), next(next), out(out) {  }
+	virtual bool push (Result* row) {
+	    if (next > 0 && _pushable(plan.operands[next - 1]) == NULL &&
+		!_passesAll(plan.stages[next - 1], row, rs->getPOSFactory()))
+		return true;
+	    if (next == plan.operands.size())
+		return out->push(row);
+	    StageSink deeper(db, rs, plan, next + 1, out);
+	    const BasicGraphPattern* oldFor = rs->filtersFor;
+	    const PushedFilters* oldFilters = rs->filters;
+	    rs->filtersFor = _pushable(plan.operands[next]);
+	    rs->filters = &plan.stages[next];
+	    bool ret = _pipelineOperand(db, rs, plan.operands[next], row, &deeper);
+	    rs->filtersFor = oldFor;
+	    rs->filters = oldFilters;
+	    return ret;
+	}
+    };
+
+    /* Like Filter::bindVariables, evaluate the pattern on its own and
+     * join the survivors with <row>.
+     */
+    bool Filter::pipeline (RdfDB* db, ResultSet* rs, Result* row, RowSink* sink) const {
+	Result empty(rs);
+	if (!rs->options->filterPushdown) {
+	    FilteringSink filtering(m_Expressions.begin(), m_Expressions.end(), rs, row, sink);
+	    return m_TableOperation->pipeline(db, rs, &empty, &filtering);
+	}
+	FilterPlan plan(m_TableOperation, m_Expressions);
+	FilteringSink filtering(plan.residual.begin(), plan.residual.end(), rs, row, sink);
+	StageSink first(db, rs, plan, 0, &filtering);
+	return first.push(&empty);
+    }
+
     void Filter::bindVariables (RdfDB* db, ResultSet* rs) const {
 	ResultSet island(rs->getPOSFactory(), rs->debugStream);
-	m_TableOperation->bindVariables(db, &island);
-	for (std::vector<const Expression*>::const_iterator it = m_Expressions.begin();
-	     it != m_Expressions.end(); it++)
+	island.partOf(*rs);
+	if (!rs->options->filterPushdown) {
+	    m_TableOperation->bindVariables(db, &island);
+	    for (std::vector<const Expression*>::const_iterator it = m_Expressions.begin();
+		 it != m_Expressions.end(); it++)
+		island.restrict(*it);
+	    rs->joinIn(&island, NULL);
+	    return;
+	}
+
+	/* Evaluate the operands in turn, dropping rows as soon as all the
+	 * variables of a conjunct are bound.
+	 */
+	FilterPlan plan(m_TableOperation, m_Expressions);
+	for (size_t i = 0; i < plan.operands.size() && island.size() > 0; ++i) {
+	    island.filtersFor = _pushable(plan.operands[i]);
+	    island.filters = &plan.stages[i];
+	    bool pushed = island.filtersFor != NULL;
+	    plan.operands[i]->bindVariables(db, &island);
+	    if (!pushed || island.filtersFor != NULL) // not applied in a triple loop
+		for (PushedFilters::const_iterator filter = plan.stages[i].begin(); filter != plan.stages[i].end(); ++filter)
+		    island.restrict(filter->expression);
+	    island.filtersFor = NULL;
+	    island.filters = NULL;
+	}
+	for (std::vector<const Expression*>::const_iterator it = plan.residual.begin();
+	     it != plan.residual.end(); it++)
 	    island.restrict(*it);
-	rs->joinIn(&island, false);
+	rs->joinIn(&island, NULL);
     }
 
     void TableConjunction::bindVariables (RdfDB* db, ResultSet* rs) const {
 	ResultSet island(rs->getPOSFactory(), rs->debugStream);
+	island.partOf(*rs);
 	for (std::vector<const TableOperation*>::const_iterator it = m_TableOperations.begin();
 	     it != m_TableOperations.end() && rs->size() > 0; it++)
 	    (*it)->bindVariables(db, &island);
 	rs->joinIn(&island, false);
     }
 
+    /* Feeds each row from operation <next-1> to operation <next>; rows
+     * from the last are joined with the conjunction's incoming row.
+     */
+    struct ConjunctionSink : public RowSink {
+	RdfDB* db;
+	ResultSet* rs;
+	const ProductionVector<const TableOperation*>& operations;
+	size_t next;
+	Result* incoming;
+	RowSink* out;
+	ConjunctionSink (RdfDB* db, ResultSet* rs, const ProductionVector<const TableOperation*>& operations,
+			 size_t next, Result* incoming, RowSink* out) :
+	    db(db), rs(rs), operations(operations), next(next), incoming(incoming), out(out) {  }
+	virtual bool push (Result* row) {
+	    if (next == operations.size())
+		return _joinAndPush(rs, incoming, row, out);
+	    ConjunctionSink deeper(db, rs, operations, next + 1, incoming, out);
+	    return _pipelineOperand(db, rs, operations[next], row, &deeper);
+	}
+    };
+
+    bool TableConjunction::pipeline (RdfDB* db, ResultSet* rs, Result* row, RowSink* sink) const {
+	Result empty(rs);
+	ConjunctionSink first(db, rs, m_TableOperations, 0, row, sink);
+	return first.push(&empty);
+    }
+
+    bool TableConjunction::pipelines () const {
+	for (std::vector<const TableOperation*>::const_iterator it = m_TableOperations.begin();
+	     it != m_TableOperations.end(); it++)
+	    if (!(*it)->pipelines())
+		return false;
+	return true;
+    }
+
     void TableConjunction::construct (RdfDB* target, const ResultSet* rs, BNodeEvaluator* evaluator, BasicGraphPattern* bgp) const {
 	for (std::vector<const TableOperation*>::const_iterator it = m_TableOperations.begin();
 	     it != m_TableOperations.end() && rs->size() > 0; it++)
 	    (*it)->construct(target, rs, evaluator, bgp);
     }
 
-    void TableConjunction::deletePattern (RdfDB* target, const ResultSet* rs, BNodeEvaluator* evaluator, BasicGraphPattern* bgp) const {
+    void TableConjunction::deletePattern (const RdfDB* source, RdfDB* deletions, const ResultSet* rs, BNodeEvaluator* evaluator, const POS* graph) const {
 	for (std::vector<const TableOperation*>::const_iterator it = m_TableOperations.begin();
 	     it != m_TableOperations.end() && rs->size() > 0; it++)
-	    (*it)->deletePattern(target, rs, evaluator, bgp);
+	    (*it)->deletePattern(source, deletions, rs, evaluator, graph);
     }
 
     void TableDisjunction::bindVariables (RdfDB* db, ResultSet* rs) const {
 	ResultSet island(rs->getPOSFactory(), rs->debugStream);
+	island.partOf(*rs);
 	delete *(island.begin());
 	island.erase(island.begin());
-	for (std::vector<const TableOperation*>::const_iterator it = m_TableOperations.begin();
-	     it != m_TableOperations.end(); it++) {
-	    ResultSet disjoint(rs->getPOSFactory(), rs->debugStream);
-	    (*it)->bindVariables(db, &disjoint);
+	/* Plan the SERVICE branches first so their queries are sent together. */
+	std::vector<ResultSet*> planned(m_TableOperations.size(), (ResultSet*)NULL);
+	ServiceGraphPattern::Joins joins;
+	try {
+	    for (size_t i = 0; i < m_TableOperations.size(); ++i) {
+		const ServiceGraphPattern* service = dynamic_cast<const ServiceGraphPattern*>(m_TableOperations[i]);
+		if (service != NULL) {
+		    planned[i] = new ResultSet(rs->getPOSFactory(), rs->debugStream);
+		    planned[i]->partOf(*rs);
+		    service->planJoins(db, planned[i], &joins);
+		}
+	    }
+	    ServiceGraphPattern::runJoins(db, joins);
+
+	    for (size_t i = 0; i < m_TableOperations.size(); ++i) {
+		ResultSet local(rs->getPOSFactory(), rs->debugStream);
+		local.partOf(*rs);
+		ResultSet& disjoint = planned[i] != NULL ? *planned[i] : local;
+		if (planned[i] == NULL)
+		    m_TableOperations[i]->bindVariables(db, &disjoint);
 #if 0
-	    for (std::vector<const Filter*>::const_iterator it = m_Filters.begin();
-		 it != m_Filters.end(); it++)
-		disjoint.restrict(*it);
+		for (std::vector<const Filter*>::const_iterator it = m_Filters.begin();
+		     it != m_Filters.end(); it++)
+		    disjoint.restrict(*it);
 #endif
-	    for (ResultSetIterator row = disjoint.begin() ; row != disjoint.end(); ) {
-		island.insert(island.end(), (*row)->duplicate(&island, island.end()));
-		delete *row;
-		row = disjoint.erase(row);
+		for (ResultSetIterator row = disjoint.begin() ; row != disjoint.end(); ) {
+		    island.insert(island.end(), (*row)->duplicate(&island, island.end()));
+		    delete *row;
+		    row = disjoint.erase(row);
+		}
+		delete planned[i];
+		planned[i] = NULL;
 	    }
+	} catch (...) {
+	    for (std::vector<ResultSet*>::iterator it = planned.begin(); it != planned.end(); ++it)
+		delete *it;
+	    throw;
 	}
 	rs->joinIn(&island, false);
     }
@@ -1152,6 +2037,7 @@ void NumberExpression::express (Expressor* p_expressor) const {
 
 compared against
 	ResultSet island(rs->getPOSFactory());
+	island.partOf(*rs);
 	db->bindVariables(&island, p_name, this);
 	for (std::vector<const Filter*>::const_iterator it = m_Filters.begin();
 	     it != m_Filters.end(); it++)
@@ -1161,6 +2047,10 @@ compared against
 	*/
     }
 
+    bool BasicGraphPattern::_pipeline (RdfDB* db, ResultSet* rs, const POS* p_name, Result* row, RowSink* sink) const {
+	return db->pipeline(rs, p_name, this, row, sink);
+    }
+
     CanonicalRDFLiteral::e_CANON CanonicalRDFLiteral::format = CANON_brief;
     std::ostream* BasicGraphPattern::DiffStream = NULL;
     bool BasicGraphPattern::CompareVars = false;
@@ -1178,16 +2068,14 @@ compared against
 	std::map<const TriplePattern*, std::vector<const TriplePattern*> >mine;
 	POSFactory f; // temp to hold trimmed triples.
 	const NULLpos* n = f.getNULL();
-	for (std::vector<const TriplePattern*>::const_iterator mit = 
-		 m_TriplePatterns.begin();
-	     mit != m_TriplePatterns.end(); ++mit)
+	for (std::vector<const TriplePattern*>::const_iterator mit = begin();
+	     mit != end(); ++mit)
 	    mine[f.getTriple(_cOrN((*mit)->getS(), n), 
 			     _cOrN((*mit)->getP(), n), 
 			     _cOrN((*mit)->getO(), n))].push_back(*mit);
 
-	for (std::vector<const TriplePattern*>::const_iterator rit = 
-		 ref.m_TriplePatterns.begin();
-	     rit != ref.m_TriplePatterns.end(); ++rit) {
+	for (std::vector<const TriplePattern*>::const_iterator rit = ref.begin();
+	     rit != ref.end(); ++rit) {
 	    const TriplePattern* r = 
 		f.getTriple(_cOrN((*rit)->getS(), n), 
 			    _cOrN((*rit)->getP(), n), 
@@ -1226,23 +2114,787 @@ compared against
 	return true;
     }
 
-    void BasicGraphPattern::bindVariables (ResultSet* rs, const POS* graphVar, const BasicGraphPattern* toMatch, const POS* graphName) const {
+    BasicGraphPattern::BasicGraphPattern (const BasicGraphPattern& ref) :
+	TableOperation(ref), m_TriplePatterns(), members(ref.members), 
+	spoIdx(ref.spoIdx), posIdx(ref.posIdx), ospIdx(ref.ospIdx), statistics(ref.statistics),
+	encoded(NULL), generation(ref.generation), allOpts(ref.allOpts) {
+	if (ref.encoded == NULL)
+	    m_TriplePatterns = ref.m_TriplePatterns;
+	else {
+	    ref.encoded->seal();
+	    boost::mutex::scoped_lock guard(ref.encoded->lock); // a reader may be counting it.
+	    encoded = new EncodedTriples(*ref.encoded);
+	}
+    }
+
+    BasicGraphPattern::~BasicGraphPattern () {
+	delete encoded;
+    }
+
+    void BasicGraphPattern::encode (TermTable* terms, boost::shared_ptr<const void> owner) {
+	std::vector<const TriplePattern*> triples(begin(), end());
+	clearTriples();
+	delete encoded;
+	encoded = terms == NULL ? NULL : new EncodedTriples(terms, owner);
+	for (std::vector<const TriplePattern*>::const_iterator it = triples.begin(); it != triples.end(); ++it)
+	    addTriplePattern(*it);
+    }
+
+    void BasicGraphPattern::addTriples (const BasicGraphPattern& from) {
+	if (encoded != NULL && from.encoded != NULL && encoded->terms == from.encoded->terms) {
+	    ++generation;
+	    encoded->add(*from.encoded);
+	    m_TriplePatterns.clear();
+	    return;
+	}
+	for (std::vector<const TriplePattern*>::const_iterator it = from.begin(); it != from.end(); ++it)
+	    addTriplePattern(*it);
+    }
+
+    void BasicGraphPattern::mapTriples (const EncodedTriples::Entry* spo, const EncodedTriples::Entry* pos,
+					const EncodedTriples::Entry* osp, size_t count) {
+	if (encoded == NULL)
+	    throw std::runtime_error("only an encoded graph can map triples");
+	++generation;
+	m_TriplePatterns.clear();
+	encoded->map(spo, pos, osp, count);
+    }
+
+    void BasicGraphPattern::_decode () const {
+	if (encoded == NULL || encoded->decoded.load(boost::memory_order_acquire))
+	    return;
+	encoded->seal();
+	boost::mutex::scoped_lock guard(encoded->lock);
+	if (encoded->decoded.load(boost::memory_order_relaxed))
+	    return;
+	/* Only a cache of the encoded triples, so a const graph fills it too. */
+	NoDelProductionVector<const TriplePattern*>& triples = const_cast<NoDelProductionVector<const TriplePattern*>&>(m_TriplePatterns);
+	triples.clear();
+	const TermTable* terms = encoded->terms;
+	POSFactory* posFactory = terms->getPOSFactory();
+	const EncodedTriples::Sorted& spo = encoded->orders[EncodedTriples::IDX_spo];
+	for (const EncodedTriples::Entry* it = spo.begin(); it != spo.end(); ++it)
+	    triples.push_back(posFactory->getTriple(terms->term(it->at[0]), terms->term(it->at[1]), terms->term(it->at[2])));
+	encoded->decoded.store(true, boost::memory_order_release);
+    }
+
+    std::vector<const TriplePattern*>::iterator BasicGraphPattern::erase (std::vector<const TriplePattern*>::iterator it) {
+	if (encoded == NULL) {
+	    _unindex(*it);
+	    return m_TriplePatterns.erase(it);
+	}
+	++generation;
+	EncodedTriples::Entry entry;
+	if (encoded->find(*it, &entry))
+	    encoded->erase(EncodedTriples::Permutation(1, entry));
+	/* Both are SPO order, so the decoded list stays current. */
+	std::vector<const TriplePattern*>::iterator ret = m_TriplePatterns.erase(it);
+	encoded->decoded.store(true, boost::memory_order_release);
+	return ret;
+    }
+
+    const TriplePattern* BasicGraphPattern::Candidates::triple () const {
+	return terms == NULL ? it->second : terms->getPOSFactory()->getTriple(getS(), getP(), getO());
+    }
+
+    EncodedTriples::EncodedTriples (const EncodedTriples& ref)
+	: terms(ref.terms), owner(ref.owner), pending(), statistics(ref.statistics),
+	  sealed(true), counted(ref.counted.load(boost::memory_order_acquire)), decoded(false) {
+	for (size_t order = 0; order < Orders; ++order)
+	    orders[order] = ref.orders[order];
+    }
+
+    bool EncodedTriples::find (const TriplePattern* t, Entry* entry) const {
+	entry->at[0] = terms->termID(t->getS());
+	entry->at[1] = terms->termID(t->getP());
+	entry->at[2] = terms->termID(t->getO());
+	return entry->at[0] != 0 && entry->at[1] != 0 && entry->at[2] != 0;
+    }
+
+    void EncodedTriples::add (const TriplePattern* t) {
+	Entry entry = { { terms->intern(t->getS()), terms->intern(t->getP()), terms->intern(t->getO()) } };
+	pending.push_back(entry);
+	sealed.store(false, boost::memory_order_release);
+	decoded.store(false, boost::memory_order_release);
+    }
+
+    void EncodedTriples::add (const EncodedTriples& from) {
+	const_cast<EncodedTriples&>(from).seal();
+	seal();
+	if (orders[IDX_spo].empty() && pending.empty()) {
+	    boost::mutex::scoped_lock guard(const_cast<boost::mutex&>(from.lock));
+	    for (size_t order = 0; order < Orders; ++order)
+		orders[order] = from.orders[order];
+	    owner = from.owner;
+	    statistics = from.statistics;
+	    counted.store(from.counted.load(boost::memory_order_acquire), boost::memory_order_release);
+	} else {
+	    pending.insert(pending.end(), from.orders[IDX_spo].begin(), from.orders[IDX_spo].end());
+	    sealed.store(false, boost::memory_order_release);
+	}
+	decoded.store(false, boost::memory_order_release);
+    }
+
+    void EncodedTriples::map (const Entry* spo, const Entry* pos, const Entry* osp, size_t count) {
+	Permutation().swap(pending);
+	orders[IDX_spo].map(spo, spo + count);
+	orders[IDX_pos].map(pos, pos + count);
+	orders[IDX_osp].map(osp, osp + count);
+	statistics._clear();
+	sealed.store(true, boost::memory_order_release);
+	counted.store(false, boost::memory_order_release);
+	decoded.store(false, boost::memory_order_release);
+    }
+
+    void EncodedTriples::_seal () {
+	boost::mutex::scoped_lock guard(lock);
+	if (sealed.load(boost::memory_order_relaxed))
+	    return;
+	std::sort(pending.begin(), pending.end());
+	Permutation added;
+	std::set_difference(pending.begin(), std::unique(pending.begin(), pending.end()),
+			    orders[IDX_spo].begin(), orders[IDX_spo].end(), std::back_inserter(added));
+	Permutation().swap(pending);
+	if (!added.empty()) {
+	    for (size_t order = 0; order < Orders; ++order) {
+		Permutation rotated;
+		rotated.reserve(added.size());
+		for (Permutation::const_iterator it = added.begin(); it != added.end(); ++it)
+		    rotated.push_back(it->rotated(order));
+		std::sort(rotated.begin(), rotated.end());
+		Permutation merged;
+		merged.reserve(orders[order].size() + rotated.size());
+		std::merge(orders[order].begin(), orders[order].end(), rotated.begin(), rotated.end(), std::back_inserter(merged));
+		orders[order].swap(merged);
+	    }
+	    counted.store(false, boost::memory_order_release);
+	}
+	sealed.store(true, boost::memory_order_release);
+    }
+
+    void EncodedTriples::erase (const Permutation& doomed) {
+	seal();
+	size_t before = orders[IDX_spo].size();
+	for (size_t order = 0; order < Orders; ++order) {
+	    Permutation rotated;
+	    rotated.reserve(doomed.size());
+	    for (Permutation::const_iterator it = doomed.begin(); it != doomed.end(); ++it)
+		rotated.push_back(it->rotated(order));
+	    std::sort(rotated.begin(), rotated.end());
+	    Permutation kept;
+	    kept.reserve(orders[order].size());
+	    std::set_difference(orders[order].begin(), orders[order].end(), rotated.begin(), rotated.end(), std::back_inserter(kept));
+	    orders[order].swap(kept);
+	}
+	if (orders[IDX_spo].size() != before) {
+	    counted.store(false, boost::memory_order_release);
+	    decoded.store(false, boost::memory_order_release);
+	}
+    }
+
+    void EncodedTriples::clear () {
+	for (size_t order = 0; order < Orders; ++order)
+	    orders[order].map(NULL, NULL);
+	Permutation().swap(pending);
+	statistics._clear();
+	sealed.store(true, boost::memory_order_release);
+	counted.store(true, boost::memory_order_release);
+	decoded.store(false, boost::memory_order_release);
+    }
+
+    /* Compares the first <length> IDs of two entries. */
+    struct EntryPrefixLess {
+	size_t length;
+	EntryPrefixLess (size_t length) : length(length) {  }
+	bool operator() (const EncodedTriples::Entry& l, const EncodedTriples::Entry& r) const {
+	    for (size_t i = 0; i < length; ++i)
+		if (l.at[i] != r.at[i])
+		    return l.at[i] < r.at[i];
+	    return false;
+	}
+    };
+
+    std::pair<const EncodedTriples::Entry*, const EncodedTriples::Entry*> EncodedTriples::range (size_t order, const Entry& key, size_t length) const {
+	const Sorted& permutation = orders[order];
+	return std::equal_range(permutation.begin(), permutation.end(), key, EntryPrefixLess(length));
+    }
+
+    void EncodedTriples::_countOnce () {
+	boost::mutex::scoped_lock guard(lock);
+	if (counted.load(boost::memory_order_relaxed))
+	    return;
+	_count();
+	counted.store(true, boost::memory_order_release);
+    }
+
+    /* Recount from the permutations: SPO groups give each subject's
+     * characteristic set and the predicates' triples and subjects, POS
+     * the predicates' objects and OSP the distinct objects.
+     */
+    void EncodedTriples::_count () {
+	statistics._clear();
+	const Sorted& spo = orders[IDX_spo];
+	statistics.triples = spo.size();
+	std::map<TermID, GraphStatistics::PredicateStats> byID;
+	GraphStatistics::CharacteristicSet set;
+	for (size_t i = 0; i < spo.size(); ) {
+	    size_t first = i;
+	    set.clear();
+	    while (i < spo.size() && spo[i].at[0] == spo[first].at[0]) {
+		size_t next = i;
+		while (next < spo.size() && spo[next].at[0] == spo[i].at[0] && spo[next].at[1] == spo[i].at[1])
+		    ++next;
+		GraphStatistics::PredicateStats& p = byID[spo[i].at[1]];
+		p.triples += next - i;
+		++p.subjects;
+		set.push_back(terms->term(spo[i].at[1]));
+		i = next;
+	    }
+	    ++statistics.countedSubjects;
+	    std::sort(set.begin(), set.end());
+	    statistics._join(set, i - first);
+	}
+	const Sorted& pos = orders[IDX_pos];
+	for (size_t i = 0; i < pos.size(); ++i)
+	    if (i == 0 || pos[i].at[0] != pos[i - 1].at[0] || pos[i].at[1] != pos[i - 1].at[1])
+		++byID[pos[i].at[0]].objects;
+	const Sorted& osp = orders[IDX_osp];
+	for (size_t i = 0; i < osp.size(); ++i)
+	    if (i == 0 || osp[i].at[0] != osp[i - 1].at[0])
+		++statistics.objects;
+	for (std::map<TermID, GraphStatistics::PredicateStats>::const_iterator it = byID.begin(); it != byID.end(); ++it)
+	    statistics.predicates[terms->term(it->first)] = it->second;
+    }
+
+    /* Any's address is its own, so no POS can share it. */
+    const POS* const BasicGraphPattern::idx_less::Any = reinterpret_cast<const POS*>(&BasicGraphPattern::idx_less::Any);
+
+    BasicGraphPattern::idx_range BasicGraphPattern::_prefix (const idx_type& index, const POS* first) {
+	return index.equal_range(idx_key(first, idx_less::Any));
+    }
+
+    bool BasicGraphPattern::_unindex (idx_type& index, idx_key key, const TriplePattern* p) {
+	std::pair<idx_type::iterator, idx_type::iterator> range = index.equal_range(key);
+	bool others = false;
+	for (idx_type::iterator it = range.first; it != range.second; ) {
+	    if (it->second == p)
+		index.erase(it++);
+	    else {
+		others = true;
+		++it;
+	    }
+	}
+	return !others;
+    }
+
+    /* multimap::insert places a new entry after any with an equal key. */
+    bool BasicGraphPattern::_firstWithKey (const idx_type& index, idx_type::const_iterator it) {
+	if (it == index.begin())
+	    return true;
+	idx_type::const_iterator prev = it;
+	return (--prev)->first != it->first;
+    }
+
+    void BasicGraphPattern::_index (const TriplePattern* p) {
+	++generation;
+	idx_type::const_iterator sp = spoIdx.insert(idx_pair(idx_key(p->getS(), p->getP()), p));
+	idx_type::const_iterator po = posIdx.insert(idx_pair(idx_key(p->getP(), p->getO()), p));
+	idx_type::const_iterator os = ospIdx.insert(idx_pair(idx_key(p->getO(), p->getS()), p));
+	/* The object is new if neither neighbor in ospIdx shares it. */
+	idx_type::const_iterator next = os;
+	bool newObject = (os == ospIdx.begin() || (--idx_type::const_iterator(os))->first.first != p->getO())
+	    && (++next == ospIdx.end() || next->first.first != p->getO());
+	statistics._add(p, _firstWithKey(spoIdx, sp), _firstWithKey(posIdx, po), newObject);
+    }
+
+    void BasicGraphPattern::_unindex (const TriplePattern* p) {
+	++generation;
+	members.erase(p);
+	bool lostSP = _unindex(spoIdx, idx_key(p->getS(), p->getP()), p);
+	bool lostPO = _unindex(posIdx, idx_key(p->getP(), p->getO()), p);
+	_unindex(ospIdx, idx_key(p->getO(), p->getS()), p);
+	bool lostObject = ospIdx.find(idx_key(p->getO(), idx_less::Any)) == ospIdx.end();
+	statistics._remove(p, lostSP, lostPO, lostObject);
+    }
+
+    GraphStatistics::GraphStatistics (const GraphStatistics& ref)
+	: triples(ref.triples), objects(ref.objects), predicates(ref.predicates),
+	  characteristicSets(ref.characteristicSets), subjects(), countedSubjects(ref.countedSubjects) {
+	for (SubjectMap::const_iterator it = ref.subjects.begin(); it != ref.subjects.end(); ++it) {
+	    SubjectEntry& e = subjects[it->first];
+	    e.set = characteristicSets.find(it->second.set->first);
+	    e.triples = it->second.triples;
+	}
+    }
+
+    GraphStatistics& GraphStatistics::operator= (const GraphStatistics& ref) {
+	if (this != &ref) {
+	    GraphStatistics copy(ref);
+	    triples = copy.triples;
+	    objects = copy.objects;
+	    predicates.swap(copy.predicates);
+	    characteristicSets.swap(copy.characteristicSets);
+	    subjects.swap(copy.subjects);
+	    countedSubjects = copy.countedSubjects;
+	}
+	return *this;
+    }
+
+    const GraphStatistics::PredicateStats& GraphStatistics::getPredicate (const POS* predicate) const {
+	static const PredicateStats None;
+	PredicateMap::const_iterator it = predicates.find(predicate);
+	return it == predicates.end() ? None : it->second;
+    }
+
+    GraphStatistics::CharacteristicSetMap::iterator GraphStatistics::_join (const CharacteristicSet& set, size_t triples) {
+	CharacteristicSetMap::iterator it = characteristicSets.find(set);
+	if (it == characteristicSets.end())
+	    it = characteristicSets.insert(std::make_pair(set, CharacteristicSetStats())).first;
+	++it->second.subjects;
+	it->second.triples += triples;
+	return it;
+    }
+
+    void GraphStatistics::_leave (CharacteristicSetMap::iterator set, size_t triples) {
+	set->second.triples -= triples;
+	if (--set->second.subjects == 0)
+	    characteristicSets.erase(set);
+    }
+
+    void GraphStatistics::_add (const TriplePattern* t, bool newSP, bool newPO, bool newObject) {
+	++triples;
+	if (newObject)
+	    ++objects;
+	PredicateStats& p = predicates[t->getP()];
+	++p.triples;
+	if (newSP)
+	    ++p.subjects;
+	if (newPO)
+	    ++p.objects;
+
+	SubjectMap::iterator s = subjects.find(t->getS());
+	if (s == subjects.end()) {
+	    SubjectEntry& e = subjects[t->getS()];
+	    e.triples = 1;
+	    e.set = _join(CharacteristicSet(1, t->getP()), 1);
+	} else if (newSP) {
+	    /* The subject moves to the set with this predicate added. */
+	    CharacteristicSet set(s->second.set->first);
+	    set.insert(std::lower_bound(set.begin(), set.end(), t->getP()), t->getP());
+	    _leave(s->second.set, s->second.triples);
+	    s->second.set = _join(set, ++s->second.triples);
+	} else {
+	    ++s->second.triples;
+	    ++s->second.set->second.triples;
+	}
+    }
+
+    void GraphStatistics::_remove (const TriplePattern* t, bool lostSP, bool lostPO, bool lostObject) {
+	--triples;
+	if (lostObject)
+	    --objects;
+	PredicateMap::iterator p = predicates.find(t->getP());
+	--p->second.triples;
+	if (lostSP)
+	    --p->second.subjects;
+	if (lostPO)
+	    --p->second.objects;
+	if (p->second.triples == 0)
+	    predicates.erase(p);
+
+	SubjectMap::iterator s = subjects.find(t->getS());
+	if (--s->second.triples == 0) {
+	    _leave(s->second.set, 1);
+	    subjects.erase(s);
+	} else if (lostSP) {
+	    CharacteristicSet set(s->second.set->first);
+	    set.erase(std::lower_bound(set.begin(), set.end(), t->getP()));
+	    _leave(s->second.set, s->second.triples + 1);
+	    s->second.set = _join(set, s->second.triples);
+	} else {
+	    --s->second.set->second.triples;
+	}
+    }
+
+    void GraphStatistics::_clear () {
+	triples = objects = 0;
+	predicates.clear();
+	characteristicSets.clear();
+	subjects.clear();
+	countedSubjects = 0;
+    }
+
+    std::string GraphStatistics::toString () const {
+	std::stringstream s;
+	s << triples << " triples, " << subjectCount() << " subjects, "
+	  << predicates.size() << " predicates, " << objects << " objects\n";
+
+	/* Sort lines so the dump doesn't depend on term addresses. */
+	std::vector<std::string> lines;
+	for (PredicateMap::const_iterator it = predicates.begin(); it != predicates.end(); ++it) {
+	    std::stringstream line;
+	    line << "  predicate " << it->first->toString() << ": " << it->second.triples << " triples, "
+		 << it->second.subjects << " subjects, " << it->second.objects << " objects\n";
+	    lines.push_back(line.str());
+	}
+	std::sort(lines.begin(), lines.end());
+	size_t predicateLines = lines.size();
+	for (CharacteristicSetMap::const_iterator it = characteristicSets.begin(); it != characteristicSets.end(); ++it) {
+	    std::vector<std::string> names;
+	    for (CharacteristicSet::const_iterator p = it->first.begin(); p != it->first.end(); ++p)
+		names.push_back((*p)->toString());
+	    std::sort(names.begin(), names.end());
+	    std::stringstream line;
+	    line << "  characteristic set {";
+	    for (std::vector<std::string>::const_iterator n = names.begin(); n != names.end(); ++n)
+		line << (n == names.begin() ? "" : " ") << *n;
+	    line << "}: " << it->second.subjects << " subjects, " << it->second.triples << " triples\n";
+	    lines.push_back(line.str());
+	}
+	std::sort(lines.begin() + predicateLines, lines.end());
+	for (std::vector<std::string>::const_iterator it = lines.begin(); it != lines.end(); ++it)
+	    s << *it;
+	return s.str();
+    }
+
+    /* NULL positions and Bindables (variables, bnodes) match anything. */
+    static inline bool _constantPosition (const POS* pos) {
+	return pos != NULL && dynamic_cast<const Bindable*>(pos) == NULL;
+    }
+
+    /* What <pos> must match in <row>: itself if constant, the value <row>
+     * binds it to, or NULL for anything. The binding is compared by
+     * identity in POS::bindVariable, so it is as good as a constant.
+     */
+    static inline const POS* _lookupValue (const POS* pos, const Result* row, const QueryOptions& options) {
+	if (_constantPosition(pos))
+	    return pos;
+	if (pos == NULL || row == NULL || !options.boundValueLookups)
+	    return NULL;
+	TreatAsVar treatAsVar;
+	return pos->evalPOS(row, &treatAsVar);
+    }
+
+    /* Whether some position of <constraint> could be bound by a row. */
+    static inline bool _rowDependent (const TriplePattern* constraint, const QueryOptions& options) {
+	return options.boundValueLookups &&
+	    (!_constantPosition(constraint->getS()) ||
+	     !_constantPosition(constraint->getP()) ||
+	     !_constantPosition(constraint->getO()));
+    }
+
+    BasicGraphPattern::Candidates BasicGraphPattern::_candidates (const TriplePattern* constraint, const QueryOptions& options, const Result* row) const {
+	const POS* s = _lookupValue(constraint->getS(), row, options);
+	const POS* p = _lookupValue(constraint->getP(), row, options);
+	const POS* o = _lookupValue(constraint->getO(), row, options);
+	bool sBound = s != NULL, pBound = p != NULL, oBound = o != NULL;
+
+	if (encoded != NULL) {
+	    /* The same choices, but a lookup on all three uses all three. */
+	    encoded->seal();
+	    const POS* spo[] = { s, p, o };
+	    EncodedTriples::Entry key = { { 0, 0, 0 } };
+	    for (size_t i = 0; i < 3; ++i)
+		if (spo[i] != NULL && (key.at[i] = encoded->terms->termID(spo[i])) == 0) // in no triple.
+		    return Candidates(spoIdx.end(), encoded->terms, std::pair<const EncodedTriples::Entry*, const EncodedTriples::Entry*>(NULL, NULL), 0);
+	    size_t order = EncodedTriples::IDX_spo, length = 0;
+	    if (!options.permutationIndexes) { order = EncodedTriples::IDX_pos; length = pBound ? 1 : 0; }
+	    else if (sBound && pBound) { order = EncodedTriples::IDX_spo; length = oBound ? 3 : 2; }
+	    else if (pBound && oBound) { order = EncodedTriples::IDX_pos; length = 2; }
+	    else if (oBound && sBound) { order = EncodedTriples::IDX_osp; length = 2; }
+	    else if (sBound) { order = EncodedTriples::IDX_spo; length = 1; }
+	    else if (pBound) { order = EncodedTriples::IDX_pos; length = 1; }
+	    else if (oBound) { order = EncodedTriples::IDX_osp; length = 1; }
+	    return Candidates(spoIdx.end(), encoded->terms, encoded->range(order, key.rotated(order), length), order);
+	}
+
+	if (!options.permutationIndexes)
+	    return pBound ? _prefix(posIdx, p) : idx_range(posIdx.begin(), posIdx.end());
+
+	if (sBound && pBound) return spoIdx.equal_range(idx_key(s, p)); // o, if bound, checked by bindVariables
+	if (pBound && oBound) return posIdx.equal_range(idx_key(p, o));
+	if (oBound && sBound) return ospIdx.equal_range(idx_key(o, s));
+	if (sBound) return _prefix(spoIdx, s);
+	if (pBound) return _prefix(posIdx, p);
+	if (oBound) return _prefix(ospIdx, o);
+	return idx_range(spoIdx.begin(), spoIdx.end());
+    }
+
+    QuadIndex::quad_range QuadIndex::_prefix (const quad_idx& index, const POS* first) {
+	return index.equal_range(idx_key(first, idx_less::Any));
+    }
+
+    QuadIndex::quad_range QuadIndex::_candidates (const TriplePattern* constraint, const QueryOptions& options, const Result* row) const {
+	const POS* s = _lookupValue(constraint->getS(), row, options);
+	const POS* p = _lookupValue(constraint->getP(), row, options);
+	const POS* o = _lookupValue(constraint->getO(), row, options);
+	bool sBound = s != NULL, pBound = p != NULL, oBound = o != NULL;
+
+	if (sBound && pBound) return spoIdx.equal_range(idx_key(s, p));
+	if (pBound && oBound) return posIdx.equal_range(idx_key(p, o));
+	if (oBound && sBound) return ospIdx.equal_range(idx_key(o, s));
+	if (sBound) return _prefix(spoIdx, s);
+	if (pBound) return _prefix(posIdx, p);
+	if (oBound) return _prefix(ospIdx, o);
+	return quad_range(spoIdx.begin(), spoIdx.end());
+    }
+
+    void QuadIndex::addGraph (const POS* name, const BasicGraphPattern* graph) {
+	graphs[name] = graph;
+	indexed[name].assign(graph->begin(), graph->end());
+	for (std::vector<const TriplePattern*>::const_iterator it = graph->begin();
+	     it != graph->end(); ++it) {
+	    const TriplePattern* t = *it;
+	    spoIdx.insert(std::make_pair(idx_key(t->getS(), t->getP()), quad(name, t)));
+	    posIdx.insert(std::make_pair(idx_key(t->getP(), t->getO()), quad(name, t)));
+	    ospIdx.insert(std::make_pair(idx_key(t->getO(), t->getS()), quad(name, t)));
+	}
+    }
+
+    void QuadIndex::_unindex (quad_idx& index, idx_key key, const quad& q) {
+	std::pair<quad_idx::iterator, quad_idx::iterator> range = index.equal_range(key);
+	for (quad_idx::iterator it = range.first; it != range.second; ++it)
+	    if (it->second == q) {
+		index.erase(it);
+		return;
+	    }
+    }
+
+    void QuadIndex::removeGraph (const POS* name) {
+	std::map<const POS*, std::vector<const TriplePattern*> >::iterator triples = indexed.find(name);
+	if (triples == indexed.end())
+	    return;
+	for (std::vector<const TriplePattern*>::const_iterator it = triples->second.begin();
+	     it != triples->second.end(); ++it) {
+	    const TriplePattern* t = *it;
+	    _unindex(spoIdx, idx_key(t->getS(), t->getP()), quad(name, t));
+	    _unindex(posIdx, idx_key(t->getP(), t->getO()), quad(name, t));
+	    _unindex(ospIdx, idx_key(t->getO(), t->getS()), quad(name, t));
+	}
+	indexed.erase(triples);
+	graphs.erase(name);
+    }
+
+    void QuadIndex::bindVariables (ResultSet* rs, const POS* graphVar, const BasicGraphPattern* toMatch) const {
 	if (rs->debugStream != NULL && *rs->debugStream != NULL)
-	    **rs->debugStream << "matching " << *toMatch;
+	    **rs->debugStream << "matching " << *toMatch << "in " << graphs.size() << " graphs\n";
+	TreatAsVar treatAsVar;
 	for (std::vector<const TriplePattern*>::const_iterator constraint = toMatch->m_TriplePatterns.begin();
 	     constraint != toMatch->m_TriplePatterns.end(); constraint++) {
+	    bool rowDependent = _rowDependent(*constraint, *rs->options);
+	    quad_range quads = _candidates(*constraint, *rs->options);
 	    for (ResultSetIterator row = rs->begin() ; row != rs->end(); ) {
-		bool rowMatched = false;
-		const POS* pToMatch = (*constraint)->getP();
+		const POS* graphName = graphVar->evalPOS(*row, &treatAsVar);
+		if (graphName == NULL) {
+		    if (rowDependent)
+			quads = _candidates(*constraint, *rs->options, *row);
+		    for (quad_idx::const_iterator q = quads.first; q != quads.second; ++q) {
+			Result* newRow = (*row)->duplicate(rs, row);
+			if ((*constraint)->bindVariables(q->second.second, false, rs, graphVar, newRow, q->second.first))
+			    rs->insert(row, newRow);
+			else
+			    delete newRow;
+		    }
+		} else {
+		    std::map<const POS*, const BasicGraphPattern*>::const_iterator graph = graphs.find(graphName);
+		    if (graph != graphs.end()) {
+			for (BasicGraphPattern::Candidates t = graph->second->_candidates(*constraint, *rs->options, *row);
+			     !t.done(); t.next()) {
+			    Result* newRow = (*row)->duplicate(rs, row);
+			    if (t.bind(*constraint, false, rs, graphVar, newRow, graphName))
+				rs->insert(row, newRow);
+			    else
+				delete newRow;
+			}
+		    }
+		}
+		delete *row;
+		row = rs->erase(row);
+	    }
+	}
+	if (rs->debugStream != NULL && *rs->debugStream != NULL)
+	    **rs->debugStream << "produced\n" << *rs;
+    }
+
+    /* Bindables which have a value in <row> or were bound by an earlier pattern. */
+    static inline bool _knownPosition (const POS* pos, const std::set<const POS*>& bound, const Result* row, const QueryOptions& options) {
+	return _lookupValue(pos, row, options) != NULL || bound.find(pos) != bound.end();
+    }
+
+    double BasicGraphPattern::_estimate (const TriplePattern* constraint, const std::set<const POS*>& bound, const Result* row, const QueryOptions& options) const {
+	bool sKnown = _knownPosition(constraint->getS(), bound, row, options);
+	bool pKnown = _knownPosition(constraint->getP(), bound, row, options);
+	bool oKnown = _knownPosition(constraint->getO(), bound, row, options);
+	const POS* predicate = _lookupValue(constraint->getP(), row, options);
+	const GraphStatistics& statistics = getStatistics();
+
+	double triples, subjects, objects;
+	if (predicate != NULL) {
+	    const GraphStatistics::PredicateStats& stats = statistics.getPredicate(predicate);
+	    if (stats.triples == 0)
+		return 0; // matches nothing, so everything after it is free.
+	    triples = stats.triples; subjects = stats.subjects; objects = stats.objects;
+	} else if (pKnown && statistics.predicateCount() > 0) {
+	    /* bound by an earlier pattern: assume an average predicate. */
+	    triples = double(statistics.size()) / statistics.predicateCount();
+	    subjects = statistics.subjectCount(); objects = statistics.objectCount();
+	} else {
+	    triples = statistics.size();
+	    subjects = statistics.subjectCount(); objects = statistics.objectCount();
+	}
+	if (triples == 0)
+	    return 0;
+	if (sKnown && oKnown)
+	    return 1;
+	if (sKnown)
+	    return triples / std::max(subjects, 1.0);
+	if (oKnown)
+	    return triples / std::max(objects, 1.0);
+	return triples;
+    }
+
+    /* What _plan reads from <row>: which variables it binds and, for
+     * predicates, their values.
+     */
+    static std::vector<const POS*> _planKey (const BasicGraphPattern* toMatch, const Result* row, const QueryOptions& options) {
+	std::vector<const POS*> ret;
+	for (std::vector<const TriplePattern*>::const_iterator it = toMatch->begin(); it != toMatch->end(); ++it) {
+	    ret.push_back(_lookupValue((*it)->getS(), row, options) != NULL ? (*it)->getS() : NULL);
+	    ret.push_back(_lookupValue((*it)->getP(), row, options));
+	    ret.push_back(_lookupValue((*it)->getO(), row, options) != NULL ? (*it)->getO() : NULL);
+	}
+	return ret;
+    }
+
+    std::vector<const TriplePattern*> BasicGraphPattern::_plan (const BasicGraphPattern* toMatch, const Result* row, const ResultSet* rs, std::vector<double>& costs) const {
+	std::vector<const TriplePattern*> remaining(toMatch->m_TriplePatterns.begin(), toMatch->m_TriplePatterns.end());
+	if (!rs->options->patternOrdering || toMatch->allOpts || remaining.size() < 2)
+	    return remaining;
+
+	/* Greedily take the pattern with the fewest estimated matches per
+	 * row. Estimates count variables bound by earlier patterns, so a
+	 * pattern sharing a variable with them is usually cheap; among
+	 * equal estimates, prefer one which does share a variable.
+	 */
+	std::set<const POS*> bound;
+	std::vector<const TriplePattern*> ret;
+	while (!remaining.empty()) {
+	    size_t best = 0;
+	    bool bestConnected = false;
+	    double bestCost = 0;
+	    for (size_t i = 0; i < remaining.size(); ++i) {
+		const POS* positions[] = { remaining[i]->getS(), remaining[i]->getP(), remaining[i]->getO() };
+		bool connected = ret.empty();
+		for (size_t j = 0; j < 3; ++j)
+		    if (!_constantPosition(positions[j]) && _knownPosition(positions[j], bound, row, *rs->options))
+			connected = true;
+		double cost = _estimate(remaining[i], bound, row, *rs->options);
+		if (i == 0 || cost < bestCost || (cost == bestCost && connected && !bestConnected)) {
+		    best = i;
+		    bestConnected = connected;
+		    bestCost = cost;
+		}
+	    }
+	    const TriplePattern* chosen = remaining[best];
+	    const POS* positions[] = { chosen->getS(), chosen->getP(), chosen->getO() };
+	    for (size_t j = 0; j < 3; ++j)
+		if (positions[j] != NULL && !_constantPosition(positions[j]))
+		    bound.insert(positions[j]);
+	    ret.push_back(chosen);
+	    costs.push_back(bestCost);
+	    remaining.erase(remaining.begin() + best);
+	}
+	return ret;
+    }
+
+    /* Write an ordered <plan> for <toMatch> to rs's debugStream the first
+     * time the query uses it.
+     */
+    static void _printPlan (const BasicGraphPattern* toMatch, const std::vector<const TriplePattern*>& plan, const std::vector<double>& costs, const ResultSet* rs) {
+	if (rs->debugStream == NULL || *rs->debugStream == NULL || costs.empty())
+	    return;
+	if (rs->printedPlans == NULL)
+	    rs->printedPlans.reset(new ResultSet::PrintedPlans());
+	if (!rs->printedPlans->insert(std::make_pair(toMatch, plan)).second)
+	    return;
+	**rs->debugStream << "pattern order:\n";
+	for (size_t i = 0; i < plan.size(); ++i)
+	    **rs->debugStream << "  " << plan[i]->toString() << " ~" << costs[i] << " per row\n";
+    }
+
+    /* Whether <row> binds every variable <filter> reads. */
+    static inline bool _bindsAll (const PushedFilter& filter, const Result* row) {
+	for (std::set<const POS*>::const_iterator var = filter.vars.begin(); var != filter.vars.end(); ++var)
+	    if (row->get(*var) == NULL)
+		return false;
+	return true;
+    }
+
+    /* Check the pushed filters whose variables <after> binds and <before>
+     * (if any) didn't, so each is evaluated once per row.
+     */
+    static bool _passesPushed (const PushedFilters* filters, const Result* before, const Result* after, POSFactory* posFactory) {
+	if (filters == NULL)
+	    return true;
+	for (PushedFilters::const_iterator filter = filters->begin(); filter != filters->end(); ++filter)
+	    if (_bindsAll(*filter, after) && (before == NULL || !_bindsAll(*filter, before)) &&
+		!posFactory->eval(filter->expression, after))
+		return false;
+	return true;
+    }
+
+    bool BasicGraphPattern::_pipelineStep (const std::vector<const TriplePattern*>& plan, size_t depth, ResultSet* rs, const PushedFilters* filters,
+					   const POS* graphVar, const POS* graphName, Result* row, RowSink* sink) const {
+	if (depth == plan.size())
+	    return sink->push(row);
+	for (Candidates triple = _candidates(plan[depth], *rs->options, row); !triple.done(); triple.next()) {
+	    Result* next = row->duplicate(rs, rs->end());
+	    bool more = !triple.bind(plan[depth], false, rs, graphVar, next, graphName)
+		|| !_passesPushed(filters, row, next, rs->getPOSFactory())
+		|| _pipelineStep(plan, depth + 1, rs, filters, graphVar, graphName, next, sink);
+	    delete next;
+	    if (!more)
+		return false;
+	}
+	return true;
+    }
 
-		idx_range range
-		    = dynamic_cast<const Bindable*>(pToMatch) 
-		    ? idx_range(idx.begin(), idx.end())
-		    : idx.equal_range (pToMatch);
-		for (idx_type::const_iterator triple = range.first; triple != range.second; ++triple) {
+    bool BasicGraphPattern::pipelineMatches (ResultSet* rs, const POS* graphVar, const BasicGraphPattern* toMatch, const POS* graphName,
+					     Result* row, RowSink* sink) const {
+	if (toMatch->allOpts) {
+	    /* Unmatched optional triples keep the row; do it the materializing way. */
+	    ResultSet island(rs->getPOSFactory(), rs->debugStream);
+	    island.partOf(*rs);
+	    island.reseed(row);
+	    bindVariables(&island, graphVar, toMatch, graphName);
+	    return island.pushRows(sink);
+	}
+	const PushedFilters* filters = rs->filtersFor == toMatch ? rs->filters : NULL;
+	if (!_passesPushed(filters, NULL, row, rs->getPOSFactory()))
+	    return true;
+	std::vector<double> costs;
+	std::vector<const TriplePattern*> plan = _plan(toMatch, row, rs, costs);
+	_printPlan(toMatch, plan, costs, rs);
+	return _pipelineStep(plan, 0, rs, filters, graphVar, graphName, row, sink);
+    }
+
+    void BasicGraphPattern::_matchPlan (const std::vector<const TriplePattern*>& plan, ResultSet* rs, const PushedFilters* filters,
+					const POS* graphVar, const BasicGraphPattern* toMatch, const POS* graphName) const {
+	for (std::vector<const TriplePattern*>::const_iterator constraint = plan.begin();
+	     constraint != plan.end(); constraint++) {
+	    /* Substitute each row's bindings so that e.g. a join on ?x probes
+	     * (x, p, ?) rather than scanning every p and testing x.
+	     */
+	    bool rowDependent = _rowDependent(*constraint, *rs->options);
+	    Candidates candidates = _candidates(*constraint, *rs->options);
+	    for (ResultSetIterator row = rs->begin() ; row != rs->end(); ) {
+		bool rowMatched = false;
+		if (rowDependent)
+		    candidates = _candidates(*constraint, *rs->options, *row);
+		for (Candidates triple = candidates; !triple.done(); triple.next()) {
 		    Result* newRow = (*row)->duplicate(rs, row);
-		    /* @@@ move filter her */
-		    if ((*constraint)->bindVariables(triple->second, toMatch->allOpts, rs, graphVar, newRow, graphName)) {
+		    if (triple.bind(*constraint, toMatch->allOpts, rs, graphVar, newRow, graphName) &&
+			_passesPushed(filters, *row, newRow, rs->getPOSFactory())) {
 			rowMatched = true;
 			rs->insert(row, newRow);
 		    } else {
@@ -1257,9 +2909,86 @@ compared against
 		}
 	    }
 	}
+    }
+
+    void BasicGraphPattern::bindVariables (ResultSet* rs, const POS* graphVar, const BasicGraphPattern* toMatch, const POS* graphName) const {
+	if (rs->debugStream != NULL && *rs->debugStream != NULL)
+	    **rs->debugStream << "matching " << *toMatch;
+	/* Drop rows as soon as they fail a FILTER pushed down to this pattern. */
+	const PushedFilters* filters = NULL;
+	if (rs->filtersFor == toMatch && !toMatch->allOpts) {
+	    filters = rs->filters;
+	    rs->filtersFor = NULL;
+	    for (ResultSetIterator row = rs->begin() ; row != rs->end(); )
+		if (_passesPushed(filters, NULL, *row, rs->getPOSFactory()))
+		    ++row;
+		else {
+		    delete *row;
+		    row = rs->erase(row);
+		}
+	}
+	/* Rows can bind different variables (e.g. after an OPTIONAL) and
+	 * different predicates, so each row is planned; rows which share a
+	 * plan are matched together.
+	 */
+	std::vector<std::vector<const TriplePattern*> > plans;
+	std::vector<size_t> rowPlans;
+	std::map<std::vector<const POS*>, size_t> planned;
+	for (ResultSetIterator row = rs->begin() ; row != rs->end(); ++row) {
+	    std::vector<const POS*> key = _planKey(toMatch, *row, *rs->options);
+	    std::map<std::vector<const POS*>, size_t>::const_iterator known = planned.find(key);
+	    if (known != planned.end()) {
+		rowPlans.push_back(known->second);
+		continue;
+	    }
+	    std::vector<double> costs;
+	    std::vector<const TriplePattern*> plan = _plan(toMatch, *row, rs, costs);
+	    size_t i = std::find(plans.begin(), plans.end(), plan) - plans.begin();
+	    if (i == plans.size()) {
+		plans.push_back(plan);
+		_printPlan(toMatch, plan, costs, rs);
+	    }
+	    planned[key] = i;
+	    rowPlans.push_back(i);
+	}
+	if (plans.size() > 1) {
+	    std::vector<ResultSet*> groups;
+	    try {
+		for (size_t i = 0; i < plans.size(); ++i) {
+		    groups.push_back(new ResultSet(rs->getPOSFactory(), rs->debugStream));
+		    groups[i]->partOf(*rs);
+		    delete *groups[i]->begin();
+		    groups[i]->erase(groups[i]->begin());
+		}
+		std::vector<size_t>::const_iterator rowPlan = rowPlans.begin();
+		for (ResultSetIterator row = rs->begin() ; row != rs->end(); ++rowPlan) {
+		    groups[*rowPlan]->insert(groups[*rowPlan]->end(), *row);
+		    row = rs->erase(row);
+		}
+		for (size_t i = 0; i < plans.size(); ++i) {
+		    _matchPlan(plans[i], groups[i], filters, graphVar, toMatch, graphName);
+		    for (ResultSetIterator row = groups[i]->begin() ; row != groups[i]->end(); ) {
+			rs->insert(rs->end(), *row);
+			row = groups[i]->erase(row);
+		    }
+		    const VariableList* vars = groups[i]->getKnownVars();
+		    for (VariableListConstIterator var = vars->begin(); var != vars->end(); ++var)
+			rs->addKnownVar(*var);
+		}
+	    } catch (...) {
+		for (std::vector<ResultSet*>::iterator it = groups.begin(); it != groups.end(); ++it)
+		    delete *it;
+		throw;
+	    }
+	    for (std::vector<ResultSet*>::iterator it = groups.begin(); it != groups.end(); ++it)
+		delete *it;
+	} else if (!plans.empty()) {
+	    _matchPlan(plans[0], rs, filters, graphVar, toMatch, graphName);
+	}
 	if (rs->debugStream != NULL && *rs->debugStream != NULL)
 	    **rs->debugStream << "produced\n" << *rs;
     }
+
     bool POS::bindVariable (const POS* constant, ResultSet* rs, Result* provisional, bool weaklyBound) const {
 	if (this == NULL || constant == NULL)
 	    return true;
@@ -1288,99 +3017,346 @@ compared against
 	}
     }
 
-    void GraphGraphPattern::deletePattern (RdfDB* target, const ResultSet* rs, BNodeEvaluator* evaluator, BasicGraphPattern* /* bgp */) const {
+    void GraphGraphPattern::deletePattern (const RdfDB* source, RdfDB* deletions, const ResultSet* rs, BNodeEvaluator* evaluator, const POS* /* graph */) const {
 	const URI* graphName = dynamic_cast<const URI*>(m_VarOrIRIref);
 	if (graphName != NULL) {
 	    /* GRAPH <x> { ?s ?p ?o } */
-	    BasicGraphPattern* bgp = target->assureGraph(graphName);
-	    m_TableOperation->deletePattern(target, rs, evaluator, bgp);
+	    m_TableOperation->deletePattern(source, deletions, rs, evaluator, graphName);
 	} else {
 	    /* GRAPH ?g { ?s ?p ?o } */
 	    for (ResultSetConstIterator result = rs->begin() ; result != rs->end(); result++) {
 		const POS* evaldGraphName = m_VarOrIRIref->evalPOS(*result, evaluator);
-		BasicGraphPattern* bgp = target->assureGraph(evaldGraphName);
-		m_TableOperation->deletePattern(target, rs, evaluator, bgp);
+		m_TableOperation->deletePattern(source, deletions, rs, evaluator, evaldGraphName);
 	    }
 	}
     }
 
-    void _constructQuery (const URI* service, const TableOperation* op, ResultSet* rs, POSFactory* posFactory, SWSAXparser* xmlParser, SWWEBagent* agent, std::ostream** debugStream) {
-	/* The VarLister is a serializer which also records all variables.
-	 */
-	struct VarLister : public SPARQLSerializer {
-	    std::set<const POS*> vars;
-	    POSList* l;
-	    VarLister () : l(new POSList()) {  }
-	    virtual void variable (const Variable* const self, std::string lexicalValue) {
-		if (vars.find(self) == vars.end()) {
-		    vars.insert(self);
-		    l->push_back(self);
-		}
-		SPARQLSerializer::variable(self, lexicalValue);
+    /* The VarLister is a serializer which also records all variables.
+     */
+    struct VarLister : public SPARQLSerializer {
+	std::set<const POS*> vars;
+	POSList* l;
+	VarLister () : l(new POSList()) {  }
+	virtual void variable (const Variable* const self, std::string lexicalValue) {
+	    if (vars.find(self) == vars.end()) {
+		vars.insert(self);
+		l->push_back(self);
 	    }
-	};
-
-	VarLister vars;
-	op->express(&vars);
+	    SPARQLSerializer::variable(self, lexicalValue);
+	}
+    };
 
+    /* The query for <op>, selecting <vars> and constrained by <bindings>
+     * (if any).
+     */
+    static std::string _serviceQuery (const TableOperation* op, POSList* vars, BindingClause* bindings) {
 	/* Copy graph pattern for inclusion in a new Select. */
 	SWObjectDuplicator dup(NULL); // doesn't need to create new atoms.
 	op->express(&dup);
-	const Operation* query = new Select(DIST_distinct, vars.l,
+	const Operation* query = new Select(DIST_distinct, vars,
 					    new ProductionVector<const DatasetClause*>(),
-					    new WhereClause(dup.last.tableOperation, NULL),
+					    new WhereClause(dup.last.tableOperation, bindings),
 					    new SolutionModifier(NULL, LIMIT_None, OFFSET_None));
-
-	/* Constrain query with any existing result bindings. */
-	const Operation* rsConstrained = rs->getConstrainedOperation(query);
-	SWWEBagent::Parameter p("query", SWWEBagent::urlEncode((rsConstrained ? rsConstrained : query)->toString()));
-	if (rsConstrained)
-	    delete rsConstrained;
+	std::string ret(query->toString());
 	delete query;
-	std::string q(SWWEBagent::getURL(service->getLexicalValue(), &p, 1));
+	return ret;
+    }
 
-	if (debugStream != NULL && *(debugStream) != NULL)
-	    **(debugStream) << "Querying <" << service->getLexicalValue() << "> for\n" << q;
+    struct ServiceGraphPattern::Join {
+	const URI* service;
+	ResultSet* rs;				// gets the joined rows
+	std::vector<std::string> queries;	// one per block of bindings
+	std::vector<std::string> urls;		// GETting each query
+	std::vector<ResultSet*> islands;	// the rows awaiting each query's answers
+	Join (const URI* service, ResultSet* rs) : service(service), rs(rs) {  }
+	~Join () {
+	    for (std::vector<ResultSet*>::iterator it = islands.begin(); it != islands.end(); ++it)
+		delete *it;
+	}
+    };
 
-	/* Do an HTTP GET and parse results into a ResultSet. */
-	std::string s(agent->get(q.c_str()));
-	IStreamContext istr(s, IStreamContext::STRING);
-	ResultSet red(posFactory, xmlParser, istr);
-	if (debugStream != NULL && *(debugStream) != NULL)
-	    **(debugStream) << " yielded\n" << red;
+    ServiceGraphPattern::Joins::~Joins () {
+	for (iterator it = begin(); it != end(); ++it)
+	    delete *it;
+    }
 
-	/* Join those results against our initial results. */
-	rs->joinIn(&red);
+    /* Move <rows> of <rs> into a Join against <service>. Rows are grouped
+     * by their values for <op>'s variables and each query carries
+     * the bindJoinBlock option's number of those distinct tuples in a
+     * BINDINGS clause.
+     */
+    static ServiceGraphPattern::Join* _planBindJoin (const URI* service, const TableOperation* op, ResultSet* rs, const std::vector<ResultSetIterator>& rows, 
+						     POSFactory* posFactory) {
+	if (rows.empty())
+	    return NULL;
+	typedef std::vector<const POS*> Tuple;
+	VarLister lister;
+	op->express(&lister);
+	Tuple bound;
+	for (std::vector<const POS*>::const_iterator var = lister.l->begin(); var != lister.l->end(); ++var)
+	    for (std::vector<ResultSetIterator>::const_iterator row = rows.begin(); row != rows.end(); ++row)
+		if ((**row)->get(*var) != NULL) {
+		    bound.push_back(*var);
+		    break;
+		}
+	delete lister.l;
+
+	/* Distinct tuples in the order they first appear, and the rows with each. */
+	std::map<Tuple, size_t> index;
+	std::vector<Tuple> tuples;
+	std::vector<std::vector<ResultSetIterator> > rowsWith;
+	bool constrains = !bound.empty();
+	for (std::vector<ResultSetIterator>::const_iterator row = rows.begin(); row != rows.end(); ++row) {
+	    Tuple tuple;
+	    bool any = false;
+	    for (Tuple::const_iterator var = bound.begin(); var != bound.end(); ++var) {
+		const POS* value = (**row)->get(*var);
+		any |= value != NULL;
+		tuple.push_back(value != NULL ? value : posFactory->getNULL());
+	    }
+	    constrains &= any; // a row binding none of them matches anything
+	    std::pair<std::map<Tuple, size_t>::iterator, bool> found = index.insert(std::make_pair(tuple, tuples.size()));
+	    if (found.second) {
+		tuples.push_back(tuple);
+		rowsWith.push_back(std::vector<ResultSetIterator>());
+	    }
+	    rowsWith[found.first->second].push_back(*row);
+	}
+	if (!constrains) {
+	    /* One unconstrained query answers every row. */
+	    tuples.resize(1);
+	    rowsWith.resize(1);
+	    rowsWith[0] = rows;
+	}
+
+	ServiceGraphPattern::Join* join = new ServiceGraphPattern::Join(service, rs);
+	size_t block = rs->options->bindJoinBlock == 0 ? tuples.size() : rs->options->bindJoinBlock;
+	for (size_t start = 0; start < tuples.size(); start += block) {
+	    size_t end = std::min(start + block, tuples.size());
+	    ResultSet* island = new ResultSet(posFactory, rs->debugStream);
+	    island->partOf(*rs);
+	    delete *island->begin();
+	    island->erase(island->begin());
+	    join->islands.push_back(island);
+	    BindingClause* bindings = NULL;
+	    if (constrains) {
+		POSList* vars = new POSList();
+		for (Tuple::const_iterator var = bound.begin(); var != bound.end(); ++var)
+		    vars->push_back(*var);
+		bindings = new BindingClause(vars);
+	    }
+	    for (size_t i = start; i < end; ++i) {
+		if (bindings != NULL) {
+		    Binding* binding = new Binding();
+		    for (Tuple::const_iterator value = tuples[i].begin(); value != tuples[i].end(); ++value)
+			binding->push_back(*value);
+		    bindings->push_back(binding);
+		}
+		for (std::vector<ResultSetIterator>::const_iterator row = rowsWith[i].begin(); row != rowsWith[i].end(); ++row) {
+		    for (BindingSetConstIterator b = (**row)->begin(); b != (**row)->end(); ++b)
+			island->addKnownVar(b->first);
+		    island->insert(island->end(), **row);
+		    rs->erase(*row);
+		}
+	    }
+
+	    VarLister select;
+	    op->express(&select);
+	    join->queries.push_back(_serviceQuery(op, select.l, bindings));
+	    SWWEBagent::Parameter p("query", SWWEBagent::urlEncode(join->queries.back()));
+	    join->urls.push_back(SWWEBagent::getURL(service->getLexicalValue(), &p, 1));
+	}
+	return join;
     }
-    void ServiceGraphPattern::bindVariables (RdfDB* db, ResultSet* rs) const {
+
+    void ServiceGraphPattern::planJoins (RdfDB* /* db */, ResultSet* rs, Joins* joins) const {
 	const URI* graph = dynamic_cast<const URI*>(m_VarOrIRIref);
-	if (graph != NULL)
-	    _constructQuery(graph, m_TableOperation, rs, posFactory, db->xmlParser, db->webAgent, db->debugStream);
-	else {
+	if (graph != NULL) {
+	    std::vector<ResultSetIterator> rows;
+	    for (ResultSetIterator row = rs->begin(); row != rs->end(); ++row)
+		rows.push_back(row);
+	    Join* join = _planBindJoin(graph, m_TableOperation, rs, rows, posFactory);
+	    if (join != NULL)
+		joins->push_back(join);
+	} else {
 	    const Variable* graphVar = dynamic_cast<const Variable*>(m_VarOrIRIref);
 	    if (graphVar != NULL) {
+		/* Group the rows by service, in the order the services appear. */
+		std::vector<const URI*> services;
+		std::map<const URI*, std::vector<ResultSetIterator> > rowsFor;
 		for (ResultSetIterator outerRow = rs->begin() ; outerRow != rs->end(); ) {
-		    BindingSetConstIterator binding;
-		    const URI* graph;
-		    if ((binding = (*outerRow)->find(graphVar)) != (*outerRow)->end()
-			&& (graph = dynamic_cast<const URI*>(m_VarOrIRIref)) != NULL) {
-			ResultSet* single = (*outerRow)->makeResultSet(posFactory);
-			_constructQuery(graph, m_TableOperation, single, posFactory, db->xmlParser, db->webAgent, db->debugStream);
-			for (ResultSetIterator innerRow = single->begin() ; innerRow != single->end(); ) {
-			    rs->insert(outerRow, *innerRow);
-			    single->erase(innerRow);
-			}
+		    const URI* service = dynamic_cast<const URI*>((*outerRow)->get(graphVar));
+		    if (service != NULL) {
+			std::vector<ResultSetIterator>& rows = rowsFor[service];
+			if (rows.empty())
+			    services.push_back(service);
+			rows.push_back(outerRow++);
 		    } else {
 			// treat like a TypeError; no result
+			delete *outerRow;
+			outerRow = rs->erase(outerRow);
 		    }
-		    delete *outerRow;
-		    outerRow = rs->erase(outerRow);
 		}
+		for (std::vector<const URI*>::const_iterator service = services.begin(); service != services.end(); ++service)
+		    joins->push_back(_planBindJoin(*service, m_TableOperation, rs, rowsFor[*service], posFactory));
 	    } else
 		throw std::string("Service name must be an IRI; attempted to call SERVICE ").append(m_VarOrIRIref->toString());
 	}
     }
 
+    /* Join the rows of <island> with the answer in <istr>, appending
+     * the products to <join>'s ResultSet.
+     */
+    static void _joinAnswer (RdfDB* db, ServiceGraphPattern::Join* join, ResultSet* island, IStreamContext& istr) {
+	size_t was = join->rs->size();
+	island->joinStream(db->xmlParser, istr, join->rs);
+	if (db->debugStream != NULL && *(db->debugStream) != NULL)
+	    **(db->debugStream) << " yielded " << join->rs->size() - was << " rows\n";
+    }
+
+    /* Boost.Iostreams source reading <in> and keeping a copy of what it read. */
+    class CopyingSource {
+	std::istream* in;
+	std::string* copy;
+    public:
+	typedef char char_type;
+	typedef boost::iostreams::source_tag category;
+	CopyingSource (std::istream* in, std::string* copy) : in(in), copy(copy) {  }
+	std::streamsize read (char* s, std::streamsize n) {
+	    in->read(s, n);
+	    std::streamsize red = in->gcount();
+	    copy->append(s, red);
+	    return red > 0 ? red : -1;
+	}
+    };
+
+    /* Joins the answers to runJoins' requests, which are the joins'
+     * islands in order, deleting each Join once its islands are done. The
+     * cached answers are joined between the fetched ones handed over by
+     * streamAll, and the fetched ones are copied for the cache as they
+     * are parsed.
+     */
+    struct JoinAnswers : public SWWEBagent::AnswerHandler {
+	RdfDB* db;
+	ServiceGraphPattern::Joins& joins;
+	const std::vector<SWWEBagent::Request>& requests;
+	const std::vector<size_t>& remote;	// the requests streamAll fetches
+	ServiceCache* cache;
+	size_t next;	// the request whose answer is joined next
+	size_t join;	// ... its Join
+	size_t island;	// ... and island
+	std::string error;
+
+	JoinAnswers (RdfDB* db, ServiceGraphPattern::Joins& joins, const std::vector<SWWEBagent::Request>& requests,
+		     const std::vector<size_t>& remote, ServiceCache* cache)
+	    : db(db), joins(joins), requests(requests), remote(remote), cache(cache), next(0), join(0), island(0) {  }
+
+	/* Join the cached answers before request <to>. */
+	void joinCached (size_t to) {
+	    while (next < to) {
+		if (error.empty()) {
+		    IStreamContext istr(requests[next].body, IStreamContext::STRING);
+		    _join(istr);
+		}
+		_done();
+	    }
+	}
+
+	virtual void answer (size_t i, std::istream& body) {
+	    joinCached(remote[i]);
+	    if (error.empty()) {
+		ServiceGraphPattern::Join* j = joins[join];
+		if (cache == NULL) {
+		    IStreamContext istr(requests[next].url, body);
+		    _join(istr);
+		} else {
+		    std::string copy;
+		    boost::iostreams::stream<CopyingSource> copying(CopyingSource(&body, &copy));
+		    IStreamContext istr(requests[next].url, copying);
+		    if (_join(istr)) {
+			char rest[4096];
+			while (copying.read(rest, sizeof(rest)) || copying.gcount() > 0)
+			    ;
+			cache->put(j->service->getLexicalValue(), j->queries[island], copy);
+		    }
+		}
+	    }
+	    _done();
+	}
+
+	virtual void failed (size_t i, std::string e) {
+	    joinCached(remote[i]);
+	    if (error.empty())
+		error = e;
+	    _done();
+	}
+
+    protected:
+	bool _join (IStreamContext& istr) {
+	    try {
+		_joinAnswer(db, joins[join], joins[join]->islands[island], istr);
+		return true;
+	    } catch (std::string& e) {
+		error = e;
+	    } catch (std::exception& e) {
+		error = e.what();
+	    }
+	    return false;
+	}
+
+	void _done () {
+	    ++next;
+	    if (++island == joins[join]->islands.size()) {
+		delete joins[join];
+		joins[join] = NULL; // in case a later join throws
+		++join;
+		island = 0;
+	    }
+	}
+    };
+
+    void ServiceGraphPattern::runJoins (RdfDB* db, Joins& joins) {
+	std::ostream** debugStream = db->debugStream;
+	std::vector<SWWEBagent::Request> requests;
+	std::vector<size_t> remote; // requests not answered by the cache
+	/* The joins are all for the one query. */
+	ServiceCache* cache = joins.empty() ? NULL : joins[0]->rs->options->serviceCache;
+	for (std::vector<Join*>::const_iterator join = joins.begin(); join != joins.end(); ++join)
+	    for (size_t i = 0; i < (*join)->urls.size(); ++i) {
+		requests.push_back(SWWEBagent::Request((*join)->urls[i]));
+		bool cached = cache != NULL && 
+		    cache->get((*join)->service->getLexicalValue(), (*join)->queries[i], &requests.back().body);
+		if (!cached)
+		    remote.push_back(requests.size() - 1);
+		if (debugStream != NULL && *(debugStream) != NULL)
+		    **(debugStream) << (cached ? "Cached answer from <" : "Querying <") << (*join)->service->getLexicalValue()
+				    << "> for " << (*join)->islands[i]->size() << " rows with\n" << (*join)->urls[i];
+	    }
+
+	/* The queries are sent together and each answer is parsed as it is
+	 * read, so its rows are joined while later answers arrive.
+	 */
+	JoinAnswers answers(db, joins, requests, remote, cache);
+	if (!remote.empty()) {
+	    std::vector<SWWEBagent::Request> fetch;
+	    for (std::vector<size_t>::const_iterator i = remote.begin(); i != remote.end(); ++i)
+		fetch.push_back(requests[*i]);
+	    db->webAgent->streamAll(fetch, &answers);
+	}
+	answers.joinCached(requests.size());
+	for (Joins::iterator join = joins.begin(); join != joins.end(); ++join)
+	    delete *join; // NULL unless it had no islands
+	joins.clear();
+	if (!answers.error.empty())
+	    throw answers.error;
+    }
+
+    void ServiceGraphPattern::bindVariables (RdfDB* db, ResultSet* rs) const {
+	Joins joins;
+	planJoins(db, rs, &joins);
+	runJoins(db, joins);
+    }
+
     void ServiceGraphPattern::construct (RdfDB* /* target */, const ResultSet* /* rs */, BNodeEvaluator* /* evaluator */, BasicGraphPattern* /* bgp */) const {
 	throw std::string("@@ServiceGraphPattern::construct not yet written");
 	// const URI* serviceName = dynamic_cast<const URI*>(m_VarOrIRIref);
@@ -1398,7 +3374,7 @@ compared against
 	// }
     }
 
-    void ServiceGraphPattern::deletePattern (RdfDB* /* target */, const ResultSet* /* rs */, BNodeEvaluator* /* evaluator */, BasicGraphPattern* /* bgp */) const {
+    void ServiceGraphPattern::deletePattern (const RdfDB* /* source */, RdfDB* /* deletions */, const ResultSet* /* rs */, BNodeEvaluator* /* evaluator */, const POS* /* graph */) const {
 	throw std::string("@@ServiceGraphPattern::delete not yet written");
 	// const URI* serviceName = dynamic_cast<const URI*>(m_VarOrIRIref);
 	// if (serviceName != NULL) {
@@ -1417,12 +3393,20 @@ compared against
 
     void OptionalGraphPattern::bindVariables (RdfDB* db, ResultSet* rs) const {
 	ResultSet optRS(*rs); // no POSFactory
+	optRS.partOf(*rs);
 	m_TableOperation->bindVariables(db, &optRS);
 	rs->joinIn(&optRS, &m_Expressions, ResultSet::OP_outer);
     }
 
+    bool OptionalGraphPattern::pipeline (RdfDB* db, ResultSet* rs, Result* row, RowSink* sink) const {
+	if (!m_TableOperation->independent())
+	    return TableOperation::pipeline(db, rs, row, sink);
+	return _joinTable(db, rs, m_TableOperation)->join(rs, row, &m_Expressions, ResultSet::OP_outer, sink);
+    }
+
     void MinusGraphPattern::bindVariables (RdfDB* db, ResultSet* rs) const {
 	ResultSet optRS(*rs); // no POSFactory
+	optRS.partOf(*rs);
 	m_TableOperation->bindVariables(db, &optRS);
 	rs->joinIn(&optRS, NULL, ResultSet::OP_minus);
     }
@@ -1440,25 +3424,49 @@ compared against
 	construct(bgp, rs, evaluator);
     }
 
-    void BasicGraphPattern::deletePattern (RdfDB* target, const ResultSet* rs, BNodeEvaluator* /* evaluator */, BasicGraphPattern* bgp) const {
-	if (bgp == NULL)
-	    bgp = target->assureGraph(NULL);
+    void BasicGraphPattern::deletePattern (const RdfDB* source, RdfDB* deletions, const ResultSet* rs, BNodeEvaluator* /* evaluator */, const POS* graph) const {
+	const BasicGraphPattern* from = source->findGraph(graph, rs);
+	if (from == NULL)
+	    return;
+	BasicGraphPattern* doomed = deletions->assureGraph(graph);
 	for (std::vector<const TriplePattern*>::const_iterator constraint = m_TriplePatterns.begin();
 	     constraint != m_TriplePatterns.end(); constraint++) {
 	    for (ResultSetConstIterator row = rs->begin() ; row != rs->end(); ++row) {
-		for (std::vector<const TriplePattern*>::iterator triple = bgp->m_TriplePatterns.begin();
-		     triple != bgp->m_TriplePatterns.end(); ) {
+		/* Probe with the row's bindings rather than testing every triple. */
+		for (Candidates triple = from->_candidates(*constraint, *rs->options, *row); !triple.done(); triple.next()) {
 		    ResultSet* island = (*row)->makeResultSet(rs->getPOSFactory());
-		    if ((*constraint)->bindVariables(*triple, false, island, NULL, *island->begin(), NULL))
-			triple = bgp->m_TriplePatterns.erase(triple);
-		    else
-			triple++;
+		    if (triple.bind(*constraint, false, island, NULL, *island->begin(), NULL))
+			doomed->addTriplePattern(triple.triple());
 		    delete island;
 		}
 	    }
 	}
     }
 
+    void BasicGraphPattern::eraseTriples (const BasicGraphPattern& doomed) {
+	if (encoded != NULL) {
+	    EncodedTriples::Permutation gone;
+	    EncodedTriples::Entry entry;
+	    for (std::vector<const TriplePattern*>::const_iterator it = doomed.begin(); it != doomed.end(); ++it)
+		if (encoded->find(*it, &entry))
+		    gone.push_back(entry);
+	    std::sort(gone.begin(), gone.end());
+	    gone.erase(std::unique(gone.begin(), gone.end()), gone.end());
+	    ++generation;
+	    m_TriplePatterns.clear();
+	    encoded->erase(gone);
+	    return;
+	}
+	std::vector<const TriplePattern*>::iterator kept = m_TriplePatterns.begin();
+	for (std::vector<const TriplePattern*>::iterator it = m_TriplePatterns.begin();
+	     it != m_TriplePatterns.end(); ++it)
+	    if (doomed.members.find(*it) != doomed.members.end())
+		_unindex(*it);
+	    else
+		*kept++ = *it;
+	m_TriplePatterns.erase(kept, m_TriplePatterns.end());
+    }
+
     bool TriplePattern::construct (BasicGraphPattern* target, const Result* r, POSFactory* posFactory, BNodeEvaluator* evaluator) const {
 	bool ret = false;
 	const POS *s, *p, *o;
@@ -1525,8 +3533,8 @@ compared against
 	    express(&s);
 	    ret << s.str();
 	} else {
-	    for (std::vector<const TriplePattern*>::const_iterator triple = m_TriplePatterns.begin();
-		 triple != m_TriplePatterns.end(); triple++)
+	    for (std::vector<const TriplePattern*>::const_iterator triple = begin();
+		 triple != end(); triple++)
 		ret << (*triple)->toString(mediaType, namespaces);
 	}
 	return ret.str();
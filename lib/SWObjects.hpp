@@ -98,6 +98,13 @@
 #endif /* (!defined(_MSC_VER) || _MSC_VER >= 1500) */
 
 #include <boost/iostreams/categories.hpp>  // source_tag
+#include <boost/unordered_set.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
 
 namespace w3c_sw {
 
@@ -302,6 +309,7 @@ public:
     typename std::vector<T>::iterator end () { return data.end(); }
     typename std::vector<T>::const_iterator end () const { return data.end(); }
     typename std::vector<T>::iterator erase (typename std::vector<T>::iterator it) { return data.erase(it); }
+    typename std::vector<T>::iterator erase (typename std::vector<T>::iterator first, typename std::vector<T>::iterator last) { return data.erase(first, last); }
     void sort (bool (*comp)(T, T)) {
 	std::list<T> l;
 	for (typename std::vector<T>::iterator it = begin(); it != end(); ++it)
@@ -382,13 +390,51 @@ public:
     std::string getLexicalValue () const { return terminal; }
 };
 
-} // namespace w3c_sw
+class Arena;
 
-namespace w3c_sw {
+/* ArenaAllocated - new (arena) T(...) places a T in <arena>, or on the
+ * heap if <arena> is NULL. POSFactory places its terms and triples so.
+ */
+class ArenaAllocated {
+public:
+    static void* operator new (size_t size) { return ::operator new(size); }
+    static void* operator new(size_t size, Arena* arena);
+    static void operator delete (void* ptr) { ::operator delete(ptr); }
+    static void operator delete(void* ptr, Arena* arena);
+};
 
 class ResultSet;
+class DistinctFilter;
 class Result;
 class RdfDB;
+class ServiceCache;
+
+/* QueryOptions - how a query is evaluated. Every strategy is on by
+ * default; turning one off falls back to the simpler way, which gives
+ * the same answers. A ResultSet carries the options of the query filling
+ * it and passes them to the ResultSets it's partOf().
+ */
+struct QueryOptions {
+    bool permutationIndexes;	// false: predicate-only lookups, as before SPO/OSP.
+    bool boundValueLookups;	// false: pick indexes from the pattern's constants alone.
+    bool patternOrdering;	// false: match triple patterns in query order.
+    bool filterPushdown;	// false: apply a FILTER once its whole pattern is matched.
+    bool pipelining;		// false: materialize every solution, even for LIMIT and ASK.
+    bool hashJoin;		// false: compare every pair of rows.
+    bool hashDistinct;		// false: compare each row with every earlier row.
+    bool columnBatches;		// false: evaluate FILTERs which weren't pushed down a row at a time.
+    bool sortKeys;		// false: evaluate the order expressions in every comparison.
+    size_t orderMemoryBudget;	// bytes of rows sorted in memory before runs spill to temp files; 0: no limit.
+    bool quadIndex;		// false: match GRAPH ?g in each graph separately.
+    size_t bindJoinBlock;	// distinct bindings sent per remote query; 0: all of them.
+    ServiceCache* serviceCache;	// remote answers kept for repeated queries; NULL: none.
+
+    QueryOptions ()
+	: permutationIndexes(true), boundValueLookups(true), patternOrdering(true), filterPushdown(true),
+	  pipelining(true), hashJoin(true), hashDistinct(true), columnBatches(true), sortKeys(true), orderMemoryBudget(0),
+	  quadIndex(true), bindJoinBlock(100), serviceCache(NULL) {  }
+    static const QueryOptions Defaults;
+};
 
     class LANGTAG : public Terminal { // @@@ should become an RDFLiteral.
 public:
@@ -409,14 +455,28 @@ class BNode;
 class BNodeEvaluator;
 class POSFactory;
 
+/* Dense numbers for terms; see TermTable. 0 is no term. */
+typedef boost::uint32_t TermID;
+
 /* START Parts Of Speach */
-class POS : public Terminal {
+class POS : public Terminal, public ArenaAllocated {
     friend struct POSsorter;
+    friend class POSFactory;
+public:
+    /* The value a numeric literal holds, so that columns of terms can be
+     * decoded without a cast or virtual call per term. Numerals whose
+     * lexical form cmp rejects are NUMERIC_none like other terms.
+     */
+    typedef enum { NUMERIC_none, NUMERIC_integer, NUMERIC_float, NUMERIC_double } e_Numeric;
+private:
+    TermID termID; // set by the POSFactory which made this.
+    unsigned char numeric; // e_Numeric, likewise.
 protected:
-    POS (std::string matched) : Terminal(matched) {  }
-    POS (std::string matched, bool gensym) : Terminal(matched, gensym) { }
+    POS (std::string matched) : Terminal(matched), termID(0), numeric(NUMERIC_none) {  }
+    POS (std::string matched, bool gensym) : Terminal(matched, gensym), termID(0), numeric(NUMERIC_none) { }
     //    virtual int compareType (POS* to) = 0;
 public:
+    e_Numeric getNumeric () const { return (e_Numeric)numeric; }
     virtual bool isConstant () const { return true; } // Override for variable types.
     static bool orderByType (const POS*, const POS*) { throw(std::runtime_error(FUNCTION_STRING)); }
     virtual int compare (POS* to, Result*) const {
@@ -694,7 +754,7 @@ public:
 class BasicGraphPattern;
 class NamespaceMap;
 
-class TriplePattern : public Base {
+class TriplePattern : public Base, public ArenaAllocated {
     friend class POSFactory;
 private:
     const POS* m_s; const POS* m_p; const POS* m_o;
@@ -728,19 +788,84 @@ public:
 	return s.str();
     }
     virtual void express(Expressor* p_expressor) const;
-    bool bindVariables (const TriplePattern* tp, bool, ResultSet* rs, const POS* graphVar, Result* provisional, const POS* graphName) const {
+    bool bindVariables (const TriplePattern* tp, bool allOpts, ResultSet* rs, const POS* graphVar, Result* provisional, const POS* graphName) const {
+	return bindVariables(tp->m_s, tp->m_p, tp->m_o, allOpts, rs, graphVar, provisional, graphName);
+    }
+    /* Bind to the triple <s> <p> <o>, e.g. one decoded from TermIDs. */
+    bool bindVariables (const POS* s, const POS* p, const POS* o, bool, ResultSet* rs, const POS* graphVar, Result* provisional, const POS* graphName) const {
 	return
 	    (graphVar == NULL || graphVar->bindVariable(graphName, rs, provisional, weaklyBound)) &&
-	    m_p->bindVariable(tp->m_p, rs, provisional, weaklyBound) && 
-	    m_s->bindVariable(tp->m_s, rs, provisional, weaklyBound) && 
-	    m_o->bindVariable(tp->m_o, rs, provisional, weaklyBound);
+	    m_p->bindVariable(p, rs, provisional, weaklyBound) && 
+	    m_s->bindVariable(s, rs, provisional, weaklyBound) && 
+	    m_o->bindVariable(o, rs, provisional, weaklyBound);
     }
     bool construct(BasicGraphPattern* target, const Result* r, POSFactory* posFactory, BNodeEvaluator* evaluator) const;
 };
 
+/* Arena - bump-pointer allocation out of large slabs which are all
+ * released together. Objects placed in an Arena must be destroyed
+ * explicitly (p->~T()) but not deleted. Only a concurrent Arena locks.
+ */
+class Arena {
+    enum { Align = 16 };
+    std::vector<char*> slabs;
+    char* next;
+    size_t left;
+    size_t slabSize;
+    size_t used;
+    bool concurrent;
+    boost::mutex mutex;
+    void* _bump (size_t size) {
+	size = (size + Align - 1) & ~(size_t)(Align - 1);
+	if (size > left) {
+	    size_t length = size > slabSize ? size : slabSize;
+	    next = new char[length];
+	    slabs.push_back(next);
+	    left = length;
+	}
+	void* ret = next;
+	next += size;
+	left -= size;
+	used += size;
+	return ret;
+    }
+public:
+    Arena (bool concurrent = false, size_t slabSize = 1 << 20)
+	: next(NULL), left(0), slabSize(slabSize), used(0), concurrent(concurrent) {  }
+    ~Arena () {
+	for (std::vector<char*>::iterator it = slabs.begin(); it != slabs.end(); ++it)
+	    delete [] *it;
+    }
+    void* allocate (size_t size) {
+	if (!concurrent)
+	    return _bump(size);
+	boost::mutex::scoped_lock lock(mutex);
+	return _bump(size);
+    }
+    size_t bytesUsed () const { return used; }
+    size_t slabCount () const { return slabs.size(); }
+};
+
+/* TermTable - numbers terms densely so a graph can store TermIDs in
+ * place of POS pointers (see BasicGraphPattern::encode). A POSFactory
+ * numbers every term it makes.
+ */
+class TermTable {
+public:
+    virtual ~TermTable () {  }
+    /* <pos>'s ID, or 0 if this table hasn't numbered it. */
+    virtual TermID termID(const POS* pos) const = 0;
+    /* <pos>'s ID, numbering it if this table can. */
+    virtual TermID intern(const POS* pos) = 0;
+    /* The term numbered <id>; a table may make it on first use. */
+    virtual const POS* term(TermID id) const = 0;
+    /* Where triples of decoded terms are interned. */
+    virtual POSFactory* getPOSFactory() const = 0;
+};
+
 class DefaultGraphPattern;
 class Expression;
-class POSFactory {
+class POSFactory : public TermTable {
 public:
 //     typedef std::map<const BNode*, std::string> BNode2string;
 //     typedef std::map<std::string, const BNode*> String2BNode;
@@ -749,19 +874,71 @@ protected:
     typedef std::map<std::string, const Variable*> VariableMap;
     typedef std::map<std::string, const URI*> URIMap;
     typedef std::map<std::string, const RDFLiteral*> RDFLiteralMap;
-    typedef std::map<std::string, const TriplePattern*> TriplePatternMap; // I don't know what the key should be. string for now...
+    /* Open-addressed (linear probing) table of TriplePatterns keyed on
+     * (s, p, o, weaklyBound). NULL marks an empty slot; size is a power of 2.
+     */
+    typedef std::vector<TriplePattern*> TriplePatternTable;
     class MakeNumericRDFLiteral {
+    protected:
+	Arena* arena;
     public:
+	MakeNumericRDFLiteral (Arena* arena) : arena(arena) {  }
 	virtual ~MakeNumericRDFLiteral () {  }
-	virtual const NumericRDFLiteral* makeIt(std::string p_String, const URI* p_URI) = 0;
+	virtual NumericRDFLiteral* makeIt(std::string p_String, const URI* p_URI) = 0;
     };
 
+    /* Each table is split into Stripes sub-tables chosen by key hash.
+     * In concurrent mode each stripe is guarded by its own mutex so
+     * threads interning different terms rarely contend.
+     */
+    enum { Stripes = 16 };
+    class StripeLock {
+	boost::mutex* mutex;
+    public:
+	StripeLock (bool concurrent, boost::mutex& m) : mutex(concurrent ? &m : NULL) {
+	    if (mutex != NULL)
+		mutex->lock();
+	}
+	~StripeLock () {
+	    if (mutex != NULL)
+		mutex->unlock();
+	}
+    };
+    static size_t _stripe (const std::string& key) { return boost::hash<std::string>()(key) % Stripes; }
+    static size_t _stripe (const void* key) { return boost::hash<const void*>()(key) % Stripes; }
+
 protected:
-    VariableMap		variables;
-    BNodeSet		bnodes;
-    URIMap		uris;
-    RDFLiteralMap	rdfLiterals;
-    TriplePatternMap	triples;
+    Arena*		arena; // NULL unless constructed with arenaAllocation
+    bool		concurrent;
+    /* Terms by TermID, TermChunk to a chunk. A full chunk list is replaced
+     * by one twice its size, the old one kept until the factory goes, so
+     * term() reads without locking.
+     */
+    enum { TermChunk = 1 << 12 };
+    typedef std::vector<const POS**> TermChunks;
+    boost::atomic<TermChunks*> termChunks;
+    std::vector<TermChunks*> retiredTermChunks;
+    TermID		termCount;
+    boost::mutex	termLock;
+    void _number(POS* pos);
+    VariableMap		variables[Stripes];
+    BNodeSet		bnodes[Stripes];
+    URIMap		uris[Stripes];
+    RDFLiteralMap	rdfLiterals[Stripes];
+    TriplePatternTable	triples[Stripes];
+    size_t		tripleCount[Stripes];
+    boost::mutex	variableLocks[Stripes], bnodeLocks[Stripes], uriLocks[Stripes], 
+			rdfLiteralLocks[Stripes], tripleLocks[Stripes];
+    template <class T> void _release (const T* t) {
+	if (arena == NULL)
+	    delete t;
+	else
+	    t->~T();
+    }
+    static size_t _hashTriple(const POS* s, const POS* p, const POS* o, bool weaklyBound);
+    void _growTriples(size_t stripe);
+    unsigned long	serial; // unique for the life of the process.
+    static unsigned long _nextSerial();
     NULLpos		nullPOS;
     const BooleanRDFLiteral* litFalse;
     const BooleanRDFLiteral* litTrue;
@@ -804,10 +981,19 @@ protected:
 
 public:
     std::ostream** debugStream;
-    POSFactory () :
+    unsigned long getSerial () const { return serial; }
+    const Arena* getArena () const { return arena; } // NULL unless arenaAllocation
+    /* arenaAllocation: place all terms and triples in an Arena which is
+     * released in one go when the factory is destroyed.
+     * concurrent: allow get* and createBNode from several threads at once.
+     */
+    explicit POSFactory (bool arenaAllocation = false, bool concurrent = false) :
+	arena(arenaAllocation ? new Arena(concurrent) : NULL), concurrent(concurrent), 
+	termChunks(NULL), termCount(0), tripleCount(), 
 	litFalse(getBooleanRDFLiteral("false", false)), 
 	litTrue(getBooleanRDFLiteral("true", true)) {
 
+	serial = _nextSerial();
 	typeOrder[typeid(BNode).name()] = DT_BNode;
 	typeOrder[typeid(URI).name()] = DT_URI;
 	typeOrder[typeid(RDFLiteral).name()] = DT_Literal;
@@ -875,6 +1061,11 @@ public:
 #endif /* REGEX_LIB == SWOb_BOOST */
     }
     ~POSFactory();
+    /* TermTable interface; intern() only knows this factory's terms. */
+    virtual TermID termID(const POS* pos) const;
+    virtual TermID intern(const POS* pos);
+    virtual const POS* term(TermID id) const;
+    virtual POSFactory* getPOSFactory () const { return const_cast<POSFactory*>(this); }
     const Variable* getVariable(std::string name);
     const BNode* createBNode();
     const BNode* getBNode(std::string name, POS::String2BNode& nodeMap);
@@ -1258,6 +1449,8 @@ public:
     ~Expression () {  }
     virtual void express(Expressor* p_expressor) const = 0;
     virtual const POS* eval(const Result* r, POSFactory* posFactory, BNodeEvaluator* evaluator) const = 0;
+    /* Whether eval gives the same value for every row. */
+    virtual bool isConstant () const { return false; }
     virtual bool operator==(const Expression&) const = 0;
 };
 typedef ProductionVector<const Expression*> ExprSet;
@@ -1300,14 +1493,44 @@ t*Conjunction t*Disjunction   namedGraphPattern  defaultGraphPattern  graphGraph
 
 */
 
+/* RowSink - receives the solutions of TableOperation::pipeline one at a
+ * time. The rows belong to the producer; push returns false to stop it.
+ */
+class RowSink {
+public:
+    virtual ~RowSink () {  }
+    virtual bool push(Result* row) = 0;
+};
+class JoinTable;
+
+/* PushedFilter - a FILTER conjunct which Filter hands to a pattern to
+ * check as soon as a row binds all of <vars>.
+ */
+struct PushedFilter {
+    const Expression* expression;
+    std::set<const POS*> vars;
+};
+typedef std::vector<PushedFilter> PushedFilters;
+
 class TableOperation : public Base {
 protected:
     TableOperation () : Base() {  }
     TableOperation(const TableOperation& ref);
 public:
     virtual void bindVariables(RdfDB*, ResultSet*) const = 0; //{ throw(std::runtime_error(FUNCTION_STRING)); }
+    /* Push the solutions bindVariables would produce for a ResultSet
+     * holding only <row> to <sink>, returning false if <sink> stopped.
+     * This default materializes them; operations which return true from
+     * pipelines() produce them one at a time.
+     */
+    virtual bool pipeline(RdfDB* db, ResultSet* rs, Result* row, RowSink* sink) const;
+    virtual bool pipelines () const { return false; }
+    /* Whether bindVariables evaluates this on its own and joins the result
+     * with the rows it's given, so a pipeline can do that just once.
+     */
+    virtual bool independent () const { return false; }
     virtual void construct(RdfDB* target, const ResultSet* rs, BNodeEvaluator* evaluator, BasicGraphPattern* bgp) const = 0;
-    virtual void deletePattern(RdfDB* target, const ResultSet* rs, BNodeEvaluator* evaluator, BasicGraphPattern* bgp) const = 0;
+    virtual void deletePattern(const RdfDB* source, RdfDB* deletions, const ResultSet* rs, BNodeEvaluator* evaluator, const POS* graph) const = 0;
     virtual void express(Expressor* p_expressor) const = 0;
     virtual TableOperation* getDNF() const = 0;
     virtual bool operator==(const TableOperation& ref) const = 0;
@@ -1358,8 +1581,11 @@ public:
 	return pref == NULL ? false : TableJunction::operator==(*pref);
     }
     virtual void bindVariables(RdfDB*, ResultSet* rs) const;
+    virtual bool pipeline(RdfDB* db, ResultSet* rs, Result* row, RowSink* sink) const;
+    virtual bool pipelines() const;
+    virtual bool independent () const { return true; }
     virtual void construct(RdfDB* target, const ResultSet* rs, BNodeEvaluator* evaluator, BasicGraphPattern* bgp) const;
-    virtual void deletePattern(RdfDB* target, const ResultSet* rs, BNodeEvaluator* evaluator, BasicGraphPattern* bgp) const;
+    virtual void deletePattern(const RdfDB* source, RdfDB* deletions, const ResultSet* rs, BNodeEvaluator* evaluator, const POS* graph) const;
     virtual TableOperation* getDNF() const;
 };
 class TableDisjunction : public TableJunction { // ⊎
@@ -1371,36 +1597,281 @@ public:
 	return pref == NULL ? false : TableJunction::operator==(*pref);
     }
     virtual void bindVariables(RdfDB*, ResultSet* rs) const;
+    virtual bool independent () const { return true; }
     virtual void construct (RdfDB* /* target */, const ResultSet* /* rs */, BNodeEvaluator* /* evaluator */, BasicGraphPattern* /* bgp */) const {
 	throw NotImplemented("CONSTRUCT{{?s?p?o}UNION{?s?p?o}}");
     }
-    virtual void deletePattern (RdfDB* /* target */, const ResultSet* /* rs */, BNodeEvaluator* /* evaluator */, BasicGraphPattern* /* bgp */) const {
+    virtual void deletePattern (const RdfDB* /* source */, RdfDB* /* deletions */, const ResultSet* /* rs */, BNodeEvaluator* /* evaluator */, const POS* /* graph */) const {
 	throw NotImplemented("DELETEPATTERN{{?s?p?o}UNION{?s?p?o}}");
     }
     virtual TableOperation* getDNF() const;
 };
+/* GraphStatistics - cardinalities of a BasicGraphPattern, kept current by
+ * its _index and _unindex, or recounted by its EncodedTriples.
+ */
+class GraphStatistics {
+    friend class BasicGraphPattern;
+    friend class EncodedTriples;
+public:
+    struct PredicateStats {
+	size_t triples, subjects, objects; // subjects and objects are distinct counts.
+	PredicateStats () : triples(0), subjects(0), objects(0) {  }
+    };
+    typedef std::map<const POS*, PredicateStats> PredicateMap;
+    /* A characteristic set is the set of predicates on some subject,
+     * sorted by address. Its stats count those subjects and their triples.
+     */
+    typedef std::vector<const POS*> CharacteristicSet;
+    struct CharacteristicSetStats {
+	size_t subjects, triples;
+	CharacteristicSetStats () : subjects(0), triples(0) {  }
+    };
+    typedef std::map<CharacteristicSet, CharacteristicSetStats> CharacteristicSetMap;
+
+protected:
+    struct SubjectEntry {
+	CharacteristicSetMap::iterator set;
+	size_t triples;
+    };
+    typedef boost::unordered_map<const POS*, SubjectEntry> SubjectMap;
+
+    size_t triples, objects;
+    PredicateMap predicates;
+    CharacteristicSetMap characteristicSets;
+    SubjectMap subjects;
+    size_t countedSubjects; // from a recount, which keeps no SubjectMap.
+
+    CharacteristicSetMap::iterator _join(const CharacteristicSet& set, size_t triples);
+    void _leave(CharacteristicSetMap::iterator set, size_t triples);
+    void _add(const TriplePattern* t, bool newSP, bool newPO, bool newObject);
+    void _remove(const TriplePattern* t, bool lostSP, bool lostPO, bool lostObject);
+    void _clear();
+
+public:
+    GraphStatistics () : triples(0), objects(0), countedSubjects(0) {  }
+    GraphStatistics(const GraphStatistics& ref);
+    GraphStatistics& operator=(const GraphStatistics& ref);
+
+    size_t size () const { return triples; }
+    size_t subjectCount () const { return subjects.empty() ? countedSubjects : subjects.size(); }
+    size_t predicateCount () const { return predicates.size(); }
+    size_t objectCount () const { return objects; }
+    /* All zeros for a predicate not in the graph. */
+    const PredicateStats& getPredicate(const POS* predicate) const;
+    const PredicateMap& getPredicates () const { return predicates; }
+    const CharacteristicSetMap& getCharacteristicSets () const { return characteristicSets; }
+    std::string toString() const;
+};
+
+/* EncodedTriples - a graph's triples as TermIDs, packed in three sorted
+ * permutations: 36 bytes a triple where the pointer indexes spend
+ * hundreds. Permutation k holds (s, p, o) rotated left by k, i.e. SPO,
+ * POS and OSP. Added triples wait in <pending> until a read seals them
+ * in, which may happen in several reading threads at once; writes need
+ * the graph to themselves, as they do for pointer indexes. Permutations
+ * may instead be views of a snapshot's mapped arrays, copied out only
+ * when the graph changes.
+ */
+class EncodedTriples {
+public:
+    struct Entry {
+	TermID at[3];
+	bool operator< (const Entry& r) const {
+	    if (at[0] != r.at[0]) return at[0] < r.at[0];
+	    if (at[1] != r.at[1]) return at[1] < r.at[1];
+	    return at[2] < r.at[2];
+	}
+	bool operator== (const Entry& r) const { return at[0] == r.at[0] && at[1] == r.at[1] && at[2] == r.at[2]; }
+	/* This SPO entry rotated into permutation <order>. */
+	Entry rotated (size_t order) const {
+	    Entry ret = { { at[order], at[(order + 1) % 3], at[(order + 2) % 3] } };
+	    return ret;
+	}
+    };
+    enum { IDX_spo, IDX_pos, IDX_osp, Orders };
+    typedef std::vector<Entry> Permutation;
+    /* A sorted run of entries, either its own or mapped from elsewhere. */
+    class Sorted {
+	Permutation owned;
+	const Entry* first;
+	const Entry* last;
+    public:
+	Sorted () : owned(), first(NULL), last(NULL) {  }
+	Sorted (const Sorted& ref) : owned(ref.owned), first(ref.first), last(ref.last) {
+	    if (!owned.empty()) { first = &owned[0]; last = first + owned.size(); }
+	}
+	Sorted& operator= (const Sorted& ref) {
+	    Sorted copy(ref);
+	    owned.swap(copy.owned); // entries keep their addresses.
+	    first = copy.first;
+	    last = copy.last;
+	    return *this;
+	}
+	const Entry* begin () const { return first; }
+	const Entry* end () const { return last; }
+	size_t size () const { return last - first; }
+	bool empty () const { return first == last; }
+	const Entry& operator[] (size_t i) const { return first[i]; }
+	/* Take <entries>, leaving the old contents in it. */
+	void swap (Permutation& entries) {
+	    owned.swap(entries);
+	    first = owned.empty() ? NULL : &owned[0];
+	    last = first + owned.size();
+	}
+	/* View [<from>, <to>), which must outlive this. */
+	void map (const Entry* from, const Entry* to) {
+	    Permutation().swap(owned);
+	    first = from;
+	    last = to;
+	}
+    };
+
+    TermTable* terms;
+    boost::shared_ptr<const void> owner; // keeps <terms> and any mapped entries alive.
+    Sorted orders[Orders];
+    Permutation pending; // SPO, unsorted, possibly repeated or already present.
+    GraphStatistics statistics;
+    boost::atomic<bool> sealed;
+    boost::atomic<bool> counted; // whether <statistics> are current.
+    boost::atomic<bool> decoded; // whether the graph's TriplePattern list is current.
+    boost::mutex lock; // guards sealing, counting and decoding.
+
+    EncodedTriples (TermTable* terms, boost::shared_ptr<const void> owner)
+	: terms(terms), owner(owner), sealed(true), counted(true), decoded(true) {  }
+    /* A copy of sealed <ref>; it's left undecoded. */
+    EncodedTriples(const EncodedTriples& ref);
+    /* Whether every term of <t> has an ID; if so, <entry> is its SPO entry. */
+    bool find(const TriplePattern* t, Entry* entry) const;
+    void add(const TriplePattern* t);
+    /* Add <from>'s triples, which must share this table; into an empty
+     * graph that's a copy of the views, not the entries.
+     */
+    void add(const EncodedTriples& from);
+    /* Serve the permutations from [spo, spo + count) and likewise <pos>
+     * and <osp>, which <owner> keeps mapped.
+     */
+    void map(const Entry* spo, const Entry* pos, const Entry* osp, size_t count);
+    /* Remove the triples in <doomed>, SPO; sorted, unique. */
+    void erase(const Permutation& doomed);
+    void clear();
+    /* Merge <pending> into the permutations. */
+    void seal () {
+	if (!sealed.load(boost::memory_order_acquire))
+	    _seal();
+    }
+    size_t size () { seal(); return orders[IDX_spo].size(); }
+    /* Counted on first use after a change, so mapping a graph reads none of it. */
+    const GraphStatistics& getStatistics () {
+	seal();
+	if (!counted.load(boost::memory_order_acquire))
+	    _countOnce();
+	return statistics;
+    }
+    /* The range of permutation <order> whose first <length> IDs are <key>'s. */
+    std::pair<const Entry*, const Entry*> range(size_t order, const Entry& key, size_t length) const;
+protected:
+    void _seal();
+    void _countOnce();
+    void _count();
+};
+
 class BasicGraphPattern : public TableOperation { // ⊌⊍
-    typedef std::multimap<const POS*, const TriplePattern*> idx_type;
-    typedef std::pair<const POS*, const TriplePattern*> idx_pair;
+    friend class QuadIndex;
+    /* Three permutation indexes, each keyed on the first two positions of
+     * its ordering (SPO, POS, OSP). A lookup on two positions is an
+     * equal_range; so is one on the leading position, with Any second.
+     */
+    typedef std::pair<const POS*, const POS*> idx_key;
+    /* Orders keys by both positions, but a second position of Any (never
+     * stored) equals every second position.
+     */
+    struct idx_less {
+	static const POS* const Any;
+	bool operator() (const idx_key& l, const idx_key& r) const {
+	    if (l.first != r.first)
+		return std::less<const POS*>()(l.first, r.first);
+	    if (l.second == Any || r.second == Any)
+		return false;
+	    return std::less<const POS*>()(l.second, r.second);
+	}
+    };
+    typedef std::multimap<idx_key, const TriplePattern*, idx_less> idx_type;
+    typedef std::pair<idx_key, const TriplePattern*> idx_pair;
     typedef std::pair<idx_type::const_iterator, idx_type::const_iterator> idx_range;
 
 protected:
 
     // make sure we don't delete the TriplePatterns
-    NoDelProductionVector<const TriplePattern*> m_TriplePatterns;
-    idx_type idx;
+    NoDelProductionVector<const TriplePattern*> m_TriplePatterns; // decoded on demand if encoded.
+    boost::unordered_set<const TriplePattern*> members; // TriplePatterns are interned so identity is equality.
+    idx_type spoIdx, posIdx, ospIdx;
+    GraphStatistics statistics;
+    EncodedTriples* encoded; // NULL: the triples are in the pointer indexes.
+    size_t generation; // bumped by every change to the triples.
     bool allOpts;
-    BasicGraphPattern (bool allOpts) : TableOperation(), m_TriplePatterns(), allOpts(allOpts) {  }
-    BasicGraphPattern (const BasicGraphPattern& ref) :
-	TableOperation(ref), m_TriplePatterns(ref.m_TriplePatterns), // idx(ref.idx), 
-	allOpts(ref.allOpts) {  }
+    BasicGraphPattern (bool allOpts) : TableOperation(), m_TriplePatterns(), encoded(NULL), generation(0), allOpts(allOpts) {  }
+    BasicGraphPattern(const BasicGraphPattern& ref);
 
     /* Misc helper functions: */
     static const POS* _cOrN(const POS* pos, const NULLpos* n);
-    /* wrapper function pushed into .cpp because RdfDB is incomplete. */
+    /* wrapper functions pushed into .cpp because RdfDB is incomplete. */
     void _bindVariables(RdfDB* db, ResultSet* rs, const POS* p_name) const;
+    bool _pipeline(RdfDB* db, ResultSet* rs, const POS* p_name, Result* row, RowSink* sink) const;
+    static idx_range _prefix(const idx_type& index, const POS* first);
+    /* Fill m_TriplePatterns from <encoded> if it's changed since. */
+    void _decode() const;
+    /* Returns whether <key> no longer appears in <index>. */
+    static bool _unindex(idx_type& index, idx_key key, const TriplePattern* p);
+    static bool _firstWithKey(const idx_type& index, idx_type::const_iterator it);
+    void _index(const TriplePattern* p);
+    void _unindex(const TriplePattern* p);
+    /* The triples found in an index: a range of a pointer index, or of
+     * an encoded permutation whose TermIDs are decoded as they're read.
+     */
+    class Candidates {
+	friend class BasicGraphPattern;
+	idx_type::const_iterator it, last;
+	const TermTable* terms; // NULL for a pointer index.
+	const EncodedTriples::Entry* entry;
+	const EncodedTriples::Entry* lastEntry;
+	size_t order;
+	const POS* _position (size_t i) const { return terms->term(entry->at[(i + 3 - order) % 3]); }
+	Candidates (idx_range range)
+	    : it(range.first), last(range.second), terms(NULL), entry(NULL), lastEntry(NULL), order(0) {  }
+	Candidates (idx_type::const_iterator none, const TermTable* terms,
+		    std::pair<const EncodedTriples::Entry*, const EncodedTriples::Entry*> range, size_t order)
+	    : it(none), last(none), terms(terms), entry(range.first), lastEntry(range.second), order(order) {  }
+    public:
+	bool done () const { return terms == NULL ? it == last : entry == lastEntry; }
+	void next () { if (terms == NULL) ++it; else ++entry; }
+	const POS* getS () const { return terms == NULL ? it->second->getS() : _position(0); }
+	const POS* getP () const { return terms == NULL ? it->second->getP() : _position(1); }
+	const POS* getO () const { return terms == NULL ? it->second->getO() : _position(2); }
+	/* The current triple, interned if it was encoded. */
+	const TriplePattern* triple() const;
+	bool bind (const TriplePattern* constraint, bool allOpts, ResultSet* rs, const POS* graphVar, Result* provisional, const POS* graphName) const {
+	    return terms == NULL
+		? constraint->bindVariables(it->second, allOpts, rs, graphVar, provisional, graphName)
+		: constraint->bindVariables(getS(), getP(), getO(), allOpts, rs, graphVar, provisional, graphName);
+	}
+    };
+    /* Pick the index matching the constant positions of <constraint>,
+     * counting those variables which <row> binds as constants.
+     */
+    Candidates _candidates(const TriplePattern* constraint, const QueryOptions& options, const Result* row = NULL) const;
+    /* Estimated matches for <constraint> once <bound> variables have values. */
+    double _estimate(const TriplePattern* constraint, const std::set<const POS*>& bound, const Result* row, const QueryOptions& options) const;
+    /* toMatch's triple patterns, cheapest first given the bindings in <row>. */
+    std::vector<const TriplePattern*> _plan(const BasicGraphPattern* toMatch, const Result* row, const ResultSet* rs, std::vector<double>& costs) const;
+    /* Match <plan> against every row of <rs>, a pattern at a time. */
+    void _matchPlan(const std::vector<const TriplePattern*>& plan, ResultSet* rs, const PushedFilters* filters,
+		    const POS* graphVar, const BasicGraphPattern* toMatch, const POS* graphName) const;
+    /* Depth-first match of plan[depth..] extending <row>. */
+    bool _pipelineStep(const std::vector<const TriplePattern*>& plan, size_t depth, ResultSet* rs, const PushedFilters* filters,
+		       const POS* graphVar, const POS* graphName, Result* row, RowSink* sink) const;
 
 public:
+    ~BasicGraphPattern();
 
     bool operator==(const BasicGraphPattern& ref) const;
     /* Controls for operator==(BasicGraphPatter&)
@@ -1409,26 +1880,59 @@ public:
     static bool CompareVars;		// Whether ?x == ?y .
 
     void addTriplePattern (const TriplePattern* p) {
-	idx_range range = idx.equal_range (p->getP());
-	for ( ; range.first != range.second; ++range.first)
-	    if ((*range.first).second == p)
-		return;
+	if (encoded != NULL) {
+	    ++generation;
+	    encoded->add(p);
+	    m_TriplePatterns.clear();
+	    return;
+	}
+	if (!members.insert(p).second)
+	    return;
 	m_TriplePatterns.push_back(p);
-	idx.insert(idx_pair(p->getP(), p));
+	_index(p);
     }
+    /* Keep the triples as TermIDs from <terms> (see EncodedTriples) or,
+     * if NULL, as TriplePattern pointers. Iterating an encoded graph
+     * decodes its triples, which are kept until it changes; matching
+     * decodes just the triples it reads. <terms> must be able to intern
+     * every term added; <owner>, if any, keeps it alive.
+     */
+    void encode(TermTable* terms, boost::shared_ptr<const void> owner = boost::shared_ptr<const void>());
+    /* Add <from>'s triples; encoded graphs sharing a table copy entries, not terms. */
+    void addTriples(const BasicGraphPattern& from);
+    /* Replace an encoded graph's triples with <count> mapped entries in
+     * each permutation; see EncodedTriples::map.
+     */
+    void mapTriples(const EncodedTriples::Entry* spo, const EncodedTriples::Entry* pos,
+		    const EncodedTriples::Entry* osp, size_t count);
+    const TermTable* getTermTable () const { return encoded == NULL ? NULL : encoded->terms; }
     virtual void bindVariables(RdfDB* db, ResultSet* rs) const = 0;
     void bindVariables(ResultSet* rs, const POS* graphVar, const BasicGraphPattern* toMatch, const POS* graphName) const;
+    /* Push each match of <toMatch> extending <row> to <sink> as it's found. */
+    bool pipelineMatches(ResultSet* rs, const POS* graphVar, const BasicGraphPattern* toMatch, const POS* graphName,
+			 Result* row, RowSink* sink) const;
     void construct(BasicGraphPattern* target, const ResultSet* rs, BNodeEvaluator* evaluator) const;
     virtual void construct(RdfDB* target, const ResultSet* rs, BNodeEvaluator* evaluator, BasicGraphPattern* bgp) const;
-    virtual void deletePattern(RdfDB* target, const ResultSet* rs, BNodeEvaluator* evaluator, BasicGraphPattern* bgp) const;
-    size_t size () const { return m_TriplePatterns.size(); }
-    std::vector<const TriplePattern*>::iterator begin () { return m_TriplePatterns.begin(); }
-    std::vector<const TriplePattern*>::const_iterator begin () const { return m_TriplePatterns.begin(); }
-    std::vector<const TriplePattern*>::iterator end () { return m_TriplePatterns.end(); }
-    std::vector<const TriplePattern*>::const_iterator end () const { return m_TriplePatterns.end(); }
-    std::vector<const TriplePattern*>::iterator erase (std::vector<const TriplePattern*>::iterator it) { return m_TriplePatterns.erase(it); }
-    void sort (bool (*comp)(const TriplePattern*, const TriplePattern*)) { m_TriplePatterns.sort(comp); }
-    void clearTriples () { m_TriplePatterns.clear(); }
+    virtual void deletePattern(const RdfDB* source, RdfDB* deletions, const ResultSet* rs, BNodeEvaluator* evaluator, const POS* graph) const;
+    size_t size () const { return encoded == NULL ? m_TriplePatterns.size() : encoded->size(); }
+    std::vector<const TriplePattern*>::iterator begin () { _decode(); return m_TriplePatterns.begin(); }
+    std::vector<const TriplePattern*>::const_iterator begin () const { _decode(); return m_TriplePatterns.begin(); }
+    std::vector<const TriplePattern*>::iterator end () { _decode(); return m_TriplePatterns.end(); }
+    std::vector<const TriplePattern*>::const_iterator end () const { _decode(); return m_TriplePatterns.end(); }
+    std::vector<const TriplePattern*>::iterator erase(std::vector<const TriplePattern*>::iterator it);
+    /* Remove every triple in <doomed> in one pass. */
+    void eraseTriples(const BasicGraphPattern& doomed);
+    void sort (bool (*comp)(const TriplePattern*, const TriplePattern*)) { _decode(); m_TriplePatterns.sort(comp); }
+    void clearTriples () {
+	m_TriplePatterns.clear(); members.clear(); spoIdx.clear(); posIdx.clear(); ospIdx.clear(); statistics._clear(); ++generation;
+	if (encoded != NULL)
+	    encoded->clear();
+    }
+    const GraphStatistics& getStatistics () const {
+	return encoded == NULL ? statistics : encoded->getStatistics();
+    }
+    size_t getGeneration () const { return generation; }
+    bool getAllOpts () const { return allOpts; }
     virtual void express(Expressor* p_expressor) const = 0;
     virtual bool operator==(const TableOperation& ref) const = 0;
     virtual std::string toString(MediaType mediaType = MediaType((const char*)NULL), NamespaceMap* namespaces = NULL) const;
@@ -1446,6 +1950,10 @@ public:
     virtual void bindVariables (RdfDB* db, ResultSet* rs) const {
 	_bindVariables(db, rs, m_name); /* RdfDB is incomplete. */
     }
+    virtual bool pipeline (RdfDB* db, ResultSet* rs, Result* row, RowSink* sink) const {
+	return _pipeline(db, rs, m_name, row, sink);
+    }
+    virtual bool pipelines () const { return true; }
     virtual bool operator== (const TableOperation& ref) const {
 	const NamedGraphPattern* pref = dynamic_cast<const NamedGraphPattern*>(&ref);
 	return pref == NULL ? false : 
@@ -1462,12 +1970,47 @@ public:
     virtual void bindVariables (RdfDB* db, ResultSet* rs) const {
 	_bindVariables(db, rs, NULL); /* RdfDB is incomplete. */
     }
+    virtual bool pipeline (RdfDB* db, ResultSet* rs, Result* row, RowSink* sink) const {
+	return _pipeline(db, rs, NULL, row, sink);
+    }
+    virtual bool pipelines () const { return true; }
     virtual bool operator== (const TableOperation& ref) const {
 	const DefaultGraphPattern* pref = dynamic_cast<const DefaultGraphPattern*>(&ref);
 	return pref == NULL ? false :
 	    BasicGraphPattern::operator==(*pref);
     }
 };
+
+/* QuadIndex - SPO, POS and OSP indexes over the triples of a set of named
+ * graphs, each entry tagged with its graph. Rows with the graph variable
+ * unbound look up quads here; rows with it bound use that graph's own
+ * indexes. GRAPH ?g { ... } is then matched in a single ResultSet.
+ */
+class QuadIndex {
+    typedef BasicGraphPattern::idx_key idx_key;
+    typedef BasicGraphPattern::idx_less idx_less;
+    typedef std::pair<const POS*, const TriplePattern*> quad;
+    typedef std::multimap<idx_key, quad, idx_less> quad_idx;
+    typedef std::pair<quad_idx::const_iterator, quad_idx::const_iterator> quad_range;
+
+    quad_idx spoIdx, posIdx, ospIdx;
+    std::map<const POS*, const BasicGraphPattern*> graphs;
+    std::map<const POS*, std::vector<const TriplePattern*> > indexed; // to take a graph's quads out again.
+
+    static quad_range _prefix(const quad_idx& index, const POS* first);
+    static void _unindex(quad_idx& index, idx_key key, const quad& q);
+    quad_range _candidates(const TriplePattern* constraint, const QueryOptions& options, const Result* row = NULL) const;
+
+public:
+    /* Patterns with no triples or all-optional triples are matched per graph. */
+    static bool Handles (const BasicGraphPattern* toMatch) { return toMatch->size() > 0 && !toMatch->allOpts; }
+    void addGraph(const POS* name, const BasicGraphPattern* graph);
+    /* Drop the quads addGraph added for <name>, even if its graph has changed since. */
+    void removeGraph(const POS* name);
+    size_t graphCount () const { return graphs.size(); }
+    size_t size () const { return spoIdx.size(); }
+    void bindVariables(ResultSet* rs, const POS* graphVar, const BasicGraphPattern* toMatch) const;
+};
 class TableOperationOnOperation : public TableOperation {
 protected:
     const TableOperation* m_TableOperation;
@@ -1489,12 +2032,14 @@ public:
     void addExpression (const Expression* expression) {
 	m_Expressions.push_back(expression);
     }
-
     virtual void bindVariables(RdfDB*, ResultSet* rs) const;
+    virtual bool pipeline(RdfDB* db, ResultSet* rs, Result* row, RowSink* sink) const;
+    virtual bool pipelines () const { return m_TableOperation->pipelines(); }
+    virtual bool independent () const { return true; }
     virtual void construct (RdfDB* /* target */, const ResultSet* /* rs */, BNodeEvaluator* /* evaluator */, BasicGraphPattern* /* bgp */) const {
 	throw NotImplemented("CONSTRUCT{FILTER(...)}");
     }
-    virtual void deletePattern (RdfDB* /* target */, const ResultSet* /* rs */, BNodeEvaluator* /* evaluator */, BasicGraphPattern* /* bgp */) const {
+    virtual void deletePattern (const RdfDB* /* source */, RdfDB* /* deletions */, const ResultSet* /* rs */, BNodeEvaluator* /* evaluator */, const POS* /* graph */) const {
 	throw NotImplemented("DELETEPATTERN{FILTER(...)}");
     }
     virtual void express(Expressor* p_expressor) const;
@@ -1532,7 +2077,7 @@ public:
 	m_TableOperation->bindVariables(db, rs);
     }
     virtual void construct(RdfDB* target, const ResultSet* rs, BNodeEvaluator* evaluator, BasicGraphPattern* bgp) const;
-    virtual void deletePattern(RdfDB* target, const ResultSet* rs, BNodeEvaluator* evaluator, BasicGraphPattern* bgp) const;
+    virtual void deletePattern(const RdfDB* source, RdfDB* deletions, const ResultSet* rs, BNodeEvaluator* evaluator, const POS* graph) const;
     virtual TableOperationOnOperation* makeANewThis (const TableOperation* p_TableOperation) const { return new GraphGraphPattern(m_VarOrIRIref, p_TableOperation); }
 };
 /* ServiceGraphPattern: pass-through class that's just used to reproduce verbatim SPARQL queries
@@ -1555,9 +2100,24 @@ public:
 	    m_VarOrIRIref == pref->m_VarOrIRIref &&
 	    *m_TableOperation == *pref->m_TableOperation;
     }
+    struct Join;	// the queries for one service and the rows awaiting their answers
+    /* Joins which are deleted with the vector, so none leak if planning
+     * or running them throws.
+     */
+    struct Joins : public std::vector<Join*> {
+	~Joins();
+    };
+    /* Take <rs>'s rows into Joins whose queries can be sent along with
+     * other SERVICEs' by runJoins.
+     */
+    void planJoins(RdfDB* db, ResultSet* rs, Joins* joins) const;
+    /* Fetch all of <joins>' queries at once and join the answers back into
+     * their ResultSets, deleting the Joins.
+     */
+    static void runJoins(RdfDB* db, Joins& joins);
     virtual void bindVariables(RdfDB* db, ResultSet* rs) const;
     virtual void construct(RdfDB* target, const ResultSet* rs, BNodeEvaluator* evaluator, BasicGraphPattern* bgp) const;
-    virtual void deletePattern(RdfDB* target, const ResultSet* rs, BNodeEvaluator* evaluator, BasicGraphPattern* bgp) const;
+    virtual void deletePattern(const RdfDB* source, RdfDB* deletions, const ResultSet* rs, BNodeEvaluator* evaluator, const POS* graph) const;
     virtual TableOperationOnOperation* makeANewThis (const TableOperation* p_TableOperation) const { return new ServiceGraphPattern(m_VarOrIRIref, p_TableOperation, posFactory, lexicalCompare); }
 };
 class OptionalGraphPattern : public TableOperationOnOperation {
@@ -1573,10 +2133,15 @@ public:
 	    *m_TableOperation == *pref->m_TableOperation;
     }
     virtual void bindVariables(RdfDB*, ResultSet* rs) const;
+    /* The default pipeline, a left join of one row, is cheap if the inner
+     * pattern streams; an independent one is evaluated once per pipeline.
+     */
+    virtual bool pipeline(RdfDB* db, ResultSet* rs, Result* row, RowSink* sink) const;
+    virtual bool pipelines () const { return m_TableOperation->pipelines() || m_TableOperation->independent(); }
     virtual void construct (RdfDB* /* target */, const ResultSet* /* rs */, BNodeEvaluator* /* evaluator */, BasicGraphPattern* /* bgp */) const {
 	throw NotImplemented("CONSTRUCT{OPTIONAL{?s?p?o}}");
     }
-    virtual void deletePattern (RdfDB* /* target */, const ResultSet* /* rs */, BNodeEvaluator* /* evaluator */, BasicGraphPattern* /* bgp */) const {
+    virtual void deletePattern (const RdfDB* /* source */, RdfDB* /* deletions */, const ResultSet* /* rs */, BNodeEvaluator* /* evaluator */, const POS* /* graph */) const {
 	throw NotImplemented("DELETEPATTERN{OPTIONAL{?s?p?o}}");
     }
     virtual TableOperationOnOperation* makeANewThis (const TableOperation* p_TableOperation) const { return new OptionalGraphPattern(p_TableOperation); }
@@ -1598,7 +2163,7 @@ public:
     virtual void construct (RdfDB* /* target */, const ResultSet* /* rs */, BNodeEvaluator* /* evaluator */, BasicGraphPattern* /* bgp */) const {
 	throw NotImplemented("CONSTRUCT{MINUS{?s?p?o}}");
     }
-    virtual void deletePattern (RdfDB* /* target */, const ResultSet* /* rs */, BNodeEvaluator* /* evaluator */, BasicGraphPattern* /* bgp */) const {
+    virtual void deletePattern (const RdfDB* /* source */, RdfDB* /* deletions */, const ResultSet* /* rs */, BNodeEvaluator* /* evaluator */, const POS* /* graph */) const {
 	throw NotImplemented("DELETEPATTERN{MINUS{?s?p?o}}");
     }
     virtual TableOperationOnOperation* makeANewThis (const TableOperation* p_TableOperation) const { return new MinusGraphPattern(p_TableOperation); }
@@ -1689,7 +2254,12 @@ public:
 		delete m_OrderConditions->at(i).expression;
 	delete m_OrderConditions;
     }
-    void order(ResultSet* rs);
+    /* Top-K unless DISTINCT/REDUCED may drop some of the first K. */
+    void order(ResultSet* rs, e_distinctness distinctness = DIST_all);
+    /* The number of ordered rows to keep, or -1 for all of them. */
+    int keep(e_distinctness distinctness) const;
+    bool orders () const { return m_OrderConditions != NULL && !m_OrderConditions->empty(); }
+    std::vector<s_OrderConditionPair>* getOrderConditions () const { return m_OrderConditions; }
     virtual void express(Expressor* p_expressor) const;
     bool operator== (const SolutionModifier& ref) const {
 	if (m_limit != ref.m_limit ||
@@ -1717,6 +2287,15 @@ public:
     ~Binding () { clear(); /* atoms in vector are centrally managed */ }
     virtual void express(Expressor* p_expressor) const;
     void bindVariables(RdfDB* db, ResultSet* rs, Result* r, POSList* p_Vars) const;
+    /* Values are positional, so compare them in order. */
+    bool operator== (const Binding& ref) const {
+	if (size() != ref.size())
+	    return false;
+	for (size_t i = 0; i < size(); ++i)
+	    if (at(i) != ref.at(i))
+		return false;
+	return true;
+    }
 };
 class BindingClause : public ProductionVector<const Binding*> {
 private:
@@ -1726,6 +2305,14 @@ public:
     ~BindingClause () { delete m_Vars; }
     virtual void express(Expressor* p_expressor) const;
     void bindVariables(RdfDB* db, ResultSet* rs) const;
+    bool operator== (const BindingClause& ref) const {
+	if (!(*m_Vars == *ref.m_Vars) || size() != ref.size())
+	    return false;
+	for (size_t i = 0; i < size(); ++i)
+	    if (!(*at(i) == *ref.at(i)))
+		return false;
+	return true;
+    }
 };
 class WhereClause : public Base {
 private:
@@ -1739,6 +2326,14 @@ public:
     }
     virtual void express(Expressor* p_expressor) const;
     void bindVariables(RdfDB* db, ResultSet* rs) const;
+
+    bool pipelines () const { return m_BindingClause == NULL && m_GroupGraphPattern->pipelines(); }
+    /* Like bindVariables but stops after <maxRows> solutions (-1 for all),
+     * not counting those <distinct> has already seen.
+     */
+    void pipeline(RdfDB* db, ResultSet* rs, int maxRows, DistinctFilter* distinct = NULL) const;
+    /* Push the solutions to <sink> rather than into rs. */
+    void pipeline(RdfDB* db, ResultSet* rs, RowSink* sink) const;
     bool operator== (const WhereClause& ref) const {
 	return
 	    *m_GroupGraphPattern == *ref.m_GroupGraphPattern &&
@@ -1936,6 +2531,7 @@ public:
     ~POSExpression () { /* m_POS is centrally managed */ }
     const POS* getPOS () const { return m_POS; }
     virtual void express(Expressor* p_expressor) const;
+    virtual bool isConstant () const { return dynamic_cast<const Bindable*>(m_POS) == NULL; }
     virtual const POS* eval (const Result* r, POSFactory* /* posFactory */, BNodeEvaluator* evaluator) const {
 	return m_POS->evalPOS(r, evaluator);
     }
@@ -1958,12 +2554,61 @@ public:
     size_t size () const { return expressions->size(); }
     virtual void express(Expressor* p_expressor) const;
 };
+/* FoldedValue - the value of a constant expression, published once by
+ * the first eval so later evals read it without locking. It's tagged
+ * with the serial of the POSFactory it came from (an address could be
+ * reused); evals with any other factory just compute it again.
+ */
+class FoldedValue {
+    struct Folding {
+	unsigned long serial;
+	const POS* value;
+    };
+    bool constant;
+    mutable boost::atomic<const Folding*> folding;
+public:
+    FoldedValue () : constant(false), folding(NULL) {  }
+    ~FoldedValue () { delete folding.load(boost::memory_order_acquire); }
+    void setConstant (bool c) { constant = c; }
+    bool isConstant () const { return constant; }
+    const POS* find (const POSFactory* f) const {
+	if (!constant)
+	    return NULL;
+	const Folding* folded = folding.load(boost::memory_order_acquire);
+	return folded != NULL && folded->serial == f->getSerial() ? folded->value : NULL;
+    }
+    const POS* remember (const POSFactory* f, const POS* v) const {
+	if (constant && folding.load(boost::memory_order_relaxed) == NULL) {
+	    Folding* mine = new Folding();
+	    mine->serial = f->getSerial();
+	    mine->value = v;
+	    const Folding* expected = NULL;
+	    if (!folding.compare_exchange_strong(expected, mine, boost::memory_order_acq_rel))
+		delete mine; // another thread got there first.
+	}
+	return v;
+    }
+};
 class FunctionCall : public Base {
+public:
+    /* The functions eval implements; resolved from m_IRIref on construction. */
+    typedef enum { FUNC_unknown, FUNC_numericCast, FUNC_dateTimeCast, FUNC_stringCast,
+		   FUNC_bound, FUNC_isIRI, FUNC_isBlank, FUNC_isLiteral, FUNC_str, FUNC_lang, FUNC_datatype,
+		   FUNC_sameTerm, FUNC_langMatches, FUNC_regex } e_Function;
 private:
     const URI* m_IRIref;
     const ArgList* m_ArgList;
+    e_Function m_Function;
+    FoldedValue m_Folded;
+#if REGEX_LIB == SWOb_BOOST
+    boost::shared_ptr<const boost::regex> m_Pattern; // REGEX's pattern and flags, if they're constants.
+    static unsigned _regexFlags(const RDFLiteral* flags);
+#endif /* REGEX_LIB == SWOb_BOOST */
+    static e_Function _resolve(std::string iri);
+    void _compile();
+    const POS* _eval(const Result* r, POSFactory* posFactory, BNodeEvaluator* evaluator) const;
 public:
-    FunctionCall (const URI* p_IRIref, const ArgList* p_ArgList) : Base(), m_IRIref(p_IRIref), m_ArgList(p_ArgList) {  }
+    FunctionCall (const URI* p_IRIref, const ArgList* p_ArgList) : Base(), m_IRIref(p_IRIref), m_ArgList(p_ArgList) { _compile(); }
     FunctionCall (const URI* p_IRIref, Expression* arg1, Expression* arg2, Expression* arg3) : Base() {
 	m_IRIref = p_IRIref;
 	ProductionVector<const Expression*>* args = new ProductionVector<const Expression*>();
@@ -1971,174 +2616,14 @@ public:
 	if (arg2) args->push_back(arg2);
 	if (arg3) args->push_back(arg3);
 	m_ArgList = new ArgList(args);
+	_compile();
     }
     ~FunctionCall () { delete m_ArgList; }
     virtual void express(Expressor* p_expressor) const;
+    bool isConstant () const { return m_Folded.isConstant(); }
     virtual const POS* eval (const Result* r, POSFactory* posFactory, BNodeEvaluator* evaluator) const {
-	std::vector<const POS*> subd;
-	for (ArgList::ArgIterator it = m_ArgList->begin(); it != m_ArgList->end(); ++it)
-	    subd.push_back((*it)->eval(r, posFactory, evaluator));
-
-	/* Write down the first 3 for convenience. */
-	std::vector<const POS*>::const_iterator it = subd.begin();
-	const POS* first = it == subd.end() ? NULL : *it++;
-	std::string func = m_IRIref->getLexicalValue();
-
-	/* casts */
-	if (func == "http://www.w3.org/2001/XMLSchema#float"    || 
-	    func == "http://www.w3.org/2001/XMLSchema#double"   || 
-	    func == "http://www.w3.org/2001/XMLSchema#decimal"  || 
-	    func == "http://www.w3.org/2001/XMLSchema#integer"  || 
-	    func == "http://www.w3.org/2001/XMLSchema#boolean"    ) {
-	    const RDFLiteral* s = dynamic_cast<const RDFLiteral*>(first);
-	    if (s != NULL) {
-		const URI* dt = s->getDatatype();
-		std::string dtl = dt ? dt->getLexicalValue() : ":noDT";
-		if (dt == NULL || 
-		    dtl == "http://www.w3.org/2001/XMLSchema#string"  || 
-		    dtl == "http://www.w3.org/2001/XMLSchema#float"   || 
-		    dtl == "http://www.w3.org/2001/XMLSchema#double"  || 
-		    dtl == "http://www.w3.org/2001/XMLSchema#decimal" || // check
-		    dtl == "http://www.w3.org/2001/XMLSchema#integer" || // check
-		    dtl == "http://www.w3.org/2001/XMLSchema#boolean"   )// adjust
-		    return posFactory->getRDFLiteral(first->getLexicalValue(), m_IRIref, NULL, true);
-	    }
-	}
-
-	if (func == "http://www.w3.org/2001/XMLSchema#dateTime"   ) {
-	    const RDFLiteral* s = dynamic_cast<const RDFLiteral*>(first);
-	    if (s != NULL) {
-		const URI* dt = s->getDatatype();
-		std::string dtl = dt ? dt->getLexicalValue() : ":noDT";
-		if (dt == NULL || 
-		    dtl == "http://www.w3.org/2001/XMLSchema#dateTime"  )// adjust
-		    return posFactory->getRDFLiteral(first->getLexicalValue(), m_IRIref, NULL, true);
-	    }
-	}
-
-	if (func == "http://www.w3.org/2001/XMLSchema#string"   ) {
-	    return posFactory->getRDFLiteral(first->getLexicalValue(), m_IRIref, NULL, true);
-	}
-
-	/* operators */
-	if (m_IRIref == posFactory->getURI("http://www.w3.org/TR/rdf-sparql-query/#func-bound") && 
-	    subd.size() == 1)
-	    return first == NULL ? posFactory->getFalse() : posFactory->getTrue();
-
-	if (m_IRIref == posFactory->getURI("http://www.w3.org/TR/rdf-sparql-query/#func-isIRI") && 
-	    subd.size() == 1)
-	    return dynamic_cast<const URI*>(first) == NULL ? posFactory->getFalse() : posFactory->getTrue();
-
-	if (m_IRIref == posFactory->getURI("http://www.w3.org/TR/rdf-sparql-query/#func-isBlank") && 
-	    subd.size() == 1)
-	    return dynamic_cast<const BNode*>(first) == NULL ? posFactory->getFalse() : posFactory->getTrue();
-
-	if (m_IRIref == posFactory->getURI("http://www.w3.org/TR/rdf-sparql-query/#func-isLiteral") && 
-	    subd.size() == 1)
-	    return dynamic_cast<const RDFLiteral*>(first) == NULL ? posFactory->getFalse() : posFactory->getTrue();
-
-	if (m_IRIref == posFactory->getURI("http://www.w3.org/TR/rdf-sparql-query/#func-str") && // STR(RDFLiteral)
-	    subd.size() == 1 && dynamic_cast<const RDFLiteral*>(first) != NULL)
-	    return posFactory->getRDFLiteral(first->getLexicalValue());
-
-	if (m_IRIref == posFactory->getURI("http://www.w3.org/TR/rdf-sparql-query/#func-str") && // STR(URI)
-	    subd.size() == 1 && dynamic_cast<const URI*>(first) != NULL)
-	    return posFactory->getRDFLiteral(first->getLexicalValue());
-
-	if (m_IRIref == posFactory->getURI("http://www.w3.org/TR/rdf-sparql-query/#func-lang") && 
-	    subd.size() == 1 && dynamic_cast<const RDFLiteral*>(first) != NULL) {
-	    const LANGTAG* t = dynamic_cast<const RDFLiteral*>(first)->getLangtag();
-	    return posFactory->getRDFLiteral(t ? t->getLexicalValue() : "");
-	}
-
-	if (m_IRIref == posFactory->getURI("http://www.w3.org/TR/rdf-sparql-query/#func-datatype") && 
-	    subd.size() == 1 && dynamic_cast<const RDFLiteral*>(first) != NULL && 
-	    dynamic_cast<const RDFLiteral*>(first)->getLangtag() == NULL) {
-	    const URI* dt = dynamic_cast<const RDFLiteral*>(first)->getDatatype();
-	    return dt ? dt : posFactory->getURI("http://www.w3.org/2001/XMLSchema#string");
-	}
-
-	const POS* second = it == subd.end() ? NULL : *it++;
-
-	if (m_IRIref == posFactory->getURI("http://www.w3.org/TR/rdf-sparql-query/#func-sameTerm") && 
-	    subd.size() == 2) {
-	    return first == second && first != NULL ? posFactory->getTrue() : posFactory->getFalse();
-	}
-
-	if (m_IRIref == posFactory->getURI("http://www.w3.org/TR/rdf-sparql-query/#func-langMatches") && 
-	    subd.size() == 2 && 
-	    dynamic_cast<const RDFLiteral*>(first) != NULL && 
-	    dynamic_cast<const RDFLiteral*>(second) != NULL) {
-
-	    /* knock off the easy ones... */
-	    if (first == second)
-		return posFactory->getTrue();
-	    std::string tag = dynamic_cast<const RDFLiteral*>(first)->getLexicalValue();
-	    std::string range = dynamic_cast<const RDFLiteral*>(second)->getLexicalValue();
-	    if (range == "*")
-		return tag.empty() ? posFactory->getFalse() : posFactory->getTrue();
-
-	    std::string::iterator t = tag.begin();
-	    std::string::iterator te = tag.end();
-	    std::string::iterator r = range.begin();
-	    std::string::iterator re = range.end();
-
-	    while (t != te && r != re)
-		if (::tolower(*t++) != ::tolower(*r++))
-		    return posFactory->getFalse();
-
-	    if (r == re && 
-		(t == te || *t == '-'))
-		return posFactory->getTrue();
-
-	    return posFactory->getFalse();
-	}
-
-	const POS* third = it == subd.end() ? NULL : *it++;
-	const RDFLiteral* firstLit = dynamic_cast<const RDFLiteral*>(first);
-	const RDFLiteral* secondLit = dynamic_cast<const RDFLiteral*>(second);
-	const RDFLiteral* thirdLit = dynamic_cast<const RDFLiteral*>(third);
-
-	if (m_IRIref == posFactory->getURI("http://www.w3.org/TR/rdf-sparql-query/#func-regex") && 
-	    ( subd.size() == 2 || subd.size() == 3 ) && 
-	    firstLit != NULL && firstLit->getDatatype() == NULL && firstLit->getLangtag() == NULL && 
-	    secondLit != NULL && secondLit->getDatatype() == NULL && secondLit->getLangtag() == NULL && 
-	    ( subd.size() == 2 || 
-	      (thirdLit != NULL && thirdLit->getDatatype() == NULL && thirdLit->getLangtag() == NULL))) {
-#if REGEX_LIB == SWOb_DISABLED
-	    throw std::string("no regular expression library was linked in");
-#else
-	    boost::match_results<std::string::const_iterator> what;
-	    boost::match_flag_type flags = boost::match_default;
-	    unsigned l_flags = boost::regex::basic | boost::regex::no_mod_m | boost::regex::no_mod_s;
-	    if (thirdLit != NULL) {
-		std::string smix = thirdLit->getLexicalValue();
-		if (smix.find_first_of('s') != std::string::npos)
-		    l_flags &= ~boost::regex::no_mod_s;
-		if (smix.find_first_of('m') != std::string::npos)
-		    l_flags &= ~boost::regex::no_mod_m;
-		if (smix.find_first_of('i') != std::string::npos)
-		    l_flags |= boost::regex::icase;
-		if (smix.find_first_of('x') != std::string::npos)
-		    l_flags |= boost::regex::mod_x;
-	    }
-	    const boost::regex pattern(secondLit->getLexicalValue(), l_flags);
-	    return regex_search(firstLit->getLexicalValue(), what, pattern, flags) ? posFactory->getTrue() : posFactory->getFalse();
-#endif
-	}
-
-	std::stringstream s;
-	s << m_IRIref->toString() << '(';
-	for (std::vector<const POS*>::iterator it = subd.begin(); it != subd.end(); ++it) {
-	    if (it != subd.begin())
-		s << ", ";
-	    if (*it)
-		s << (*it)->toString();
-	    else
-		s << "NULL";
-	}
-	s << ')';
-	throw NotImplemented(s.str());
+	const POS* folded = m_Folded.find(posFactory);
+	return folded != NULL ? folded : m_Folded.remember(posFactory, _eval(r, posFactory, evaluator));
     }
     bool operator== (const FunctionCall& ref) const {
 	if (m_IRIref != ref.m_IRIref)
@@ -2160,6 +2645,7 @@ public:
     FunctionCallExpression (FunctionCall* p_FunctionCall) : Expression(), m_FunctionCall(p_FunctionCall) {  }
     ~FunctionCallExpression () { delete m_FunctionCall; }
     virtual void express(Expressor* p_expressor) const;
+    virtual bool isConstant () const { return m_FunctionCall->isConstant(); }
     virtual const POS* eval (const Result* r, POSFactory* posFactory, BNodeEvaluator* evaluator) const {
 	return m_FunctionCall->eval(r, posFactory, evaluator);
     }
@@ -2177,6 +2663,8 @@ protected:
 public:
     UnaryExpression (const Expression* p_Expression) : Expression(), m_Expression(p_Expression) {  }
     ~UnaryExpression () { delete m_Expression; }
+    const Expression* getExpression () const { return m_Expression; }
+    virtual bool isConstant () const { return m_Expression->isConstant(); }
     virtual const char* getUnaryOperator() = 0;
 };
 class NaryExpression : public Expression {
@@ -2200,6 +2688,14 @@ public:
 		return false;
 	return true;
     }
+    virtual bool isConstant () const {
+	for (std::vector<const Expression*>::const_iterator it = m_Expressions.begin(); it != m_Expressions.end(); ++it)
+	    if (!(*it)->isConstant())
+		return false;
+	return true;
+    }
+    std::vector<const Expression*>::const_iterator begin () const { return m_Expressions.begin(); }
+    std::vector<const Expression*>::const_iterator end () const { return m_Expressions.end(); }
     virtual const char* getInfixNotation() = 0;
 };
 class BooleanJunction : public NaryExpression {
@@ -2273,6 +2769,8 @@ public:
     BooleanComparator (const Expression* left, const Expression* right) : Expression(), left(left), right(right) {  }
     ~BooleanComparator () { delete left; delete right; }
     virtual void setLeftParm (const Expression* p_left) { left = p_left; }
+    const Expression* getLeft () const { return left; }
+    const Expression* getRight () const { return right; }
 
     virtual const char* getComparisonNotation() = 0;
     virtual void express(Expressor* p_expressor) const = 0;
@@ -2374,6 +2872,7 @@ private:
 public:
     ComparatorExpression (const BooleanComparator* p_BooleanComparator) : Expression(), m_BooleanComparator(p_BooleanComparator) {  }
     ~ComparatorExpression () { delete m_BooleanComparator; }
+    const BooleanComparator* getComparator () const { return m_BooleanComparator; }
     virtual void express(Expressor* p_expressor) const;
     virtual const POS* eval (const Result* r, POSFactory* posFactory, BNodeEvaluator* evaluator) const {
 	return m_BooleanComparator->eval(r, posFactory, evaluator);
@@ -2399,9 +2898,10 @@ public:
     }
 };
 class ArithmeticSum : public NaryExpression {
+    FoldedValue m_Folded;
 public:
-    ArithmeticSum (ProductionVector<const Expression*>* p_Expressions) : NaryExpression(p_Expressions) {  }
-    ArithmeticSum (const Expression* p_Expression, ProductionVector<const Expression*>* p_Expressions) : NaryExpression(p_Expression, p_Expressions) {  }
+    ArithmeticSum (ProductionVector<const Expression*>* p_Expressions) : NaryExpression(p_Expressions) { m_Folded.setConstant(NaryExpression::isConstant()); }
+    ArithmeticSum (const Expression* p_Expression, ProductionVector<const Expression*>* p_Expressions) : NaryExpression(p_Expression, p_Expressions) { m_Folded.setConstant(NaryExpression::isConstant()); }
     virtual const char* getInfixNotation () { return "+"; };    
     virtual void express(Expressor* p_expressor) const;
     struct NaryAdder : public POSFactory::NaryFunctor {
@@ -2413,8 +2913,11 @@ public:
 	virtual double eval (double l, double r) { return l + r; }
     };
     virtual const POS* eval (const Result* res, POSFactory* posFactory, BNodeEvaluator* evaluator) const {
+	const POS* folded = m_Folded.find(posFactory);
+	if (folded != NULL)
+	    return folded;
 	NaryAdder f(res, posFactory, evaluator);
-	return posFactory->applyCommonNumeric(std::vector<const Expression*>(m_Expressions.begin(), m_Expressions.end()), &f);
+	return m_Folded.remember(posFactory, posFactory->applyCommonNumeric(std::vector<const Expression*>(m_Expressions.begin(), m_Expressions.end()), &f));
     }
     virtual bool operator== (const Expression& ref) const {
 	const ArithmeticSum* pref = dynamic_cast<const ArithmeticSum*>(&ref);
@@ -2422,8 +2925,9 @@ public:
     }
 };
 class ArithmeticNegation : public UnaryExpression {
+    FoldedValue m_Folded;
 public:
-    ArithmeticNegation (const Expression* p_MultiplicativeExpression) : UnaryExpression(p_MultiplicativeExpression) {  }
+    ArithmeticNegation (const Expression* p_MultiplicativeExpression) : UnaryExpression(p_MultiplicativeExpression) { m_Folded.setConstant(UnaryExpression::isConstant()); }
     ~ArithmeticNegation () {  }
     virtual const char* getUnaryOperator () { return "-"; };
     virtual void express(Expressor* p_expressor) const;
@@ -2436,8 +2940,11 @@ public:
 	virtual double eval (double v) { return -v; }
     };
     virtual const POS* eval (const Result* res, POSFactory* posFactory, BNodeEvaluator* evaluator) const {
+	const POS* folded = m_Folded.find(posFactory);
+	if (folded != NULL)
+	    return folded;
 	UnaryNegator f(res, posFactory, evaluator);
-	return posFactory->applyCommonNumeric(m_Expression, &f);
+	return m_Folded.remember(posFactory, posFactory->applyCommonNumeric(m_Expression, &f));
     }
     virtual bool operator== (const Expression& ref) const {
 	const ArithmeticNegation* pref = dynamic_cast<const ArithmeticNegation*>(&ref);
@@ -2451,6 +2958,7 @@ public:
     NumberExpression (const NumericRDFLiteral* p_NumericRDFLiteral) : Expression(), m_NumericRDFLiteral(p_NumericRDFLiteral) {  }
     ~NumberExpression () { /* m_NumericRDFLiteral is centrally managed */ }
     virtual void express(Expressor* p_expressor) const;
+    virtual bool isConstant () const { return true; }
     virtual const POS* eval (const Result* res, POSFactory* /* posFactory */, BNodeEvaluator* evaluator) const {
 	return m_NumericRDFLiteral->evalPOS(res, evaluator);
     }
@@ -2460,9 +2968,10 @@ public:
     }
 };
 class ArithmeticProduct : public NaryExpression {
+    FoldedValue m_Folded;
 public:
-    ArithmeticProduct (ProductionVector<const Expression*>* p_Expressions) : NaryExpression(p_Expressions) {  }
-    ArithmeticProduct (const Expression* p_Expression, ProductionVector<const Expression*>* p_Expressions) : NaryExpression(p_Expression, p_Expressions) {  }
+    ArithmeticProduct (ProductionVector<const Expression*>* p_Expressions) : NaryExpression(p_Expressions) { m_Folded.setConstant(NaryExpression::isConstant()); }
+    ArithmeticProduct (const Expression* p_Expression, ProductionVector<const Expression*>* p_Expressions) : NaryExpression(p_Expression, p_Expressions) { m_Folded.setConstant(NaryExpression::isConstant()); }
     virtual const char* getInfixNotation () { return "+"; };    
     virtual void express(Expressor* p_expressor) const;
     struct NaryMultiplier : public POSFactory::NaryFunctor {
@@ -2474,8 +2983,11 @@ public:
 	virtual double eval (double l, double r) { return l * r; }
     };
     virtual const POS* eval (const Result* res, POSFactory* posFactory, BNodeEvaluator* evaluator) const {
+	const POS* folded = m_Folded.find(posFactory);
+	if (folded != NULL)
+	    return folded;
 	NaryMultiplier f(res, posFactory, evaluator);
-	return posFactory->applyCommonNumeric(std::vector<const Expression*>(m_Expressions.begin(), m_Expressions.end()), &f);
+	return m_Folded.remember(posFactory, posFactory->applyCommonNumeric(std::vector<const Expression*>(m_Expressions.begin(), m_Expressions.end()), &f));
     }
     virtual bool operator== (const Expression& ref) const {
 	const ArithmeticProduct* pref = dynamic_cast<const ArithmeticProduct*>(&ref);
@@ -0,0 +1,150 @@
+/* ServiceCache - answers to remote queries, kept for repeated SERVICEs.
+ */
+
+#include "ServiceCache.hpp"
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <boost/functional/hash.hpp>
+
+namespace w3c_sw {
+
+    std::string ServiceCache::normalize (std::string query) {
+	std::string ret;
+	char quote = 0;
+	bool space = false;
+	for (std::string::const_iterator it = query.begin(); it != query.end(); ++it) {
+	    if (quote != 0) {
+		ret += *it;
+		if (*it == '\\' && it + 1 != query.end())
+		    ret += *++it;
+		else if (*it == quote)
+		    quote = 0;
+	    } else if (*it == ' ' || *it == '\t' || *it == '\n' || *it == '\r') {
+		space = true;
+	    } else {
+		if (space && !ret.empty())
+		    ret += ' ';
+		space = false;
+		if (*it == '"' || *it == '\'')
+		    quote = *it;
+		ret += *it;
+	    }
+	}
+	return ret;
+    }
+
+    std::string ServiceCache::path (std::string endpoint, std::string query) const {
+	std::stringstream s;
+	s << directory << '/' << std::hex << boost::hash<std::string>()(key(endpoint, query)) << ".srx";
+	return s.str();
+    }
+
+    bool ServiceCache::get (std::string endpoint, std::string query, std::string* answer) {
+	std::string k(key(endpoint, query));
+	boost::mutex::scoped_lock lock(mutex);
+	boost::unordered_map<std::string, LRU::iterator>::iterator found = index.find(k);
+	if (found != index.end()) {
+	    if (ttl == 0 || found->second->expires > now()) {
+		entries.splice(entries.begin(), entries, found->second);
+		*answer = found->second->answer;
+		++hits;
+		return true;
+	    }
+	    forget(found->second);
+	}
+	if (!directory.empty()) {
+	    time_t expires;
+	    if (readDisk(k, path(endpoint, query), answer, &expires)) {
+		remember(k, *answer, expires);
+		++hits;
+		++diskHits;
+		return true;
+	    }
+	}
+	++misses;
+	return false;
+    }
+
+    void ServiceCache::put (std::string endpoint, std::string query, std::string answer) {
+	std::string k(key(endpoint, query));
+	time_t expires = ttl == 0 ? 0 : now() + ttl;
+	boost::mutex::scoped_lock lock(mutex);
+	remember(k, answer, expires);
+	if (!directory.empty())
+	    writeDisk(k, path(endpoint, query), answer, expires);
+    }
+
+    void ServiceCache::clear () {
+	boost::mutex::scoped_lock lock(mutex);
+	entries.clear();
+	index.clear();
+	bytes = 0;
+    }
+
+    void ServiceCache::remember (std::string key, std::string answer, time_t expires) {
+	boost::unordered_map<std::string, LRU::iterator>::iterator found = index.find(key);
+	if (found != index.end())
+	    forget(found->second);
+	size_t size = key.size() + answer.size();
+	if (size > maxBytes)
+	    return; // would evict everything else
+	while (bytes + size > maxBytes) {
+	    forget(--entries.end());
+	    ++evictions;
+	}
+	entries.push_front(Entry(key, answer, expires));
+	index[key] = entries.begin();
+	bytes += size;
+    }
+
+    void ServiceCache::forget (LRU::iterator entry) {
+	bytes -= entry->key.size() + entry->answer.size();
+	index.erase(entry->key);
+	entries.erase(entry);
+    }
+
+    void ServiceCache::writeDisk (std::string key, std::string file, std::string answer, time_t expires) {
+	/* Write a temporary file and rename it over <file> so readers never
+	 * see a partial entry. A failed write leaves any old entry in place.
+	 */
+	std::stringstream s;
+	s << file << '.' << this << ".tmp";
+	std::string tmp(s.str());
+	std::ofstream out(tmp.c_str(), std::ios::out | std::ios::binary);
+	/* expiry, key length, key, answer */
+	out << expires << '\n' << key.size() << '\n' << key << answer;
+	out.close();
+	if (!out) {
+	    std::remove(tmp.c_str());
+	    return;
+	}
+	if (std::rename(tmp.c_str(), file.c_str()) != 0) {
+	    // Some platforms won't rename over an existing file.
+	    std::remove(file.c_str());
+	    if (std::rename(tmp.c_str(), file.c_str()) != 0)
+		std::remove(tmp.c_str());
+	}
+    }
+
+    bool ServiceCache::readDisk (std::string key, std::string file, std::string* answer, time_t* expires) {
+	std::ifstream in(file.c_str(), std::ios::in | std::ios::binary);
+	size_t keySize;
+	if (!(in >> *expires >> keySize) || in.get() != '\n')
+	    return false;
+	if (*expires != 0 && *expires <= now()) {
+	    in.close();
+	    std::remove(file.c_str());
+	    return false;
+	}
+	std::string onDisk(keySize, '\0');
+	if (!in.read(&onDisk[0], keySize) || onDisk != key)
+	    return false; // another key with the same hash
+	std::stringstream s;
+	s << in.rdbuf();
+	*answer = s.str();
+	return true;
+    }
+
+} // namespace w3c_sw
+
@@ -0,0 +1,76 @@
+/* ServiceCache - answers to remote queries, kept for repeated SERVICEs.
+ */
+
+#ifndef SERVICE_CACHE_H
+#define SERVICE_CACHE_H
+
+#include <string>
+#include <list>
+#include <ctime>
+#include <boost/unordered_map.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace w3c_sw {
+
+    /* Answers keyed by endpoint and normalized query text. Entries expire
+     * ttl seconds after they are put; past maxBytes, the least recently
+     * used are evicted. With a directory, every entry is also written
+     * there and a miss in memory looks there before going remote.
+     */
+    class ServiceCache {
+    public:
+	size_t hits;		// includes diskHits
+	size_t diskHits;
+	size_t misses;
+	size_t evictions;
+
+	ServiceCache (size_t maxBytes = 16 * 1024 * 1024, long ttl = 300, std::string directory = "")
+	    : hits(0), diskHits(0), misses(0), evictions(0),
+	      maxBytes(maxBytes), ttl(ttl), directory(directory), bytes(0) {  }
+	virtual ~ServiceCache () {  }
+
+	/* Set *answer to the cached answer to <query> at <endpoint>, if any. */
+	bool get(std::string endpoint, std::string query, std::string* answer);
+	void put(std::string endpoint, std::string query, std::string answer);
+	/* Drop the entries in memory; those on disk stay. */
+	void clear();
+	size_t size () const { return entries.size(); }
+	size_t getBytes () const { return bytes; }
+	/* The file which holds <query> at <endpoint> in the disk tier. */
+	std::string path(std::string endpoint, std::string query) const;
+
+	/* <query> with runs of whitespace outside of literals made one space. */
+	static std::string normalize(std::string query);
+
+    protected:
+	struct Entry {
+	    std::string key;
+	    std::string answer;
+	    time_t expires;
+	    Entry (std::string key, std::string answer, time_t expires)
+		: key(key), answer(answer), expires(expires) {  }
+	};
+	typedef std::list<Entry> LRU;	// most recently used first
+
+	size_t maxBytes;
+	long ttl;		// 0: never expire
+	std::string directory;	// "": no disk tier
+	size_t bytes;
+	LRU entries;
+	boost::unordered_map<std::string, LRU::iterator> index;
+	boost::mutex mutex;
+
+	virtual time_t now () const { return std::time(NULL); }
+	static std::string key (std::string endpoint, std::string query) {
+	    return endpoint + '\n' + normalize(query);
+	}
+	void remember(std::string key, std::string answer, time_t expires);
+	void forget(LRU::iterator entry);
+	void writeDisk(std::string key, std::string file, std::string answer, time_t expires);
+	bool readDisk(std::string key, std::string file, std::string* answer, time_t* expires);
+    };
+
+} // namespace w3c_sw
+
+#endif // !SERVICE_CACHE_H
+
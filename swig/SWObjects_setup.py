@@ -10,6 +10,7 @@ SWObjects_module = Extension('_SWObjects',
                              sources=['swig/SWObjects_wrap.cpp',
                                       'lib/SWObjects.cpp',
                                       'lib/ResultSet.cpp',
+                                      'lib/ServiceCache.cpp',
                                       'lib/RdfDB.cpp',
                                       'lib/ParserCommon.cpp',
                                       'lib/TurtleSParser/TurtleSParser.cpp',
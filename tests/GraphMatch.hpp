@@ -0,0 +1,279 @@
+/* GraphMatch.hpp -- Common code for the graph-matching tests and benchmarks.
+ *
+ * test_GraphMatch checks on small data that each QueryOptions toggle
+ * gives the same answers as the code it bypasses; bench_GraphMatch times
+ * the same comparisons on larger data.
+ */
+
+#include <map>
+#include <vector>
+#include <sstream>
+#include "SWObjects.hpp"
+#include "ResultSet.hpp"
+#include "RdfDB.hpp"
+#include "SPARQLfedParser/SPARQLfedParser.hpp"
+
+using namespace w3c_sw;
+
+POSFactory f;
+
+const URI* U (const char* prefix, int i) {
+    std::stringstream s;
+    s << "http://example.org/" << prefix << i;
+    return f.getURI(s.str());
+}
+
+const POS* Int (int i) {
+    std::stringstream s;
+    s << i;
+    return f.getNumericRDFLiteral(s.str(), i);
+}
+
+/* <data> with <s{i}> <p{j}> <o{(i+j)%objects}> for each subject and predicate. */
+void gridData (DefaultGraphPattern* data, int subjects, int predicates, int objects) {
+    for (int i = 0; i < subjects; ++i)
+	for (int j = 0; j < predicates; ++j)
+	    data->addTriplePattern(f.getTriple(U("s", i), U("p", j), U("o", (i + j) % objects)));
+}
+
+/* Match <pattern> against <data> into <rs> with <options>. */
+void match (const DefaultGraphPattern& data, const DefaultGraphPattern& pattern,
+	    const QueryOptions& options, ResultSet* rs) {
+    rs->options = &options;
+    data.BasicGraphPattern::bindVariables(rs, NULL, &pattern, NULL);
+    rs->options = &QueryOptions::Defaults;
+}
+
+/* Execute the SPARQL in <query> on <db> into <rs> with <options>. */
+void execute (const char* query, RdfDB* db, const QueryOptions& options, ResultSet* rs) {
+    SPARQLfedDriver parser("", &f);
+    IStreamContext s(query, IStreamContext::STRING);
+    if (parser.parse(s))
+	throw std::string("failed to parse ") + query;
+    rs->options = &options;
+    try {
+	parser.root->execute(db, rs);
+    } catch (...) {
+	rs->options = &QueryOptions::Defaults;
+	delete parser.root;
+	throw;
+    }
+    rs->options = &QueryOptions::Defaults;
+    delete parser.root;
+}
+
+/* Execute the query in the file <path> on <db> with <options>, returning
+ * its results; CONSTRUCTs and DESCRIBEs write into <constructed>.
+ */
+ResultSet* executeFile (const char* path, RdfDB* db, const QueryOptions& options, RdfDB* constructed) {
+    SPARQLfedDriver parser("", &f);
+    IStreamContext query(path, IStreamContext::FILE);
+    if (parser.parse(query))
+	throw std::string("failed to parse ") + path;
+    ResultSet* rs = dynamic_cast<const Select*>(parser.root) != NULL ?
+	new ResultSet(&f) : new ResultSet(&f, constructed);
+    rs->options = &options;
+    parser.root->execute(db, rs);
+    rs->options = &QueryOptions::Defaults;
+    delete parser.root;
+    return rs;
+}
+
+/* A small BSBM-shaped dataset with the instances the bsbm/q*.rq queries
+ * name (Product62, Offer2920, Review30), so that each query can be run
+ * with and without triple pattern ordering.
+ */
+std::string bsbmData (int products, int offers, int reviews) {
+    const char* inst = "<http://www4.wiwiss.fu-berlin.de/bizer/bsbm/v01/instances/";
+    std::stringstream s;
+    s << "@prefix bsbm: <http://www4.wiwiss.fu-berlin.de/bizer/bsbm/v01/vocabulary/> .\n"
+	"@prefix inst: <http://www4.wiwiss.fu-berlin.de/bizer/bsbm/v01/instances/> .\n"
+	"@prefix rdfs: <http://www.w3.org/2000/01/rdf-schema#> .\n"
+	"@prefix dc: <http://purl.org/dc/elements/1.1/> .\n"
+	"@prefix foaf: <http://xmlns.com/foaf/0.1/> .\n"
+	"@prefix rev: <http://purl.org/stuff/rev#> .\n"
+	"@prefix country: <http://downlode.org/rdf/iso-3166/countries#> .\n";
+    for (int i = 0; i < 10; ++i)
+	s << inst << "dataFromProducer" << i << "/Producer" << i << "> rdfs:label \"producer " << i << "\" .\n"
+	  << inst << "dataFromVendor" << i << "/Vendor" << i << "> rdfs:label \"vendor " << i << "\" ;"
+	  << " bsbm:country country:" << (i % 3 == 0 ? "US" : i % 3 == 1 ? "DE" : "GB") << " ;"
+	  << " foaf:homepage <http://vendor" << i << ".example/> .\n"
+	  << inst << "dataFromRatingSite" << i << "/Reviewer" << i << "> foaf:name \"reviewer " << i << "\" .\n";
+    for (int i = 0; i < 50; ++i)
+	s << "inst:ProductFeature" << i << " rdfs:label \"feature " << i << "\" .\n";
+    for (int i = 0; i < products; ++i) {
+	std::stringstream producer;
+	producer << inst << "dataFromProducer" << i % 10 << "/Producer" << i % 10 << ">";
+	s << inst << "dataFromProducer" << i % 10 << "/Product" << i << ">"
+	  << " a bsbm:Product, inst:ProductType" << i % 100 << " ;"
+	  << " rdfs:label \"product " << i << (i % 97 == 0 ? " lipolyses" : "") << "\" ;"
+	  << " rdfs:comment \"comment " << i << "\" ;"
+	  << " bsbm:producer " << producer.str() << " ; dc:publisher " << producer.str() << " ;"
+	  << " bsbm:productFeature inst:ProductFeature" << i % 10 << ", inst:ProductFeature" << i / 10 % 10
+	  << ", inst:ProductFeature" << i / 7 % 10 << " ;"
+	  << " bsbm:productPropertyNumeric1 " << i % 1000 << " ; bsbm:productPropertyNumeric2 " << i % 300 << " ;"
+	  << " bsbm:productPropertyNumeric3 " << i % 200 << " ;";
+	for (int t = 1; t <= 5; ++t)
+	    s << " bsbm:productPropertyTextual" << t << " \"text " << t << " " << i << "\" ;";
+	s << " bsbm:productPropertyNumeric4 " << i % 7 << " .\n";
+    }
+    for (int i = 0; i < offers; ++i) {
+	std::stringstream vendor;
+	vendor << inst << "dataFromVendor" << (i + 3) % 10 << "/Vendor" << (i + 3) % 10 << ">";
+	s << inst << "dataFromVendor" << (i + 3) % 10 << "/Offer" << i << ">"
+	  << " bsbm:product " << inst << "dataFromProducer" << i % products % 10 << "/Product" << i % products << "> ;"
+	  << " bsbm:vendor " << vendor.str() << " ; dc:publisher " << vendor.str() << " ;"
+	  << " bsbm:price \"" << 1000 + i << ".5\" ; bsbm:deliveryDays " << i % 7 << " ;"
+	  << " bsbm:validTo \"2008-" << 10 + i % 3 << "-15\" ;"
+	  << " bsbm:offerWebpage <http://vendor.example/offer" << i << "> .\n";
+    }
+    for (int i = 0; i < reviews; ++i)
+	s << inst << "dataFromRatingSite" << (i + 1) % 10 << "/Review" << i << ">"
+	  << " bsbm:reviewFor " << inst << "dataFromProducer" << i % products % 10 << "/Product" << i % products << "> ;"
+	  << " dc:title \"review " << i << "\" ; rev:text \"text " << i << "\"@en ;"
+	  << " bsbm:reviewDate \"2008-" << 1000000 + i << "\" ;"
+	  << " rev:reviewer " << inst << "dataFromRatingSite" << i % 10 << "/Reviewer" << i % 10 << "> ;"
+	  << " bsbm:rating1 " << i % 10 << " ; bsbm:rating2 " << i % 9 << " .\n";
+    return s.str();
+}
+
+void loadBsbm (RdfDB* db, int products, int offers, int reviews) {
+    IStreamContext s(bsbmData(products, offers, reviews), IStreamContext::STRING);
+    s.mediaType = "text/turtle";
+    db->loadData(db->assureGraph(NULL), s, "", "", &f);
+}
+
+/* The bsbm queries which Operation::execute evaluates; q9 is a DESCRIBE. */
+const char* BsbmQueries[] = { "bsbm/q1.rq", "bsbm/q2.rq", "bsbm/q3.rq", "bsbm/q4.rq", "bsbm/q5.rq", "bsbm/q6.rq",
+			      "bsbm/q7.rq", "bsbm/q8.rq", "bsbm/q10.rq", "bsbm/q11.rq", "bsbm/q12.rq" };
+
+/* <rows> rows binding ?x to one of <distinct> values. */
+void repeatedRows (ResultSet* rs, int rows, int distinct) {
+    delete *(rs->begin());
+    rs->erase(rs->begin());
+    const Variable* x = f.getVariable("x");
+    for (int i = 0; i < rows; ++i) {
+	Result* r = Result::make(rs);
+	rs->insert(rs->end(), r);
+	rs->set(r, x, U("x", i % distinct), false);
+    }
+}
+
+/* Rows as strings, in result order. */
+std::vector<std::string> orderedRows (ResultSet* rs) {
+    std::vector<std::string> ret;
+    for (ResultSetIterator it = rs->begin(); it != rs->end(); ++it)
+	ret.push_back((*it)->toString());
+    return ret;
+}
+
+/* <s{i}> <p0> <i*7919%1000> ; <p1> <i%13> for <count> subjects. */
+void orderData (RdfDB* db, int count) {
+    BasicGraphPattern* g = db->assureGraph(NULL);
+    for (int i = 0; i < count; ++i) {
+	g->addTriplePattern(f.getTriple(U("s", i), U("p", 0), Int(i * 7919 % 1000)));
+	g->addTriplePattern(f.getTriple(U("s", i), U("p", 1), Int(i % 13)));
+    }
+}
+
+/* <count> subjects with a p0 of i%100, ten p2 links and, for every third,
+ * a p3 of i%7.
+ */
+void filterData (RdfDB* db, int count) {
+    BasicGraphPattern* g = db->assureGraph(NULL);
+    for (int i = 0; i < count; ++i) {
+	g->addTriplePattern(f.getTriple(U("s", i), U("p", 0), Int(i % 100)));
+	for (int j = 0; j < 10; ++j)
+	    g->addTriplePattern(f.getTriple(U("s", i), U("p", 2), U("s", (i * 10 + j) % count)));
+	if (i % 3 == 0)
+	    g->addTriplePattern(f.getTriple(U("s", i), U("p", 3), Int(i % 7)));
+    }
+}
+
+/* <count> subjects with a p0 which is, in turn, a double, a float, a
+ * plain literal and two integers, and for every other one a p1 of i%7.
+ */
+void columnData (RdfDB* db, int count) {
+    BasicGraphPattern* g = db->assureGraph(NULL);
+    for (int i = 0; i < count; ++i) {
+	std::stringstream lexical;
+	const POS* n;
+	switch (i % 5) {
+	case 0: lexical << (i % 100) << ".5"; n = f.getNumericRDFLiteral(lexical.str(), (double)(i % 100) + 0.5); break;
+	case 1: lexical << (i % 100) << ".25"; n = f.getNumericRDFLiteral(lexical.str(), (float)(i % 100) + 0.25f); break;
+	case 2: lexical << (i % 100); n = f.getRDFLiteral(lexical.str()); break; // not numeric
+	default: n = Int(i % 100);
+	}
+	g->addTriplePattern(f.getTriple(U("s", i), U("p", 0), n));
+	if (i % 2 == 0)
+	    g->addTriplePattern(f.getTriple(U("s", i), U("p", 1), Int(i % 7)));
+    }
+}
+
+/* FILTERs of numeric comparisons and integer arithmetic, which
+ * ResultSet::restrict can evaluate a ColumnBatch at a time.
+ */
+const char* ColumnQueries[] = {
+    "SELECT ?s { ?s <http://example.org/p0> ?n FILTER (?n < 50) }",
+    "SELECT ?s { ?s <http://example.org/p0> ?n FILTER (50.5 >= ?n) }",
+    "SELECT ?s ?m { ?s <http://example.org/p0> ?n OPTIONAL { ?s <http://example.org/p1> ?m } FILTER (?n != 7 && ?m = 3) }",
+    "SELECT ?s { ?s <http://example.org/p0> ?n ; <http://example.org/p1> ?m FILTER (?n > 10 && 2e0 < ?m) }",
+    "SELECT ?s ?m { ?s <http://example.org/p0> ?n ; <http://example.org/p1> ?m "
+    "FILTER (?m * 2 + 1 > 5 && !(?n >= 30) || ?m - 1 = 5) }",
+    "SELECT ?s { ?s <http://example.org/p0> ?n ; <http://example.org/p1> ?m FILTER (-?m * ?m + 10 <= ?n && ?m + 0.5 > 2) }"
+};
+
+/* <count> GRAPHs <g{i}>, each with <s{i}> <p1> <o{i}>, for every third
+ * <o{i}> <p2> <x{i}>, and a <p3>.
+ */
+void quadData (RdfDB* db, int count) {
+    for (int i = 0; i < count; ++i) {
+	BasicGraphPattern* g = db->assureGraph(U("g", i));
+	g->addTriplePattern(f.getTriple(U("s", i), U("p", 1), U("o", i)));
+	if (i % 3 == 0)
+	    g->addTriplePattern(f.getTriple(U("o", i), U("p", 2), U("x", i)));
+	g->addTriplePattern(f.getTriple(U("s", i), U("p", 3), U("o", i + 1)));
+    }
+}
+
+/* Rows binding ?<first> to <count> values and ?<second> to one of
+ * <values>, except every <skip>th row.
+ */
+ResultSet joinSide (const char* first, const char* second, int count, int skip, int values) {
+    ResultSet rs(&f);
+    delete *(rs.begin());
+    rs.erase(rs.begin());
+    for (int i = 0; i < count; ++i) {
+	Result* r = Result::make(&rs);
+	rs.insert(rs.end(), r);
+	rs.set(r, f.getVariable(first), U(first, i), false);
+	if (i % skip != 0)
+	    rs.set(r, f.getVariable(second), U(second, i % values), false);
+    }
+    return rs;
+}
+
+/* <count> triples with a literal object, ten to a subject. */
+std::string arenaTurtle (int count) {
+    std::stringstream turtle;
+    for (int i = 0; i < count; ++i)
+	turtle << "<http://example.org/s" << i / 10 << "> <http://example.org/p" << i % 10
+	       << "> \"literal value " << i << "\" .\n";
+    return turtle.str();
+}
+
+/* Load <turtle> with a new POSFactory, with or without arena allocation,
+ * and return the factory for the caller to delete.
+ */
+POSFactory* arenaLoad (bool arena, const std::string& turtle, size_t* triples, size_t* arenaBytes, size_t* slabs) {
+    POSFactory* factory = new POSFactory(arena);
+    RdfDB* db = new RdfDB();
+    IStreamContext s(turtle, IStreamContext::STRING);
+    s.mediaType = "text/turtle";
+    db->loadData(db->assureGraph(NULL), s, "", "", factory);
+    *triples = db->findGraph(NULL)->size();
+    *arenaBytes = arena ? factory->getArena()->bytesUsed() : 0;
+    *slabs = arena ? factory->getArena()->slabCount() : 0;
+    delete db;
+    return factory;
+}
@@ -0,0 +1,310 @@
+/* test_Concurrency.cpp - share one concurrent POSFactory between threads
+ */
+
+#define BOOST_TEST_MODULE Concurrency
+
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include "SWObjects.hpp"
+#include "SPARQLfedParser/SPARQLfedParser.hpp"
+#include "RdfDB.hpp"
+#include "ResultSet.hpp"
+
+/* Keep all inclusions of boost *after* the inclusion of SWObjects.hpp
+ * (or define BOOST_*_DYN_LINK manually).
+ */
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+using namespace w3c_sw;
+
+POSFactory F(false, true);
+
+const int Threads = 8;
+
+static std::string makeTurtle (int count) {
+    std::stringstream s;
+    for (int i = 0; i < count; ++i)
+	s << "<http://example.org/s" << i << "> <http://example.org/p> " << i << " .\n"
+	  << "<http://example.org/s" << i << "> <http://example.org/label> \"label " << i << "\" .\n";
+    return s.str();
+}
+
+/* Boost.Test assertions aren't thread-safe so workers only record
+ * their outcomes; the test case checks them after join().
+ */
+struct Loader {
+    const std::string* data;
+    RdfDB* db;
+    std::string* error;
+    void operator() () {
+	try {
+	    IStreamContext s(*data, IStreamContext::STRING);
+	    s.mediaType = "text/turtle";
+	    db->loadData(db->assureGraph(NULL), s, "", "", &F);
+	} catch (std::string& e) {
+	    *error = e;
+	} catch (std::exception& e) {
+	    *error = e.what();
+	}
+    }
+};
+
+struct Querier {
+    RdfDB* db;
+    const char* query;
+    int repeat;
+    std::vector<size_t>* rows;
+    std::string* error;
+    void operator() () {
+	try {
+	    for (int i = 0; i < repeat; ++i) {
+		SPARQLfedDriver parser("", &F);
+		IStreamContext s(query, IStreamContext::STRING);
+		if (parser.parse(s)) {
+		    *error = "parse failed";
+		    return;
+		}
+		ResultSet rs(&F);
+		parser.root->execute(db, &rs);
+		rows->push_back(rs.size());
+		delete parser.root;
+	    }
+	} catch (std::string& e) {
+	    *error = e;
+	} catch (std::exception& e) {
+	    *error = e.what();
+	}
+    }
+};
+
+struct BNodeMaker {
+    POSFactory* factory;
+    std::vector<const BNode*>* made;
+    void operator() () {
+	for (int i = 0; i < 10000; ++i)
+	    made->push_back(factory->createBNode());
+    }
+};
+
+/* Evaluate a shared constant expression with factories of its own; each
+ * must get the value from its own factory, never another thread's.
+ */
+struct Folder {
+    const Expression* expression;
+    std::string* error;
+    void operator() () {
+	for (int i = 0; i < 50 && error->empty(); ++i) {
+	    POSFactory mine;
+	    ResultSet rs(&mine);
+	    const POS* expected = mine.getNumericRDFLiteral("5", 5);
+	    for (int j = 0; j < 1000; ++j)
+		if (expression->eval(*rs.begin(), &mine, NULL) != expected) {
+		    *error = "folded with another factory";
+		    break;
+		}
+	}
+    }
+};
+
+static std::vector<const TriplePattern*> sortedTriples (RdfDB& db) {
+    const BasicGraphPattern* bgp = db.findGraph(NULL);
+    std::vector<const TriplePattern*> ret(bgp->begin(), bgp->end());
+    std::sort(ret.begin(), ret.end());
+    return ret;
+}
+
+/* Every thread must intern the same terms and triples. */
+BOOST_AUTO_TEST_CASE( parallelLoad ) {
+    std::string data = makeTurtle(2000);
+    RdfDB dbs[Threads];
+    std::string errors[Threads];
+    boost::thread_group threads;
+    for (int i = 0; i < Threads; ++i) {
+	Loader l = { &data, &dbs[i], &errors[i] };
+	threads.create_thread(l);
+    }
+    threads.join_all();
+
+    std::vector<const TriplePattern*> reference = sortedTriples(dbs[0]);
+    BOOST_CHECK_EQUAL(reference.size(), (size_t)4000);
+    for (int i = 0; i < Threads; ++i) {
+	BOOST_CHECK_EQUAL(errors[i], "");
+	BOOST_CHECK(sortedTriples(dbs[i]) == reference);
+    }
+}
+
+/* Queries which create literals (arithmetic, EBV) while loaders intern
+ * new terms into the same factory.
+ */
+BOOST_AUTO_TEST_CASE( queriesDuringLoads ) {
+    const char* query =
+	"SELECT ?s ?label { ?s <http://example.org/p> ?n ; <http://example.org/label> ?label "
+	"FILTER (?n * 2 + 1 > 1000 && ?n - 0.5 < 900) }";
+    std::string data = makeTurtle(1000);
+    RdfDB shared;
+    {
+	IStreamContext s(data, IStreamContext::STRING);
+	s.mediaType = "text/turtle";
+	shared.loadData(shared.assureGraph(NULL), s, "", "", &F);
+    }
+
+    std::vector<size_t> rows[Threads];
+    std::string errors[Threads * 2];
+    std::string more = makeTurtle(3000);
+    RdfDB loaded[Threads];
+    boost::thread_group threads;
+    for (int i = 0; i < Threads; ++i) {
+	Querier q = { &shared, query, 5, &rows[i], &errors[i] };
+	threads.create_thread(q);
+	Loader l = { &more, &loaded[i], &errors[Threads + i] };
+	threads.create_thread(l);
+    }
+    threads.join_all();
+
+    for (int i = 0; i < Threads; ++i) {
+	BOOST_CHECK_EQUAL(errors[i], "");
+	BOOST_CHECK_EQUAL(errors[Threads + i], "");
+	BOOST_REQUIRE_EQUAL(rows[i].size(), (size_t)5);
+	for (size_t j = 0; j < rows[i].size(); ++j)
+	    BOOST_CHECK_EQUAL(rows[i][j], (size_t)401); // 500 through 900
+	BOOST_CHECK_EQUAL(loaded[i].findGraph(NULL)->size(), (size_t)6000);
+    }
+}
+
+/* Adds and removes the triples in <batch>; queries see them all or none. */
+struct Committer {
+    RdfDB* db;
+    const RdfDB* batch;
+    int repeat;
+    void operator() () {
+	for (int i = 0; i < repeat; ++i) {
+	    db->commit(batch, NULL);
+	    db->commit(NULL, batch);
+	}
+    }
+};
+
+BOOST_AUTO_TEST_CASE( queriesDuringCommits ) {
+    /* 1000 rows, or 1300 with the batch's 100 extra ?n between 0 and 99;
+     * both groups must see the same version.
+     */
+    const char* query = "SELECT ?s ?t { ?s <http://example.org/p> ?n { ?t <http://example.org/p> ?n } }";
+    std::string data = makeTurtle(1000);
+    RdfDB shared, batch;
+    {
+	IStreamContext s(data, IStreamContext::STRING);
+	s.mediaType = "text/turtle";
+	shared.loadData(shared.assureGraph(NULL), s, "", "", &F);
+    }
+    {
+	std::stringstream extra;
+	for (int i = 0; i < 100; ++i)
+	    extra << "<http://example.org/t" << i << "> <http://example.org/p> " << i << " .\n";
+	std::string extraData = extra.str();
+	IStreamContext s(extraData, IStreamContext::STRING);
+	s.mediaType = "text/turtle";
+	batch.loadData(batch.assureGraph(NULL), s, "", "", &F);
+    }
+
+    std::vector<size_t> rows[Threads];
+    std::string errors[Threads];
+    boost::thread_group threads;
+    Committer c = { &shared, &batch, 200 };
+    threads.create_thread(c);
+    for (int i = 0; i < Threads; ++i) {
+	Querier q = { &shared, query, 20, &rows[i], &errors[i] };
+	threads.create_thread(q);
+    }
+    threads.join_all();
+
+    for (int i = 0; i < Threads; ++i) {
+	BOOST_CHECK_EQUAL(errors[i], "");
+	BOOST_REQUIRE_EQUAL(rows[i].size(), (size_t)20);
+	for (size_t j = 0; j < rows[i].size(); ++j)
+	    BOOST_CHECK(rows[i][j] == 1000 || rows[i][j] == 1300);
+    }
+    BOOST_CHECK_EQUAL(shared.findGraph(NULL)->size(), (size_t)2000);
+}
+
+/* A DELETE commits just the triples its template matches; a version
+ * pinned before it and graphs it doesn't touch are left as they were.
+ */
+BOOST_AUTO_TEST_CASE( deleteWhere ) {
+    std::string data = makeTurtle(1000);
+    RdfDB db;
+    const POS* g = F.getURI("http://example.org/g");
+    {
+	IStreamContext s(data, IStreamContext::STRING);
+	s.mediaType = "text/turtle";
+	db.loadData(db.assureGraph(NULL), s, "", "", &F);
+    }
+    {
+	IStreamContext s(data, IStreamContext::STRING);
+	s.mediaType = "text/turtle";
+	db.loadData(db.assureGraph(g), s, "", "", &F);
+    }
+    const BasicGraphPattern* named = db.findGraph(g);
+    RdfDB::Version before = db.pin();
+
+    SPARQLfedDriver parser("", &F);
+    IStreamContext s("DELETE { ?s <http://example.org/label> ?l } "
+		     "WHERE { ?s <http://example.org/p> ?n ; <http://example.org/label> ?l FILTER (?n < 10) }",
+		     IStreamContext::STRING);
+    BOOST_REQUIRE(!parser.parse(s));
+    ResultSet rs(&F);
+    parser.root->execute(&db, &rs);
+    BOOST_CHECK_EQUAL(db.findGraph(NULL)->size(), (size_t)1990);
+    BOOST_CHECK_EQUAL(before->find(DefaultGraph)->second->size(), (size_t)2000);
+    BOOST_CHECK(db.findGraph(g) == named);
+    BOOST_CHECK_THROW(parser.root->execute(&db), std::exception);
+    delete parser.root;
+}
+
+BOOST_AUTO_TEST_CASE( sharedConstantExpressions ) {
+    ProductionVector<const Expression*> rest(new POSExpression(F.getNumericRDFLiteral("3", 3)));
+    ArithmeticSum sum(new POSExpression(F.getNumericRDFLiteral("2", 2)), &rest);
+    rest.clear();
+    std::string errors[Threads];
+    boost::thread_group threads;
+    for (int i = 0; i < Threads; ++i) {
+	Folder folder = { &sum, &errors[i] };
+	threads.create_thread(folder);
+    }
+    threads.join_all();
+    for (int i = 0; i < Threads; ++i)
+	BOOST_CHECK_EQUAL(errors[i], "");
+}
+
+static void makeBNodes (POSFactory* factory) {
+    std::vector<const BNode*> made[Threads];
+    boost::thread_group threads;
+    for (int i = 0; i < Threads; ++i) {
+	BNodeMaker m = { factory, &made[i] };
+	threads.create_thread(m);
+    }
+    threads.join_all();
+
+    std::set<const BNode*> all;
+    std::set<std::string> labels;
+    for (int i = 0; i < Threads; ++i)
+	for (std::vector<const BNode*>::const_iterator it = made[i].begin(); it != made[i].end(); ++it) {
+	    all.insert(*it);
+	    labels.insert((*it)->getLexicalValue());
+	}
+    BOOST_CHECK_EQUAL(all.size(), (size_t)(Threads * 10000));
+    BOOST_CHECK_EQUAL(labels.size(), (size_t)(Threads * 10000));
+}
+
+BOOST_AUTO_TEST_CASE( parallelBNodes ) {
+    makeBNodes(&F);
+}
+
+/* A concurrent factory's Arena hands each thread its own space. */
+BOOST_AUTO_TEST_CASE( parallelArena ) {
+    POSFactory arenaFactory(true, true);
+    size_t used = arenaFactory.getArena()->bytesUsed();
+    makeBNodes(&arenaFactory);
+    BOOST_CHECK(arenaFactory.getArena()->bytesUsed() >= used + Threads * 10000 * sizeof(BNode));
+}
@@ -0,0 +1,772 @@
+/* test_Federation.cpp - SERVICE queries against in-process endpoints
+ */
+
+#define BOOST_TEST_MODULE Federation
+
+#include <map>
+#include <vector>
+#include <ctime>
+#include <sstream>
+#include <fstream>
+#include "SWObjects.hpp"
+#include "ResultSet.hpp"
+#include "RdfDB.hpp"
+#include "RdfRemoteDB.hpp"
+#include "ServiceCache.hpp"
+#include "SPARQLfedParser/SPARQLfedParser.hpp"
+#include "../interface/WEBagent.hpp"
+#if HTTP_CLIENT == SWOb_ASIO && HTTP_SERVER == SWOb_ASIO
+  #include "../interface/WEBagent_boostASIO.hpp"
+  #include "../interface/WEBserver_asio.hpp"
+#endif
+
+#if XML_PARSER == SWOb_LIBXML2
+  #include "../interface/SAXparser_libxml.hpp"
+  w3c_sw::SAXparser_libxml P;
+#elif XML_PARSER == SWOb_EXPAT1
+  #include "../interface/SAXparser_expat.hpp"
+  w3c_sw::SAXparser_expat P;
+#elif XML_PARSER == SWOb_MSXML3
+  #include "../interface/SAXparser_msxml3.hpp"
+  w3c_sw::SAXparser_msxml3 P;
+#else
+  #warning Federation tests require an XML parser
+#endif
+
+/* Keep all inclusions of boost *after* the inclusion of SWObjects.hpp
+ * (or define BOOST_*_DYN_LINK manually).
+ */
+#include <boost/test/unit_test.hpp>
+
+using namespace w3c_sw;
+
+POSFactory f(false, true); // shared with the endpoints' server threads
+
+#if REGEX_LIB != SWOb_DISABLED && XML_PARSER != SWOb_DISABLED
+
+/* Answers SPARQL GETs from a local RdfDB per service URL, recording each
+ * query it was sent.
+ */
+struct LocalEndpoints : public SWWEBagent {
+    std::map<std::string, RdfDB*> services;
+    std::vector<std::string> queries;
+
+    static std::string urlDecode (std::string encoded) {
+	std::string ret;
+	for (size_t i = 0; i < encoded.size(); ++i)
+	    if (encoded[i] == '+')
+		ret += ' ';
+	    else if (encoded[i] == '%' && i + 2 < encoded.size()) {
+		ret += (char)strtol(encoded.substr(i + 1, 2).c_str(), NULL, 16);
+		i += 2;
+	    } else
+		ret += encoded[i];
+	return ret;
+    }
+
+    virtual std::string get (const char* url) {
+	std::string u(url);
+	size_t q = u.find("?query=");
+	BOOST_REQUIRE(q != std::string::npos);
+	std::map<std::string, RdfDB*>::const_iterator service = services.find(u.substr(0, q));
+	BOOST_REQUIRE(service != services.end());
+	queries.push_back(urlDecode(u.substr(q + 7)));
+
+	SPARQLfedDriver parser("", &f);
+	IStreamContext s(queries.back(), IStreamContext::STRING);
+	BOOST_REQUIRE(!parser.parse(s));
+	ResultSet rs(&f);
+	parser.root->execute(service->second, &rs);
+	delete parser.root;
+	return rs.toString(MediaType("application/sparql-results+xml"));
+    }
+};
+
+static const URI* U (const char* prefix, int i) {
+    std::stringstream s;
+    s << "http://example.org/" << prefix << i;
+    return f.getURI(s.str());
+}
+
+static const POS* Int (int i) {
+    std::stringstream s;
+    s << i;
+    return f.getNumericRDFLiteral(s.str(), i);
+}
+
+/* Execute <query> against <db> into <rs>, sending SERVICE bindings <block>
+ * at a time.
+ */
+static void federate (const char* query, RdfDB* db, size_t block, ResultSet* rs, ServiceCache* cache = NULL) {
+    SPARQLfedDriver parser("", &f);
+    IStreamContext s(query, IStreamContext::STRING);
+    BOOST_REQUIRE(!parser.parse(s));
+    QueryOptions options;
+    options.bindJoinBlock = block;
+    options.serviceCache = cache;
+    rs->options = &options;
+    parser.root->execute(db, rs);
+    rs->options = &QueryOptions::Defaults;
+    delete parser.root;
+}
+
+/* The outer rows' distinct bindings go to the endpoint bindJoinBlock at
+ * a time in a BINDINGS clause.
+ */
+BOOST_AUTO_TEST_CASE( bindJoin ) {
+    LocalEndpoints agent;
+    RdfDB remote;
+    BasicGraphPattern* r = remote.assureGraph(NULL);
+    for (int i = 0; i < 1000; ++i)
+	if (i % 4 != 0)
+	    r->addTriplePattern(f.getTriple(U("s", i), U("p", 1), Int(i)));
+    agent.services["http://remote.example/sparql"] = &remote;
+
+    RdfDB local(&agent, &P);
+    BasicGraphPattern* g = local.assureGraph(NULL);
+    for (int i = 0; i < 1000; ++i) {
+	g->addTriplePattern(f.getTriple(U("s", i), U("p", 0), Int(0)));
+	g->addTriplePattern(f.getTriple(U("s", i), U("p", 0), Int(1))); // each ?s in two rows
+    }
+    const char* query =
+	"SELECT ?s ?n ?v { ?s <http://example.org/p0> ?n SERVICE <http://remote.example/sparql> { ?s <http://example.org/p1> ?v } }";
+
+    ResultSet blocked(&f), perRow(&f);
+    federate(query, &local, 100, &blocked);
+    size_t blockedQueries = agent.queries.size();
+    std::string first = agent.queries[0];
+    agent.queries.clear();
+    federate(query, &local, 1, &perRow);
+    BOOST_CHECK_EQUAL(blockedQueries, (size_t)10);
+    BOOST_CHECK_EQUAL(agent.queries.size(), (size_t)1000);
+    BOOST_CHECK_EQUAL(blocked.size(), (size_t)1500);
+    BOOST_CHECK(blocked == perRow);
+
+    /* Two rows per ?s but each ?s is sent once. */
+    size_t tuples = 0;
+    for (size_t at = first.find("<http://example.org/s"); at != std::string::npos; at = first.find("<http://example.org/s", at + 1))
+	++tuples;
+    BOOST_CHECK(first.find("BINDINGS") != std::string::npos);
+    BOOST_CHECK_EQUAL(tuples, (size_t)100);
+}
+
+/* Outer rows which don't bind a shared variable send NULL for it in
+ * BINDINGS, and the endpoint leaves that variable for its pattern to
+ * bind.
+ */
+BOOST_AUTO_TEST_CASE( bindingsNull ) {
+    LocalEndpoints agent;
+    RdfDB remote;
+    for (int i = 0; i < 10; ++i)
+	remote.assureGraph(NULL)->addTriplePattern(f.getTriple(U("s", i), U("p", 1), Int(i)));
+    agent.services["http://remote.example/sparql"] = &remote;
+
+    RdfDB local(&agent, &P);
+    BasicGraphPattern* g = local.assureGraph(NULL);
+    for (int i = 0; i < 10; ++i) {
+	g->addTriplePattern(f.getTriple(U("s", i), U("p", 0), Int(0)));
+	if (i < 5)
+	    g->addTriplePattern(f.getTriple(U("s", i), U("p", 2), Int(i)));
+    }
+    const char* query =
+	"SELECT ?s ?o { ?s <http://example.org/p0> ?n OPTIONAL { ?s <http://example.org/p2> ?o }"
+	" SERVICE <http://remote.example/sparql> { ?s <http://example.org/p1> ?o } }";
+
+    ResultSet rs(&f);
+    federate(query, &local, 0, &rs);
+    BOOST_REQUIRE_EQUAL(agent.queries.size(), (size_t)1);
+    BOOST_CHECK(agent.queries[0].find("NULL") != std::string::npos);
+    BOOST_CHECK_EQUAL(rs.size(), (size_t)10);
+    for (ResultSetConstIterator row = rs.begin(); row != rs.end(); ++row) {
+	const POS* s = (*row)->get(f.getVariable("s"));
+	const POS* o = (*row)->get(f.getVariable("o"));
+	BOOST_REQUIRE(o != NULL);
+	BOOST_CHECK_EQUAL(s, U("s", dynamic_cast<const IntegerRDFLiteral*>(o)->getValue()));
+    }
+}
+
+/* Endpoints answer in the SPARQL results XML format, which gives a typed
+ * literal's datatype in a plain "datatype" attribute.
+ */
+BOOST_AUTO_TEST_CASE( resultsXmlDatatype ) {
+    ResultSet written(&f);
+    Result* row = *written.begin();
+    written.set(row, f.getVariable("n"), Int(7), false);
+    written.set(row, f.getVariable("d"), f.getRDFLiteral("2008-10-15", f.getURI("http://www.w3.org/2001/XMLSchema#date")), false);
+    std::string xml = written.toString(MediaType("application/sparql-results+xml"));
+    BOOST_CHECK(xml.find("datatype=\"http://www.w3.org/2001/XMLSchema#integer\"") != std::string::npos);
+    BOOST_CHECK(xml.find("datatype=\"http://www.w3.org/2001/XMLSchema#date\"") != std::string::npos);
+    BOOST_CHECK(xml.find("xsd:datatype") == std::string::npos);
+
+    IStreamContext s(xml, IStreamContext::STRING);
+    ResultSet read(&f, &P, s);
+    BOOST_CHECK_EQUAL(read, written);
+}
+
+/* SERVICE ?svc queries each service named in the outer rows with just
+ * the rows naming it.
+ */
+BOOST_AUTO_TEST_CASE( variableService ) {
+    LocalEndpoints agent;
+    RdfDB remotes[3];
+    for (int e = 0; e < 3; ++e) {
+	std::stringstream url;
+	url << "http://remote" << e << ".example/sparql";
+	agent.services[url.str()] = &remotes[e];
+	for (int i = 0; i < 300; ++i)
+	    if (i % 3 == e)
+		remotes[e].assureGraph(NULL)->addTriplePattern(f.getTriple(U("s", i), U("p", 1), Int(e)));
+    }
+
+    RdfDB local(&agent, &P);
+    BasicGraphPattern* g = local.assureGraph(NULL);
+    for (int i = 0; i < 300; ++i) {
+	std::stringstream url;
+	url << "http://remote" << i % 3 << ".example/sparql";
+	g->addTriplePattern(f.getTriple(U("s", i), U("p", 0), f.getURI(url.str())));
+    }
+    g->addTriplePattern(f.getTriple(U("s", 300), U("p", 0), Int(0))); // not a service
+    const char* query =
+	"SELECT ?s ?svc ?v { ?s <http://example.org/p0> ?svc SERVICE ?svc { ?s <http://example.org/p1> ?v } }";
+
+    ResultSet rs(&f);
+    federate(query, &local, 40, &rs);
+    BOOST_CHECK_EQUAL(agent.queries.size(), (size_t)9); // 100 rows per service
+    BOOST_CHECK_EQUAL(rs.size(), (size_t)300);
+    for (ResultSetConstIterator row = rs.begin(); row != rs.end(); ++row) {
+	std::stringstream url;
+	url << "http://remote" << dynamic_cast<const IntegerRDFLiteral*>((*row)->get(f.getVariable("v")))->getValue() << ".example/sparql";
+	BOOST_CHECK_EQUAL((*row)->get(f.getVariable("svc")), f.getURI(url.str()));
+    }
+}
+
+/* SERVICE ?svc calls the IRI each row binds ?svc to, even when the
+ * inner pattern shares no other variable with the rows.
+ */
+BOOST_AUTO_TEST_CASE( serviceVariableBinding ) {
+    LocalEndpoints agent;
+    RdfDB remote;
+    remote.assureGraph(NULL)->addTriplePattern(f.getTriple(U("s", 0), U("p", 1), Int(1)));
+    agent.services["http://remote.example/sparql"] = &remote;
+
+    RdfDB local(&agent, &P);
+    local.assureGraph(NULL)->addTriplePattern(f.getTriple(U("s", 0), U("p", 0), f.getURI("http://remote.example/sparql")));
+    const char* query =
+	"SELECT ?svc ?x ?v { ?s <http://example.org/p0> ?svc SERVICE ?svc { ?x <http://example.org/p1> ?v } }";
+
+    ResultSet rs(&f);
+    federate(query, &local, 0, &rs);
+    BOOST_CHECK_EQUAL(agent.queries.size(), (size_t)1);
+    BOOST_REQUIRE_EQUAL(rs.size(), (size_t)1);
+    BOOST_CHECK_EQUAL((*rs.begin())->get(f.getVariable("svc")), f.getURI("http://remote.example/sparql"));
+    BOOST_CHECK_EQUAL((*rs.begin())->get(f.getVariable("x")), U("s", 0));
+}
+
+/* A ServiceCache whose clock the test sets. */
+struct TestCache : public ServiceCache {
+    time_t clock;
+    TestCache (size_t maxBytes, long ttl, std::string directory = "")
+	: ServiceCache(maxBytes, ttl, directory), clock(1000) {  }
+    virtual time_t now () const { return clock; }
+};
+
+/* Repeated SERVICE queries are answered from the cache until they expire. */
+BOOST_AUTO_TEST_CASE( serviceCache ) {
+    LocalEndpoints agent;
+    RdfDB remote;
+    for (int i = 0; i < 100; ++i)
+	remote.assureGraph(NULL)->addTriplePattern(f.getTriple(U("s", i), U("p", 1), Int(i)));
+    agent.services["http://remote.example/sparql"] = &remote;
+    RdfDB local(&agent, &P);
+    for (int i = 0; i < 100; ++i)
+	local.assureGraph(NULL)->addTriplePattern(f.getTriple(U("s", i), U("p", 0), Int(0)));
+    const char* query =
+	"SELECT ?s ?v { ?s <http://example.org/p0> ?n SERVICE <http://remote.example/sparql> { ?s <http://example.org/p1> ?v } }";
+
+    TestCache cache(1024 * 1024, 60);
+    ResultSet first(&f), second(&f), expired(&f);
+    federate(query, &local, 10, &first, &cache);
+    federate(query, &local, 10, &second, &cache);
+    BOOST_CHECK_EQUAL(agent.queries.size(), (size_t)10);
+    BOOST_CHECK_EQUAL(cache.misses, (size_t)10);
+    BOOST_CHECK_EQUAL(cache.hits, (size_t)10);
+    BOOST_CHECK(first == second);
+
+    cache.clock += 61;
+    federate(query, &local, 10, &expired, &cache);
+    BOOST_CHECK_EQUAL(agent.queries.size(), (size_t)20);
+    BOOST_CHECK(first == expired);
+}
+
+/* RdfRemoteDB sends a GRAPH named by one of its endpoint patterns to
+ * that endpoint, constrained to the rows bound so far, and asks the
+ * ServiceCache first.
+ */
+BOOST_AUTO_TEST_CASE( remoteGraph ) {
+    LocalEndpoints agent;
+    RdfDB remote;
+    for (int i = 0; i < 10; ++i)
+	remote.assureGraph(NULL)->addTriplePattern(f.getTriple(U("s", i), U("p", 1), Int(i)));
+    agent.services["http://remote.example/sparql"] = &remote;
+
+    std::vector<const char*> endpoints;
+    endpoints.push_back("http://remote\\.example/.*");
+    RdfRemoteDB local(&agent, &P, endpoints);
+    for (int i = 0; i < 5; ++i)
+	local.assureGraph(NULL)->addTriplePattern(f.getTriple(U("s", i), U("p", 0), Int(0)));
+    const URI* name = f.getURI("http://remote.example/sparql");
+    std::stringstream nothing;
+    IStreamContext istr(name->getLexicalValue(), nothing);
+    BOOST_REQUIRE(!local.loadData(local.assureGraph(name), istr, name->getLexicalValue(), name->getLexicalValue(), &f));
+    const char* query =
+	"SELECT ?s ?v { ?s <http://example.org/p0> ?n GRAPH <http://remote.example/sparql> { ?s <http://example.org/p1> ?v } }";
+
+    TestCache cache(1024 * 1024, 60);
+    ResultSet first(&f), second(&f);
+    federate(query, &local, 0, &first, &cache);
+    federate(query, &local, 0, &second, &cache);
+    BOOST_REQUIRE_EQUAL(agent.queries.size(), (size_t)1);
+    BOOST_CHECK(agent.queries[0].find("FILTER") != std::string::npos);
+    BOOST_CHECK_EQUAL(cache.misses, (size_t)1);
+    BOOST_CHECK_EQUAL(cache.hits, (size_t)1);
+    BOOST_CHECK_EQUAL(first.size(), (size_t)5);
+    BOOST_CHECK(first == second);
+}
+
+/* Entries count their key and answer, ~70 bytes here, so two fit. */
+BOOST_AUTO_TEST_CASE( cacheEviction ) {
+    TestCache cache(160, 0);
+    cache.put("http://a.example/", "SELECT * { ?s ?p ?o }", std::string(30, 'a'));
+    cache.put("http://b.example/", "SELECT * { ?s ?p ?o }", std::string(30, 'b'));
+    std::string answer;
+    BOOST_CHECK(cache.get("http://a.example/", "SELECT *\n{ ?s  ?p ?o }", &answer)); // a is now most recent
+    BOOST_CHECK_EQUAL(answer, std::string(30, 'a'));
+    BOOST_CHECK(!cache.get("http://a.example/", "SELECT * { ?s ?p \"?o  \" }", &answer));
+    cache.put("http://c.example/", "SELECT * { ?s ?p ?o }", std::string(30, 'c'));
+    BOOST_CHECK_EQUAL(cache.evictions, (size_t)1);
+    BOOST_CHECK(!cache.get("http://b.example/", "SELECT * { ?s ?p ?o }", &answer));
+    BOOST_CHECK(cache.get("http://a.example/", "SELECT * { ?s ?p ?o }", &answer));
+    BOOST_CHECK(cache.getBytes() <= 160);
+}
+
+/* A second cache on the same directory finds the first one's answers. */
+BOOST_AUTO_TEST_CASE( cacheDisk ) {
+    const char* query = "SELECT ?s { ?s <http://example.org/p1> 1 }";
+    TestCache writer(1024, 60, ".");
+    writer.put("http://remote.example/sparql", query, "<sparql/>");
+    TestCache reader(1024, 60, "."), late(1024, 60, ".");
+    late.clock += 61;
+    std::string answer;
+    BOOST_CHECK(reader.get("http://remote.example/sparql", query, &answer));
+    BOOST_CHECK_EQUAL(answer, "<sparql/>");
+    BOOST_CHECK_EQUAL(reader.diskHits, (size_t)1);
+    BOOST_CHECK(reader.get("http://remote.example/sparql", query, &answer)); // now in memory
+    BOOST_CHECK_EQUAL(reader.diskHits, (size_t)1);
+    BOOST_CHECK(!late.get("http://remote.example/sparql", query, &answer)); // expired and removed
+    BOOST_CHECK(!std::ifstream(writer.path("http://remote.example/sparql", query).c_str()));
+    std::stringstream tmp; // writer's temporary file, renamed into place
+    tmp << writer.path("http://remote.example/sparql", query) << '.' << (ServiceCache*)&writer << ".tmp";
+    BOOST_CHECK(!std::ifstream(tmp.str().c_str()));
+}
+
+/* An answer which can't be written to disk is still kept in memory. */
+BOOST_AUTO_TEST_CASE( cacheDiskUnwritable ) {
+    const char* query = "SELECT ?s { ?s <http://example.org/p1> 1 }";
+    TestCache writer(1024, 60, "./no-such-directory");
+    writer.put("http://remote.example/sparql", query, "<sparql/>");
+    std::string answer;
+    BOOST_CHECK(writer.get("http://remote.example/sparql", query, &answer));
+    BOOST_CHECK_EQUAL(answer, "<sparql/>");
+    TestCache reader(1024, 60, "./no-such-directory");
+    BOOST_CHECK(!reader.get("http://remote.example/sparql", query, &answer));
+}
+
+#if HTTP_CLIENT == SWOb_ASIO && HTTP_SERVER == SWOb_ASIO
+
+/* Counts the requests a group of endpoints is handling at once. */
+struct Overlap {
+    boost::mutex lock;
+    size_t current, peak;
+    Overlap () : current(0), peak(0) {  }
+    struct Visit {
+	Overlap* overlap;
+	Visit (Overlap* overlap) : overlap(overlap) {
+	    if (overlap == NULL)
+		return;
+	    boost::mutex::scoped_lock lock(overlap->lock);
+	    if (++overlap->current > overlap->peak)
+		overlap->peak = overlap->current;
+	}
+	~Visit () {
+	    if (overlap == NULL)
+		return;
+	    boost::mutex::scoped_lock lock(overlap->lock);
+	    --overlap->current;
+	}
+    };
+};
+
+/* A SPARQL endpoint which answers from an RdfDB after <latency> ms,
+ * counting its requests in <overlap> if given.
+ */
+struct SlowEndpoint : public webserver::request_handler {
+    RdfDB* db;
+    int latency;
+    Overlap* overlap;
+    SlowEndpoint (RdfDB* db, int latency, Overlap* overlap = NULL)
+	: webserver::request_handler(""), db(db), latency(latency), overlap(overlap) {  }
+    virtual void handle_request (webserver::request& req, webserver::reply& rep) {
+	Overlap::Visit visit(overlap);
+	req.getPath(); // decodes req.parms
+	boost::this_thread::sleep(boost::posix_time::milliseconds(latency));
+	try {
+	    SPARQLfedDriver parser("", &f);
+	    IStreamContext s(req.parms["query"], IStreamContext::STRING);
+	    if (parser.parse(s)) {
+		rep = webserver::reply::stock_reply(webserver::reply::bad_request);
+		return;
+	    }
+	    ResultSet rs(&f);
+	    parser.root->execute(db, &rs);
+	    delete parser.root;
+	    rep.status = webserver::reply::ok;
+	    rep.content = rs.toString(MediaType("application/sparql-results+xml"));
+	} catch (std::string&) {
+	    rep = webserver::reply::stock_reply(webserver::reply::internal_server_error);
+	    return;
+	}
+	rep.addHeader("Content-Length", boost::lexical_cast<std::string>(rep.content.size()));
+	rep.addHeader("Content-Type", "application/sparql-results+xml");
+    }
+};
+
+/* Serves <handler> on 127.0.0.1, on a port the system picks, while in
+ * scope.
+ */
+struct LocalServer {
+    webserver::server server;
+    boost::thread thread;
+    LocalServer (webserver::request_handler& handler)
+	: server("127.0.0.1", "0", 8, handler),
+	  thread(boost::bind(&webserver::server::run, &server)) {  }
+    ~LocalServer () {
+	server.stop();
+	thread.join();
+    }
+    std::string hostPort () const {
+	std::stringstream s;
+	s << "127.0.0.1:" << server.port();
+	return s.str();
+    }
+    std::string url (const char* path = "/sparql") const {
+	return "http://" + hostPort() + path;
+    }
+};
+
+/* A SERVICE's blocks of bindings go to the endpoint maxPerEndpoint at a
+ * time; the endpoint counts how many it handles at once.
+ */
+BOOST_AUTO_TEST_CASE( concurrentBlocks ) {
+    RdfDB remote;
+    for (int i = 0; i < 80; ++i)
+	remote.assureGraph(NULL)->addTriplePattern(f.getTriple(U("s", i), U("p", 1), Int(i)));
+    Overlap serialOverlap, concurrentOverlap;
+    SlowEndpoint serialEndpoint(&remote, 100, &serialOverlap), concurrentEndpoint(&remote, 100, &concurrentOverlap);
+    LocalServer serialServer(serialEndpoint), concurrentServer(concurrentEndpoint);
+
+    WEBagent_boostASIO agent;
+    RdfDB local(&agent, &P);
+    for (int i = 0; i < 80; ++i)
+	local.assureGraph(NULL)->addTriplePattern(f.getTriple(U("s", i), U("p", 0), Int(0)));
+    std::string serialQuery =
+	"SELECT ?s ?v { ?s <http://example.org/p0> ?n SERVICE <" + serialServer.url() + "> { ?s <http://example.org/p1> ?v } }";
+    std::string concurrentQuery =
+	"SELECT ?s ?v { ?s <http://example.org/p0> ?n SERVICE <" + concurrentServer.url() + "> { ?s <http://example.org/p1> ?v } }";
+
+    ResultSet serial(&f), concurrent(&f);
+    agent.maxPerEndpoint = 1;
+    federate(serialQuery.c_str(), &local, 10, &serial);
+    agent.maxPerEndpoint = 8;
+    federate(concurrentQuery.c_str(), &local, 10, &concurrent);
+    BOOST_CHECK_EQUAL(serial.size(), (size_t)80);
+    BOOST_CHECK(serial == concurrent);
+    BOOST_CHECK_EQUAL(serialOverlap.peak, (size_t)1);
+    BOOST_CHECK(concurrentOverlap.peak > 1);
+    BOOST_CHECK(concurrentOverlap.peak <= 8);
+}
+
+/* UNIONed SERVICEs query their endpoints at the same time. */
+BOOST_AUTO_TEST_CASE( concurrentUnion ) {
+    RdfDB remotes[2];
+    Overlap overlap;
+    SlowEndpoint endpoint0(&remotes[0], 300, &overlap), endpoint1(&remotes[1], 300, &overlap);
+    for (int i = 0; i < 20; ++i)
+	remotes[i % 2].assureGraph(NULL)->addTriplePattern(f.getTriple(U("s", i), U("p", 1), Int(i)));
+    LocalServer server0(endpoint0), server1(endpoint1);
+
+    WEBagent_boostASIO agent;
+    RdfDB local(&agent, &P);
+    std::string query =
+	"SELECT ?s ?v {\n"
+	"  { SERVICE <" + server0.url() + "> { ?s <http://example.org/p1> ?v } }\n"
+	"  UNION\n"
+	"  { SERVICE <" + server1.url() + "> { ?s <http://example.org/p1> ?v } }\n"
+	"}";
+    ResultSet rs(&f);
+    federate(query.c_str(), &local, 100, &rs);
+    BOOST_CHECK_EQUAL(rs.size(), (size_t)20);
+    BOOST_CHECK_EQUAL(overlap.peak, (size_t)2);
+}
+
+/* Queries still outstanding at the deadline fail the SERVICE. */
+BOOST_AUTO_TEST_CASE( serviceDeadline ) {
+    RdfDB remote;
+    remote.assureGraph(NULL)->addTriplePattern(f.getTriple(U("s", 0), U("p", 1), Int(0)));
+    SlowEndpoint endpoint(&remote, 500);
+    LocalServer server(endpoint);
+
+    WEBagent_boostASIO agent(NULL, NULL, 4, 100);
+    RdfDB local(&agent, &P);
+    ResultSet rs(&f);
+    std::string error;
+    try {
+	std::string query = "SELECT ?s ?v { SERVICE <" + server.url() + "> { ?s <http://example.org/p1> ?v } }";
+	federate(query.c_str(), &local, 100, &rs);
+    } catch (std::string& e) {
+	error = e;
+    }
+    BOOST_CHECK(error.find("exceeded the deadline of 100ms") != std::string::npos);
+}
+
+/* Answers every GET with <content>, in 100-byte chunks if <chunked>. */
+struct FixedEndpoint : public webserver::request_handler {
+    std::string content;
+    bool chunked;
+    FixedEndpoint (std::string content, bool chunked)
+	: webserver::request_handler(""), content(content), chunked(chunked) {  }
+    virtual void handle_request (webserver::request& /* req */, webserver::reply& rep) {
+	rep.status = webserver::reply::ok;
+	if (chunked) {
+	    std::stringstream s;
+	    for (size_t at = 0; at < content.size(); at += 100) {
+		std::string chunk(content.substr(at, 100));
+		s << std::hex << chunk.size() << "\r\n" << chunk << "\r\n";
+	    }
+	    s << "0\r\n\r\n";
+	    rep.content = s.str();
+	    rep.addHeader("Transfer-Encoding", "chunked");
+	} else {
+	    rep.content = content;
+	    rep.addHeader("Content-Length", boost::lexical_cast<std::string>(rep.content.size()));
+	}
+	rep.addHeader("Content-Type", "text/plain");
+    }
+};
+
+struct PooledAgent : public WEBagent_boostASIO {
+    size_t idleTo (std::string hostPort) { return idle[hostPort].size(); }
+};
+
+/* Sequential GETs reuse one kept-alive connection. */
+BOOST_AUTO_TEST_CASE( keepAliveGets ) {
+    std::string content;
+    for (int i = 0; i < 100; ++i)
+	content += "0123456789";
+    FixedEndpoint plain(content, false), chunked(content, true);
+    LocalServer server0(plain), server1(chunked);
+    const int Gets = 300;
+
+    for (int i = 0; i < Gets; ++i) {
+	WEBagent_boostASIO fresh; // a new connection, resolver and buffers each time
+	BOOST_REQUIRE_EQUAL(fresh.get(server0.url("/").c_str()), content);
+    }
+    PooledAgent agent;
+    for (int i = 0; i < Gets; ++i)
+	BOOST_REQUIRE_EQUAL(agent.get(server0.url("/").c_str()), content);
+    BOOST_CHECK_EQUAL(agent.idleTo(server0.hostPort()), (size_t)1);
+
+    BOOST_CHECK_EQUAL(agent.get(server1.url("/").c_str()), content);
+    BOOST_CHECK_EQUAL(agent.get(server1.url("/").c_str()), content);
+    BOOST_CHECK_EQUAL(agent.idleTo(server1.hostPort()), (size_t)1);
+}
+
+/* Answers the GETs on one kept-alive connection: the first with a 204
+ * carrying no Content-Length, the second with "ok". Gives up if the
+ * second GET doesn't come within two seconds, and takes no more
+ * connections.
+ */
+struct NoContentServer {
+    boost::asio::io_service io_service;
+    boost::asio::ip::tcp::acceptor acceptor;
+    boost::thread thread;
+    NoContentServer ()
+	: acceptor(io_service, boost::asio::ip::tcp::endpoint(boost::asio::ip::address::from_string("127.0.0.1"), 0)),
+	  thread(boost::bind(&NoContentServer::serve, this)) {  }
+    ~NoContentServer () {
+	thread.join();
+    }
+    std::string hostPort () const {
+	std::stringstream s;
+	s << "127.0.0.1:" << acceptor.local_endpoint().port();
+	return s.str();
+    }
+    void serve () {
+	boost::asio::ip::tcp::socket socket(io_service);
+	try {
+	    acceptor.accept(socket);
+	    boost::asio::streambuf request;
+	    boost::asio::read_until(socket, request, "\r\n\r\n");
+	    request.consume(request.size());
+	    boost::asio::write(socket, boost::asio::buffer(std::string("HTTP/1.1 204 No Content\r\nConnection: keep-alive\r\n\r\n")));
+	    for (int i = 0; i < 200 && socket.available() == 0; ++i)
+		boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+	    if (socket.available() != 0) {
+		boost::asio::read_until(socket, request, "\r\n\r\n");
+		boost::asio::write(socket, boost::asio::buffer(std::string("HTTP/1.1 200 OK\r\nContent-Length: 2\r\nConnection: keep-alive\r\n\r\nok")));
+	    }
+	} catch (...) {
+	}
+	// Stop listening before the client sees the connection close.
+	boost::system::error_code ignored;
+	acceptor.close(ignored);
+    }
+};
+
+/* A 204 without a Content-Length has an empty body, so its connection is
+ * reused rather than read until the server closes it.
+ */
+BOOST_AUTO_TEST_CASE( noContentKeepAlive ) {
+    NoContentServer server;
+    std::string url("http://" + server.hostPort() + "/");
+    PooledAgent agent;
+    std::string error;
+    try {
+	agent.get(url.c_str());
+    } catch (std::string& e) {
+	error = e;
+    }
+    BOOST_CHECK(error.find("returned with status code 204") != std::string::npos);
+    BOOST_CHECK_EQUAL(agent.idleTo(server.hostPort()), (size_t)1);
+    BOOST_CHECK_EQUAL(agent.get(url.c_str()), "ok");
+}
+
+/* Reads each answer whole before parsing it, as agents did before getStream. */
+struct BufferingAgent : public WEBagent_boostASIO {
+    virtual std::istream* getStream (const char* url) { return SWWEBagent::getStream(url); }
+};
+
+/* A lone SERVICE query's answer is joined as it is read off the socket. */
+BOOST_AUTO_TEST_CASE( streamedService ) {
+    RdfDB remote;
+    for (int i = 0; i < 5000; ++i)
+	remote.assureGraph(NULL)->addTriplePattern(f.getTriple(U("s", i), U("p", 1), Int(i)));
+    SlowEndpoint endpoint(&remote, 0);
+    LocalServer server(endpoint);
+
+    WEBagent_boostASIO streaming;
+    BufferingAgent buffering;
+    RdfDB streamingDB(&streaming, &P), bufferingDB(&buffering, &P);
+    for (int i = 0; i < 5000; i += 2) {
+	streamingDB.assureGraph(NULL)->addTriplePattern(f.getTriple(U("s", i), U("p", 0), Int(0)));
+	bufferingDB.assureGraph(NULL)->addTriplePattern(f.getTriple(U("s", i), U("p", 0), Int(0)));
+    }
+    std::string query =
+	"SELECT ?s ?v { ?s <http://example.org/p0> ?n SERVICE <" + server.url() + "> { ?s <http://example.org/p1> ?v } }";
+
+    ResultSet streamed(&f), buffered(&f);
+    federate(query.c_str(), &streamingDB, 0, &streamed);
+    federate(query.c_str(), &bufferingDB, 0, &buffered);
+    BOOST_CHECK_EQUAL(streamed.size(), (size_t)2500);
+    BOOST_CHECK(streamed == buffered);
+}
+
+/* getStream undoes the chunked transfer-coding as it reads. */
+BOOST_AUTO_TEST_CASE( chunkedStream ) {
+    std::string content;
+    for (int i = 0; i < 1000; ++i)
+	content += (char)('a' + i % 26);
+    FixedEndpoint chunked(content, true);
+    LocalServer server(chunked);
+
+    WEBagent_boostASIO agent;
+    for (int i = 0; i < 2; ++i) {
+	std::istream* body = agent.getStream(server.url("/").c_str());
+	std::string read;
+	char buf[64];
+	while (body->read(buf, sizeof(buf)) || body->gcount() > 0)
+	    read.append(buf, body->gcount());
+	delete body;
+	BOOST_CHECK_EQUAL(read, content);
+    }
+}
+
+/* Notes each answer streamAll hands over and how long it took. */
+struct AnswerTimes : public SWWEBagent::AnswerHandler {
+    boost::posix_time::ptime start;
+    std::vector<std::string> bodies;
+    std::vector<long> millis;
+    AnswerTimes () : start(boost::posix_time::microsec_clock::universal_time()) {  }
+    virtual void answer (size_t, std::istream& body) {
+	std::string read;
+	char buf[256];
+	while (body.read(buf, sizeof(buf)) || body.gcount() > 0)
+	    read.append(buf, body.gcount());
+	note(read);
+    }
+    virtual void failed (size_t, std::string error) { note("failed: " + error); }
+    void note (std::string body) {
+	bodies.push_back(body);
+	millis.push_back((boost::posix_time::microsec_clock::universal_time() - start).total_milliseconds());
+    }
+};
+
+/* streamAll hands over each answer while later ones are still coming. */
+BOOST_AUTO_TEST_CASE( streamedAnswers ) {
+    RdfDB remote;
+    remote.assureGraph(NULL)->addTriplePattern(f.getTriple(U("s", 0), U("p", 1), Int(0)));
+    FixedEndpoint fast("fast", false);
+    SlowEndpoint slow(&remote, 500);
+    LocalServer fastServer(fast), slowServer(slow);
+
+    WEBagent_boostASIO agent;
+    std::vector<SWWEBagent::Request> requests;
+    requests.push_back(SWWEBagent::Request(fastServer.url("/")));
+    SWWEBagent::Parameter query("query", SWWEBagent::urlEncode("SELECT ?s { ?s ?p ?o }"));
+    requests.push_back(SWWEBagent::Request(SWWEBagent::getURL(slowServer.url(), &query, 1)));
+    AnswerTimes times;
+    agent.streamAll(requests, &times);
+    BOOST_REQUIRE_EQUAL(times.bodies.size(), (size_t)2);
+    BOOST_CHECK_EQUAL(times.bodies[0], "fast");
+    BOOST_CHECK(times.bodies[1].find("http://example.org/s0") != std::string::npos);
+    BOOST_CHECK(times.millis[0] < 400);
+    BOOST_CHECK(times.millis[1] >= 500);
+}
+
+/* Streamed blocks are still copied whole into the cache. */
+BOOST_AUTO_TEST_CASE( streamedBlocksCache ) {
+    RdfDB remote;
+    for (int i = 0; i < 80; ++i)
+	remote.assureGraph(NULL)->addTriplePattern(f.getTriple(U("s", i), U("p", 1), Int(i)));
+    SlowEndpoint endpoint(&remote, 0);
+    LocalServer server(endpoint);
+
+    WEBagent_boostASIO agent;
+    RdfDB local(&agent, &P);
+    for (int i = 0; i < 80; ++i)
+	local.assureGraph(NULL)->addTriplePattern(f.getTriple(U("s", i), U("p", 0), Int(0)));
+    std::string query =
+	"SELECT ?s ?v { ?s <http://example.org/p0> ?n SERVICE <" + server.url() + "> { ?s <http://example.org/p1> ?v } }";
+
+    TestCache cache(1024 * 1024, 60);
+    ResultSet fetched(&f), cached(&f);
+    federate(query.c_str(), &local, 10, &fetched, &cache);
+    federate(query.c_str(), &local, 10, &cached, &cache);
+    BOOST_CHECK_EQUAL(fetched.size(), (size_t)80);
+    BOOST_CHECK_EQUAL(cache.misses, (size_t)8);
+    BOOST_CHECK_EQUAL(cache.hits, (size_t)8);
+    BOOST_CHECK(fetched == cached);
+}
+
+#endif /* HTTP_CLIENT == SWOb_ASIO && HTTP_SERVER == SWOb_ASIO */
+
+#endif /* REGEX_LIB != SWOb_DISABLED && XML_PARSER != SWOb_DISABLED */
@@ -5,19 +5,15 @@
 
 #define BOOST_TEST_MODULE GraphMatch
 
-#include <map>
-#include <vector>
-#include "SWObjects.hpp"
-#include "ResultSet.hpp"
+#include <new>
+#include <fstream>
+#include "GraphMatch.hpp"
 
 /* Keep all inclusions of boost *after* the inclusion of SWObjects.hpp
  * (or define BOOST_*_DYN_LINK manually).
  */
 #include <boost/test/unit_test.hpp>
-
-using namespace w3c_sw;
-
-POSFactory f;
+#include <boost/weak_ptr.hpp>
 
 /* Intermediate structures to make it easier to create ResultSets.
  * usage:
@@ -47,7 +43,7 @@ ResultSet makeResultSet (R rows[], int count, POS::String2BNode& bnodeMap) {
     delete *(rs.begin());
     rs.erase(rs.begin());
     for (int i = 0; i < count; ++i) {
-	Result* r = new Result(&rs);
+	Result* r = Result::make(&rs);
 	rs.insert(rs.end(), r);
 	B* bindings = rows[i].bindings;
 	for (int j = 0; j < rows[i].count; ++j)
@@ -157,5 +153,989 @@ BOOST_AUTO_TEST_CASE( bgp ) {
 
 }
 
-#endif /* ! REGEX_LIB != SWOb_DISABLED */
+/* Each access path finds the same rows with and without the SPO/OSP
+ * indexes.
+ */
+BOOST_AUTO_TEST_CASE( permutationIndexes ) {
+    const int subjects = 2000, predicates = 5, objects = 100;
+    DefaultGraphPattern data;
+    gridData(&data, subjects, predicates, objects);
+    BOOST_REQUIRE_EQUAL(data.size(), (size_t)(subjects * predicates));
+
+    const Variable* s = f.getVariable("s");
+    const Variable* p = f.getVariable("p");
+    const Variable* o = f.getVariable("o");
+    struct { const POS *s, *p, *o; size_t expect; } paths[] = {
+	{ U("s", 17), p,          o,          predicates },
+	{ s,          p,          U("o", 17), subjects * predicates / objects },
+	{ U("s", 17), p,          U("o", 18), 1 },
+	{ s,          U("p", 1),  U("o", 18), subjects / objects },
+	{ U("s", 17), U("p", 1),  o,          1 }
+    };
+    QueryOptions predOnly;
+    predOnly.permutationIndexes = false;
+    for (size_t i = 0; i < sizeof(paths)/sizeof(paths[0]); ++i) {
+	DefaultGraphPattern pattern;
+	pattern.addTriplePattern(f.getTriple(paths[i].s, paths[i].p, paths[i].o));
+	ResultSet indexed(&f), scanned(&f);
+	match(data, pattern, QueryOptions::Defaults, &indexed);
+	match(data, pattern, predOnly, &scanned);
+	BOOST_CHECK_EQUAL(indexed.size(), paths[i].expect);
+	BOOST_CHECK(indexed == scanned);
+    }
+
+    /* Erasing a triple removes it from every permutation. */ {
+	DefaultGraphPattern pattern;
+	pattern.addTriplePattern(f.getTriple(U("s", 17), p, o));
+	data.erase(data.begin() + 17 * predicates);
+	ResultSet bySubject(&f), byObject(&f);
+	match(data, pattern, QueryOptions::Defaults, &bySubject);
+	BOOST_CHECK_EQUAL(bySubject.size(), (size_t)(predicates - 1));
+	pattern.clearTriples();
+	pattern.addTriplePattern(f.getTriple(s, U("p", 0), U("o", 17)));
+	match(data, pattern, QueryOptions::Defaults, &byObject);
+	BOOST_CHECK_EQUAL(byObject.size(), (size_t)(subjects / objects - 1));
+    }
+}
+
+/* A star join where the first pattern binds ?s to a few subjects finds
+ * the same rows whether later patterns probe SPO for that ?s or scan
+ * every triple with their predicate.
+ */
+BOOST_AUTO_TEST_CASE( boundValueLookups ) {
+    const int subjects = 2000, predicates = 4, objects = 100;
+    DefaultGraphPattern data;
+    gridData(&data, subjects, predicates, objects);
+
+    const Variable* s = f.getVariable("s");
+    DefaultGraphPattern pattern;
+    pattern.addTriplePattern(f.getTriple(s, U("p", 0), U("o", 17)));
+    pattern.addTriplePattern(f.getTriple(s, U("p", 1), f.getVariable("x")));
+    pattern.addTriplePattern(f.getTriple(s, U("p", 2), f.getVariable("y")));
+    pattern.addTriplePattern(f.getTriple(f.getVariable("z"), U("p", 3), f.getVariable("y")));
+
+    QueryOptions constantsOnly;
+    constantsOnly.boundValueLookups = false;
+    ResultSet probed(&f), scanned(&f);
+    match(data, pattern, QueryOptions::Defaults, &probed);
+    match(data, pattern, constantsOnly, &scanned);
+    BOOST_CHECK_EQUAL(probed.size(), (size_t)(subjects / objects * subjects / objects));
+    BOOST_CHECK_EQUAL(probed.toString(), scanned.toString());
+}
+
+BOOST_AUTO_TEST_CASE( patternOrdering ) {
+    RdfDB db;
+    loadBsbm(&db, 200, 3000, 500);
+    const char* q1Patterns =
+	"?product <http://www.w3.org/2000/01/rdf-schema#label> ?label ."
+	"?product <http://www.w3.org/1999/02/22-rdf-syntax-ns#type> <http://www4.wiwiss.fu-berlin.de/bizer/bsbm/v01/instances/ProductType59> .";
+    QueryOptions queryOrder;
+    queryOrder.patternOrdering = false;
+
+    /* ?product a <ProductType59> is more selective than the rdfs:label
+     * which q1 lists first.
+     */ {
+	DefaultGraphPattern q1;
+	POS::String2BNode bnodeMap;
+	f.parseTriples(&q1, q1Patterns, bnodeMap);
+	std::stringstream debug;
+	std::ostream* debugStream = &debug;
+	ResultSet rs(&f, &debugStream);
+	db.findGraph(NULL)->bindVariables(&rs, NULL, &q1, NULL);
+	BOOST_CHECK_EQUAL(rs.size(), (size_t)2);
+	std::string out = debug.str();
+	std::string::size_type order = out.find("pattern order:");
+	BOOST_REQUIRE(order != std::string::npos);
+	BOOST_CHECK(out.find("ProductType59", order) < out.find("rdf-schema#label", order));
+    }
+
+    /* Rows binding different variables get their own plans: one with
+     * ?label starts there, the other with ProductType59.
+     */ {
+	DefaultGraphPattern q1;
+	POS::String2BNode bnodeMap;
+	f.parseTriples(&q1, q1Patterns, bnodeMap);
+	std::stringstream debug;
+	std::ostream* debugStream = &debug;
+	ResultSet planned(&f, &debugStream), written(&f);
+	written.options = &queryOrder;
+	ResultSet* both[] = { &planned, &written };
+	for (size_t i = 0; i < 2; ++i) {
+	    Result* labeled = Result::make(both[i]);
+	    both[i]->insert(both[i]->end(), labeled);
+	    both[i]->set(labeled, f.getVariable("label"), f.getRDFLiteral("product 159"), false);
+	}
+	db.findGraph(NULL)->bindVariables(&planned, NULL, &q1, NULL);
+	db.findGraph(NULL)->bindVariables(&written, NULL, &q1, NULL);
+	written.options = &QueryOptions::Defaults;
+	BOOST_CHECK_EQUAL(planned.size(), (size_t)3);
+	BOOST_CHECK(planned == written);
+	std::string out = debug.str();
+	std::string::size_type first = out.find("pattern order:");
+	std::string::size_type second = out.find("pattern order:", first + 1);
+	BOOST_REQUIRE(second != std::string::npos);
+	BOOST_CHECK(out.find("ProductType59", first) < out.find("rdf-schema#label", first));
+	BOOST_CHECK(out.find("rdf-schema#label", second) < out.find("ProductType59", second));
+    }
+
+    /* Pipelined rows which share a plan write it once per query. */ {
+	const char* perProduct =
+	    "SELECT ?product ?label ?feature { ?product a <http://www4.wiwiss.fu-berlin.de/bizer/bsbm/v01/vocabulary/Product>"
+	    " { ?product <http://www.w3.org/2000/01/rdf-schema#label> ?label ."
+	    "   ?product <http://www4.wiwiss.fu-berlin.de/bizer/bsbm/v01/vocabulary/productFeature> ?feature } } LIMIT 100";
+	std::stringstream debug;
+	std::ostream* debugStream = &debug;
+	ResultSet rs(&f, &debugStream);
+	execute(perProduct, &db, QueryOptions::Defaults, &rs);
+	BOOST_CHECK_EQUAL(rs.size(), (size_t)100);
+	std::string out = debug.str();
+	size_t printed = 0;
+	for (std::string::size_type at = out.find("pattern order:"); at != std::string::npos; at = out.find("pattern order:", at + 1))
+	    ++printed;
+	BOOST_CHECK_EQUAL(printed, (size_t)1);
+    }
+
+    for (size_t i = 0; i < sizeof(BsbmQueries)/sizeof(BsbmQueries[0]); ++i) {
+	RdfDB plannedGraph, writtenGraph;
+	ResultSet* planned = executeFile(BsbmQueries[i], &db, QueryOptions::Defaults, &plannedGraph);
+	ResultSet* written = executeFile(BsbmQueries[i], &db, queryOrder, &writtenGraph);
+	BOOST_CHECK_MESSAGE(*planned == *written, BsbmQueries[i]);
+	delete planned;
+	delete written;
+    }
+
+    /* q9's WHERE clause. */ {
+	const char* q9 =
+	    "SELECT ?x WHERE { <http://www4.wiwiss.fu-berlin.de/bizer/bsbm/v01/instances/dataFromRatingSite1/Review30>"
+	    " <http://purl.org/stuff/rev#reviewer> ?x }";
+	ResultSet planned(&f), written(&f);
+	execute(q9, &db, QueryOptions::Defaults, &planned);
+	execute(q9, &db, queryOrder, &written);
+	BOOST_CHECK_EQUAL(planned.size(), (size_t)1);
+	BOOST_CHECK(planned == written);
+    }
+}
+
+/* LIMIT and ASK stop pulling solutions once they have enough, and give
+ * the answers the materialized plan does.
+ */
+BOOST_AUTO_TEST_CASE( pipelinedLimit ) {
+    RdfDB db;
+    BasicGraphPattern* g = db.assureGraph(NULL);
+    for (int i = 0; i < 2000; ++i) {
+	g->addTriplePattern(f.getTriple(U("s", i), U("p", 0), Int(i % 100)));
+	g->addTriplePattern(f.getTriple(U("s", i), U("p", 1), U("s", (i + 1) % 2000)));
+    }
+    const char* queries[] = {
+	"SELECT ?s ?n ?t { ?s <http://example.org/p1> ?t . ?t <http://example.org/p0> ?n } LIMIT 10",
+	"SELECT ?s ?n { ?s <http://example.org/p0> ?n FILTER (?n < 3) } LIMIT 5 OFFSET 3",
+	"SELECT ?s ?t ?n { ?s <http://example.org/p1> ?t OPTIONAL { ?t <http://example.org/p0> ?n FILTER (?n = 7) } } LIMIT 20",
+	"SELECT DISTINCT ?n { ?s <http://example.org/p0> ?n } LIMIT 5",
+	"ASK { ?s <http://example.org/p1> ?t . ?t <http://example.org/p0> 42 }",
+	"ASK { ?s <http://example.org/p0> 100 }"
+    };
+    size_t expect[] = { 10, 5, 20, 5, 1, 0 };
+    QueryOptions materialize;
+    materialize.pipelining = false;
+    for (size_t i = 0; i < sizeof(queries)/sizeof(queries[0]); ++i) {
+	ResultSet pipelined(&f), materialized(&f);
+	execute(queries[i], &db, QueryOptions::Defaults, &pipelined);
+	execute(queries[i], &db, materialize, &materialized);
+	BOOST_CHECK_EQUAL(pipelined.size(), expect[i]);
+	BOOST_CHECK_EQUAL(pipelined.toString(), materialized.toString());
+    }
+}
+
+/* Groups and FILTERs which don't read the incoming row are evaluated once
+ * per pipeline rather than once per row.
+ */
+BOOST_AUTO_TEST_CASE( pipelinedIndependentOperands ) {
+    RdfDB db;
+    BasicGraphPattern* g = db.assureGraph(NULL);
+    for (int i = 0; i < 2000; ++i) {
+	g->addTriplePattern(f.getTriple(U("s", i), U("p", 0), Int(i % 100)));
+	g->addTriplePattern(f.getTriple(U("s", i), U("p", 1), Int(i % 10)));
+    }
+    const char* queries[] = {
+	"SELECT * { ?s <http://example.org/p0> ?o { ?s <http://example.org/p1> ?y FILTER (?y > 5) } }",
+	"SELECT * { ?s <http://example.org/p0> ?o OPTIONAL { ?s <http://example.org/p1> ?y FILTER (?y > 5) } }",
+	"SELECT * { ?s <http://example.org/p0> ?o OPTIONAL { { ?s <http://example.org/p1> ?y FILTER (?y > 5) } } FILTER (?o < 50) }",
+	"SELECT * { ?s <http://example.org/p0> ?o { { ?s <http://example.org/p1> ?y } { ?s <http://example.org/p0> ?n FILTER (?n < 50) } } }",
+	"SELECT * { ?s <http://example.org/p0> ?o { ?s <http://example.org/p1> ?y FILTER (?y > 5) } } LIMIT 10"
+    };
+    size_t expect[] = { 800, 2000, 1000, 1000, 10 };
+    QueryOptions materialize;
+    materialize.pipelining = false;
+    for (size_t i = 0; i < sizeof(queries)/sizeof(queries[0]); ++i) {
+	ResultSet pipelined(&f), materialized(&f);
+	execute(queries[i], &db, QueryOptions::Defaults, &pipelined);
+	execute(queries[i], &db, materialize, &materialized);
+	BOOST_CHECK_EQUAL(pipelined.size(), expect[i]);
+	BOOST_CHECK_EQUAL(pipelined.toString(), materialized.toString());
+    }
+}
+
+BOOST_AUTO_TEST_CASE( hashDistinct ) {
+    QueryOptions pairwise;
+    pairwise.hashDistinct = false;
+    ResultSet hashed(&f), compared(&f);
+    repeatedRows(&hashed, 2000, 500);
+    repeatedRows(&compared, 2000, 500);
+    hashed.trim(DIST_distinct, LIMIT_None, OFFSET_None);
+    compared.options = &pairwise;
+    compared.trim(DIST_distinct, LIMIT_None, OFFSET_None);
+    compared.options = &QueryOptions::Defaults;
+    BOOST_CHECK_EQUAL(hashed.size(), (size_t)500);
+    BOOST_CHECK_EQUAL(hashed.toString(), compared.toString());
+}
+
+/* ORDER BY with precomputed sort keys, top-K for LIMIT and spilled runs
+ * gives the rows a full sort does.
+ */
+BOOST_AUTO_TEST_CASE( topKOrder ) {
+    RdfDB db;
+    orderData(&db, 2000);
+    const char* queries[] = {
+	"SELECT ?s ?n { ?s <http://example.org/p0> ?n } ORDER BY DESC(?n) ?s LIMIT 10",
+	"SELECT ?s ?n ?m { ?s <http://example.org/p0> ?n ; <http://example.org/p1> ?m } ORDER BY ?m DESC(?n) LIMIT 5 OFFSET 20",
+	"SELECT ?s ?n { ?s <http://example.org/p0> ?n } ORDER BY (?n * -1) LIMIT 0"
+    };
+    size_t expect[] = { 10, 5, 0 };
+    QueryOptions fullSort;
+    fullSort.sortKeys = false;
+    for (size_t i = 0; i < sizeof(queries)/sizeof(queries[0]); ++i) {
+	ResultSet keyed(&f), compared(&f);
+	execute(queries[i], &db, QueryOptions::Defaults, &keyed);
+	execute(queries[i], &db, fullSort, &compared);
+	BOOST_CHECK_EQUAL(keyed.size(), expect[i]);
+	BOOST_CHECK(orderedRows(&keyed) == orderedRows(&compared));
+    }
+
+    /* An 8KB budget spills the 2000 rows into many runs. */
+    const char* all = "SELECT ?s ?n ?m { ?s <http://example.org/p0> ?n ; <http://example.org/p1> ?m } ORDER BY ?m DESC(?n)";
+    QueryOptions spill;
+    spill.orderMemoryBudget = 8 * 1024;
+    ResultSet inMemory(&f), spilled(&f);
+    execute(all, &db, QueryOptions::Defaults, &inMemory);
+    execute(all, &db, spill, &spilled);
+    BOOST_CHECK_EQUAL(spilled.size(), (size_t)2000);
+    BOOST_CHECK(orderedRows(&spilled) == orderedRows(&inMemory));
+
+    /* Rows ordered after they're all bound give the same answers. */
+    QueryOptions unpipelined;
+    unpipelined.pipelining = false;
+    unpipelined.orderMemoryBudget = 8 * 1024;
+    ResultSet late(&f), lateTop(&f), pipelinedTop(&f);
+    execute(all, &db, unpipelined, &late);
+    BOOST_CHECK(orderedRows(&late) == orderedRows(&inMemory));
+    execute(queries[1], &db, unpipelined, &lateTop);
+    execute(queries[1], &db, QueryOptions::Defaults, &pipelinedTop);
+    BOOST_CHECK_EQUAL(lateTop.size(), (size_t)5);
+    BOOST_CHECK(orderedRows(&lateTop) == orderedRows(&pipelinedTop));
+}
+
+/* An ORDER BY key which fails to evaluate abandons the sort, releasing
+ * the rows held for it; ordering a ResultSet leaves the rows from the
+ * failing one on in place.
+ */
+BOOST_AUTO_TEST_CASE( throwingOrderKey ) {
+    RdfDB db;
+    BasicGraphPattern* g = db.assureGraph(NULL);
+    for (int i = 0; i < 10; ++i)
+	g->addTriplePattern(f.getTriple(U("s", i), U("p", 0), i == 6 ? (const POS*)U("o", i) : Int(i)));
+    const char* queries[] = {
+	"SELECT ?s { ?s <http://example.org/p0> ?o } ORDER BY (<http://www.w3.org/2001/XMLSchema#integer>(?o)) LIMIT 2",
+	"SELECT ?s { ?s <http://example.org/p0> ?o } ORDER BY DESC(<http://www.w3.org/2001/XMLSchema#integer>(?o)) LIMIT 2",
+	"SELECT ?s { ?s <http://example.org/p0> ?o } ORDER BY (<http://www.w3.org/2001/XMLSchema#integer>(?o))"
+    };
+    size_t budgets[] = { 0, 64 };
+    for (size_t i = 0; i < sizeof(queries)/sizeof(queries[0]); ++i)
+	for (size_t b = 0; b < sizeof(budgets)/sizeof(budgets[0]); ++b)
+	    for (int pipelined = 0; pipelined < 2; ++pipelined) {
+		SPARQLfedDriver parser("", &f);
+		IStreamContext s(queries[i], IStreamContext::STRING);
+		BOOST_REQUIRE(!parser.parse(s));
+		QueryOptions options;
+		options.orderMemoryBudget = budgets[b];
+		options.pipelining = pipelined != 0;
+		ResultSet rs(&f);
+		rs.options = &options;
+		BOOST_CHECK_THROW(parser.root->execute(&db, &rs), std::exception);
+		if (pipelined)
+		    BOOST_CHECK_EQUAL(rs.size(), (size_t)0);
+		else {
+		    BOOST_REQUIRE(rs.size() > 0);
+		    BOOST_CHECK_EQUAL((*rs.begin())->get(f.getVariable("o")), U("o", 6));
+		}
+		delete parser.root;
+	    }
+}
+
+/* FILTER conjuncts checked as soon as their variables are bound give the
+ * rows checked after the pattern, pipelined or not.
+ */
+BOOST_AUTO_TEST_CASE( filterPushdown ) {
+    RdfDB db;
+    filterData(&db, 500);
+    const char* queries[] = {
+	"SELECT ?s ?x ?m { ?s <http://example.org/p0> ?n ; <http://example.org/p2> ?x . ?x <http://example.org/p0> ?m "
+	"FILTER (?n < 2 && ?m < 50) }",
+	"SELECT ?s ?x ?z { ?s <http://example.org/p0> ?n OPTIONAL { ?s <http://example.org/p3> ?z } ?s <http://example.org/p2> ?x "
+	"FILTER (?n = 5) FILTER (!bound(?z) || ?z > 3) }",
+	"SELECT ?s ?x { ?s <http://example.org/p2> ?x . ?x <http://example.org/p0> ?m FILTER (?m * 2 = 8 && false) }"
+    };
+    size_t expect[] = { 100, 40, 0 };
+    QueryOptions pushed, late, pushedPipelined, latePipelined;
+    pushed.pipelining = late.pipelining = false;
+    late.filterPushdown = latePipelined.filterPushdown = false;
+    for (size_t i = 0; i < sizeof(queries)/sizeof(queries[0]); ++i) {
+	ResultSet pushedRows(&f), lateRows(&f), pushedPipelinedRows(&f), latePipelinedRows(&f);
+	execute(queries[i], &db, pushed, &pushedRows);
+	execute(queries[i], &db, late, &lateRows);
+	execute(queries[i], &db, pushedPipelined, &pushedPipelinedRows);
+	execute(queries[i], &db, latePipelined, &latePipelinedRows);
+	BOOST_CHECK_EQUAL(pushedRows.size(), expect[i]);
+	BOOST_CHECK(pushedRows == lateRows);
+	BOOST_CHECK(pushedPipelinedRows == lateRows);
+	BOOST_CHECK(latePipelinedRows == lateRows);
+    }
+}
+
+/* Function IRIs are resolved and constant REGEX patterns compiled once
+ * per query; a pattern read from a variable is compiled for each row.
+ * Both find the same rows.
+ */
+BOOST_AUTO_TEST_CASE( compiledFunctions ) {
+    RdfDB db;
+    BasicGraphPattern* g = db.assureGraph(NULL);
+    for (int i = 0; i < 5000; ++i) {
+	std::stringstream label;
+	label << "Label " << i;
+	g->addTriplePattern(f.getTriple(U("s", i), U("p", 0), f.getRDFLiteral(label.str())));
+	g->addTriplePattern(f.getTriple(U("s", i), U("p", 1), f.getRDFLiteral("^label 1")));
+	g->addTriplePattern(f.getTriple(U("s", i), U("p", 2), Int(i % 10)));
+    }
+    ResultSet compiled(&f), perRow(&f);
+    execute("SELECT ?s { ?s <http://example.org/p0> ?l ; <http://example.org/p1> ?pat FILTER regex(?l, \"^label 1\", \"i\") }",
+	    &db, QueryOptions::Defaults, &compiled);
+    execute("SELECT ?s { ?s <http://example.org/p0> ?l ; <http://example.org/p1> ?pat FILTER regex(?l, ?pat, \"i\") }",
+	    &db, QueryOptions::Defaults, &perRow);
+    BOOST_CHECK_EQUAL(compiled.size(), (size_t)1111); // 1, 1x, 1xx, 1xxx
+    BOOST_CHECK(compiled == perRow);
+
+    /* Constant arithmetic and function calls are evaluated once. */
+    ResultSet folded(&f);
+    execute("SELECT ?s { ?s <http://example.org/p2> ?n "
+	    "FILTER (?n > 2 * 3 + -1 && str(<http://example.org/p2>) = \"http://example.org/p2\") }",
+	    &db, QueryOptions::Defaults, &folded);
+    BOOST_CHECK_EQUAL(folded.size(), (size_t)2000); // 6 through 9
+
+    /* The value folded with one factory isn't handed to another. */
+    ProductionVector<const Expression*> rest(new POSExpression(Int(3)));
+    ArithmeticSum sum(new POSExpression(Int(2)), &rest);
+    rest.clear();
+    BOOST_CHECK_EQUAL(sum.eval(*folded.begin(), &f, NULL), Int(5));
+    for (int i = 0; i < 20; ++i) {
+	POSFactory other;
+	BOOST_CHECK_EQUAL(sum.eval(*folded.begin(), &other, NULL), other.getNumericRDFLiteral("5", 5));
+    }
+    BOOST_CHECK_EQUAL(sum.eval(*folded.begin(), &f, NULL), Int(5));
+}
+
+/* Rows hold their bindings by the slots their ResultSet's variables
+ * were assigned, widening for variables first seen after they were made.
+ */
+BOOST_AUTO_TEST_CASE( slotRows ) {
+    ResultSet rs(&f);
+    Result* row = *rs.begin();
+    std::vector<const POS*> vars;
+    for (int i = 11; i >= 0; --i) {
+	std::stringstream name;
+	name << "v" << i;
+	vars.push_back(f.getVariable(name.str()));
+	rs.set(row, vars.back(), Int(i), i % 2 == 0);
+    }
+    BOOST_REQUIRE_EQUAL(row->size(), (size_t)12);
+    int i = 11;
+    for (BindingSetConstIterator it = row->begin(); it != row->end(); ++it, --i) { // in slot order
+	BOOST_CHECK_EQUAL(it->first, vars[11 - i]);
+	BOOST_CHECK_EQUAL(it->second.pos, Int(i));
+	BOOST_CHECK_EQUAL(it->second.weaklyBound, i % 2 == 0);
+    }
+    BOOST_CHECK_EQUAL(row->get(f.getVariable("v7")), Int(7));
+    BOOST_CHECK(row->get(f.getVariable("v12")) == NULL);
+    BOOST_CHECK_THROW(row->set(f.getVariable("v7"), Int(8), false), std::runtime_error);
+    row->set(f.getVariable("v7"), Int(8), false, true);
+    BOOST_CHECK_EQUAL(row->get(f.getVariable("v7")), Int(8));
+    row->set(f.getVariable("v7"), Int(7), false, true);
+
+    Result* copy = row->duplicate(&rs, rs.begin());
+    BOOST_CHECK(*copy == *row);
+    Result* wider = row->duplicate(&rs, rs.begin());
+    for (int j = 12; j < 80; ++j) {
+	std::stringstream name;
+	name << "v" << j;
+	rs.set(wider, f.getVariable(name.str()), Int(j), j % 3 == 0);
+    }
+    BOOST_CHECK_EQUAL(wider->size(), (size_t)80);
+    BOOST_CHECK_EQUAL(wider->get(f.getVariable("v79")), Int(79));
+    BOOST_CHECK(copy->get(f.getVariable("v79")) == NULL);
+    BOOST_CHECK(!(*wider == *row));
+    wider->erase(wider->find(f.getVariable("v79")));
+    BOOST_CHECK(wider->get(f.getVariable("v79")) == NULL);
+    BOOST_CHECK_EQUAL(wider->size(), (size_t)79);
+    delete wider;
+
+    /* Rows of other slots are copied binding by binding. */
+    ResultSet other(&f);
+    rs.set(*other.begin(), f.getVariable("v3"), Int(3), false);
+    Result* moved = row->duplicate(&other, other.begin());
+    BOOST_CHECK_EQUAL(moved->getSlots(), (*other.begin())->getSlots());
+    BOOST_CHECK(*moved == *copy);
+    delete moved;
+    delete copy;
+
+    /* ResultSets partOf a query share its slots. */
+    other.partOf(rs);
+    BOOST_CHECK_EQUAL((*other.begin())->getSlots(), row->getSlots());
+    BOOST_CHECK_EQUAL((*other.begin())->get(f.getVariable("v3")), Int(3));
+}
+
+/* FILTERs give the same rows pushed into the triple loop, evaluated a
+ * ColumnBatch at a time by ResultSet::restrict, or row by row.
+ */
+BOOST_AUTO_TEST_CASE( columnarFilter ) {
+    RdfDB db;
+    columnData(&db, 10000);
+    size_t expect[] = { 4000, 4100, 571, 2057, 1227, 2814 };
+    QueryOptions pushdown, late, rowByRow;
+    pushdown.pipelining = late.pipelining = rowByRow.pipelining = false;
+    late.filterPushdown = rowByRow.filterPushdown = false;
+    rowByRow.columnBatches = false;
+    for (size_t i = 0; i < sizeof(ColumnQueries)/sizeof(ColumnQueries[0]); ++i) {
+	ResultSet pushed(&f), columns(&f), rows(&f);
+	execute(ColumnQueries[i], &db, pushdown, &pushed);
+	execute(ColumnQueries[i], &db, late, &columns);
+	execute(ColumnQueries[i], &db, rowByRow, &rows);
+	BOOST_CHECK_EQUAL(pushed.size(), expect[i]);
+	BOOST_CHECK(columns == pushed);
+	BOOST_CHECK(rows == pushed);
+    }
+}
+
+/* Rows survive the trip through a ColumnarResultSet with their weak
+ * bindings, including rows in slots of their own.
+ */
+BOOST_AUTO_TEST_CASE( columnRoundTrip ) {
+    ResultSet rs(&f);
+    delete *rs.begin();
+    rs.erase(rs.begin());
+    const POS* a = f.getVariable("a");
+    const POS* b = f.getVariable("b");
+    for (int i = 0; i < 2500; ++i) {
+	Result* row = i % 100 == 0 ? Result::make(NULL) : Result::make(&rs);
+	row->set(a, Int(i), false);
+	if (i % 3 == 0)
+	    row->set(b, Int(i % 7), i % 2 == 0);
+	rs.insert(rs.end(), row);
+    }
+    ResultSet copy(rs);
+
+    ColumnarResultSet columns(&rs);
+    BOOST_CHECK_EQUAL(rs.size(), (size_t)0);
+    BOOST_CHECK_EQUAL(columns.size(), (size_t)2500);
+    BOOST_REQUIRE_EQUAL(columns.batchCount(), (size_t)3);
+    ColumnBatch& first = columns.batch(0);
+    BOOST_CHECK(first.full());
+    int slot = first.getSlots()->find(b);
+    BOOST_REQUIRE(slot >= 0);
+    BOOST_CHECK_EQUAL(first.column(slot)[3], Int(3));
+    BOOST_CHECK(first.column(slot)[1] == NULL);
 
+    columns.toRows(&rs);
+    BOOST_CHECK_EQUAL(columns.size(), (size_t)0);
+    BOOST_CHECK(rs == copy);
+    ResultSetIterator it = rs.begin();
+    std::advance(it, 3);
+    BOOST_CHECK((*it)->find(b)->second.weaklyBound == false);
+    std::advance(it, 3);
+    BOOST_CHECK((*it)->find(b)->second.weaklyBound == true);
+
+    /* select keeps the marked rows in order. */
+    ColumnarResultSet again(&rs);
+    ColumnBatch& last = again.batch(2);
+    std::vector<char> keep(last.size(), 0);
+    keep[1] = keep[401] = 1;
+    last.select(keep);
+    BOOST_REQUIRE_EQUAL(last.size(), (size_t)2);
+    Result* kept = last.makeRow(1, &rs);
+    BOOST_CHECK_EQUAL(kept->get(a), Int(2048 + 401));
+    BOOST_CHECK(kept->find(b) == kept->end());
+    delete kept;
+    BOOST_CHECK_EQUAL(again.size(), (size_t)2050);
+}
+
+/* Interning a triple that's already known should find the same
+ * TriplePattern without allocating anything; in an arena factory it
+ * would have taken more arena space.
+ */
+BOOST_AUTO_TEST_CASE( tripleInterning ) {
+    const int count = 20000, terms = 1000;
+    POSFactory g(true);
+    std::vector<const URI*> uris;
+    for (int i = 0; i < terms; ++i) {
+	std::stringstream s;
+	s << "http://example.org/t" << i;
+	uris.push_back(g.getURI(s.str()));
+    }
+
+    std::vector<const TriplePattern*> first;
+    first.reserve(count);
+    size_t used = g.getArena()->bytesUsed();
+    for (int i = 0; i < count; ++i)
+	first.push_back(g.getTriple(uris[i % terms], uris[(i / terms) % terms], uris[(i * 7) % terms]));
+    size_t usedNew = g.getArena()->bytesUsed() - used;
+
+    used = g.getArena()->bytesUsed();
+    bool same = true;
+    for (int i = 0; i < count; ++i)
+	same &= g.getTriple(uris[i % terms], uris[(i / terms) % terms], uris[(i * 7) % terms]) == first[i];
+    size_t usedKnown = g.getArena()->bytesUsed() - used;
+
+    BOOST_CHECK(same);
+    BOOST_CHECK(usedNew >= count * sizeof(TriplePattern));
+    BOOST_CHECK_EQUAL(usedKnown, (size_t)0);
+    BOOST_CHECK(g.getTriple(uris[0], uris[0], uris[0], true) != g.getTriple(uris[0], uris[0], uris[0], false));
+}
+
+/* Adding every triple twice keeps one copy of each. */
+BOOST_AUTO_TEST_CASE( duplicateSuppression ) {
+    const int subjects = 100, classes = 100;
+    const URI* type = f.getURI("http://www.w3.org/1999/02/22-rdf-syntax-ns#type");
+    DefaultGraphPattern data;
+    for (int pass = 0; pass < 2; ++pass) // second pass is all duplicates
+	for (int i = 0; i < subjects; ++i)
+	    for (int j = 0; j < classes; ++j)
+		data.addTriplePattern(f.getTriple(U("instance", i), type, U("Class", j)));
+    BOOST_CHECK_EQUAL(data.size(), (size_t)(subjects * classes));
+
+    /* An erased triple may be added again. */
+    const TriplePattern* first = *data.begin();
+    data.erase(data.begin());
+    BOOST_CHECK_EQUAL(data.size(), (size_t)(subjects * classes - 1));
+    data.addTriplePattern(first);
+    BOOST_CHECK_EQUAL(data.size(), (size_t)(subjects * classes));
+}
+
+static std::vector<std::string> sortedLines (std::string text) {
+    std::vector<std::string> ret;
+    std::istringstream is(text);
+    for (std::string line; std::getline(is, line); )
+	ret.push_back(line);
+    std::sort(ret.begin(), ret.end());
+    return ret;
+}
+
+BOOST_AUTO_TEST_CASE( snapshot ) {
+    POS::String2BNode bnodeMap;
+    RdfDB db;
+    f.parseTriples(db.assureGraph(NULL), 
+		   "<n1> <p1> \"l1\" ."
+		   "<n1> <p2> _:b1 ."
+		   "_:b1 <p1> <n2> .", bnodeMap);
+    BasicGraphPattern* named = db.assureGraph(f.getURI("http://example.org/g1"));
+    named->addTriplePattern(f.getTriple(U("s", 1), U("p", 1), f.getRDFLiteral("7", f.getURI("http://www.w3.org/2001/XMLSchema#integer"))));
+    named->addTriplePattern(f.getTriple(U("s", 1), U("p", 2), f.getRDFLiteral("chat", NULL, new LANGTAG("fr"))));
+
+    std::string path = "snapshot_test.swobsnap";
+    {
+	std::ofstream os(path.c_str(), std::ios::out | std::ios::binary);
+	db.writeSnapshot(os);
+    }
+
+    /* Writing leaves no state behind: a second snapshot is identical. */
+    std::stringstream first, second;
+    db.writeSnapshot(first);
+    db.writeSnapshot(second);
+    BOOST_CHECK(first.str() == second.str());
+
+    /* Reading into a fresh factory exercises every term kind. */
+    POSFactory g;
+    RdfDB loaded;
+    loaded.loadSnapshot(path, &g);
+    std::remove(path.c_str());
+    BOOST_CHECK_EQUAL(loaded.findGraph(NULL)->size(), (size_t)3);
+    /* Loaded graphs serialize in the snapshot's term order. */
+    BOOST_CHECK(sortedLines(loaded.toString()) == sortedLines(db.toString()));
+
+    /* Not a snapshot. */
+    {
+	std::ofstream os(path.c_str());
+	os << "<n1> <p1> <n2> .\n";
+    }
+    BOOST_CHECK_THROW(loaded.loadSnapshot(path, &g), std::string);
+    std::remove(path.c_str());
+}
+
+/* Load the same Turtle with and without arena allocation; the arena
+ * should hold every term and triple.
+ */
+BOOST_AUTO_TEST_CASE( arenaAllocation ) {
+    const int count = 5000;
+    std::string turtle = arenaTurtle(count);
+    BOOST_CHECK(f.getArena() == NULL);
+    size_t triples[2], arenaBytes[2], slabs[2];
+    for (int arena = 0; arena < 2; ++arena)
+	delete arenaLoad(arena == 1, turtle, &triples[arena], &arenaBytes[arena], &slabs[arena]);
+    BOOST_CHECK_EQUAL(triples[0], (size_t)count);
+    BOOST_CHECK_EQUAL(triples[1], (size_t)count);
+    /* 5000 triples, 500 subjects and 5000 literals at the least. */
+    BOOST_CHECK(arenaBytes[1] >= count * sizeof(TriplePattern) + count / 10 * sizeof(URI) + count * sizeof(RDFLiteral));
+    BOOST_CHECK(slabs[1] >= 1);
+}
+
+/* A pinned version doesn't see later commits and goes away when the
+ * last view of it does.
+ */
+BOOST_AUTO_TEST_CASE( versionedUpdates ) {
+    POS::String2BNode bnodeMap;
+    RdfDB db;
+    f.parseTriples(db.assureGraph(NULL), "<n1> <p1> <n2> . <n1> <p1> <n3> .", bnodeMap);
+    const URI* g1 = f.getURI("http://example.org/g1");
+    RdfDB inserts, deletes;
+    f.parseTriples(inserts.assureGraph(g1), "<n1> <p1> <n4> .", bnodeMap);
+    f.parseTriples(deletes.assureGraph(NULL), "<n1> <p1> <n2> .", bnodeMap);
+
+    RdfDB::Version pinned = db.pin();
+    boost::weak_ptr<const RdfDB::graphmap_type> watch(pinned);
+    {
+	RdfDB reader(pinned);
+	pinned.reset();
+	std::string before = reader.toString();
+	db.commit(&inserts, &deletes);
+	BOOST_CHECK_EQUAL(reader.toString(), before);
+	BOOST_CHECK_EQUAL(reader.findGraph(NULL)->size(), (size_t)2);
+	BOOST_CHECK(reader.findGraph(g1) == NULL);
+	BOOST_CHECK_EQUAL(db.findGraph(NULL)->size(), (size_t)1);
+	BOOST_CHECK_EQUAL(db.findGraph(g1)->size(), (size_t)1);
+	BOOST_CHECK(!watch.expired());
+    }
+    BOOST_CHECK(watch.expired());
+
+    /* Nothing pinned: the commit updates the graph in place. */
+    const BasicGraphPattern* g1Graph = db.findGraph(g1);
+    db.commit(NULL, &inserts);
+    BOOST_CHECK_EQUAL(db.findGraph(g1), g1Graph);
+    BOOST_CHECK_EQUAL(g1Graph->size(), (size_t)0);
+
+    /* A query's Reading keeps its matches on the version it started with. */
+    {
+	DefaultGraphPattern toMatch;
+	toMatch.addTriplePattern(f.getTriple(f.getVariable("s"), f.getVariable("p"), f.getVariable("o")));
+	ResultSet rs(&f);
+	RdfDB::Reading reading(&db, &rs);
+	db.commit(&inserts, NULL);
+	BOOST_CHECK_EQUAL(db.findGraph(g1)->size(), (size_t)1);
+	BOOST_CHECK_EQUAL(g1Graph->size(), (size_t)0);
+	db.bindVariables(&rs, g1, &toMatch);
+	BOOST_CHECK_EQUAL(rs.size(), (size_t)0);
+    }
+
+    /* Making sure graphs exist doesn't copy those already shared. */
+    RdfDB::Version held = db.pin();
+    std::set<const POS*> names;
+    names.insert(DefaultGraph);
+    names.insert(f.getURI("http://example.org/g2"));
+    db.assureGraphs(names);
+    BOOST_CHECK_EQUAL(db.findGraph(NULL), held->find(DefaultGraph)->second.get());
+    BOOST_CHECK(db.findGraph(f.getURI("http://example.org/g2")) != NULL);
+    BOOST_CHECK(held->find(f.getURI("http://example.org/g2")) == held->end());
+}
+
+BOOST_AUTO_TEST_CASE( graphStatistics ) {
+    POS::String2BNode bnodeMap;
+    RdfDB db;
+    BasicGraphPattern* g = db.assureGraph(NULL);
+    f.parseTriples(g, 
+		   "<s1> <name> \"a\" . <s1> <knows> <s2> . <s1> <knows> <s3> ."
+		   "<s2> <name> \"b\" . <s2> <knows> <s3> ."
+		   "<s3> <name> \"a\" .", bnodeMap);
+    const URI* name = f.getURI("name");
+    const URI* knows = f.getURI("knows");
+    const GraphStatistics* stats = db.getStatistics(NULL);
+    BOOST_REQUIRE(stats != NULL);
+    BOOST_CHECK(db.getStatistics(f.getURI("http://example.org/none")) == NULL);
+    BOOST_CHECK_EQUAL(stats->size(), (size_t)6);
+    BOOST_CHECK_EQUAL(stats->subjectCount(), (size_t)3);
+    BOOST_CHECK_EQUAL(stats->predicateCount(), (size_t)2);
+    BOOST_CHECK_EQUAL(stats->objectCount(), (size_t)4);
+    BOOST_CHECK_EQUAL(stats->getPredicate(knows).triples, (size_t)3);
+    BOOST_CHECK_EQUAL(stats->getPredicate(knows).subjects, (size_t)2);
+    BOOST_CHECK_EQUAL(stats->getPredicate(knows).objects, (size_t)2);
+    BOOST_CHECK_EQUAL(stats->getPredicate(name).objects, (size_t)2);
+    BOOST_CHECK_EQUAL(stats->getPredicate(f.getURI("none")).triples, (size_t)0);
+
+    /* {name knows} has s1 and s2; {name} has s3. */
+    const GraphStatistics::CharacteristicSetMap& sets = stats->getCharacteristicSets();
+    BOOST_CHECK_EQUAL(sets.size(), (size_t)2);
+    GraphStatistics::CharacteristicSet both;
+    both.push_back(name);
+    both.push_back(knows);
+    std::sort(both.begin(), both.end());
+    BOOST_REQUIRE(sets.find(both) != sets.end());
+    BOOST_CHECK_EQUAL(sets.find(both)->second.subjects, (size_t)2);
+    BOOST_CHECK_EQUAL(sets.find(both)->second.triples, (size_t)5);
+
+    /* Deleting s2's only knows moves it to {name}. */
+    std::string before = db.statisticsString();
+    RdfDB deletes;
+    f.parseTriples(deletes.assureGraph(NULL), "<s2> <knows> <s3> .", bnodeMap);
+    db.commit(NULL, &deletes);
+    stats = db.getStatistics(NULL);
+    BOOST_CHECK_EQUAL(stats->size(), (size_t)5);
+    BOOST_CHECK_EQUAL(stats->objectCount(), (size_t)4); // <s1> <knows> <s3> keeps s3.
+    BOOST_CHECK_EQUAL(stats->getPredicate(knows).subjects, (size_t)1);
+    BOOST_CHECK_EQUAL(stats->getCharacteristicSets().find(both)->second.subjects, (size_t)1);
+    BOOST_CHECK_EQUAL(stats->getCharacteristicSets().find(GraphStatistics::CharacteristicSet(1, name))->second.subjects, (size_t)2);
+
+    /* Putting it back restores the original statistics. */
+    db.commit(&deletes, NULL);
+    BOOST_CHECK_EQUAL(db.statisticsString(), before);
+    BOOST_TEST_MESSAGE(before);
+
+    db.clearTriples();
+    BOOST_CHECK_EQUAL(db.getStatistics(NULL)->size(), (size_t)0);
+    BOOST_CHECK_EQUAL(db.getStatistics(NULL)->getCharacteristicSets().size(), (size_t)0);
+}
+
+/* GRAPH ?g { ?s <p1> ?o . ?o <p2> ?x } over many small named graphs
+ * matches the same rows with the quad index as graph by graph.
+ */
+BOOST_AUTO_TEST_CASE( quadIndex ) {
+    const int graphCount = 300;
+    RdfDB db;
+    quadData(&db, graphCount);
+    const URI* p1 = U("p", 1);
+    const URI* p2 = U("p", 2);
+    const Variable* g = f.getVariable("g");
+    DefaultGraphPattern toMatch;
+    toMatch.addTriplePattern(f.getTriple(f.getVariable("s"), p1, f.getVariable("o")));
+    toMatch.addTriplePattern(f.getTriple(f.getVariable("o"), p2, f.getVariable("x")));
+    QueryOptions byGraph;
+    byGraph.quadIndex = false;
+
+    ResultSet perGraph(&f), quads(&f);
+    perGraph.options = &byGraph;
+    db.bindVariables(&perGraph, g, &toMatch);
+    perGraph.options = &QueryOptions::Defaults;
+    db.bindVariables(&quads, g, &toMatch);
+    BOOST_CHECK_EQUAL(quads.size(), (size_t)(graphCount / 3));
+    BOOST_CHECK_EQUAL(quads, perGraph);
+
+    /* Changing a graph re-indexes just that graph. */
+    db.assureGraph(U("g", 1))->addTriplePattern(f.getTriple(U("o", 1), p2, U("x", 1)));
+    ResultSet again(&f);
+    db.bindVariables(&again, g, &toMatch);
+    BOOST_CHECK_EQUAL(again.size(), (size_t)(graphCount / 3 + 1));
+
+    /* Removing triples and adding graphs too. */
+    BasicGraphPattern* g0 = db.assureGraph(U("g", 0));
+    for (std::vector<const TriplePattern*>::iterator it = g0->begin(); it != g0->end(); )
+	it = (*it)->getP() == p2 ? g0->erase(it) : it + 1;
+    BasicGraphPattern* added = db.assureGraph(U("g", graphCount));
+    added->addTriplePattern(f.getTriple(U("s", graphCount), p1, U("o", graphCount)));
+    added->addTriplePattern(f.getTriple(U("o", graphCount), p2, U("x", graphCount)));
+    ResultSet changed(&f), changedPerGraph(&f);
+    db.bindVariables(&changed, g, &toMatch);
+    changedPerGraph.options = &byGraph;
+    db.bindVariables(&changedPerGraph, g, &toMatch);
+    changedPerGraph.options = &QueryOptions::Defaults;
+    BOOST_CHECK_EQUAL(changed.size(), (size_t)(graphCount / 3 + 1));
+    BOOST_CHECK_EQUAL(changed, changedPerGraph);
+}
+
+/* Graphs stored as TermIDs give the answers, statistics and
+ * serializations which TriplePattern pointers do, through updates too.
+ */
+BOOST_AUTO_TEST_CASE( encodedTriples ) {
+    const int graphCount = 30;
+    RdfDB pointers, ids;
+    ids.setTermTable(&f);
+    loadBsbm(&pointers, 100, 1000, 200);
+    loadBsbm(&ids, 100, 1000, 200);
+    quadData(&pointers, graphCount);
+    quadData(&ids, graphCount);
+    BOOST_REQUIRE(ids.findGraph(NULL)->getTermTable() == &f);
+    BOOST_REQUIRE(pointers.findGraph(NULL)->getTermTable() == NULL);
+    BOOST_CHECK_EQUAL(ids.findGraph(NULL)->size(), pointers.findGraph(NULL)->size());
+    BOOST_CHECK_EQUAL(ids.statisticsString(), pointers.statisticsString());
+    BOOST_CHECK(ids == pointers);
+    /* Encoded triples serialize in SPO order rather than as they came. */
+    BOOST_CHECK(sortedLines(ids.findGraph(NULL)->toString(MediaType("text/turtle"))) ==
+		sortedLines(pointers.findGraph(NULL)->toString(MediaType("text/turtle"))));
+
+    QueryOptions predOnly;
+    predOnly.permutationIndexes = false;
+    for (size_t i = 0; i < sizeof(BsbmQueries)/sizeof(BsbmQueries[0]); ++i) {
+	RdfDB pointerGraph, idGraph;
+	ResultSet* byPointer = executeFile(BsbmQueries[i], &pointers, QueryOptions::Defaults, &pointerGraph);
+	ResultSet* byID = executeFile(BsbmQueries[i], &ids, QueryOptions::Defaults, &idGraph);
+	ResultSet* scanned = executeFile(BsbmQueries[i], &ids, predOnly, &idGraph);
+	BOOST_CHECK_MESSAGE(*byPointer == *byID, BsbmQueries[i]);
+	BOOST_CHECK_MESSAGE(*scanned == *byID, BsbmQueries[i]);
+	delete byPointer;
+	delete byID;
+	delete scanned;
+    }
+
+    const char* queries[] = {
+	"SELECT ?g ?s ?x { GRAPH ?g { ?s <http://example.org/p1> ?o . ?o <http://example.org/p2> ?x } }",
+	"SELECT ?p ?o { GRAPH <http://example.org/g3> { <http://example.org/s3> ?p ?o } }",
+	"SELECT ?s { GRAPH <http://example.org/g3> { ?s ?p <http://example.org/o3> } }",
+	"SELECT ?s { GRAPH <http://example.org/g3> { ?s <http://example.org/p1> <http://example.org/o3> } }",
+	"ASK { GRAPH <http://example.org/g3> { <http://example.org/s3> <http://example.org/p3> <http://example.org/o4> } }",
+	"SELECT ?o { GRAPH <http://example.org/g3> { <http://example.org/s3> <http://example.org/unused> ?o } }"
+    };
+    size_t expect[] = { graphCount / 3, 2, 1, 1, 1, 0 };
+    for (size_t i = 0; i < sizeof(queries)/sizeof(queries[0]); ++i) {
+	ResultSet byPointer(&f), byID(&f);
+	execute(queries[i], &pointers, QueryOptions::Defaults, &byPointer);
+	execute(queries[i], &ids, QueryOptions::Defaults, &byID);
+	BOOST_CHECK_EQUAL(byID.size(), expect[i]);
+	BOOST_CHECK_MESSAGE(byPointer == byID, queries[i]);
+    }
+
+    /* Deleting and re-adding triples; a pinned version keeps its own. */
+    RdfDB doomed;
+    BasicGraphPattern* gone = doomed.assureGraph(NULL);
+    const BasicGraphPattern* before = ids.findGraph(NULL);
+    for (std::vector<const TriplePattern*>::const_iterator it = before->begin(); it != before->begin() + 100; ++it)
+	gone->addTriplePattern(*it);
+    std::string statistics = ids.statisticsString();
+    RdfDB::Version pinned = ids.pin();
+    pointers.commit(NULL, &doomed);
+    ids.commit(NULL, &doomed);
+    BOOST_CHECK_EQUAL(pinned->find(DefaultGraph)->second->size(), pointers.findGraph(NULL)->size() + 100);
+    BOOST_CHECK_EQUAL(ids.findGraph(NULL)->size(), pointers.findGraph(NULL)->size());
+    BOOST_CHECK_EQUAL(ids.statisticsString(), pointers.statisticsString());
+    BOOST_CHECK(ids == pointers);
+    ids.commit(&doomed, NULL);
+    BOOST_CHECK_EQUAL(ids.statisticsString(), statistics);
+
+    /* Erasing through the decoded triples. */
+    BasicGraphPattern* g0 = ids.assureGraph(U("g", 0));
+    for (std::vector<const TriplePattern*>::iterator it = g0->begin(); it != g0->end(); )
+	it = (*it)->getP() == U("p", 2) ? g0->erase(it) : it + 1;
+    BOOST_CHECK_EQUAL(g0->size(), (size_t)2);
+    ResultSet withoutG0(&f);
+    execute(queries[0], &ids, QueryOptions::Defaults, &withoutG0);
+    BOOST_CHECK_EQUAL(withoutG0.size(), (size_t)(graphCount / 3 - 1));
+
+    /* Terms must come from the TermTable. */
+    POSFactory other;
+    const URI* stranger = other.getURI("http://example.org/stranger");
+    BOOST_CHECK_THROW(g0->addTriplePattern(other.getTriple(stranger, stranger, stranger)), std::runtime_error);
+    BOOST_CHECK_EQUAL(g0->size(), (size_t)2);
+}
+
+/* A loaded snapshot matches in its mapped permutations and gives the
+ * answers the graphs it was written from do, through updates too.
+ */
+BOOST_AUTO_TEST_CASE( mappedSnapshot ) {
+    const int graphCount = 30;
+    RdfDB pointers;
+    loadBsbm(&pointers, 100, 1000, 200);
+    quadData(&pointers, graphCount);
+    std::string path = "mapped_test.swobsnap";
+    {
+	std::ofstream os(path.c_str(), std::ios::out | std::ios::binary);
+	pointers.writeSnapshot(os);
+    }
+    RdfDB mapped;
+    mapped.loadSnapshot(path, &f);
+    std::remove(path.c_str()); // the mapping outlives the name.
+    BOOST_REQUIRE(mapped.findGraph(NULL)->getTermTable() != NULL);
+    BOOST_CHECK_EQUAL(mapped.findGraph(NULL)->size(), pointers.findGraph(NULL)->size());
+    BOOST_CHECK_EQUAL(mapped.statisticsString(), pointers.statisticsString());
+    BOOST_CHECK(mapped == pointers);
+
+    for (size_t i = 0; i < sizeof(BsbmQueries)/sizeof(BsbmQueries[0]); ++i) {
+	RdfDB pointerGraph, mappedGraph;
+	ResultSet* byPointer = executeFile(BsbmQueries[i], &pointers, QueryOptions::Defaults, &pointerGraph);
+	ResultSet* byMapped = executeFile(BsbmQueries[i], &mapped, QueryOptions::Defaults, &mappedGraph);
+	BOOST_CHECK_MESSAGE(*byPointer == *byMapped, BsbmQueries[i]);
+	delete byPointer;
+	delete byMapped;
+    }
+    const char* queries[] = {
+	"SELECT ?g ?s ?x { GRAPH ?g { ?s <http://example.org/p1> ?o . ?o <http://example.org/p2> ?x } }",
+	"SELECT ?p ?o { GRAPH <http://example.org/g3> { <http://example.org/s3> ?p ?o } }",
+	"SELECT ?o { <http://example.org/nowhere> ?p ?o }"
+    };
+    size_t expect[] = { graphCount / 3, 2, 0 };
+    for (size_t i = 0; i < sizeof(queries)/sizeof(queries[0]); ++i) {
+	ResultSet byPointer(&f), byMapped(&f);
+	execute(queries[i], &pointers, QueryOptions::Defaults, &byPointer);
+	execute(queries[i], &mapped, QueryOptions::Defaults, &byMapped);
+	BOOST_CHECK_EQUAL(byMapped.size(), expect[i]);
+	BOOST_CHECK_MESSAGE(byPointer == byMapped, queries[i]);
+    }
+
+    /* Changes copy the permutations out; a pinned version keeps the mapped ones. */
+    RdfDB changes;
+    BasicGraphPattern* changed = changes.assureGraph(NULL);
+    const BasicGraphPattern* before = mapped.findGraph(NULL);
+    for (std::vector<const TriplePattern*>::const_iterator it = before->begin(); it != before->begin() + 100; ++it)
+	changed->addTriplePattern(*it);
+    RdfDB::Version pinned = mapped.pin();
+    pointers.commit(NULL, &changes);
+    mapped.commit(NULL, &changes);
+    BOOST_CHECK_EQUAL(pinned->find(DefaultGraph)->second->size(), mapped.findGraph(NULL)->size() + 100);
+    BOOST_CHECK_EQUAL(mapped.statisticsString(), pointers.statisticsString());
+    BOOST_CHECK(mapped == pointers);
+    changed->clearTriples();
+    changed->addTriplePattern(f.getTriple(U("new", 1), U("p", 1), f.getRDFLiteral("not in the snapshot")));
+    pointers.commit(&changes, NULL);
+    mapped.commit(&changes, NULL);
+    BOOST_CHECK(mapped == pointers);
+    ResultSet added(&f);
+    execute("SELECT ?o { <http://example.org/new1> ?p ?o }", &mapped, QueryOptions::Defaults, &added);
+    BOOST_CHECK_EQUAL(added.size(), (size_t)1);
+
+    /* Loading into a graph with triples adds to them: the deleted 100
+     * come back beside the new one.
+     */
+    {
+	std::ofstream os(path.c_str(), std::ios::out | std::ios::binary);
+	RdfDB original;
+	loadBsbm(&original, 100, 1000, 200);
+	original.writeSnapshot(os);
+    }
+    mapped.loadSnapshot(path, &f);
+    std::remove(path.c_str());
+    BOOST_CHECK_EQUAL(mapped.findGraph(NULL)->size(), pinned->find(DefaultGraph)->second->size() + 1);
+    BOOST_CHECK_EQUAL(mapped.findGraph(U("g", 3))->size(), pointers.findGraph(U("g", 3))->size());
+}
+
+/* Rows ?a ?b (a few without ?b) joined with ?b ?c (a few
+ * without ?b) must come out the same, in the same order, with and
+ * without the hash join.
+ */
+BOOST_AUTO_TEST_CASE( hashJoin ) {
+    ResultSet::e_OP operations[] = { ResultSet::OP_join, ResultSet::OP_outer, ResultSet::OP_minus };
+    QueryOptions nestedLoop;
+    nestedLoop.hashJoin = false;
+    for (size_t i = 0; i < sizeof(operations)/sizeof(operations[0]); ++i) {
+	ResultSet right = joinSide("c", "b", 500, 125, 500);
+	ResultSet nested = joinSide("a", "b", 500, 100, 500);
+	ResultSet hashed(nested);
+	nested.options = &nestedLoop;
+	nested.joinIn(&right, NULL, operations[i]);
+	nested.options = &QueryOptions::Defaults;
+	hashed.joinIn(&right, NULL, operations[i]);
+	BOOST_CHECK_EQUAL(hashed.size(), nested.size());
+	BOOST_CHECK_EQUAL(hashed.toString(), nested.toString());
+    }
+}
+
+#endif /* ! REGEX_LIB != SWOb_DISABLED */
@@ -232,3 +232,15 @@ BOOST_AUTO_TEST_CASE( bgp_with_triples ) {
   }");
 }
 
+
+BOOST_AUTO_TEST_CASE( bindings ) {
+    /* Each BINDINGS row is parenthesized, as the grammar reads it back.
+     */
+    SERIALIZER_TEST("SELECT ?s {\n\
+  ?s <p> ?o .\n\
+  }\n\
+BINDINGS ?s ?o {\n\
+  ( <a> 1 )\n\
+  ( <b> NULL )\n\
+}");
+}